@@ -250,6 +250,89 @@ convert_json_to_tabs "${SETTINGS_FILE}" |
 echo "-version=$( get_version )" >> "${ARGS_FILE}"
 echo "-save_dir=${CAPTURE_SAVE_DIR}" >> "${ARGS_FILE}"
 
+# The capture program subtracts darks from, resizes, crops, and stretches images so
+# saveImage.sh doesn't have to.
+{
+	echo "-imgresize=${IMG_RESIZE}"
+	echo "-imgwidth=${IMG_WIDTH}"
+	echo "-imgheight=${IMG_HEIGHT}"
+	echo "-cropimage=${CROP_IMAGE}"
+	echo "-cropwidth=${CROP_WIDTH}"
+	echo "-cropheight=${CROP_HEIGHT}"
+	echo "-cropoffsetx=${CROP_OFFSET_X}"
+	echo "-cropoffsety=${CROP_OFFSET_Y}"
+	echo "-autostretch=${AUTO_STRETCH}"
+	echo "-autostretchamount=${AUTO_STRETCH_AMOUNT}"
+	echo "-autostretchmidpoint=${AUTO_STRETCH_MID_POINT%\%}"
+	echo "-autostretchadaptive=${AUTO_STRETCH_ADAPTIVE:-false}"
+	echo "-darksdir=${ALLSKY_DARKS}"
+} >> "${ARGS_FILE}"
+
+# The capture program can also write the copy of each image in ${ALLSKY_IMAGES}/<date>,
+# its thumbnail, and the resized upload file, but only if no post-processing module
+# changes the image after it's saved.
+IMAGE_IS_FINAL="true"
+for FLOW in day night; do
+	F="${ALLSKY_MODULES}/postprocessing_${FLOW}.json"
+	[[ ! -f ${F} ]] && continue
+	if ! M="$( jq -r 'to_entries[] | select(.value.enabled == true) | .key' "${F}" )" ||
+			[[ -n $( grep -v -E '^(loadimage|overlay|saveimage)$' <<< "${M}" ) ]]; then
+		IMAGE_IS_FINAL="false"
+	fi
+done
+[[ ${IMG_UPLOAD} == "true" ]] && X="${RESIZE_UPLOADS}" || X="false"
+{
+	echo "-imagesdir=${ALLSKY_IMAGES}"
+	echo "-imageisfinal=${IMAGE_IS_FINAL}"
+	echo "-thumbnails=${IMG_CREATE_THUMBNAILS}"
+	echo "-thumbnailwidth=${THUMBNAIL_SIZE_X}"
+	echo "-thumbnailheight=${THUMBNAIL_SIZE_Y}"
+	echo "-resizeuploads=${X}"
+	echo "-resizeuploadswidth=${RESIZE_UPLOADS_WIDTH}"
+	echo "-resizeuploadsheight=${RESIZE_UPLOADS_HEIGHT}"
+	echo "-livekeogram=${KEOGRAM_LIVE_IMAGES:-0}"
+} >> "${ARGS_FILE}"
+
+# Stack the dark frames taken at each temperature into a master dark
+# if any were taken since the master was made.
+# The hot pixels in all the masters are combined into one map.
+HOT_PIXELS_FILE="${ALLSKY_DARKS}/hotpixels.txt"
+if [[ $( settings ".takeDarkFrames" ) -ne 1 && -d ${ALLSKY_DARKS}/frames ]]; then
+	# Images from color cameras that aren't debayered are RAW8 or RAW16.
+	# This must match what fixHotPixels() in the capture programs considers a Bayer image.
+	BAYER=""
+	TYPE="$( settings ".type" )"
+	[[ $( jq -r ".colorCamera" "${CC_FILE}" 2>/dev/null ) == "true" &&
+		(${TYPE} -eq 0 || ${TYPE} -eq 2) ]] && BAYER="--bayer"
+	(
+		for DIR in "${ALLSKY_DARKS}"/frames/*/ ; do
+			[[ ! -d ${DIR} ]] && continue
+			T="$( basename "${DIR}" )"
+			MASTER="${ALLSKY_DARKS}/${T}.png"
+			[[ -f ${MASTER} && -z $( find "${DIR}" -type f -newer "${MASTER}" -print -quit ) ]] && continue
+			# shellcheck disable=SC2086
+			"${ALLSKY_BIN}/darkmaster" --directory "${DIR}" --extension "*" --output "${MASTER}" \
+				--max-frames "${ALLSKY_DARK_FRAMES_TO_STACK}" --temperature "${T}" --hot-pixels "${ALLSKY_DARKS}/${T}.hotpixels" ${BAYER} &&
+				rm -f "${ALLSKY_DARKS}/${T}.jpg" "${ALLSKY_DARKS}/${T}.jpeg"
+		done
+		# Only combine maps for the same size images as the newest one, and say what size
+		# that is so the capture programs don't use the map if the size changes.
+		if compgen -G "${ALLSKY_DARKS}/*.hotpixels" > /dev/null ; then
+			get_size() { sed -n '1s/^#.* in \([0-9]*x[0-9]*\) .*/\1/p' "${1}" ; }
+			# shellcheck disable=SC2012
+			SIZE="$( get_size "$( ls -t "${ALLSKY_DARKS}"/*.hotpixels | head -1 )" )"
+			{
+				echo "# hot pixels in ${SIZE} ${BAYER:+Bayer }darks"
+				for MAP in "${ALLSKY_DARKS}"/*.hotpixels ; do
+					[[ $( get_size "${MAP}" ) == "${SIZE}" ]] && grep -v "^#" "${MAP}"
+				done | sort -u
+			} > "${HOT_PIXELS_FILE}.tmp" &&
+				mv "${HOT_PIXELS_FILE}.tmp" "${HOT_PIXELS_FILE}"
+		fi
+	) &
+fi
+echo "-hotpixelsfile=${HOT_PIXELS_FILE}" >> "${ARGS_FILE}"
+
 FREQUENCY_FILE="${ALLSKY_TMP}/IMG_UPLOAD_FREQUENCY.txt"
 # If the user wants images uploaded only every n times, save that number to a file.
 if [[ ${IMG_UPLOAD_FREQUENCY} -ne 1 ]]; then
@@ -267,12 +350,18 @@ rm -f "${ALLSKY_NOTIFICATION_LOG}"	# clear out any notificatons from prior runs.
 # Clear up any flow timings
 "${ALLSKY_SCRIPTS}/flow-runner.py" --cleartimings
 
+# Start the program that processes saved images so a new saveImage.sh doesn't need to be
+# started for every image.  If it isn't running the capture program uses saveImage.sh.
+"${ALLSKY_SCRIPTS}/saveImageDaemon.sh" &
+SAVE_IMAGE_DAEMON_PID=$!
+
 # Run the main program - this is the main attraction...
 # -cmd needs to come first since the capture_RPi code checks for it first.  It's ignored
 # in capture_ZWO.
 # Pass debuglevel on command line so the capture program knows if it should display debug output.
 "${ALLSKY_BIN}/${CAPTURE}" -cmd "${RPi_COMMAND_TO_USE}" -debuglevel "${ALLSKY_DEBUG_LEVEL}" -config "${ARGS_FILE}"
 RETCODE=$?
+kill "${SAVE_IMAGE_DAEMON_PID}" 2>/dev/null
 
 [[ ${RETCODE} -eq ${EXIT_OK} ]] && doExit "${EXIT_OK}" ""
 
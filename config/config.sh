@@ -36,6 +36,8 @@ CROP_OFFSET_Y=0
 AUTO_STRETCH="false"
 AUTO_STRETCH_AMOUNT=10
 AUTO_STRETCH_MID_POINT="10%"
+# Set to "true" to use each image's sky brightness as the mid point instead.
+AUTO_STRETCH_ADAPTIVE="false"
 
 # Resize uploaded images.  Change the size to fit your sensor.  
 RESIZE_UPLOADS="false"
@@ -117,6 +119,10 @@ KEOGRAM_EXTRA_PARAMETERS="--font-size 1.0 --font-line 1 --font-color '255 255 25
 # Set to "true" to upload the keogram image to your website at the end of each night.
 UPLOAD_KEOGRAM="false"
 
+# Set to a number to update the keogram during the night every that many images,
+# so the current night's keogram can be seen before the night ends.  "0" disables it.
+KEOGRAM_LIVE_IMAGES="0"
+
 
 ########## Startrails
 # Set to "true" to generate a startrails image of each night.
@@ -19,6 +19,7 @@ DARK_EXTENSION="${CURRENT_IMAGE##*.}"
 
 DARKS_DIR="${ALLSKY_DARKS}"
 mkdir -p "${DARKS_DIR}"
+FRAMES_DIR=""
 if [[ -z ${AS_TEMPERATURE_C} ]]; then
 	# The camera doesn't support temperature so we'll keep overwriting the file until
 	# AS_TEMPERATURE_C is set.
@@ -26,9 +27,30 @@ if [[ -z ${AS_TEMPERATURE_C} ]]; then
 	MOVE_TO_FILE="${DARKS_DIR}/$(basename "${CURRENT_IMAGE}")"
 else
 	MOVE_TO_FILE="${DARKS_DIR}/${AS_TEMPERATURE_C}.${DARK_EXTENSION}"
+
+	# Keep the newest frames so they can be stacked into a master dark by "darkmaster"
+	# when dark frames are no longer being taken.
+	# Until then the latest frame is the dark, unless there's already a master,
+	# which mustn't be overwritten even if the frames are also PNGs.
+	FRAMES_DIR="${DARKS_DIR}/frames/${AS_TEMPERATURE_C}"
+	mkdir -p "${FRAMES_DIR}"
+	FRAME_FILE="${FRAMES_DIR}/$( date +'%Y%m%d%H%M%S' ).${DARK_EXTENSION}"
+	if [[ -f ${DARKS_DIR}/${AS_TEMPERATURE_C}.png ]]; then
+		MOVE_TO_FILE="${FRAME_FILE}"
+	else
+		cp "${CURRENT_IMAGE}" "${FRAME_FILE}"
+	fi
 fi
 mv "${CURRENT_IMAGE}" "${MOVE_TO_FILE}" || exit 3
 
+if [[ -n ${FRAMES_DIR} ]]; then
+	# darkmaster only stacks the newest frames so delete older ones.
+	# Their names are times so the oldest are first.
+	FRAMES=( "${FRAMES_DIR}"/* )
+	NUM_OLD=$(( ${#FRAMES[@]} - ALLSKY_DARK_FRAMES_TO_STACK ))
+	[[ ${NUM_OLD} -gt 0 ]] && rm -f "${FRAMES[@]:0:NUM_OLD}"
+fi
+
 # If the user has notification images on, the current image says "Taking dark frames",
 # so don't overwrite it.
 # If notification images are off, let the user see the dark from to know it's working.
@@ -52,43 +52,48 @@ if [[ ${WEBSITES} != "none" ]]; then
 	"${ALLSKY_SCRIPTS}/postData.sh"
 fi
 
-# Generate keogram from collected images
+# Generate the keogram, startrails, and timelapse from collected images.
+# They're generated in one call so generateForDay.sh can read each image once for all of them.
+# Use generateForDay.sh instead of putting all the commands here so users can easily
+# test the creation, which sometimes has issues.
+# Startrails threshold set to 0.1 by default in config.sh to avoid stacking over-exposed images.
+GENERATE_ARGS=""
+GENERATE_WHAT=""
 if [[ ${KEOGRAM} == "true" ]]; then
-	echo -e "${ME}: ===== Generating Keogram"
-	#shellcheck disable=SC2086
-	"${ALLSKY_SCRIPTS}/generateForDay.sh" ${NICE_ARG} --silent --keogram "${DATE}"
-	RET=$?
-	echo -e "${ME}: ===== Keogram complete"
-	if [[ ${UPLOAD_KEOGRAM} == "true" && ${RET} = 0 ]] ; then
-		"${ALLSKY_SCRIPTS}/generateForDay.sh" --upload --keogram "${DATE}"
-	fi
+	GENERATE_ARGS="${GENERATE_ARGS} --keogram"
+	GENERATE_WHAT="${GENERATE_WHAT}, Keogram"
 fi
-
-# Generate startrails from collected images.
-# Threshold set to 0.1 by default in config.sh to avoid stacking over-exposed images.
 if [[ ${STARTRAILS} == "true" ]]; then
-	echo -e "${ME}: ===== Generating Startrails"
-	#shellcheck disable=SC2086
-	"${ALLSKY_SCRIPTS}/generateForDay.sh" ${NICE_ARG} --silent --startrails "${DATE}"
-	RET=$?
-	echo -e "${ME}: ===== Startrails complete"
-	if [[ ${UPLOAD_STARTRAILS} == "true" && ${RET} = 0 ]] ; then
-		"${ALLSKY_SCRIPTS}/generateForDay.sh" --upload --startrails "${DATE}"
-	fi
+	GENERATE_ARGS="${GENERATE_ARGS} --startrails"
+	GENERATE_WHAT="${GENERATE_WHAT}, Startrails"
 fi
-
-# Generate timelapse from collected images.
-# Use generateForDay.sh instead of putting all the commands here so users can easily
-# test the timelapse creation, which sometimes has issues.
 if [[ ${TIMELAPSE} == "true" ]]; then
-	echo -e "${ME}: ===== Generating Timelapse"
+	GENERATE_ARGS="${GENERATE_ARGS} --timelapse"
+	GENERATE_WHAT="${GENERATE_WHAT}, Timelapse"
+fi
+if [[ -n ${GENERATE_ARGS} ]]; then
+	GENERATE_WHAT="${GENERATE_WHAT#, }"
+	# Anything newer than this was created now, so can be uploaded even if something else failed.
+	GENERATE_START="${ALLSKY_TMP}/endOfNight-start"
+	touch "${GENERATE_START}"
+	echo -e "${ME}: ===== Generating ${GENERATE_WHAT}"
 	#shellcheck disable=SC2086
-	"${ALLSKY_SCRIPTS}/generateForDay.sh" ${NICE_ARG} --silent --timelapse "${DATE}"
-	RET=$?
-	echo -e "${ME}: ===== Timelapse complete"
-	if [[ ${UPLOAD_VIDEO} == "true" && ${RET} = 0 ]] ; then
+	"${ALLSKY_SCRIPTS}/generateForDay.sh" ${NICE_ARG} --silent ${GENERATE_ARGS} "${DATE}"
+	echo -e "${ME}: ===== ${GENERATE_WHAT} complete"
+
+	F="${DATE_DIR}/keogram/keogram-${DATE}.${EXTENSION}"
+	if [[ ${KEOGRAM} == "true" && ${UPLOAD_KEOGRAM} == "true" && ${F} -nt ${GENERATE_START} ]] ; then
+		"${ALLSKY_SCRIPTS}/generateForDay.sh" --upload --keogram "${DATE}"
+	fi
+	F="${DATE_DIR}/startrails/startrails-${DATE}.${EXTENSION}"
+	if [[ ${STARTRAILS} == "true" && ${UPLOAD_STARTRAILS} == "true" && ${F} -nt ${GENERATE_START} ]] ; then
+		"${ALLSKY_SCRIPTS}/generateForDay.sh" --upload --startrails "${DATE}"
+	fi
+	F="${DATE_DIR}/allsky-${DATE}.mp4"
+	if [[ ${TIMELAPSE} == "true" && ${UPLOAD_VIDEO} == "true" && ${F} -nt ${GENERATE_START} ]] ; then
 		"${ALLSKY_SCRIPTS}/generateForDay.sh" --upload --timelapse "${DATE}"
 	fi
+	rm -f "${GENERATE_START}"
 fi
 
 # Run custom script at the end of a night. This is run BEFORE the automatic deletion
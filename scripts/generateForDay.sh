@@ -193,6 +193,48 @@ if [[ ${DO_KEOGRAM} == "true" || ${DO_STARTRAILS} == "true" ]]; then
 
 fi
 
+# When creating more than one of the keogram, startrails, and timelapse, read each image
+# once for all of them with nightproducts instead of once for each.
+# It saves the keogram slits so keogram doesn't read the images, creates the startrails,
+# and sends the timelapse frames to timelapse.sh.
+# Startrails with extra parameters and timelapses that keep their sequence are created as usual.
+ONE_PASS=""
+ONE_PASS_RET=1
+if [[ ${TYPE} == "GENERATE" && ${THUMBNAIL_ONLY} == "false" && -x ${ALLSKY_BIN}/nightproducts ]]; then
+	[[ ${DO_KEOGRAM} == "true" ]] && ONE_PASS="${ONE_PASS} keogram"
+	[[ ${DO_STARTRAILS} == "true" && -z ${STARTRAILS_EXTRA_PARAMETERS} ]] && ONE_PASS="${ONE_PASS} startrails"
+	[[ ${DO_TIMELAPSE} == "true" && ${KEEP_SEQUENCE} == "false" ]] && ONE_PASS="${ONE_PASS} timelapse"
+	# shellcheck disable=SC2086
+	[[ $( echo ${ONE_PASS} | wc -w ) -lt 2 ]] && ONE_PASS=""
+fi
+if [[ -n ${ONE_PASS} ]]; then
+	if [[ -z "${NICE}" ]]; then
+		N=""
+	else
+		N="--nice-level ${NICE}"
+	fi
+	CMD="'${ALLSKY_BIN}/nightproducts' ${N} ${SIZE_FILTER} -d '${OUTPUT_DIR}' -e ${EXTENSION}"
+	[[ ${ONE_PASS} == *keogram* ]] && CMD="${CMD} --keogram"
+	if [[ ${ONE_PASS} == *startrails* ]]; then
+		mkdir -p "${OUTPUT_DIR}/startrails"
+		CMD="${CMD} -b ${BRIGHTNESS_THRESHOLD} -o '${OUTPUT_DIR}/startrails/startrails-${DATE}.${EXTENSION}'"
+	fi
+	if [[ ${ONE_PASS} == *timelapse* ]]; then
+		[[ ${TIMELAPSEWIDTH} != "0" ]] && CMD="${CMD} --video-size ${TIMELAPSEWIDTH}x${TIMELAPSEHEIGHT}"
+		if [[ -z "${NICE}" ]]; then
+			N=""
+		else
+			N="nice -n ${NICE}"
+		fi
+		CMD="${CMD} --fps ${FPS} --timelapse - | ${N} '${ALLSKY_SCRIPTS}/timelapse.sh' --frames - \
+			--output '${OUTPUT_DIR}/allsky-${DATE}.mp4' ${DATE}"
+	fi
+	# Fail if any part of the pipeline does.
+	generate "${ONE_PASS# } in one pass" "" "( set -o pipefail; ${CMD} )"
+	ONE_PASS_RET=$?
+	# Anything not created is created the usual way.
+fi
+
 if [[ ${DO_KEOGRAM} == "true" ]]; then
 	KEOGRAM_FILE="keogram-${DATE}.${EXTENSION}"
 	UPLOAD_FILE="${OUTPUT_DIR}/keogram/${KEOGRAM_FILE}"
@@ -224,7 +266,11 @@ if [[ ${DO_STARTRAILS} == "true" ]]; then
 		CMD="'${ALLSKY_BIN}/startrails' ${N} ${SIZE_FILTER} -d '${OUTPUT_DIR}' \
 			-e ${EXTENSION} -b ${BRIGHTNESS_THRESHOLD} -o '${UPLOAD_FILE}' \
 			${STARTRAILS_EXTRA_PARAMETERS}"
-		generate "Startrails, threshold=${BRIGHTNESS_THRESHOLD}" "startrails" "${CMD}"
+		if [[ ${ONE_PASS} == *startrails* && ${ONE_PASS_RET} -eq 0 ]]; then
+			true	# already created
+		else
+			generate "Startrails, threshold=${BRIGHTNESS_THRESHOLD}" "startrails" "${CMD}"
+		fi
 	else
 		upload "Startrails" "${UPLOAD_FILE}" "${STARTRAILS_DIR}" "${STARTRAILS_FILE}" \
 			"${STARTRAILS_DESTINATION_NAME}" "${WEB_STARTRAILS_DIR}"
@@ -257,8 +303,12 @@ if [[ ${DO_TIMELAPSE} == "true" ]]; then
 				N="nice -n ${NICE}"
 			fi
 			CMD="${N} '${ALLSKY_SCRIPTS}/timelapse.sh' --output '${UPLOAD_FILE}' ${DATE}"
-			generate "Timelapse" "" "${CMD}"	# it creates the necessary directory
-			RET=$?
+			if [[ ${ONE_PASS} == *timelapse* && ${ONE_PASS_RET} -eq 0 ]]; then
+				RET=0	# already created
+			else
+				generate "Timelapse" "" "${CMD}"	# it creates the necessary directory
+				RET=$?
+			fi
 		fi
 		if [[ ${RET} -eq 0 && ${TIMELAPSE_UPLOAD_THUMBNAIL} == "true" ]]; then
 			rm -f "${UPLOAD_THUMBNAIL}"
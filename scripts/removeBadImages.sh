@@ -94,9 +94,10 @@ fi
 set +a		# turn off auto-export since $IMAGE_FILES might be huge and produce errors
 
 cd "${DATE}" || exit 99
+BIN="${ALLSKY_BIN}/removebadimages"
 if [[ -n ${FILE} ]]; then
 	IMAGE_FILES="${FILE}"
-else
+elif [[ ! -x ${BIN} ]]; then
 	IMAGE_FILES="$( find . -maxdepth 1 -type f -iname "${FILENAME}"-\*."${EXTENSION}" )"
 fi
 ERROR_WORDS="Huffman|Bogus|Corrupt|Invalid|Trunc|Missing|insufficient image data|no decode delegate|no images defined"
@@ -130,6 +131,28 @@ else
 		NICE=""
 fi
 
+# The removebadimages program does the same checks much faster,
+# and doesn't need to read the image if the capture program passed its mean.
+if [[ -x ${BIN} ]]; then
+	ARGS=(--low "${LOW}" --high "${HIGH}")
+	[[ ${DEBUG} == "true" ]] && ARGS+=(--debug)
+	if [[ -n ${FILE} ]]; then
+		[[ -n ${AS_IMAGE_MEAN} ]] && ARGS+=(--mean "${AS_IMAGE_MEAN}")
+		RESULT="$( "${BIN}" "${ARGS[@]}" "${DATE}" "${FILE}" )"
+		if [[ $? -eq 99 ]]; then
+			OUTPUT="${r} ${RESULT}"
+			num_bad=1
+		else
+			echo "${RESULT}"
+		fi
+	else
+		ARGS+=(--pattern "${FILENAME}-*.${EXTENSION}" --log "${OUTPUT}")
+		num_bad="$( ${NICE} "${BIN}" "${ARGS[@]}" "${DATE}" )"
+		[[ -z ${num_bad} ]] && num_bad=0
+	fi
+	IMAGE_FILES=""
+fi
+
 for f in ${IMAGE_FILES} ; do
 	BAD=""
 
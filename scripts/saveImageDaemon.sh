@@ -0,0 +1,80 @@
+#!/bin/bash
+
+# Long-running version of saveImage.sh.
+# The capture programs write one line per image to ${FIFO}:
+#	DAY|NIGHT <tab> full_path_to_image <tab> variable=value [<tab> ...]
+# and each image is processed by save_image() in saveImage.sh.
+# Bash is only started, variables.sh, functions.sh, and config.sh only read, and the settings
+# only looked up once instead of for every image.  save_image() runs in this shell, so
+# no new process is started for an image unless saveImage.sh itself runs a program.
+
+[[ -z ${ALLSKY_HOME} ]] && export ALLSKY_HOME="$(realpath "$(dirname "${BASH_ARGV0}")/..")"
+ME="$(basename "${BASH_ARGV0}")"
+
+#shellcheck disable=SC2086 source-path=.
+source "${ALLSKY_HOME}/variables.sh"		|| exit ${ALLSKY_ERROR_STOP}
+#shellcheck disable=SC2086 source-path=scripts
+source "${ALLSKY_SCRIPTS}/functions.sh"		|| exit ${ALLSKY_ERROR_STOP}
+#shellcheck disable=SC2086,SC1091		# file doesn't exist in GitHub
+source "${ALLSKY_CONFIG}/config.sh"			|| exit ${ALLSKY_ERROR_STOP}
+
+FIFO="${ALLSKY_TMP}/saveImage.fifo"
+# After each image: capture program's pid, image sequence number, ms from capture to published.
+STATUS_FILE="${ALLSKY_TMP}/saveImage-status.txt"
+PID_FILE="${ALLSKY_TMP}/saveImageDaemon-pid.txt"
+
+# Only one of us should be running.
+if [[ -s ${PID_FILE} ]]; then
+	OLD_PID="$( < "${PID_FILE}" )"
+	[[ ${OLD_PID} != "$$" ]] && kill "${OLD_PID}" 2>/dev/null
+fi
+echo "$$" > "${PID_FILE}"
+
+if [[ ! -p ${FIFO} ]]; then
+	rm -f "${FIFO}"
+	if ! mkfifo "${FIFO}" ; then
+		echo -e "${RED}*** ${ME}: ERROR: Unable to create '${FIFO}'.${NC}" >&2
+		exit 1
+	fi
+fi
+rm -f "${STATUS_FILE}"
+
+# Finish the current image before exiting.
+SAVING=""
+STOP=""
+trap 'if [[ -n ${SAVING} ]]; then STOP="true"; else rm -f "${PID_FILE}"; exit 0; fi' SIGTERM SIGINT
+
+# Tell saveImage.sh it's being run by us, then get save_image() and the settings it uses.
+SAVE_IMAGE_DAEMON="true"
+#shellcheck source-path=scripts
+source "${ALLSKY_SCRIPTS}/saveImage.sh"		|| exit ${ALLSKY_ERROR_STOP}
+
+# Open for reading and writing so we don't get end-of-file when the capture program restarts.
+exec 3<> "${FIFO}"
+
+while [[ -z ${STOP} ]] && IFS=$'\t' read -r -u 3 -a RECORD ; do
+	[[ ${#RECORD[@]} -lt 2 ]] && continue
+
+	SAVING="true"
+	save_image "${RECORD[@]}"
+	SAVING=""
+
+	SEQUENCE=""; PID=""; CAPTURED_US=""
+	for V in "${RECORD[@]:2}"; do
+		case "${V}" in
+			SEQUENCE=*)		SEQUENCE="${V#*=}" ;;
+			PID=*)			PID="${V#*=}" ;;
+			CAPTURED_US=*)	CAPTURED_US="${V#*=}" ;;
+		esac
+	done
+	[[ -z ${SEQUENCE} || -z ${PID} || -z ${CAPTURED_US} ]] && continue
+
+	# ${EPOCHREALTIME} may use a comma as the decimal point.
+	NOW_US="${EPOCHREALTIME/[.,]/}"
+	LATENCY_MS=$(( (NOW_US - CAPTURED_US) / 1000 ))
+	echo "${PID} ${SEQUENCE} ${LATENCY_MS}" > "${STATUS_FILE}"
+	[[ ${ALLSKY_DEBUG_LEVEL} -ge 3 ]] && echo "${ME}: '${RECORD[1]##*/}' published ${LATENCY_MS} ms after capture."
+done
+
+rm -f "${PID_FILE}"
+exit 0
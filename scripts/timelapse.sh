@@ -18,6 +18,7 @@ HELP="false"
 IS_MINI="false"
 LOCK="false"
 IMAGES_FILE=""
+FRAMES_FILE=""
 OUTPUT_FILE=""
 while [[ $# -gt 0 ]]; do
 	case "${1}" in
@@ -38,6 +39,10 @@ while [[ $# -gt 0 ]]; do
 				IMAGES_FILE="${2}"
 				shift
 				;;
+			-f | --frames)
+				FRAMES_FILE="${2}"
+				shift
+				;;
 			-m | --mini)
 				IS_MINI="true"
 				;;
@@ -58,7 +63,7 @@ usage_and_exit()
 	XD="/some_nonstandard_path"
 	TODAY="$(date +%Y%m%d)"
 	[[ ${RET} -ne 0 ]] && echo -en "${RED}"
-	echo -n "Usage: ${ME} [--debug] [--help] [--lock] [--output file] [--mini] {--images file | <INPUT_DIR> }"
+	echo -n "Usage: ${ME} [--debug] [--help] [--lock] [--output file] [--mini] [--frames file] {--images file | <INPUT_DIR> }"
 	echo -e "${NC}"
 	echo "    example: ${ME} ${TODAY}"
 	echo "    or:      ${ME} --output '${XD}' ${TODAY}"
@@ -81,6 +86,8 @@ usage_and_exit()
 	echo "'--output file' overrides the default storage location and file name."
 	echo "'--mini' uses the MINI_TIMELAPSE settings and the timelapse file is"
 	echo "   called 'mini-timelapse.mp4' if '--output' isn't used."
+	echo "'--frames file' reads the video frames from 'file' ('-' for stdin) as written by"
+	echo "   nightproducts instead of reading the images."
 	echo -en "${NC}"
 	# shellcheck disable=SC2086
 	exit ${RET}
@@ -167,7 +174,9 @@ fi
 TMP="${ALLSKY_TMP}/timelapseTMP.txt"
 [[ ${IS_MINI} == "false"  ]] && : > "${TMP}"		# Only create when NOT doing mini-timelapses
 
-if [[ ${KEEP_SEQUENCE} == "false" ]]; then
+if [[ -n ${FRAMES_FILE} ]]; then
+	:	# nightproducts read the images.
+elif [[ ${KEEP_SEQUENCE} == "false" ]]; then
 	rm -fr "${SEQUENCE_DIR}"
 	mkdir -p "${SEQUENCE_DIR}"
 
@@ -239,11 +248,17 @@ if [[ ${IS_MINI} == "true" ]]; then
 elif [[ ${TIMELAPSEWIDTH} != "0" ]]; then
 	SCALE="-filter:v scale=${TIMELAPSEWIDTH}:${TIMELAPSEHEIGHT}"
 fi
+if [[ -n ${FRAMES_FILE} ]]; then
+	# nightproducts already made the frames the right size and set the frame rate.
+	SCALE=""
+	INPUT=( -f yuv4mpegpipe -i "${FRAMES_FILE}" )
+else
+	INPUT=( -f image2 -r "${FPS}" -i "${SEQUENCE_DIR}/%04d.${EXTENSION}" )
+fi
 # shellcheck disable=SC2086
-X="$(ffmpeg -y -f image2 \
+X="$(ffmpeg -y \
 	-loglevel "${FFLOG}" \
-	-r "${FPS}" \
-	-i "${SEQUENCE_DIR}/%04d.${EXTENSION}" \
+	"${INPUT[@]}" \
 	-vcodec "${VCODEC}" \
 	-b:v "${TIMELAPSE_BITRATE}" \
 	-pix_fmt "${PIX_FMT}" \
@@ -260,9 +275,12 @@ X="$(echo "${X}" | grep -v "deprecated pixel format used")"
 if [[ ${RET} -ne -0 ]]; then
 	echo -e "\n${RED}*** $ME: ERROR: ffmpeg failed."
 	echo "Error log is in '${TMP}'."
-	echo
-	echo "Links in '${SEQUENCE_DIR}' left for debugging."
-	echo -e "Remove them when the problem is fixed.${NC}\n"
+	if [[ -z ${FRAMES_FILE} ]]; then
+		echo
+		echo "Links in '${SEQUENCE_DIR}' left for debugging."
+		echo -e "Remove them when the problem is fixed."
+	fi
+	echo -e "${NC}"
 	rm -f "${OUTPUT_FILE}"	# don't leave around to confuse user
 	exit 1
 fi
@@ -270,7 +288,9 @@ fi
 # if the user wants output, give it to them
 [[ ${FFLOG} == "info" && ${IS_MINI} == "false"  ]] && cat "${TMP}"
 
-if [[ ${KEEP_SEQUENCE} == "false" ]]; then
+if [[ -n ${FRAMES_FILE} ]]; then
+	:
+elif [[ ${KEEP_SEQUENCE} == "false" ]]; then
 	rm -rf "${SEQUENCE_DIR}"
 else
 	echo -e "${ME} ${GREEN}Keeping sequence${NC}"
@@ -373,7 +373,12 @@ int ASIGetNumOfConnectedCameras()
 	char cmd[300];
 	int num;
 	// Put the list of cameras and attributes in a file and return the number of cameras (the exit code).
-	if (CG.isLibcamera)
+	if (CG.replay != NULL)
+	{
+		// There's no camera when replaying images so pretend there's an RPi HQ camera.
+		snprintf(cmd, sizeof(cmd), "echo '0 : imx477 [%ldx%ld]' > '%s'; exit 1", ASICameraInfoArray[0].MaxWidth, ASICameraInfoArray[0].MaxHeight, camerasInfoFile);
+	}
+	else if (CG.isLibcamera)
 	{
 		// --list-cameras" writes to stderr.
 		snprintf(cmd, sizeof(cmd), "NUM=$(LIBCAMERA_LOG_LEVELS=FATAL %s --list-cameras 2>&1 | grep -E '^[0-9 ]' | tee '%s' | grep -E '^[0-9] : ' | wc -l); exit ${NUM}", CG.cmdToUse, camerasInfoFile);
@@ -562,6 +567,12 @@ ASI_ERROR_CODE ASIGetControlValue(int iCameraIndex, ASI_CONTROL_TYPE ControlType
 }
 
 
+// ZWO needs to handle replayed images differently; RPi doesn't.
+ASI_ERROR_CODE getControlCaps(int iCameraIndex, int iControlIndex, ASI_CONTROL_CAPS *pControlCaps)
+{
+	return(ASIGetControlCaps(iCameraIndex, iControlIndex, pControlCaps));
+}
+
 // Empty routine so code compiles.
 int stopVideoCapture(int cameraID) { return(ASI_SUCCESS); }
 
@@ -613,8 +624,56 @@ char const *argumentNames[][2] = {
 	{ "NEW", "" } // In case a new type is added we won't get an error
 };
 
+// The camera used when replaying images since there's no real camera.
+// The values are typical of a color USB 3 camera.
+ASI_CAMERA_INFO replayCameraInfo =
+{
+	"ZWO Replay", 0, 2080, 3096, ASI_TRUE, ASI_BAYER_RG,
+	{ 1, 2, 3, 4, 0 }, { ASI_IMG_RAW8, ASI_IMG_RGB24, ASI_IMG_RAW16, ASI_IMG_Y8, ASI_IMG_END },
+	2.4, ASI_FALSE, ASI_FALSE, ASI_FALSE, ASI_TRUE, ASI_FALSE, 1.0, 12, ASI_FALSE, { 0 }
+};
+
+// These must be sorted by ControlType, like ZWO's.
+ASI_CONTROL_CAPS replayControlCaps[] =
+{
+	// Name, Description, MaxValue, MinValue, DefaultValue, IsAutoSupported, IsWritable, ControlType
+	{ "Gain", "Gain", 570, 0, 200, ASI_TRUE, ASI_TRUE, ASI_GAIN, { 0 } },
+	{ "Exposure", "Exposure Time(us)", 2000000000, 32, 10000, ASI_TRUE, ASI_TRUE, ASI_EXPOSURE, { 0 } },
+	{ "WB_R", "White balance: Red component", 99, 1, 52, ASI_TRUE, ASI_TRUE, ASI_WB_R, { 0 } },
+	{ "WB_B", "White balance: Blue component", 99, 1, 95, ASI_TRUE, ASI_TRUE, ASI_WB_B, { 0 } },
+	{ "Offset", "offset", 80, 0, 8, ASI_FALSE, ASI_TRUE, ASI_OFFSET, { 0 } },
+	{ "BandWidth", "The total data transfer rate percentage", 100, 40, 50, ASI_TRUE, ASI_TRUE, ASI_BANDWIDTHOVERLOAD, { 0 } },
+	{ "Temperature", "Sensor temperature(degrees Celsius)", 1000, -500, 20, ASI_FALSE, ASI_FALSE, ASI_TEMPERATURE, { 0 } },
+	{ "Flip", "Flip: 0->None 1->Horiz 2->Vert 3->Both", 3, 0, 0, ASI_FALSE, ASI_TRUE, ASI_FLIP, { 0 } },
+	{ "AutoExpMaxGain", "Auto exposure maximum gain value", 570, 0, 285, ASI_FALSE, ASI_TRUE, ASI_AUTO_MAX_GAIN, { 0 } },
+	{ "AutoExpMaxExpMS", "Auto exposure maximum exposure value(unit ms)", 60000, 1, 100, ASI_FALSE, ASI_TRUE, ASI_AUTO_MAX_EXP, { 0 } },
+	{ "AutoExpTargetBrightness", "Auto exposure target brightness value", 160, 50, 100, ASI_FALSE, ASI_TRUE, ASI_AUTO_TARGET_BRIGHTNESS, { 0 } },
+	{ "HighSpeedMode", "Is high speed mode:0->No 1->Yes", 1, 0, 0, ASI_FALSE, ASI_TRUE, ASI_HIGH_SPEED_MODE, { 0 } },
+};
+int const replayNumOfControls = sizeof(replayControlCaps) / sizeof(ASI_CONTROL_CAPS);
+
+// Get the camera control at index iControlIndex, from the replay camera if replaying images.
+ASI_ERROR_CODE getControlCaps(int iCameraIndex, int iControlIndex, ASI_CONTROL_CAPS *pControlCaps)
+{
+	if (CG.replay != NULL)
+	{
+		if (iControlIndex < 0 || iControlIndex >= replayNumOfControls)
+			return(ASI_ERROR_INVALID_CONTROL_TYPE);
+		*pControlCaps = replayControlCaps[iControlIndex];
+		return(ASI_SUCCESS);
+	}
+
+	return(ASIGetControlCaps(iCameraIndex, iControlIndex, pControlCaps));
+}
+
 int stopVideoCapture(int cameraID)
 {
+	if (CG.replay != NULL)
+		return(ASI_SUCCESS);
+
+	if (CG.snapshotMode)
+		return((int) ASIStopExposure(cameraID));
+
 	return((int) ASIStopVideoCapture(cameraID));
 }
 
@@ -737,9 +796,9 @@ ASI_ERROR_CODE getControlCapForControlType(int iCameraIndex, ASI_CONTROL_TYPE Co
 	{
 		ASI_CONTROL_CAPS cc;
 		ASI_ERROR_CODE ret;
-		ret = ASIGetControlCaps(iCameraIndex, i, &cc);
+		ret = getControlCaps(iCameraIndex, i, &cc);
 		if (ret != ASI_SUCCESS) {
-			Log(3, "%s: ASIGetControlCaps(%d, %i, &cc) failed: %s\n",
+			Log(3, "%s: getControlCaps(%d, %i, &cc) failed: %s\n",
 				CG.ME, iCameraIndex, i, getRetCode(ret));
 			return(ret);
 		}
@@ -760,6 +819,13 @@ bool hasSerialNumber = true;
 
 char *getSerialNumber(int camNum)
 {
+	if (CG.replay != NULL)
+	{
+		hasSerialNumber = false;
+		snprintf(sn, sizeof(sn), "[none]");
+		return(sn);
+	}
+
 	ASI_SN serialNumber;
 	ASI_ERROR_CODE asiRetCode = ASIGetSerialNumber(camNum, &serialNumber);
 	if (asiRetCode != ASI_SUCCESS)
@@ -1035,6 +1101,14 @@ void saveCameraInfo(ASI_CAMERA_INFO cameraInfo, char const *file, int width, int
 	fprintf(f, "\t\t\t\"DefaultValue\" : \"%s\"\n", CG.HB.sArgs);
 	fprintf(f, "\t\t},\n");
 
+	fprintf(f, "\t\t{\n");
+	fprintf(f, "\t\t\t\"Name\" : \"%s\",\n", "HistogramSampling");
+	fprintf(f, "\t\t\t\"argumentName\" : \"%s\",\n", "histogramsampling");
+	fprintf(f, "\t\t\t\"MinValue\" : 1,\n");
+	fprintf(f, "\t\t\t\"MaxValue\" : %d,\n", MAX_HISTOGRAM_SAMPLING);
+	fprintf(f, "\t\t\t\"DefaultValue\" : %ld\n", CG.HB.sampling);
+	fprintf(f, "\t\t},\n");
+
 	fprintf(f, "\t\t{\n");
 	fprintf(f, "\t\t\t\"Name\" : \"%s\",\n", "showhistogrambox");
 	fprintf(f, "\t\t\t\"argumentName\" : \"%s\",\n", "showhistogrambox");
@@ -1047,6 +1121,26 @@ void saveCameraInfo(ASI_CAMERA_INFO cameraInfo, char const *file, int width, int
 	fprintf(f, "\t\t\t\"DefaultValue\" : %d\n", CG.videoOffBetweenImages ? 1 : 0);
 	fprintf(f, "\t\t},\n");
 
+	fprintf(f, "\t\t{\n");
+	fprintf(f, "\t\t\t\"Name\" : \"%s\",\n", "SaveBuffers");
+	fprintf(f, "\t\t\t\"argumentName\" : \"%s\",\n", "savebuffers");
+	fprintf(f, "\t\t\t\"MinValue\" : 1,\n");
+	fprintf(f, "\t\t\t\"MaxValue\" : %d,\n", MAX_SAVE_BUFFERS);
+	fprintf(f, "\t\t\t\"DefaultValue\" : %ld\n", CG.saveBuffers);
+	fprintf(f, "\t\t},\n");
+
+	fprintf(f, "\t\t{\n");
+	fprintf(f, "\t\t\t\"Name\" : \"%s\",\n", "snapshotmode");
+	fprintf(f, "\t\t\t\"argumentName\" : \"%s\",\n", "snapshotmode");
+	fprintf(f, "\t\t\t\"DefaultValue\" : %d\n", CG.snapshotMode ? 1 : 0);
+	fprintf(f, "\t\t},\n");
+
+	fprintf(f, "\t\t{\n");
+	fprintf(f, "\t\t\t\"Name\" : \"%s\",\n", "streamingmode");
+	fprintf(f, "\t\t\t\"argumentName\" : \"%s\",\n", "streamingmode");
+	fprintf(f, "\t\t\t\"DefaultValue\" : %d\n", CG.streamingMode ? 1 : 0);
+	fprintf(f, "\t\t},\n");
+
 	fprintf(f, "\t\t{\n");
 	fprintf(f, "\t\t\t\"Name\" : \"%s\",\n", "CameraNumber");
 	fprintf(f, "\t\t\t\"argumentName\" : \"%s\",\n", "cameraNumber");
@@ -1074,7 +1168,7 @@ void saveCameraInfo(ASI_CAMERA_INFO cameraInfo, char const *file, int width, int
 	for (int i = 0; i < iNumOfCtrl; i++)
 	{
 		ASI_CONTROL_CAPS cc;
-		ASIGetControlCaps(cameraInfo.CameraID, i, &cc);
+		getControlCaps(cameraInfo.CameraID, i, &cc);
 
 		// blank names means it's unsupported
 		if (cc.Name[0] == '\0')
@@ -1208,7 +1302,7 @@ void outputCameraInfo(ASI_CAMERA_INFO cameraInfo, config cg, long width, long he
 	ASI_CONTROL_CAPS cc;
 	for (int i = 0; i < iNumOfCtrl; i++)
 	{
-		ASIGetControlCaps(cameraInfo.CameraID, i, &cc);
+		getControlCaps(cameraInfo.CameraID, i, &cc);
 		switch (cc.ControlType) {
 		case ASI_EXPOSURE:
 			cg.cameraMinExposure_us = cc.MinValue;
@@ -1246,7 +1340,7 @@ void outputCameraInfo(ASI_CAMERA_INFO cameraInfo, config cg, long width, long he
 		printf("Control Caps:\n");
 		for (int i = 0; i < iNumOfCtrl; i++)
 		{
-			ASIGetControlCaps(cameraInfo.CameraID, i, &cc);
+			getControlCaps(cameraInfo.CameraID, i, &cc);
 			printf("  - %s:\n", cc.Name);
 			printf("    - Description = %s\n", cc.Description);
 			printf("    - MinValue = %s\n", LorF(cc.MinValue, "%'ld", "%'.3f"));
@@ -1545,6 +1639,24 @@ bool validateSettings(config *cg, ASI_CAMERA_INFO ci)
 		validateLong(&cg->gainTransitionTime, 0, NO_MAX_VALUE, "Gain Transition Time", true);
 		// user specifies minutes but we want seconds.
 		cg->gainTransitionTime *= 60;
+
+		validateLong(&cg->saveBuffers, 1, MAX_SAVE_BUFFERS, "Save Buffers", true);
+		validateLong(&cg->HB.sampling, 1, MAX_HISTOGRAM_SAMPLING, "Histogram Sampling", true);
+
+		// Streaming needs video left on, and a snapshot can't be taken while streaming.
+		if (cg->streamingMode)
+		{
+			if (cg->snapshotMode)
+			{
+				Log(-1, "*** %s: WARNING: Snapshot Mode and Streaming Mode can't both be on; turning Snapshot Mode off.\n", cg->ME);
+				cg->snapshotMode = false;
+			}
+			if (cg->videoOffBetweenImages)
+			{
+				Log(2, "  > Streaming Mode leaves video on between images.\n");
+				cg->videoOffBetweenImages = false;
+			}
+		}
 	}
 
 	if (cg->imageType != AUTO_IMAGE_TYPE)
@@ -1574,6 +1686,38 @@ bool validateSettings(config *cg, ASI_CAMERA_INFO ci)
 			&cg->overlay.smallFontcolor[0], &cg->overlay.smallFontcolor[1], &cg->overlay.smallFontcolor[2]) != 3)
 		Log(-1, "*** %s: WARNING: Not enough small font color parameters: '%s'%s\n", cg->ME, cg->overlay.sfc);
 
+	// Image processing arguments
+	if (cg->PP.resize && (cg->PP.width <= 0 || cg->PP.height <= 0))
+	{
+		Log(0, "*** %s: ERROR: Image Resize Width and Height must be greater than 0 (%ld x %ld).\n",
+			cg->ME, cg->PP.width, cg->PP.height);
+		ok = false;
+	}
+	if (cg->PP.crop && (cg->PP.cropWidth <= 0 || cg->PP.cropHeight <= 0))
+	{
+		Log(0, "*** %s: ERROR: Image Crop Width and Height must be greater than 0 (%ld x %ld).\n",
+			cg->ME, cg->PP.cropWidth, cg->PP.cropHeight);
+		ok = false;
+	}
+	if (cg->PP.stretch)
+	{
+		validateFloat(&cg->PP.stretchAmount, 0, NO_MAX_VALUE, "Auto Stretch Amount", true);
+		validateFloat(&cg->PP.stretchMidPoint, 0, 100, "Auto Stretch Mid Point", true);
+	}
+	// saveImage.sh will make these files (or try to) if we don't.
+	if (cg->OUT.thumbnails && (cg->OUT.thumbnailWidth <= 0 || cg->OUT.thumbnailHeight <= 0))
+	{
+		Log(1, "*** %s: WARNING: Thumbnail size %ld x %ld is invalid; not making thumbnails.\n",
+			cg->ME, cg->OUT.thumbnailWidth, cg->OUT.thumbnailHeight);
+		cg->OUT.thumbnails = false;
+	}
+	if (cg->OUT.resizeUploads && (cg->OUT.uploadWidth <= 0 || cg->OUT.uploadHeight <= 0))
+	{
+		Log(1, "*** %s: WARNING: Resize Uploads size %ld x %ld is invalid; not resizing uploads.\n",
+			cg->ME, cg->OUT.uploadWidth, cg->OUT.uploadHeight);
+		cg->OUT.resizeUploads = false;
+	}
+
 	cg->defaultBin = 1;
 	if (! checkBin(cg->dayBin, ci, "Daytime Binning"))
 		ok = false;
@@ -19,8 +19,24 @@
 #include <sys/wait.h>
 #include <stdio.h>
 #include <fcntl.h>
+#include <chrono>
+#include <thread>
+#include <limits>
+#include <vector>
+#include <math.h>
+#include <semaphore.h>
+#include <atomic>
+#include <mutex>
+#include <signal.h>
+#include <limits.h>
 
 #include "include/allsky_common.h"
+#include "include/sunriset.h"
+#include "include/jpeg_parallel.h"
+#include "include/dark_library.h"
+#include "include/hot_pixels.h"
+#include "include/frame_journal.h"
+#include "include/live_keogram.h"
 
 using namespace std;
 
@@ -33,6 +49,238 @@ static char const *fontnames[]		= {		// Character representation of names for cl
 //xxxxxxxxxxxxxx TODO: isDayOrNight dayOrNight;
 
 
+// WebUI messages.
+// Log() queues them and a background thread adds them to the messages file the same way
+// addMessage.sh does, so the caller never forks a shell or waits on the disk.
+// The queue is a fixed-size ring that any thread can add to without locking:
+// each slot's sequence number says whether it's free or holds a message.
+// If the queue is full the message is counted and dropped.
+#define MAX_QUEUED_MESSAGES		32			// must be a power of 2
+#define MESSAGE_REPEAT_SECONDS	60			// write a repeated message at most this often
+
+struct queuedMessage {
+	std::atomic<unsigned> sequence;
+	char const *severity;
+	char msg[1000];
+};
+static queuedMessage messageQueue[MAX_QUEUED_MESSAGES];
+static std::atomic<unsigned> messageEnqueuePos(0);
+static unsigned messageDequeuePos		= 0;		// only used by the message thread
+static std::atomic<long> numMessagesDropped(0);
+static std::atomic<bool> stopMessages(false);
+static std::once_flag messageThreadStarted;
+static sem_t messagesWaiting;
+static sem_t messagesFlushed;
+
+// Messages written recently, so repeats can be counted instead of written each time.
+struct recentMessage {
+	std::string severity;
+	std::string msg;
+	time_t lastWritten;
+	int numRepeats;						// not written yet
+};
+
+// Add "count" occurrences of a message to the messages file.
+// The file is tab-separated: type date count message
+// If the message is already there, remove it and add it at the end with the new count.
+static void writeMessage(char const *severity, char const *msg, int count)
+{
+	std::string type = severity;
+	if (type == "error")
+		type = "danger";
+
+	std::string message;
+	for (char const *p = msg; *p != '\0'; p++)
+	{
+		if (*p == '%')
+			message += "&#37;";
+		else if (*p == '\\' && *(p+1) == 'n')
+		{
+			message += "<br>";
+			p++;
+		}
+		else
+			message += *p;
+	}
+
+	std::string file = std::string(CG.allskyHome) + "/config/messages.txt";
+	std::vector<std::string> lines;
+	std::ifstream in(file);
+	std::string line, tabMessage = "\t" + message;
+	while (std::getline(in, line))
+	{
+		if (line.size() >= tabMessage.size() &&
+			line.compare(line.size() - tabMessage.size(), tabMessage.size(), tabMessage) == 0)
+		{
+			int priorCount = 0;
+			if (sscanf(line.c_str(), "%*[^\t]\t%*[^\t]\t%d", &priorCount) == 1)
+				count += priorCount;
+		}
+		else
+		{
+			lines.push_back(line);
+		}
+	}
+	in.close();
+
+	char date[100];
+	time_t now = time(NULL);
+	struct tm tm;
+	strftime(date, sizeof(date), "%B %d, %r", localtime_r(&now, &tm));
+
+	std::string tmpFile = file + ".tmp";
+	std::ofstream out(tmpFile);
+	for (size_t i = 0; i < lines.size(); i++)
+		out << lines[i] << "\n";
+	out << type << "\t" << date << "\t" << count << "\t" << message << "\n";
+	out.close();
+	if (! out || rename(tmpFile.c_str(), file.c_str()) != 0)
+		Log(1, "*** %s: WARNING: Unable to update '%s': %s\n", CG.ME, file.c_str(), strerror(errno));
+}
+
+// Write the message unless it was written recently, in which case just count it.
+static void addMessage(std::vector<recentMessage> &recentMessages, char const *severity, char const *msg, time_t now)
+{
+	for (size_t i = 0; i < recentMessages.size(); i++)
+	{
+		recentMessage *r = &recentMessages[i];
+		if (r->msg == msg && r->severity == severity)
+		{
+			if (now - r->lastWritten < MESSAGE_REPEAT_SECONDS)
+			{
+				r->numRepeats++;
+			}
+			else
+			{
+				writeMessage(severity, msg, r->numRepeats + 1);
+				r->lastWritten = now;
+				r->numRepeats = 0;
+			}
+			return;
+		}
+	}
+
+	writeMessage(severity, msg, 1);
+	recentMessages.push_back({ severity, msg, now, 0 });
+}
+
+// Write repeats that have waited long enough, or all of them if "all" is true,
+// and forget messages that haven't been seen in a while.
+static void writeRepeatedMessages(std::vector<recentMessage> &recentMessages, time_t now, bool all)
+{
+	for (size_t i = 0; i < recentMessages.size(); )
+	{
+		recentMessage *r = &recentMessages[i];
+		if (r->numRepeats > 0 && (all || now - r->lastWritten >= MESSAGE_REPEAT_SECONDS))
+		{
+			writeMessage(r->severity.c_str(), r->msg.c_str(), r->numRepeats);
+			r->lastWritten = now;
+			r->numRepeats = 0;
+		}
+
+		if (r->numRepeats == 0 && now - r->lastWritten >= MESSAGE_REPEAT_SECONDS)
+			recentMessages.erase(recentMessages.begin() + i);
+		else
+			i++;
+	}
+}
+
+static void messageThreadLoop()
+{
+	std::vector<recentMessage> recentMessages;
+
+	while (true)
+	{
+		// Wake up periodically to write repeated messages.
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += 1;
+		(void) sem_timedwait(&messagesWaiting, &ts);
+
+		time_t now = time(NULL);
+		while (true)
+		{
+			queuedMessage *m = &messageQueue[messageDequeuePos % MAX_QUEUED_MESSAGES];
+			if (m->sequence.load(std::memory_order_acquire) != messageDequeuePos + 1)
+				break;		// empty
+			addMessage(recentMessages, m->severity, m->msg, now);
+			m->sequence.store(messageDequeuePos + MAX_QUEUED_MESSAGES, std::memory_order_release);
+			messageDequeuePos++;
+		}
+
+		long numDropped = numMessagesDropped.exchange(0);
+		if (numDropped > 0)
+		{
+			char msg[100];
+			snprintf(msg, sizeof(msg), "%s: %ld messages were lost because too many arrived at once.", CG.ME, numDropped);
+			addMessage(recentMessages, "warning", msg, now);
+		}
+
+		bool stopping = stopMessages.load();
+		writeRepeatedMessages(recentMessages, now, stopping);
+		if (stopping)
+			break;
+	}
+	sem_post(&messagesFlushed);
+}
+
+// Write any queued messages when the program exits.
+// Don't wait forever in case the disk is hung.
+static void flushMessages()
+{
+	stopMessages = true;
+	sem_post(&messagesWaiting);
+
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += 5;
+	(void) sem_timedwait(&messagesFlushed, &ts);
+}
+
+static void startMessageThread()
+{
+	for (unsigned i = 0; i < MAX_QUEUED_MESSAGES; i++)
+		messageQueue[i].sequence.store(i, std::memory_order_relaxed);
+	sem_init(&messagesWaiting, 0, 0);
+	sem_init(&messagesFlushed, 0, 0);
+	std::thread(messageThreadLoop).detach();
+	atexit(flushMessages);
+}
+
+// Queue a message for the WebUI.  Return false if the queue is full.
+static bool queueMessage(char const *severity, char const *msg)
+{
+	std::call_once(messageThreadStarted, startMessageThread);
+
+	unsigned pos = messageEnqueuePos.load(std::memory_order_relaxed);
+	while (true)
+	{
+		queuedMessage *m = &messageQueue[pos % MAX_QUEUED_MESSAGES];
+		int diff = (int) (m->sequence.load(std::memory_order_acquire) - pos);
+		if (diff == 0)
+		{
+			// The slot is free; claim it unless another thread beat us to it.
+			if (messageEnqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+			{
+				m->severity = severity;
+				snprintf(m->msg, sizeof(m->msg), "%s", msg);
+				m->sequence.store(pos + 1, std::memory_order_release);
+				sem_post(&messagesWaiting);
+				return(true);
+			}
+		}
+		else if (diff < 0)
+		{
+			numMessagesDropped++;
+			return(false);
+		}
+		else
+		{
+			pos = messageEnqueuePos.load(std::memory_order_relaxed);
+		}
+	}
+}
+
 /**
  * Helper function to display debug info.
  * If the required_level is negative then also put the info in a "message" file.
@@ -62,11 +310,7 @@ void Log(int required_level, const char *fmt, ...)
 				*p = '\0';
 			}
 
-			char command[sizeof(msg) + 100];
-			snprintf(command, sizeof(command)-1, "%s/scripts/addMessage.sh %s '%s'",
-				CG.allskyHome, severity, msg);
-			Log(4, "Executing %s\n", command);
-			(void) system(command);
+			(void) queueMessage(severity, msg);
 		}
 
 		va_end(va);
@@ -200,114 +444,690 @@ std::string getOverlayMethod(int m)
 		return("unknown");
 }
 
-void add_variables_to_command(config cg, char *cmd, timeval startDateTime)
+// Processing of images before they are saved.
+// saveImage.sh used to do this with ImageMagick, which decoded and re-encoded the image
+// for each step.
+// When taking dark frames saveImage.sh still does the processing since darks are the full size
+// of the image.  Darks are subtracted here first at night if we know where they are.
+bool willProcessImage(config const &cg, char const *dayOrNight)
+{
+	if (cg.takeDarkFrames)
+		return(false);
+	return(! (cg.useDarkFrames && cg.darksDir == NULL && strcmp(dayOrNight, "NIGHT") == 0));
+}
+
+// Like ImageMagick's "-resize widthxheight", resize "src" to fit in the width and height
+// while keeping its aspect ratio.  Returns false if "src" is already that size.
+static bool resizeToFit(cv::Mat const &src, cv::Mat &dst, long width, long height)
+{
+	double scale = std::min((double) width / src.cols, (double) height / src.rows);
+	cv::Size size(std::max(1, (int) round(src.cols * scale)), std::max(1, (int) round(src.rows * scale)));
+	if (size == src.size())
+		return(false);
+
+	cv::resize(src, dst, size, 0, 0, scale < 1.0 ? cv::INTER_AREA : cv::INTER_LINEAR);
+	return(true);
+}
+
+// Same as ImageMagick's "-sigmoidal-contrast amount x midPoint%":
+// increase the contrast around midPoint without saturating the brightest or darkest pixels.
+// The lookup table is only rebuilt when the amount or mid point changes.
+template<typename T>
+static void stretchImage(cv::Mat &image, double amount, double midPoint)
+{
+	static std::vector<T> lut;
+	static double lutAmount = NOT_SET, lutMidPoint = NOT_SET;
+
+	int const maxValue = std::numeric_limits<T>::max();
+	if (lut.size() != (size_t) maxValue + 1 || amount != lutAmount || midPoint != lutMidPoint)
+	{
+		double b = midPoint / 100.0;
+		auto sig = [amount, b](double x) { return(1.0 / (1.0 + exp(amount * (b - x)))); };
+		double sig0 = sig(0.0), sig1 = sig(1.0);
+
+		lut.resize(maxValue + 1);
+		for (int i = 0; i <= maxValue; i++)
+		{
+			double v = (sig((double) i / maxValue) - sig0) / (sig1 - sig0);
+			lut[i] = cv::saturate_cast<T>(v * maxValue);
+		}
+		lutAmount = amount;
+		lutMidPoint = midPoint;
+		Log(4, "  > Made stretch table for amount %.1f, mid point %.1f%%.\n", amount, midPoint);
+	}
+
+	// OpenCV's LUT() is vectorized and multithreaded but only handles 8-bit images.
+	if (sizeof(T) == 1)
+	{
+		cv::LUT(image, cv::Mat(1, (int) lut.size(), CV_8U, lut.data()), image);
+		return;
+	}
+
+	int cols = image.cols * image.channels();
+	for (int y = 0; y < image.rows; y++)
+	{
+		T *p = image.ptr<T>(y);
+		for (int x = 0; x < cols; x++)
+			p[x] = lut[p[x]];
+	}
+}
+
+// Times the steps of processing an image so they can be logged together.
+class stepTimes
+{
+public:
+	void endStep(char const *name)
+	{
+		auto now = std::chrono::high_resolution_clock::now();
+		double ms = (double) std::chrono::duration_cast<std::chrono::microseconds>(now - last).count() / US_IN_MS;
+		l += snprintf(times + l, sizeof(times) - l, "%s %s %'.1f ms", l == 0 ? "" : ",", name, ms);
+		last = now;
+	}
+	void log(char const *what)
+	{
+		if (l > 0)
+			Log(3, "  > %s time:%s\n", what, times);
+	}
+
+private:
+	std::chrono::high_resolution_clock::time_point last = std::chrono::high_resolution_clock::now();
+	char times[200] = "";
+	int l = 0;
+};
+
+// Subtract darks from and fix hot pixels in the image, in place, as configured.
+// This is done before the overlay is added so neither changes it.
+// Returns true if the image changed.
+bool correctImage(cv::Mat &image, config const &cg, char const *dayOrNight)
+{
+	if (! willProcessImage(cg, dayOrNight) || strcmp(dayOrNight, "NIGHT") != 0)
+		return(false);
+
+	stepTimes t;
+	bool changed = false;
+
+	if (cg.useDarkFrames)
+	{
+		if (subtractDark(image, cg))
+			changed = true;
+		t.endStep("dark");
+	}
+
+	// After subtracting darks, which also have the hot pixels.
+	if (cg.hotPixels)
+	{
+		if (fixHotPixels(image, cg))
+			changed = true;
+		t.endStep("hot pixels");
+	}
+
+	t.log("Correction");
+	return(changed);
+}
+
+// Resize, crop, and stretch the image as configured, after correctImage() and the overlay.
+// "image" may end up referring to different memory, so the caller's buffer is never resized.
+// Returns true if the image changed.
+bool processImage(cv::Mat &image, config const &cg, char const *dayOrNight)
+{
+	if (! willProcessImage(cg, dayOrNight))
+		return(false);
+
+	stepTimes t;
+	bool night = strcmp(dayOrNight, "NIGHT") == 0;
+	bool changed = false;
+
+	if (cg.PP.resize)
+	{
+		// Reuse the memory from the last image when it's no longer in use.
+		static cv::Mat resized;
+		if (resizeToFit(image, resized, cg.PP.width, cg.PP.height))
+		{
+			image = resized;
+			changed = true;
+		}
+		t.endStep("resize");
+	}
+
+	if (cg.PP.crop)
+	{
+		// Like ImageMagick's "-gravity Center", the offsets are from the center.
+		cv::Rect r((image.cols - cg.PP.cropWidth) / 2 + cg.PP.cropOffsetX,
+			(image.rows - cg.PP.cropHeight) / 2 + cg.PP.cropOffsetY, cg.PP.cropWidth, cg.PP.cropHeight);
+		r &= cv::Rect(0, 0, image.cols, image.rows);
+		if (r.area() > 0)
+		{
+			if (r.size() != image.size())
+			{
+				image = image(r);		// no copy
+				changed = true;
+			}
+		}
+		else
+		{
+			static bool showedMessage = false;
+			if (! showedMessage)
+			{
+				Log(0, "*** %s: ERROR: The crop area %ldx%ld offset %ld,%ld is outside the %dx%d image; not cropping.\n",
+					cg.ME, cg.PP.cropWidth, cg.PP.cropHeight, cg.PP.cropOffsetX, cg.PP.cropOffsetY, image.cols, image.rows);
+				showedMessage = true;
+			}
+		}
+		t.endStep("crop");
+	}
+
+	if (cg.PP.stretch && cg.PP.stretchAmount > 0.0 && night)
+	{
+		changed = true;
+		double midPoint = cg.PP.stretchMidPoint;
+		if (cg.PP.stretchAdaptive && cg.lastMedianFull != NOT_SET)
+		{
+			// Stretch the most around the sky background, which is the median brightness.
+			// Round it so small changes don't rebuild the lookup table.
+			midPoint = std::min(50.0, std::max(1.0, round(cg.lastMedianFull * 100.0 * 2.0) / 2.0));
+		}
+		if (image.depth() == CV_16U)
+			stretchImage<uint16_t>(image, cg.PP.stretchAmount, midPoint);
+		else
+			stretchImage<uint8_t>(image, cg.PP.stretchAmount, midPoint);
+		t.endStep("stretch");
+	}
+
+	t.log("Processing");
+	return(changed);
+}
+
+// Write "image" to "file" via a temporary file in the same directory that's then renamed,
+// so nothing ever sees a partially-written file.
+// If "parallel" is true and parallel JPEG encoding is on, use all the CPU cores.
+static bool writeFileAtomically(std::string const &file, cv::Mat const &image,
+	std::vector<int> const &compressionParameters, config const &cg, bool parallel)
+{
+	// Keep the extension so imwrite() knows the format, and start the name with "."
+	// so it's ignored by anything looking for images.
+	size_t slash = file.rfind('/');
+	std::string temp = file.substr(0, slash + 1) + "." + file.substr(slash + 1);
+
+	bool result = false;
+	try
+	{
+		if (parallel && cg.parallelJpeg && cg.extensionType == isJPG && image.depth() == CV_8U &&
+			(image.channels() == 1 || image.channels() == 3))
+			result = writeParallelJpeg(temp.c_str(), image, cg.quality, std::thread::hardware_concurrency());
+		else
+			result = cv::imwrite(temp, image, compressionParameters);
+	}
+	catch (const cv::Exception& ex)
+	{
+		Log(0, "*** %s: ERROR: Exception saving '%s': %s\n", cg.ME, temp.c_str(), ex.what());
+	}
+
+	if (result && rename(temp.c_str(), file.c_str()) != 0)
+	{
+		Log(0, "*** %s: ERROR: Unable to rename '%s' to '%s': %s\n", cg.ME, temp.c_str(), file.c_str(), strerror(errno));
+		result = false;
+	}
+	if (! result)
+		(void) remove(temp.c_str());
+	return(result);
+}
+
+// Create "dir" if it doesn't exist.  Its parent must exist.
+static bool makeDirectory(std::string const &dir, char const *ME)
+{
+	if (mkdir(dir.c_str(), 0777) == 0 || errno == EEXIST)
+		return(true);
+
+	Log(0, "*** %s: ERROR: Unable to create '%s': %s\n", ME, dir.c_str(), strerror(errno));
+	return(false);
+}
+
+// The name of the <date> directory an image is saved in, the same as saveImage.sh uses.
+// Nighttime images are saved in the directory for the day the night started.
+static std::string getDateName(char const *dayOrNight)
+{
+	time_t now = time(NULL);
+	if (strcmp(dayOrNight, "NIGHT") == 0)
+		now -= 12 * S_IN_HOUR;
+
+	struct tm tm;
+	localtime_r(&now, &tm);
+	char name[20];
+	strftime(name, sizeof(name), "%Y%m%d", &tm);
+	return(name);
+}
+
+// Write the image to cg.fullFilename as well as the copy in the <date> directory,
+// the thumbnail, and the resized upload file, so saveImage.sh doesn't have to
+// read the image back in and write those itself.
+// The other files are only written if nothing after us changes the image,
+// and are each made by their own thread from the same image.
+bool writeImage(cv::Mat const &image, config const &cg, char const *dayOrNight,
+	std::vector<int> const &compressionParameters, savedImages *saved)
+{
+	*saved = savedImages();
+
+	struct output {
+		std::string *file;
+		long width				= NOT_SET;		// resize to fit in width x height if set
+		long height				= NOT_SET;
+		int chopRight			= 0;			// columns to remove from the right side
+		bool ok					= false;
+	};
+	std::vector<output> outputs;
+
+	if (cg.OUT.imageIsFinal && cg.OUT.imagesDir != NULL && willProcessImage(cg, dayOrNight) &&
+		cg.overlay.overlayMethod == OVERLAY_METHOD_LEGACY)
+	{
+		if (cg.daytimeSave || strcmp(dayOrNight, "NIGHT") == 0)
+		{
+			std::string dateDir = std::string(cg.OUT.imagesDir) + "/" + getDateName(dayOrNight);
+			if (makeDirectory(dateDir, cg.ME))
+			{
+				saved->copy = dateDir + "/" + cg.finalFileName;
+				output o;
+				o.file = &saved->copy;
+				outputs.push_back(o);
+
+				std::string thumbnailsDir = dateDir + "/thumbnails";
+				if (cg.OUT.thumbnails && makeDirectory(thumbnailsDir, cg.ME))
+				{
+					saved->thumbnail = thumbnailsDir + "/" + cg.finalFileName;
+					o.file = &saved->thumbnail;
+					o.width = cg.OUT.thumbnailWidth;
+					o.height = cg.OUT.thumbnailHeight;
+					outputs.push_back(o);
+				}
+			}
+		}
+
+		if (cg.OUT.resizeUploads)
+		{
+			saved->upload = std::string(cg.saveDir) + "/resize-" + cg.finalFileName;
+			output o;
+			o.file = &saved->upload;
+			o.width = cg.OUT.uploadWidth;
+			o.height = cg.OUT.uploadHeight;
+			o.chopRight = 2;		// saveImage.sh always did this
+			outputs.push_back(o);
+		}
+	}
+
+	std::vector<std::thread> threads;
+	for (output &o : outputs)
+	{
+		threads.emplace_back([&o, &image, &cg, &compressionParameters]()
+		{
+			cv::Mat m = image;
+			try
+			{
+				if (o.width != NOT_SET)
+					(void) resizeToFit(image, m, o.width, o.height);
+				if (o.chopRight > 0 && m.cols > o.chopRight)
+					m = m.colRange(0, m.cols - o.chopRight);
+			}
+			catch (const cv::Exception& ex)
+			{
+				Log(0, "*** %s: ERROR: Exception resizing for '%s': %s\n", cg.ME, o.file->c_str(), ex.what());
+				return;
+			}
+			o.ok = writeFileAtomically(*o.file, m, compressionParameters, cg, false);
+		});
+	}
+
+	bool ok = writeFileAtomically(cg.fullFilename, image, compressionParameters, cg, true);
+
+	for (std::thread &t : threads)
+		t.join();
+
+	// So removeBadImages.sh, the frame journal, and the keogram don't have to read the image to get them.
+	if (ok)
+		setSavedImageStats(image, saved);
+
+	// saveImage.sh makes whatever we didn't, and nothing else is needed if the image wasn't saved.
+	for (output &o : outputs)
+	{
+		if (! ok && o.ok)
+			(void) remove(o.file->c_str());
+		if (! ok || ! o.ok)
+			o.file->clear();
+	}
+
+	return(ok);
+}
+
+// Set the size, means, and keogram slit of the saved image.
+// If "stats" is given they're of the image so the means don't need to be calculated.
+void setSavedImageStats(cv::Mat const &image, savedImages *saved, imageStats const *stats)
+{
+	saved->slit = image.col(image.cols / 2).clone();
+	saved->width = image.cols;
+	saved->height = image.rows;
+	saved->channels = image.channels();
+	saved->bitDepth = image.depth() == CV_16U ? 16 : 8;
+
+	if (stats != NULL)
+	{
+		saved->mean = stats->fullMean;
+		for (int c = 0; c < 3; c++)
+			saved->channelMeans[c] = stats->channelMeans[c];
+		return;
+	}
+
+	int numColors = std::min(image.channels(), 3);
+	double maxValue = image.depth() == CV_16U ? 65535.0 : 255.0;
+	cv::Scalar m = cv::mean(image);
+	double sum = 0.0;
+	for (int c = 0; c < 3; c++)
+	{
+		// Mono images have the same mean for every "channel", like computeImageStats().
+		saved->channelMeans[c] = m[c < numColors ? c : 0] / maxValue;
+		if (c < numColors)
+			sum += saved->channelMeans[c];
+	}
+	saved->mean = sum / numColors;
+}
+
+// Remove the files writeImage() wrote in addition to the image.
+static void removeSavedImages(savedImages const &saved)
+{
+	for (std::string const *f : { &saved.copy, &saved.thumbnail, &saved.upload })
+	{
+		if (! f->empty())
+			(void) remove(f->c_str());
+	}
+}
+
+// Return the "variable=value" settings for an image, which saveImage.sh makes available
+// to other scripts and overlays.
+static std::vector<std::string> getImageVariables(config const &cg, char const *dayOrNight,
+	timeval startDateTime, savedImages const &saved)
 {
 	// If the double variables are an integer value, pass an integer value.
 	// Pass boolean values as 0 or 1.
 	// If any value < 0 don't use it.
 
-	int const s = 100;
-	char tmp[s];
+	std::vector<std::string> v;
+	std::string const Auto = "(auto)";
 
-	snprintf(tmp, s, " DATE=%s", formatTime(startDateTime, "%Y%m%d"));
-	strcat(cmd, tmp);
-	snprintf(tmp, s, " TIME=%s", formatTime(startDateTime, "%H%M%S"));
-	strcat(cmd, tmp);
+	v.push_back(std::string("DATE=") + formatTime(startDateTime, "%Y%m%d"));
+	v.push_back(std::string("TIME=") + formatTime(startDateTime, "%H%M%S"));
 
-	snprintf(tmp, s, " AUTOEXPOSURE=%d", cg.currentAutoExposure ? 1 : 0);
-	strcat(cmd, tmp);
-	snprintf(tmp, s, " sAUTOEXPOSURE='%s'", cg.currentAutoExposure ? "(auto)" : "");
-	strcat(cmd, tmp);
+	v.push_back(std::string("AUTOEXPOSURE=") + (cg.currentAutoExposure ? "1" : "0"));
+	v.push_back("sAUTOEXPOSURE=" + (cg.currentAutoExposure ? Auto : ""));
 	if (cg.lastExposure_us >= 0) {
-		snprintf(tmp, s, " EXPOSURE_US=%ld", cg.lastExposure_us);
-		strcat(cmd, tmp);
-
-		snprintf(tmp, s, " sEXPOSURE='%s'", length_in_units(cg.lastExposure_us, true));
-		strcat(cmd, tmp);
+		v.push_back("EXPOSURE_US=" + std::to_string(cg.lastExposure_us));
+		v.push_back(std::string("sEXPOSURE=") + length_in_units(cg.lastExposure_us, true));
 	}
 
-	snprintf(tmp, s, " AUTOGAIN=%d", cg.currentAutoGain ? 1 : 0);
-	strcat(cmd, tmp);
-	snprintf(tmp, s, " sAUTOGAIN='%s'", cg.currentAutoGain ? "(auto)" : "");
-	strcat(cmd, tmp);
+	v.push_back(std::string("AUTOGAIN=") + (cg.currentAutoGain ? "1" : "0"));
+	v.push_back("sAUTOGAIN=" + (cg.currentAutoGain ? Auto : ""));
 	if (cg.lastGain >= 0.0) {
-		snprintf(tmp, s, " GAIN=%s", LorF(cg.lastGain, "%d", "%f"));
-		strcat(cmd, tmp);
+		v.push_back(std::string("GAIN=") + LorF(cg.lastGain, "%d", "%f"));
 	}
 
-	snprintf(tmp, s, " AUTOWB=%d", cg.currentAutoAWB ? 1 : 0);
-	strcat(cmd, tmp);
-	snprintf(tmp, s, " sAUTOAWB='%s'", cg.currentAutoAWB ? "(auto)" : "");
-	strcat(cmd, tmp);
+	v.push_back(std::string("AUTOWB=") + (cg.currentAutoAWB ? "1" : "0"));
+	v.push_back("sAUTOAWB=" + (cg.currentAutoAWB ? Auto : ""));
 	if (cg.lastWBR >= 0.0) {
-		snprintf(tmp, s, " WBR=%s", LorF(cg.lastWBR, "%d", "%f"));
-		strcat(cmd, tmp);
+		v.push_back(std::string("WBR=") + LorF(cg.lastWBR, "%d", "%f"));
 	}
 	if (cg.lastWBB >= 0.0) {
-		snprintf(tmp, s, " WBB=%s", LorF(cg.lastWBB, "%d", "%f"));
-		strcat(cmd, tmp);
+		v.push_back(std::string("WBB=") + LorF(cg.lastWBB, "%d", "%f"));
 	}
 
 	if (cg.currentBrightness >= 0) {
-		snprintf(tmp, s, " BRIGHTNESS=%ld", cg.currentBrightness);
-		strcat(cmd, tmp);
+		v.push_back("BRIGHTNESS=" + std::to_string(cg.currentBrightness));
 	}
 
 	if (cg.lastMean >= 0.0) {
-		snprintf(tmp, s, " MEAN=%s", LorF(cg.lastMean, "%d", "%f"));
-		strcat(cmd, tmp);
+		v.push_back(std::string("MEAN=") + LorF(cg.lastMean, "%d", "%f"));
 	}
 	// FULLMEAN is to see if the mean of the whole image is the same as the mean returned
 	// by removeBadImages.sh; if so, removeBadImages.sh doesn't need to determine the mean.
 	if (cg.lastMeanFull >= 0.0) {
-		snprintf(tmp, s, " FULLMEAN=%s", LorF(cg.lastMeanFull, "%d", "%f"));
-		strcat(cmd, tmp);
+		v.push_back(std::string("FULLMEAN=") + LorF(cg.lastMeanFull, "%d", "%f"));
 	}
 
 	// Since negative temperatures are valid, check against an impossible temperature.
 	// The temperature passed to us is 10 times the actual temperature so we can deal with
 	// integers with 1 decimal place, which is all we care about.
 	if (cg.supportsTemperature && cg.lastSensorTemp != NOT_SET) {
-		snprintf(tmp, s, " TEMPERATURE_C=%d", (int)round(cg.lastSensorTemp));
-		strcat(cmd, tmp);
-		snprintf(tmp, s, " TEMPERATURE_F=%d", (int)round((cg.lastSensorTemp * 1.8) +32));
-		strcat(cmd, tmp);
+		v.push_back("TEMPERATURE_C=" + std::to_string((int)round(cg.lastSensorTemp)));
+		v.push_back("TEMPERATURE_F=" + std::to_string((int)round((cg.lastSensorTemp * 1.8) +32)));
+	}
+
+
+	if (cg.currentBin >= 0) {
+		v.push_back("BIN=" + std::to_string(cg.currentBin));
+	}
+
+	char const *f = getFlip(cg.flip);
+	if (f[0] != '\0') {
+		v.push_back(std::string("FLIP=") + f);
+	}
+
+	if (cg.currentBitDepth >= 0) {
+		v.push_back("BIT_DEPTH=" + std::to_string(cg.currentBitDepth));
+	}
+
+	if (cg.lastFocusMetric >= 0) {
+		v.push_back("FOCUS=" + std::to_string(cg.lastFocusMetric));
+	}
+
+	v.push_back(std::string("DARKFRAME=") + (cg.takeDarkFrames ? "1" : "0"));
+
+	v.push_back("eOVERLAY=" + std::to_string(cg.overlay.overlayMethod));
+
+	if (cg.ct == ctZWO) {
+		v.push_back(std::string("AUTOUSB=") + (cg.asiAutoBandwidth ? "1" : "0"));
+		v.push_back("USB=" + std::to_string(cg.lastAsiBandwidth));
+	}
+
+	// Tell saveImage.sh it doesn't need to resize, crop, or stretch.
+	if (willProcessImage(cg, dayOrNight))
+		v.push_back("PROCESSED=1");
+
+	// ... or make these files.
+	if (! saved.copy.empty())
+		v.push_back("SAVED_COPY=" + saved.copy);
+	if (! saved.thumbnail.empty())
+		v.push_back("SAVED_THUMBNAIL=" + saved.thumbnail);
+	if (! saved.upload.empty())
+		v.push_back("SAVED_UPLOAD=" + saved.upload);
+	if (saved.mean != NOT_SET)
+		v.push_back("IMAGE_MEAN=" + std::to_string(saved.mean));
+
+	return(v);
+}
+
+
+// Post-processing of saved images.
+// If saveImageDaemon.sh is running, each image is sent to it as one line on its FIFO:
+//		DAY|NIGHT <tab> image file <tab> variable=value <tab> ...
+// Otherwise saveImage.sh is started for each image, which means starting bash and
+// reading all its configuration files every time.
+// The daemon writes "pid sequence latency_ms" to its status file after each image
+// so we know how far behind it is.  If too many images are waiting, new ones are dropped
+// so they don't pile up.
+#define MAX_POSTPROCESS_WAITING		5
+
+static int postProcessFd			= NOT_SET;		// the daemon's FIFO
+static long postProcessSequence		= 0;			// # images sent to the daemon
+static long numPostProcessDropped	= 0;
+
+static bool openPostProcessFifo(config const &cg)
+{
+	if (postProcessFd >= 0)
+		return(true);
+
+	// This fails if the daemon isn't running since no one has the FIFO open for reading.
+	std::string fifo = std::string(cg.allskyHome) + "/tmp/saveImage.fifo";
+	postProcessFd = open(fifo.c_str(), O_WRONLY | O_NONBLOCK);
+	if (postProcessFd < 0)
+		return(false);
+
+	Log(3, "Sending images to saveImageDaemon.sh.\n");
+	return(true);
+}
+
+// Return the number of images the daemon hasn't finished.
+static long getPostProcessWaiting(config const &cg, long *latency_ms)
+{
+	std::string file = std::string(cg.allskyHome) + "/tmp/saveImage-status.txt";
+	long pid = 0, done = 0;
+	FILE *f = fopen(file.c_str(), "r");
+	if (f != NULL)
+	{
+		if (fscanf(f, "%ld %ld %ld", &pid, &done, latency_ms) != 3 || pid != (long) getpid())
+			done = 0;		// nothing from us done yet
+		fclose(f);
+	}
+	return(postProcessSequence - done);
+}
+
+// Send the line to the daemon; it's small enough that the write is all or nothing.
+static bool sendToPostProcessDaemon(std::string const &line)
+{
+	// Don't get killed by SIGPIPE if the daemon went away.
+	sigset_t pipeSet, oldSet;
+	sigemptyset(&pipeSet);
+	sigaddset(&pipeSet, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &pipeSet, &oldSet);
+
+	ssize_t n = write(postProcessFd, line.c_str(), line.size());
+	if (n < 0 && errno == EPIPE)
+	{
+		struct timespec zero = { 0, 0 };
+		(void) sigtimedwait(&pipeSet, NULL, &zero);
+	}
+	pthread_sigmask(SIG_SETMASK, &oldSet, NULL);
+
+	return(n == (ssize_t) line.size());
+}
+
+// Return the <date> directory the image will be saved in, or "" if it won't be saved.
+static std::string getSavedDateDir(config const &cg, char const *dayOrNight)
+{
+	bool night = strcmp(dayOrNight, "NIGHT") == 0;
+	if (cg.OUT.imagesDir == NULL || cg.takeDarkFrames || (! cg.daytimeSave && ! night))
+		return("");
+
+	std::string dateDir = std::string(cg.OUT.imagesDir) + "/" + getDateName(dayOrNight);
+	if (! makeDirectory(dateDir, cg.ME))
+		return("");
+	return(dateDir);
+}
+
+// Return true if the saved image is what ends up in the <date> directory,
+// so its means, size, and slit describe that file.
+static bool savedImageIsFinal(config const &cg, savedImages const &saved)
+{
+	return(saved.mean != NOT_SET && cg.OUT.imageIsFinal && cg.overlay.overlayMethod == OVERLAY_METHOD_LEGACY);
+}
+
+// Add the image to the journal in the <date> directory it will be saved in.
+// Programs that read the journal ignore images that aren't there,
+// for example because removeBadImages.sh removed them.
+static void journalFrame(std::string const &dateDir, config const &cg, char const *dayOrNight,
+	timeval startDateTime, savedImages const &saved)
+{
+	if (strlen(cg.finalFileName) >= sizeof(frameRecord::name))
+		return;
+
+	bool night = strcmp(dayOrNight, "NIGHT") == 0;
+	frameRecord r;
+	memset(&r, 0, sizeof(r));
+	r.start_us = ((int64_t) startDateTime.tv_sec * US_IN_SEC) + startDateTime.tv_usec;
+	r.exposure_us = cg.lastExposure_us;
+	r.gain = cg.lastGain;
+	r.sensorTemp = cg.supportsTemperature && cg.lastSensorTemp != NOT_SET ? cg.lastSensorTemp : NAN;
+	r.mean = saved.mean;
+	r.boxMean = cg.lastBoxMean;
+	for (int c = 0; c < 3; c++)
+		r.channelMeans[c] = saved.channelMeans[c];
+	r.focus = cg.lastFocusMetric >= 0 ? cg.lastFocusMetric : NAN;
+	r.width = saved.width;
+	r.height = saved.height;
+	r.channels = saved.channels;
+	r.bitDepth = saved.bitDepth;
+	r.flags = night ? FRAME_NIGHT : 0;
+	if (savedImageIsFinal(cg, saved))
+		r.flags |= FRAME_FINAL;
+	strcpy(r.name, cg.finalFileName);
+
+	std::string error;
+	static bool showedMessage = false;
+	if (! appendFrameRecord(dateDir, r, error) && ! showedMessage)
+	{
+		Log(1, "*** %s: WARNING: %s\n", cg.ME, error.c_str());
+		showedMessage = true;
+	}
+}
+
+void postProcessImage(config const &cg, char const *dayOrNight, timeval startDateTime, savedImages const &saved)
+{
+	std::string dateDir = getSavedDateDir(cg, dayOrNight);
+	if (! dateDir.empty())
+	{
+		journalFrame(dateDir, cg, dayOrNight, startDateTime, saved);
+		if (savedImageIsFinal(cg, saved))
+			addToLiveKeogram(dateDir, cg, startDateTime, saved);
 	}
 
+	std::vector<std::string> variables = getImageVariables(cg, dayOrNight, startDateTime, saved);
 
-	if (cg.currentBin >= 0) {
-		snprintf(tmp, s, " BIN=%ld", cg.currentBin);
-		strcat(cmd, tmp);
-	}
-
-	char const *f = getFlip(cg.flip);
-	if (f[0] != '\0') {
-		snprintf(tmp, s, " FLIP=%s", f);
-		strcat(cmd, tmp);
-	}
+	if (openPostProcessFifo(cg))
+	{
+		long latency_ms = NOT_SET;
+		long waiting = getPostProcessWaiting(cg, &latency_ms);
+		if (waiting >= MAX_POSTPROCESS_WAITING)
+		{
+			numPostProcessDropped++;
+			Log(1, "*** %s: WARNING: %ld images are waiting to be processed; not processing '%s' (%ld dropped so far).\n",
+				cg.ME, waiting, cg.fullFilename, numPostProcessDropped);
+			if (remove(cg.fullFilename) != 0)
+				Log(1, "*** %s: WARNING: Unable to remove '%s': %s\n", cg.ME, cg.fullFilename, strerror(errno));
+			removeSavedImages(saved);
+			return;
+		}
 
-	if (cg.currentBitDepth >= 0) {
-		snprintf(tmp, s, " BIT_DEPTH=%d", cg.currentBitDepth);
-		strcat(cmd, tmp);
-	}
+		// Capture time is the end of the exposure.
+		long long captured_us = ((long long) startDateTime.tv_sec * US_IN_SEC) + startDateTime.tv_usec;
+		if (cg.lastExposure_us > 0)
+			captured_us += cg.lastExposure_us;
 
-	if (cg.lastFocusMetric >= 0) {
-		snprintf(tmp, s, " FOCUS=%ld", cg.lastFocusMetric);
-		strcat(cmd, tmp);
-	}
+		std::string line = std::string(dayOrNight) + "\t" + cg.fullFilename;
+		for (size_t i = 0; i < variables.size(); i++)
+			line += "\t" + variables[i];
+		line += "\tSEQUENCE=" + std::to_string(postProcessSequence + 1);
+		line += "\tPID=" + std::to_string((long) getpid());
+		line += "\tCAPTURED_US=" + std::to_string(captured_us) + "\n";
 
-	snprintf(tmp, s, " DARKFRAME=%d", cg.takeDarkFrames ? 1 : 0);
-	strcat(cmd, tmp);
+		if (line.size() <= PIPE_BUF && sendToPostProcessDaemon(line))
+		{
+			postProcessSequence++;
+			if (latency_ms != NOT_SET)
+				Log(3, "  > Post-processing: %ld images waiting; last image published %'ld ms after capture.\n",
+					waiting, latency_ms);
+			return;
+		}
 
-	snprintf(tmp, s, " eOVERLAY=%d", cg.overlay.overlayMethod);
-	strcat(cmd, tmp);
+		Log(1, "*** %s: WARNING: Unable to send '%s' to saveImageDaemon.sh (%s); using saveImage.sh.\n",
+			cg.ME, cg.fullFilename, strerror(errno));
+		close(postProcessFd);
+		postProcessFd = NOT_SET;
+	}
 
-	if (cg.ct == ctZWO) {
-		snprintf(tmp, s, " AUTOUSB=%d", cg.asiAutoBandwidth ? 1 : 0);
-		strcat(cmd, tmp);
-		snprintf(tmp, s, " USB=%ld", cg.lastAsiBandwidth);
-		strcat(cmd, tmp);
+	std::string cmd = std::string(cg.allskyHome) + "/scripts/saveImage.sh " + dayOrNight + " '" + cg.fullFilename + "'";
+	for (size_t i = 0; i < variables.size(); i++)
+	{
+		// Quote the value.
+		size_t e = variables[i].find('=');
+		cmd += " " + variables[i].substr(0, e+1) + "'" + variables[i].substr(e+1) + "'";
 	}
+	cmd += " &";
+	// Not too useful to check return code for commands run in the background.
+	(void) system(cmd.c_str());
 }
 
 
@@ -373,98 +1193,146 @@ char *length_in_units(long us, bool multi)	// microseconds
 	return(length_p);
 }
 
-// sunwait barfs if it receives an angle with a comma in it,
-// so convert it to a period.
-char const *convertCommaToPeriod(float n, char const *format)
+// Convert a latitude or longitude like "12.34N" or "12,34W" to degrees,
+// negative for south and west.
+// Either a period or comma can be the decimal point, so don't use atof(), which uses the locale.
+static double latLongToDegrees(char const *l)
 {
-	static char number[20];
-	char *p = number;
-	snprintf(number, sizeof(number), format, n);
-	while (*p != '\0') {
-		if (*p == ',') {
-			*p = '.';
-			break;
+	double degrees = 0.0, scale = 0.0;
+	bool negative = false;
+	for (char const *p = l; *p != '\0'; p++)
+	{
+		if (*p >= '0' && *p <= '9')
+		{
+			if (scale == 0.0)
+			{
+				degrees = (degrees * 10) + (*p - '0');
+			}
+			else
+			{
+				degrees += (*p - '0') * scale;
+				scale /= 10;
+			}
 		}
-		p++;
+		else if (*p == '.' || *p == ',')
+			scale = 0.1;
+		else if (*p == '-' || *p == 'S' || *p == 's' || *p == 'W' || *p == 'w')
+			negative = true;
 	}
-	return(number);
+	return(negative ? -degrees : degrees);
 }
 
-// Calculate if it is day or night
-std::string _day = "DAY", _night = "NIGHT";
-std::string calculateDayOrNight(const char *latitude, const char *longitude, float angle)
+// When the sun crosses the angle on one day.
+struct sunTimes {
+	long solarDay;				// days since 1970 in local mean solar time
+	int status;					// from sunRiseSet()
+	time_t rise, set;			// if status is SUN_ALWAYS_*, both are local noon
+};
+
+// Calculate the sun times for the solar day.
+static void getSunTimes(long solarDay, double latitude, double longitude, float angle, sunTimes *st)
 {
-	char sunwaitCommand[128];
-	int d;
+	time_t midnight = solarDay * S_IN_DAY;
+	struct tm tm;
+	gmtime_r(&midnight, &tm);
+
+	double rise, set;
+	st->solarDay = solarDay;
+	st->status = sunRiseSet(tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, longitude, latitude, angle, &rise, &set);
+	st->rise = midnight + (time_t) round(rise * S_IN_HOUR);
+	st->set = midnight + (time_t) round(set * S_IN_HOUR);
+}
 
-	snprintf(sunwaitCommand, sizeof(sunwaitCommand),
-		"sunwait poll exit angle %s %s %s > /dev/null",
-		convertCommaToPeriod(angle, "%.4f"), latitude, longitude);
-	Log(4, "Executing %s\n", sunwaitCommand);
-	d = system(sunwaitCommand);	// returns exit code 2 for DAY, 3 for night
+// The solar day "t" is in.
+// Each solar day runs from local midnight to local midnight at the longitude,
+// so the sun rises and sets on the same solar day.
+static long getSolarDay(time_t t, double longitude)
+{
+	time_t local = t + (time_t) round(longitude * (S_IN_DAY / 360.0));
+	return((long) floor((double) local / S_IN_DAY));
+}
 
-	if (WIFEXITED(d))
+// Today's sun times.
+// They only change once a day so are calculated once and cached; after that each image
+// only needs to compare the time.
+static sunTimes const *getTodaysSunTimes(time_t now, char const *latitude, char const *longitude, float angle)
+{
+	static sunTimes today = { NOT_SET, SUN_RISES_AND_SETS, 0, 0 };
+	static double lastLatitude, lastLongitude;
+	static float lastAngle;
+
+	double lat = latLongToDegrees(latitude);
+	double lon = latLongToDegrees(longitude);
+	long solarDay = getSolarDay(now, lon);
+	if (solarDay != today.solarDay || lat != lastLatitude || lon != lastLongitude || angle != lastAngle)
 	{
-		d = WEXITSTATUS(d);
-		if (d != 2 && d != 3)
+		getSunTimes(solarDay, lat, lon, angle, &today);
+		lastLatitude = lat;
+		lastLongitude = lon;
+		lastAngle = angle;
+
+		if (today.status == SUN_RISES_AND_SETS)
+		{
+			timeval t = { today.rise, 0 };
+			char rise[50];
+			snprintf(rise, sizeof(rise), "%s", formatTime(t, "%F %T"));
+			t.tv_sec = today.set;
+			Log(4, "Sun crosses angle %.4f at %s and %s\n", angle, rise, formatTime(t, "%F %T"));
+		}
+		else
 		{
-			Log(0, "*** %s: ERROR: sunwait returned %d, not DAY or NIGHT\n", CG.ME, d);
-			closeUp(EXIT_ERROR_STOP);
+			Log(4, "Sun is always %s angle %.4f today\n",
+				today.status == SUN_ALWAYS_ABOVE ? "above" : "below", angle);
 		}
-		return(d == 2 ? _day : _night);
 	}
+	return(&today);
+}
+
+// Calculate if it is day or night
+std::string _day = "DAY", _night = "NIGHT";
+std::string calculateDayOrNight(const char *latitude, const char *longitude, float angle)
+{
+	time_t now = time(NULL);
+	sunTimes const *st = getTodaysSunTimes(now, latitude, longitude, angle);
 
-	// Didn't exit normally
-	Log(0, "*** %s: ERROR: sunwait exited abnormally: 0x%x\n", CG.ME, d);
-	closeUp(EXIT_ERROR_STOP);
-	/*NOTREACHED*/
-	return("");
+	if (st->status == SUN_RISES_AND_SETS)
+		return(now >= st->rise && now < st->set ? _day : _night);
+	return(st->status == SUN_ALWAYS_ABOVE ? _day : _night);
 }
 
 // Calculate how long until nighttime.
 int calculateTimeToNightTime(const char *latitude, const char *longitude, float angle)
 {
-	std::string t;
-	char sunwaitCommand[128];	// returns "hh:mm"
-	snprintf(sunwaitCommand, sizeof(sunwaitCommand),
-		"sunwait list set angle %s %s %s",
-		convertCommaToPeriod(angle, "%.4f"), latitude, longitude);
-	t = exec(sunwaitCommand);
-
-	t.erase(std::remove(t.begin(), t.end(), '\n'), t.end());
-
-	int hNight=0, mNight=0, secsNight;
-	// It's possible for sunwait to return "--:--" if the angle causes sunset to start
-	// after midnight or before noon.
-	if (sscanf(t.c_str(), "%d:%d", &hNight, &mNight) != 2)
+	time_t now = time(NULL);
+	sunTimes const *today = getTodaysSunTimes(now, latitude, longitude, angle);
+
+	// Near the poles nighttime may be days away.
+	sunTimes st = *today;
+	double lat = latLongToDegrees(latitude);
+	double lon = latLongToDegrees(longitude);
+	for (int i = 0; i <= 366; i++)
 	{
-		Log(0, "*** %s: ERROR: With angle %.4f sunwait returned unknown time to nighttime: %s\n",
-			CG.ME, angle, t.c_str());
-		return(1 * S_IN_HOUR);	// 1 hour - should we exit instead?
-	}
-	secsNight = (hNight * S_IN_HOUR) + (mNight * S_IN_MIN);	// secs to nighttime from start of today
-	// sunwait doesn't return seconds so on average the actual time will be 30 seconds
-	// after the stated time. So, add 30 seconds.
-	secsNight += 30;
-
-	char *now = getTime("%H:%M:%S");
-	int hNow=0, mNow=0, sNow=0, secsNow;
-	sscanf(now, "%d:%d:%d", &hNow, &mNow, &sNow);
-	secsNow = (hNow*S_IN_HOUR) + (mNow*S_IN_MIN) + sNow;	// seconds to now from start of today
-	Log(4, "Now=%s, nighttime starts at %s\n", now, t.c_str());
+		if (i > 0)
+			getSunTimes(today->solarDay + i, lat, lon, angle, &st);
+
+		time_t night;
+		if (st.status == SUN_RISES_AND_SETS)
+			night = st.set;
+		else if (st.status == SUN_ALWAYS_BELOW)
+			night = st.rise - (S_IN_DAY / 2);		// local midnight
+		else
+			continue;
 
-	// Handle the (probably rare) case where nighttime is tomorrow.
-	// We are only called during the day, so if nighttime is earlier than now, it was past midnight.
-	int diff_s = secsNight - secsNow;
-	if (diff_s < 0)
-	{
-		// This assumes tomorrow's nighttime starts same as today's, which is close enough.
-		return(diff_s + S_IN_DAY);	// Add one day
-	}
-	else
-	{
-		return(diff_s);
+		if (night > now)
+		{
+			timeval t = { night, 0 };
+			Log(4, "Nighttime starts at %s\n", formatTime(t, "%F %T"));
+			return((int) (night - now));
+		}
 	}
+
+	Log(0, "*** %s: ERROR: With angle %.4f unable to determine time to nighttime.\n", CG.ME, angle);
+	return(1 * S_IN_HOUR);	// 1 hour - should we exit instead?
 }
 
 // Simple function to make flags easier to read for humans.
@@ -753,21 +1621,409 @@ int doOverlay(cv::Mat image, config cg, char *startTime, int gainChange)
 	return(iYOffset);
 }
 
+// The focus metric (variance of the Laplacian) is from:
 // https://stackoverflow.com/questions/7765810/is-there-a-way-to-detect-if-an-image-is-blurry
 // https://drive.google.com/file/d/0B6UHr3GQEkQwYnlDY2dKNTdudjg/view?resourcekey=0-a73PvBnc3a2B5wztAV0QaA
-double get_focus_metric(cv::Mat img)
+
+// Statistics from the rows of an image that one thread handles.
+// Four sub-histograms are used since neighboring pixels often have the same value, and
+// incrementing the same counter back to back makes each increment wait for the prior one.
+struct partialImageStats {
+	unsigned int histogram[4][256];
+	unsigned int histogramFull[4][256];
+	unsigned long long roiSum;				// of all color channels
+	unsigned long long roiCount;
+	unsigned long long channelSums[3];
+	unsigned long long fullCount;
+	unsigned long long saturated;
+	unsigned long long black;
+	long long laplacianSum;
+	long long laplacianSumSquares;
+	long long laplacianCount;
+};
+
+// Totals for the pixels in part of a row.  They fit in 32 bits, which are faster than 64.
+struct rowTotals {
+	unsigned int sums[3];
+	unsigned int roiSum;
+	unsigned int saturated;
+	unsigned int black;
+};
+
+// Add the pixel at "p" to "rt", and its bin to "histogramFull" and, if IN_ROI, "histogram".
+// A 4th channel is alpha so is ignored.
+template <typename T, int CN, bool IN_ROI>
+static inline void addPixel(T const *p, unsigned int *histogramFull, unsigned int *histogram, rowTotals *rt)
+{
+	int const NUM_COLORS = CN < 3 ? CN : 3;
+	T const maxValue = std::numeric_limits<T>::max();
+	int const shift = sizeof(T) == 1 ? 0 : 8;		// histogram uses the top 8 bits
+
+	unsigned int total = 0;
+	bool isSaturated = false, isBlack = true;
+	for (int c = 0; c < NUM_COLORS; c++)
+	{
+		total += p[c];
+		rt->sums[c] += p[c];
+		isSaturated |= (p[c] == maxValue);
+		isBlack &= (p[c] == 0);
+	}
+	rt->saturated += isSaturated;
+	rt->black += isBlack;
+
+	int bin = (total / NUM_COLORS) >> shift;
+	histogramFull[bin]++;
+	if (IN_ROI)
+	{
+		histogram[bin]++;
+		rt->roiSum += total;
+	}
+}
+
+// Add every "sampling"th pixel in columns x1 to x2 of "row" to "ps".
+// This is the kernel computeHistogram() used, with the other statistics added.
+// Having the compiler generate a version for each pixel type and number of channels
+// avoids a loop over the channels and a divide for every pixel.
+// Each of four pixels in a row goes in its own sub-histogram.
+template <typename T, int CN, bool IN_ROI>
+static void addPixelsToStats(T const *row, int x1, int x2, int sampling, partialImageStats *ps)
+{
+	rowTotals rt;
+	memset(&rt, 0, sizeof(rt));
+
+	// Use the same columns in every row, no matter where x1 is.
+	int const first = ((x1 + sampling - 1) / sampling) * sampling;
+	int const numPixels = first < x2 ? (x2 - first + sampling - 1) / sampling : 0;
+	int const pixelStep = CN * sampling;
+	T const *p = row + ((long) first * CN);
+
+	int k = 0;
+	for (; k + 4 <= numPixels; k += 4, p += 4 * pixelStep)
+	{
+		addPixel<T, CN, IN_ROI>(p, ps->histogramFull[0], ps->histogram[0], &rt);
+		addPixel<T, CN, IN_ROI>(p + pixelStep, ps->histogramFull[1], ps->histogram[1], &rt);
+		addPixel<T, CN, IN_ROI>(p + (2 * pixelStep), ps->histogramFull[2], ps->histogram[2], &rt);
+		addPixel<T, CN, IN_ROI>(p + (3 * pixelStep), ps->histogramFull[3], ps->histogram[3], &rt);
+	}
+	for (; k < numPixels; k++, p += pixelStep)
+	{
+		addPixel<T, CN, IN_ROI>(p, ps->histogramFull[0], ps->histogram[0], &rt);
+	}
+
+	for (int c = 0; c < (CN < 3 ? CN : 3); c++)
+		ps->channelSums[c] += rt.sums[c];
+	ps->fullCount += numPixels;
+	ps->saturated += rt.saturated;
+	ps->black += rt.black;
+	if (IN_ROI)
+	{
+		ps->roiSum += rt.roiSum;
+		ps->roiCount += numPixels;
+	}
+}
+
+// Add the Laplacian of the first channel of every "sampling"th pixel in row y to "ps".
+// This is what cv::Laplacian() calculates, including how it handles the edges.
+template <typename T, int CN>
+static void addLaplacianToStats(cv::Mat const &image, int y, int sampling, partialImageStats *ps)
+{
+	int const width = image.cols;
+	int const height = image.rows;
+	T const *row = image.ptr<T>(y);
+	T const *above = image.ptr<T>(y > 0 ? y - 1 : 1);
+	T const *below = image.ptr<T>(y < height - 1 ? y + 1 : height - 2);
+
+	long long sum = 0, sumSquares = 0, count = 0;
+	for (int x = 0; x < width; x += sampling, count++)
+	{
+		int left = x > 0 ? x - 1 : 1;
+		int right = x < width - 1 ? x + 1 : width - 2;
+		long long l = (long long) above[x * CN] + below[x * CN] + row[left * CN] + row[right * CN] - (4 * (long long) row[x * CN]);
+		sum += l;
+		sumSquares += l * l;
+	}
+	ps->laplacianSum += sum;
+	ps->laplacianSumSquares += sumSquares;
+	ps->laplacianCount += count;
+}
+
+// Calculate the statistics for rows y1 to y2.
+template <typename T, int CN>
+static void imageStatsWorker(cv::Mat const *image, int y1, int y2, cv::Rect roi, bool roiIsCircle,
+	int sampling, bool wantFocus, partialImageStats *ps)
+{
+	int const width = image->cols;
+	double const centerX = roi.x + (roi.width / 2.0);
+	double const centerY = roi.y + (roi.height / 2.0);
+	double const radius = std::min(roi.width, roi.height) / 2.0;
+
+	for (int y = y1; y < y2; y += sampling)
+	{
+		// Determine which columns in this row are in the region of interest.
+		int roiX1 = 0, roiX2 = 0;
+		if (y >= roi.y && y < roi.y + roi.height)
+		{
+			if (roiIsCircle)
+			{
+				// Use the pixels whose centers are in the circle.
+				double dy = y + 0.5 - centerY;
+				if (fabs(dy) < radius)
+				{
+					double halfWidth = sqrt((radius * radius) - (dy * dy));
+					roiX1 = (int) ceil(centerX - halfWidth - 0.5);
+					roiX2 = (int) floor(centerX + halfWidth - 0.5) + 1;
+				}
+			}
+			else
+			{
+				roiX1 = roi.x;
+				roiX2 = roi.x + roi.width;
+			}
+			roiX1 = std::max(roiX1, 0);
+			roiX2 = std::min(roiX2, width);
+			if (roiX1 > roiX2)
+				roiX1 = roiX2 = 0;
+		}
+
+		T const *row = image->ptr<T>(y);
+		addPixelsToStats<T, CN, false>(row, 0, roiX1, sampling, ps);
+		addPixelsToStats<T, CN, true>(row, roiX1, roiX2, sampling, ps);
+		addPixelsToStats<T, CN, false>(row, roiX2, width, sampling, ps);
+
+		// The row is still in the cache so this doesn't read the image again.
+		if (wantFocus)
+			addLaplacianToStats<T, CN>(*image, y, sampling, ps);
+	}
+}
+
+// Return the mean bin (0 - 255) of a histogram.
+static int histogramMeanBin(unsigned int const *histogram)
+{
+	// Use 64 bits since a large image's total can overflow an int.
+	long long a = 0, b = 0;
+	for (int i = 0; i < 256; i++) {
+		a += (long long) (i+1) * histogram[i];
+		b += histogram[i];
+	}
+
+	if (b == 0)
+	{
+		// This is one heck of a dark picture!
+		return(0);
+	}
+
+	return((int) (a/b) - 1);
+}
+
+// Return the median (0.0 - 1.0) of a histogram, interpolating within the bin it's in.
+static double histogramMedian(unsigned int const *histogram)
+{
+	long long total = 0;
+	for (int i = 0; i < 256; i++)
+		total += histogram[i];
+	if (total == 0)
+		return(0.0);
+
+	double half = total / 2.0;
+	long long count = 0;
+	int i = 0;
+	while (i < 255 && count + histogram[i] < half)
+		count += histogram[i++];
+	double fraction = histogram[i] == 0 ? 0.0 : (half - count) / histogram[i];
+	return((i + fraction) / 256.0);
+}
+
+// Calculate the statistics for an image in one pass over it, splitting the rows between threads.
+// The region of interest (roi) is either a rectangle or the circle that fits in it.
+// Only every "sampling"th row and column is used, which is plenty for exposure decisions.
+// The focus metric is only calculated if "wantFocus" is true since it takes the most time.
+// Return false if the image type isn't supported.
+bool computeImageStats(cv::Mat const &image, cv::Rect roi, bool roiIsCircle, int sampling,
+	bool wantFocus, imageStats *stats)
 {
- 	cv::Mat lap;
-	cv::Laplacian(img, lap, CV_64F);
+	void (*worker)(cv::Mat const *, int, int, cv::Rect, bool, int, bool, partialImageStats *);
+	double maxValue;
+	switch (image.type())
+	{
+		case CV_8UC1:	worker = imageStatsWorker<unsigned char, 1>;	maxValue = 255.0;	break;
+		case CV_8UC3:	worker = imageStatsWorker<unsigned char, 3>;	maxValue = 255.0;	break;
+		case CV_8UC4:	worker = imageStatsWorker<unsigned char, 4>;	maxValue = 255.0;	break;
+		case CV_16UC1:	worker = imageStatsWorker<unsigned short, 1>;	maxValue = 65535.0;	break;
+		case CV_16UC3:	worker = imageStatsWorker<unsigned short, 3>;	maxValue = 65535.0;	break;
+		case CV_16UC4:	worker = imageStatsWorker<unsigned short, 4>;	maxValue = 65535.0;	break;
+		default:
+			Log(0, "*** %s: ERROR: computeImageStats() doesn't support image type %d.\n", CG.ME, image.type());
+			return(false);
+	}
+	if (sampling < 1)
+		sampling = 1;
+	// The Laplacian needs at least 2 rows and columns.
+	wantFocus = wantFocus && image.rows >= 2 && image.cols >= 2;
+
+	// Threads have overhead so small images aren't worth splitting up.
+	int numThreads = 1;
+	if ((long) image.rows * image.cols / (sampling * sampling) >= 1000000)
+		numThreads = std::max(1, std::min((int) std::thread::hardware_concurrency(), MAX_STATS_THREADS));
+
+	std::vector<partialImageStats> partials(numThreads);
+	std::vector<std::thread> threads;
+	int numRows = (image.rows + sampling - 1) / sampling;		// rows actually used
+	for (int t = 0; t < numThreads; t++)
+	{
+		memset(&partials[t], 0, sizeof(partialImageStats));
+		int y1 = (numRows * t / numThreads) * sampling;
+		int y2 = std::min((numRows * (t + 1) / numThreads) * sampling, image.rows);
+		if (t == numThreads - 1)
+			worker(&image, y1, y2, roi, roiIsCircle, sampling, wantFocus, &partials[t]);	// use this thread too
+		else
+			threads.push_back(std::thread(worker, &image, y1, y2, roi, roiIsCircle, sampling, wantFocus, &partials[t]));
+	}
+	for (size_t t = 0; t < threads.size(); t++)
+		threads[t].join();
+
+	partialImageStats total;
+	memset(&total, 0, sizeof(total));
+	for (int t = 0; t < numThreads; t++)
+	{
+		partialImageStats *ps = &partials[t];
+		for (int s = 0; s < 4; s++)
+		{
+			for (int i = 0; i < 256; i++)
+			{
+				total.histogram[0][i] += ps->histogram[s][i];
+				total.histogramFull[0][i] += ps->histogramFull[s][i];
+			}
+		}
+		total.roiSum += ps->roiSum;
+		total.roiCount += ps->roiCount;
+		for (int c = 0; c < 3; c++)
+			total.channelSums[c] += ps->channelSums[c];
+		total.fullCount += ps->fullCount;
+		total.saturated += ps->saturated;
+		total.black += ps->black;
+		total.laplacianSum += ps->laplacianSum;
+		total.laplacianSumSquares += ps->laplacianSumSquares;
+		total.laplacianCount += ps->laplacianCount;
+	}
+
+	int numColors = std::min(image.channels(), 3);
+	memcpy(stats->histogram, total.histogram[0], sizeof(stats->histogram));
+	stats->roiMeanBin = histogramMeanBin(total.histogram[0]);
+	stats->fullMeanBin = histogramMeanBin(total.histogramFull[0]);
+	stats->fullMedian = histogramMedian(total.histogramFull[0]);
+	stats->roiMean = total.roiCount == 0 ? 0.0 : (double) total.roiSum / (total.roiCount * numColors) / maxValue;
+
+	double fullSum = 0.0;
+	for (int c = 0; c < 3; c++)
+	{
+		// Mono images have the same mean for every "channel".
+		int from = c < numColors ? c : 0;
+		stats->channelMeans[c] = total.fullCount == 0 ? 0.0 : (double) total.channelSums[from] / total.fullCount / maxValue;
+		if (c < numColors)
+			fullSum += stats->channelMeans[c];
+	}
+	stats->fullMean = fullSum / numColors;
+	stats->saturatedFraction = total.fullCount == 0 ? 0.0 : (double) total.saturated / total.fullCount;
+	stats->blackFraction = total.fullCount == 0 ? 0.0 : (double) total.black / total.fullCount;
+
+	if (wantFocus && total.laplacianCount > 0)
+	{
+		// The focus metric is the variance of the Laplacian.
+		double mean = (double) total.laplacianSum / total.laplacianCount;
+		stats->focus = ((double) total.laplacianSumSquares / total.laplacianCount) - (mean * mean);
+		Log(4, "  > Focus: %'f\n", stats->focus);
+	}
+	else
+	{
+		stats->focus = NOT_SET;
+	}
+
+	return(true);
+}
+
 
-	cv::Scalar mu, sigma;
-	cv::meanStdDev(lap, mu, sigma);
+// The mean bin of the whole image calculated like computeHistogram() originally did it:
+// one pixel at a time, with a loop over the channels and a divide by a variable.
+template <typename T>
+static int referenceMeanBin(cv::Mat const &image)
+{
+	unsigned int histogram[256] = { 0 };
+	int numColors = std::min(image.channels(), 3);
+	int bpp = image.channels();
+	int shift = sizeof(T) == 1 ? 0 : 8;
+	for (int y = 0; y < image.rows; y++)
+	{
+		T const *row = image.ptr<T>(y);
+		for (int x = 0; x < image.cols * bpp; x += bpp)
+		{
+			int total = 0;
+			for (int z = 0; z < numColors; z++)
+				total += row[x + z];
+			histogram[(total / numColors) >> shift]++;
+		}
+	}
+	return(histogramMeanBin(histogram));
+}
 
-	double focusMetric = sigma.val[0]*sigma.val[0];
-	Log(4, "  > Focus: %'f\n", focusMetric);
-	return(focusMetric);
+// Return the best time in milliseconds of "times" calls to "f".
+template <typename F>
+static double bestTime(F f, int times)
+{
+	double best_ms = 0;
+	for (int i = 0; i < times; i++)
+	{
+		auto start = std::chrono::high_resolution_clock::now();
+		f();
+		auto end = std::chrono::high_resolution_clock::now();
+		double ms = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / (double) US_IN_MS;
+		if (i == 0 || ms < best_ms)
+			best_ms = ms;
+	}
+	return(best_ms);
 }
 
+void benchmarkStats(config const &cg, char const *file)
+{
+	cv::Mat image = cv::imread(file, cv::IMREAD_UNCHANGED);
+	if (! image.data)
+	{
+		Log(0, "*** %s: ERROR: Unable to read '%s'.\n", cg.ME, file);
+		return;
+	}
+
+	int const times = 5;
+	double mpixels = (double) image.rows * image.cols / 1000000.0;
+	printf("Statistics of %dx%d, %d-channel, %d-bit '%s'; best of %d:\n",
+		image.cols, image.rows, image.channels(), image.depth() == CV_16U ? 16 : 8, file, times);
+
+	int referenceBin = 0;
+	double reference_ms = bestTime([&]() {
+		referenceBin = image.depth() == CV_16U ?
+			referenceMeanBin<unsigned short>(image) : referenceMeanBin<unsigned char>(image);
+	}, times);
+	printf("  one pixel at a time:    %'8.1f ms, %'6.0f Mpixel/s, mean bin %d\n",
+		reference_ms, mpixels / reference_ms * MS_IN_SEC, referenceBin);
+
+	cv::Rect box(image.cols / 4, image.rows / 4, image.cols / 2, image.rows / 2);
+	for (int focus = 0; focus <= 1; focus++)
+	{
+		for (int sampling = 1; sampling <= 4; sampling *= 2)
+		{
+			if (focus && sampling > 1)
+				break;
+			imageStats stats;
+			bool ok = true;
+			double ms = bestTime([&]() {
+				ok = computeImageStats(image, box, false, sampling, focus, &stats) && ok;
+			}, times);
+			if (! ok)
+				return;
+			printf("  computeImageStats(), sampling %d%s: %'8.1f ms, %'6.0f Mpixel/s, mean bin %d%s\n",
+				sampling, focus ? ", focus" : "", ms, mpixels / ms * MS_IN_SEC, stats.fullMeanBin,
+				sampling == 1 && stats.fullMeanBin != referenceBin ? " - ERROR: different mean bin" : "");
+		}
+	}
+}
 
 // Return the flip value as a human-readable string
 char const *getFlip(int f)
@@ -1057,6 +2313,7 @@ void displayHelp(config cg)
 	}
 	printf("\n");
 	printf(" -%-*s - Quality (JPG, 0-100) or compression (PNG, 0-9) of image [JPG=%ld, PNG=%ld].\n", n, "quality n", cg.qualityJPG, cg.qualityPNG);
+	printf(" -%-*s - 1 encodes JPG images using all the CPU cores [%s].\n", n, "paralleljpeg b", yesNo(cg.parallelJpeg));
 	printf(" -%-*s - Name of image file to create [%s].\n", n, "filename s", cg.fileName);
 	if (cg.ct == ctRPi) {
 		if (cg.isLibcamera)
@@ -1074,19 +2331,50 @@ void displayHelp(config cg)
 	printf("  %-*s   -6 = civil twilight   -12 = nautical twilight   -18 = astronomical twilight.\n", n, "");
 	printf(" -%-*s - 1 enables capturing of daytime images [%s].\n", n, "takeDaytimeImages b", yesNo(cg.daytimeCapture));
 	printf(" -%-*s - 1 takes dark frames [%s].\n", n, "takeDarkFrames b", yesNo(cg.takeDarkFrames));
+	printf(" -%-*s - 1 subtracts dark frames from nighttime images [%s].\n", n, "useDarkFrames b", yesNo(cg.useDarkFrames));
+	printf(" -%-*s - Directory of dark frames to subtract; none has saveImage.sh subtract them [%s].\n", n, "darksdir s", cg.darksDir == NULL ? "none" : cg.darksDir);
+	printf(" -%-*s - 1 fixes hot pixels in nighttime images [%s].\n", n, "hotPixels b", yesNo(cg.hotPixels));
+	printf(" -%-*s - File listing the hot pixels [%s].\n", n, "hotpixelsfile s", cg.hotPixelsFile == NULL ? "none" : cg.hotPixelsFile);
+	printf(" -%-*s - 1 resizes images to fit in the width and height below [%s].\n", n, "imgresize b", yesNo(cg.PP.resize));
+	printf(" -%-*s - Width of resized images.\n", n, "imgwidth n");
+	printf(" -%-*s - Height of resized images.\n", n, "imgheight n");
+	printf(" -%-*s - 1 crops images to the width and height below [%s].\n", n, "cropimage b", yesNo(cg.PP.crop));
+	printf(" -%-*s - Width of cropped images.\n", n, "cropwidth n");
+	printf(" -%-*s - Height of cropped images.\n", n, "cropheight n");
+	printf(" -%-*s - Pixels to move the cropped area right of the center [%ld].\n", n, "cropoffsetx n", cg.PP.cropOffsetX);
+	printf(" -%-*s - Pixels to move the cropped area below the center [%ld].\n", n, "cropoffsety n", cg.PP.cropOffsetY);
+	printf(" -%-*s - 1 stretches nighttime images [%s].\n", n, "autostretch b", yesNo(cg.PP.stretch));
+	printf(" -%-*s - Amount to stretch [%.1f].\n", n, "autostretchamount n", cg.PP.stretchAmount);
+	printf(" -%-*s - Brightness percent that is stretched the most [%.1f].\n", n, "autostretchmidpoint n", cg.PP.stretchMidPoint);
+	printf(" -%-*s - 1 uses each image's median brightness as the mid point [%s].\n", n, "autostretchadaptive b", yesNo(cg.PP.stretchAdaptive));
+	printf(" -%-*s - Directory the <date> directories of saved images are in [%s].\n", n, "imagesdir s", cg.OUT.imagesDir == NULL ? "none" : cg.OUT.imagesDir);
+	printf(" -%-*s - 1 if post-processing doesn't change images, so other files can be made from them [%s].\n", n, "imageisfinal b", yesNo(cg.OUT.imageIsFinal));
+	printf(" -%-*s - 1 makes thumbnails of saved images [%s].\n", n, "thumbnails b", yesNo(cg.OUT.thumbnails));
+	printf(" -%-*s - Width of thumbnails [%ld].\n", n, "thumbnailwidth n", cg.OUT.thumbnailWidth);
+	printf(" -%-*s - Height of thumbnails [%ld].\n", n, "thumbnailheight n", cg.OUT.thumbnailHeight);
+	printf(" -%-*s - 1 makes a resized copy of images to upload [%s].\n", n, "resizeuploads b", yesNo(cg.OUT.resizeUploads));
+	printf(" -%-*s - Write the night's keogram after this many images; 0 disables [%ld].\n", n, "livekeogram n", cg.OUT.liveKeogram);
+	printf(" -%-*s - Width of resized uploaded images.\n", n, "resizeuploadswidth n");
+	printf(" -%-*s - Height of resized uploaded images.\n", n, "resizeuploadsheight n");
 	printf(" -%-*s - Your locale - to determine thousands separator and decimal point [%s].\n", n, "locale s", "locale on Pi");
 	printf("  %-*s   Type 'locale' at a command prompt to determine yours.\n", n, "");
 	if (cg.ct == ctZWO) {
 		printf(" -%-*s - Default = %d %d %0.2f %0.2f (box width X, box width y, X offset percent (0-100), Y offset (0-100))\n", n, "histogrambox n n n n", cg.HB.histogramBoxSizeX, cg.HB.histogramBoxSizeY, cg.HB.histogramBoxPercentFromLeft * 100.0, cg.HB.histogramBoxPercentFromTop * 100.0);
+		printf(" -%-*s - Only use every n'th row and column when calculating the mean [%ld].\n", n, "histogramsampling n", cg.HB.sampling);
 		printf(" -%-*s - 1 enables auto USB Speed.\n", n, "autousb b");
 		printf(" -%-*s - USB bandwidth percent.\n", n, "usb n");
 		printf(" -%-*s - 1 enables a newer ZWO auto-exposure algorithm [%s].\n", n, "experimentalExposure b", yesNo(cg.HB.useExperimentalExposure));
 		printf(" -%-*s - Determines if version 0.8 exposure method should be used [%s].\n", n, "newexposure b", yesNo(cg.videoOffBetweenImages));
+		printf(" -%-*s - Number of images that can be waiting to be saved before new ones are dropped [%ld].\n", n, "savebuffers n", cg.saveBuffers);
+		printf(" -%-*s - 1 takes snapshots instead of video frames and exposes the next image while the last one is processed [%s].\n", n, "snapshotmode b", yesNo(cg.snapshotMode));
+		printf(" -%-*s - 1 leaves video running and uses the next frame from the camera; for high frame rates [%s].\n", n, "streamingmode b", yesNo(cg.streamingMode));
 	}
 	if (cg.ct == ctRPi) {
 		printf(" -%-*s - Extra arguments pass to image capture program [%s].\n", n, "extraArgs s", cg.extraArgs);
 	}
 	printf(" -%-*s - Set to 1, 2, 3, or 4 for more debugging information [%ld].\n", n, "debuglevel n", cg.debugLevel);
+	printf(" -%-*s - Replay images from directory 's' instead of using the camera, or make them up if 's' is 'synthetic'.\n", n, "replay s");
+	printf("  %-*s   Must be on the command line.  For testing and timing.\n", n, "");
 
 	printf("\nOverlay settings:\n");
 	printf(" -%-*s - Set to %d to use the new, enhanced 'module' overlay program [%s].\n", n, "overlayMethod n", OVERLAY_METHOD_LEGACY, getOverlayMethod(cg.overlay.overlayMethod).c_str());
@@ -1121,6 +2409,8 @@ void displayHelp(config cg)
 	printf(" -%-*s - Where to save 'filename' [%s].\n", n, "save_dir s", cg.saveDir);
 	printf(" -%-*s - 1 previews the captured images. Only works with a Desktop Environment [%s]\n", n, "preview", yesNo(cg.preview));
 	printf(" -%-*s - Outputs the camera's capabilities to the specified file and exists.\n", n, "cc_file s");
+	printf(" -%-*s - Times saving the specified image as a JPG with and without parallel encoding and exits.\n", n, "benchmarkjpeg s");
+	printf(" -%-*s - Times calculating the specified image's statistics with different sampling and exits.\n", n, "benchmarkstats s");
 	if (cg.ct == ctRPi) {
 		printf(" -%-*s - Command being used to take pictures (Buster: raspistill, Bullseye: libcamera-still\n", n, "cmd s");
 	}
@@ -1177,6 +2467,7 @@ void displaySettings(config cg)
 	printf("   Resolution (before any binning): %ldx%ld\n", cg.width, cg.height);
 	printf("   Configuration file: %s\n", stringORnone(cg.configFile));
 	printf("   Quality: %ld\n", cg.userQuality);
+	printf("   Parallel JPG Encoding: %s\n", yesNo(cg.parallelJpeg));
 	printf("   Daytime capture: %s\n", yesNo(cg.daytimeCapture));
 
 	printf("   Exposure (day):   %15s, Auto: %3s", length_in_units(cg.dayExposure_us, true), yesNo(cg.dayAutoExposure));
@@ -1257,12 +2548,50 @@ void displaySettings(config cg)
 			cg.HB.histogramBoxSizeX, cg.HB.histogramBoxSizeY,
 			cg.HB.histogramBoxPercentFromLeft * 100.0, cg.HB.histogramBoxPercentFromTop * 100.0,
 			cg.HB.centerX, cg.HB.centerY, cg.HB.leftOfBox, cg.HB.topOfBox, cg.HB.rightOfBox, cg.HB.bottomOfBox);
+		printf("   Histogram Sampling: every %ld pixels\n", cg.HB.sampling);
 		printf("   New Exposure Algorithm: %s\n", yesNo(cg.HB.useExperimentalExposure));
 		printf("   Video OFF Between Images: %s\n", yesNo(cg.videoOffBetweenImages));
+		printf("   Save Buffers: %ld\n", cg.saveBuffers);
+		printf("   Snapshot Mode: %s\n", yesNo(cg.snapshotMode));
+		printf("   Streaming Mode: %s\n", yesNo(cg.streamingMode));
 	}
 	printf("   Preview: %s\n", yesNo(cg.preview));
 	printf("   Taking Dark Frames: %s\n", yesNo(cg.takeDarkFrames));
+	printf("   Using Dark Frames: %s\n", yesNo(cg.useDarkFrames));
+	printf("   Dark Frames Directory: %s\n", stringORnone(cg.darksDir));
+	printf("   Fix Hot Pixels: %s, map in %s\n", yesNo(cg.hotPixels), stringORnone(cg.hotPixelsFile));
+	printf("   Resize Images: %s", yesNo(cg.PP.resize));
+	if (cg.PP.resize) printf(", %ldx%ld", cg.PP.width, cg.PP.height);
+	printf("\n");
+	printf("   Crop Images: %s", yesNo(cg.PP.crop));
+	if (cg.PP.crop) printf(", %ldx%ld offset %ld,%ld", cg.PP.cropWidth, cg.PP.cropHeight, cg.PP.cropOffsetX, cg.PP.cropOffsetY);
+	printf("\n");
+	printf("   Stretch Nighttime Images: %s", yesNo(cg.PP.stretch));
+	if (cg.PP.stretch)
+	{
+		printf(", amount %.1f, mid point ", cg.PP.stretchAmount);
+		if (cg.PP.stretchAdaptive)
+			printf("from image");
+		else
+			printf("%.1f%%", cg.PP.stretchMidPoint);
+	}
+	printf("\n");
+	printf("   Saved image files made by capture program: %s", yesNo(cg.OUT.imageIsFinal));
+	if (cg.OUT.imageIsFinal)
+	{
+		printf(", copy");
+		if (cg.OUT.thumbnails) printf(", %ldx%ld thumbnail", cg.OUT.thumbnailWidth, cg.OUT.thumbnailHeight);
+		if (cg.OUT.resizeUploads) printf(", %ldx%ld upload", cg.OUT.uploadWidth, cg.OUT.uploadHeight);
+	}
+	printf("\n");
+	printf("   Live Keogram: ");
+	if (cg.OUT.liveKeogram > 0)
+		printf("every %ld images\n", cg.OUT.liveKeogram);
+	else
+		printf("no\n");
 	printf("   Debug Level: %ld\n", cg.debugLevel);
+	if (cg.replay != NULL)
+		printf("   Replaying: %s\n", cg.replay);
 	printf("   On TTY: %s\n", yesNo(cg.tty));
 	if (cg.ct == ctRPi && cg.isLibcamera) {
 		printf("   Tuning File (day): %s\n", stringORnone(cg.dayTuningFile));
@@ -1341,11 +2670,13 @@ bool daytimeSleep(bool displayedMsg, config cg)
 }
 
 
-void delayBetweenImages(config cg, long lastExposure_us, std::string sleepType)
+// Return how long to wait after an image before starting the next one, and log it if "showMessage".
+long getDelayBetweenImages_us(config const &cg, long lastExposure_us, std::string sleepType, bool showMessage)
 {
 	if (cg.takeDarkFrames) {
-		Log(2, "  > Not sleeping between dark frames\n");
-		return;
+		if (showMessage)
+			Log(2, "  > Not sleeping between dark frames\n");
+		return(0);
 	}
 
 	long s_us = 0;
@@ -1359,14 +2690,74 @@ void delayBetweenImages(config cg, long lastExposure_us, std::string sleepType)
 		if (lastExposure_us < cg.currentMaxAutoExposure_us)		// TODO: if AE_ALLSKY:    && cg.currentAutoExposure)
 			s_us = cg.currentMaxAutoExposure_us - lastExposure_us;	// how much longer till max?
 		s_us += (cg.currentDelay_ms * US_IN_MS);		// Add standard delay amount
-		Log(2, "  > Sleeping: %s\n", length_in_units(s_us, false));
+		if (showMessage)
+			Log(2, "  > Sleeping: %s\n", length_in_units(s_us, false));
 
 	} else {
 		s_us = cg.currentDelay_ms * US_IN_MS;
-		Log(2, "  > Sleeping %s between %s exposures\n", length_in_units(s_us, false), sleepType.c_str());
+		if (showMessage)
+			Log(2, "  > Sleeping %s between %s exposures\n", length_in_units(s_us, false), sleepType.c_str());
 	}
 
-	usleep(s_us);	// usleep() is in us (microseconds)
+	return(s_us);
+}
+
+void delayBetweenImages(config cg, long lastExposure_us, std::string sleepType)
+{
+	usleep(getDelayBetweenImages_us(cg, lastExposure_us, sleepType));	// usleep() is in us (microseconds)
+}
+
+
+// Keep track of how long each stage of taking and processing an image takes,
+// and how many images per second we're getting.
+// Call startImageTiming() before taking an image, endStageTiming() at the end of each stage,
+// and reportImageTiming() when done with the image.
+// Stages can be ended more than once per image, e.g., when retaking an image;
+// the times are added together.
+static char const *stageNames[stNumStages] = { "exposure", "histogram", "overlay", "save" };
+static std::chrono::high_resolution_clock::time_point firstImageStart, stageStart;
+static long stageTimes_us[stNumStages];			// for the current image
+static long long totalStageTimes_us[stNumStages];	// for all images
+static long numTimedImages = 0;
+
+void startImageTiming()
+{
+	stageStart = std::chrono::high_resolution_clock::now();
+	if (numTimedImages == 0)
+		firstImageStart = stageStart;
+	for (int i = 0; i < stNumStages; i++)
+		stageTimes_us[i] = 0;
+}
+
+void endStageTiming(imageStage stage)
+{
+	auto now = std::chrono::high_resolution_clock::now();
+	stageTimes_us[stage] += std::chrono::duration_cast<std::chrono::microseconds>(now - stageStart).count();
+	stageStart = now;
+}
+
+void reportImageTiming()
+{
+	numTimedImages++;
+
+	char line[500];
+	int l = snprintf(line, sizeof(line), "  > Image time:");
+	for (int i = 0; i < stNumStages; i++)
+	{
+		totalStageTimes_us[i] += stageTimes_us[i];
+		l += snprintf(line + l, sizeof(line) - l, " %s %'.1f ms (avg %'.1f)%s",
+			stageNames[i], (double) stageTimes_us[i] / US_IN_MS,
+			(double) totalStageTimes_us[i] / numTimedImages / US_IN_MS,
+			i == stNumStages - 1 ? "" : ",");
+	}
+	Log(3, "%s\n", line);
+
+	// This includes delays between images.
+	auto elapsed = std::chrono::high_resolution_clock::now() - firstImageStart;
+	double elapsed_sec = (double) std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() / US_IN_SEC;
+	if (elapsed_sec > 0.0)
+		Log(3, "  > %'ld images in %'.1f seconds = %'.2f images/sec\n",
+			numTimedImages, elapsed_sec, numTimedImages / elapsed_sec);
 }
 
 
@@ -1515,6 +2906,21 @@ static bool getConfigFileArguments(config *cg)
 }
 
 
+// The capture programs need to know if they're replaying images before they look for
+// a camera, which is before the other arguments are processed, so look for it now.
+// It must be on the command line, not in a configuration file.
+char const *getReplayArgument(int argc, char *argv[])
+{
+	for (int i=1; i < argc - 1; i++)
+	{
+		char const *a = argv[i];
+		if (*a == '-') a++;		// skip leading "-"
+		if (strcasecmp(a, "replay") == 0)
+			return(argv[i+1]);
+	}
+	return(NULL);
+}
+
 // Get arguments from the command line.
 bool getCommandLineArguments(config *cg, int argc, char *argv[])
 {
@@ -1791,6 +3197,18 @@ bool getCommandLineArguments(config *cg, int argc, char *argv[])
 		{
 			cg->userQuality = cg->quality = atol(argv[++i]);
 		}
+		else if (strcmp(a, "paralleljpeg") == 0)
+		{
+			cg->parallelJpeg = getBoolean(argv[++i]);
+		}
+		else if (strcmp(a, "benchmarkjpeg") == 0)
+		{
+			cg->benchmarkJpeg = argv[++i];
+		}
+		else if (strcmp(a, "benchmarkstats") == 0)
+		{
+			cg->benchmarkStats = argv[++i];
+		}
 		else if (strcmp(a, "meanp0") == 0)
 		{
 			cg->myModeMeanSetting.mean_p0 = atof(argv[++i]);
@@ -1843,6 +3261,107 @@ bool getCommandLineArguments(config *cg, int argc, char *argv[])
 		{
 			cg->angle = atof(argv[++i]);
 		}
+		else if (strcmp(a, "usedarkframes") == 0)
+		{
+			cg->useDarkFrames = getBoolean(argv[++i]);
+		}
+		else if (strcmp(a, "darksdir") == 0)
+		{
+			cg->darksDir = argv[++i];
+		}
+		else if (strcmp(a, "hotpixels") == 0)
+		{
+			cg->hotPixels = getBoolean(argv[++i]);
+		}
+		else if (strcmp(a, "hotpixelsfile") == 0)
+		{
+			cg->hotPixelsFile = argv[++i];
+		}
+		else if (strcmp(a, "imgresize") == 0)
+		{
+			cg->PP.resize = getBoolean(argv[++i]);
+		}
+		else if (strcmp(a, "imgwidth") == 0)
+		{
+			cg->PP.width = atol(argv[++i]);
+		}
+		else if (strcmp(a, "imgheight") == 0)
+		{
+			cg->PP.height = atol(argv[++i]);
+		}
+		else if (strcmp(a, "cropimage") == 0)
+		{
+			cg->PP.crop = getBoolean(argv[++i]);
+		}
+		else if (strcmp(a, "cropwidth") == 0)
+		{
+			cg->PP.cropWidth = atol(argv[++i]);
+		}
+		else if (strcmp(a, "cropheight") == 0)
+		{
+			cg->PP.cropHeight = atol(argv[++i]);
+		}
+		else if (strcmp(a, "cropoffsetx") == 0)
+		{
+			cg->PP.cropOffsetX = atol(argv[++i]);
+		}
+		else if (strcmp(a, "cropoffsety") == 0)
+		{
+			cg->PP.cropOffsetY = atol(argv[++i]);
+		}
+		else if (strcmp(a, "autostretch") == 0)
+		{
+			cg->PP.stretch = getBoolean(argv[++i]);
+		}
+		else if (strcmp(a, "autostretchamount") == 0)
+		{
+			cg->PP.stretchAmount = atof(argv[++i]);
+		}
+		else if (strcmp(a, "autostretchmidpoint") == 0)
+		{
+			// A percent, with or without the "%".
+			cg->PP.stretchMidPoint = atof(argv[++i]);
+		}
+		else if (strcmp(a, "autostretchadaptive") == 0)
+		{
+			cg->PP.stretchAdaptive = getBoolean(argv[++i]);
+		}
+		else if (strcmp(a, "imagesdir") == 0)
+		{
+			cg->OUT.imagesDir = argv[++i];
+		}
+		else if (strcmp(a, "imageisfinal") == 0)
+		{
+			cg->OUT.imageIsFinal = getBoolean(argv[++i]);
+		}
+		else if (strcmp(a, "thumbnails") == 0)
+		{
+			cg->OUT.thumbnails = getBoolean(argv[++i]);
+		}
+		else if (strcmp(a, "thumbnailwidth") == 0)
+		{
+			cg->OUT.thumbnailWidth = atol(argv[++i]);
+		}
+		else if (strcmp(a, "thumbnailheight") == 0)
+		{
+			cg->OUT.thumbnailHeight = atol(argv[++i]);
+		}
+		else if (strcmp(a, "resizeuploads") == 0)
+		{
+			cg->OUT.resizeUploads = getBoolean(argv[++i]);
+		}
+		else if (strcmp(a, "resizeuploadswidth") == 0)
+		{
+			cg->OUT.uploadWidth = atol(argv[++i]);
+		}
+		else if (strcmp(a, "resizeuploadsheight") == 0)
+		{
+			cg->OUT.uploadHeight = atol(argv[++i]);
+		}
+		else if (strcmp(a, "livekeogram") == 0)
+		{
+			cg->OUT.liveKeogram = atol(argv[++i]);
+		}
 		else if (strcmp(a, "takedarkframes") == 0)
 		{
 			cg->takeDarkFrames = getBoolean(argv[++i]);
@@ -1855,6 +3374,10 @@ bool getCommandLineArguments(config *cg, int argc, char *argv[])
 		{
 			cg->HB.sArgs = argv[++i];
 		}
+		else if (strcmp(a, "histogramsampling") == 0)
+		{
+			cg->HB.sampling = atol(argv[++i]);
+		}
 		else if (strcmp(a, "debuglevel") == 0)
 		{
 			cg->debugLevel = atol(argv[++i]);
@@ -1867,6 +3390,22 @@ bool getCommandLineArguments(config *cg, int argc, char *argv[])
 		{
 			cg->videoOffBetweenImages = getBoolean(argv[++i]);
 		}
+		else if (strcmp(a, "savebuffers") == 0)
+		{
+			cg->saveBuffers = atol(argv[++i]);
+		}
+		else if (strcmp(a, "snapshotmode") == 0)
+		{
+			cg->snapshotMode = getBoolean(argv[++i]);
+		}
+		else if (strcmp(a, "streamingmode") == 0)
+		{
+			cg->streamingMode = getBoolean(argv[++i]);
+		}
+		else if (strcmp(a, "replay") == 0)
+		{
+			i++;		// Already handled by getReplayArgument().
+		}
 		else if (strcmp(a, "extraargs") == 0)
 		{
 			cg->extraArgs = argv[++i];
@@ -1996,7 +3535,6 @@ bool getCommandLineArguments(config *cg, int argc, char *argv[])
 			strcmp(a, "camera") == 0 ||
 			strcmp(a, "lens") == 0 ||
 			strcmp(a, "computer") == 0 ||
-			strcmp(a, "usedarkframes") == 0 ||
 			strcmp(a, "uselogin") == 0 ||
 			strcmp(a, "cameratype") == 0 ||
 			strcmp(a, "cameramodel") == 0 ||
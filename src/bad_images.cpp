@@ -0,0 +1,196 @@
+// Check images for corruption and for being too dark or too bright.
+// removeBadImages.sh ran ImageMagick's "convert" on every image to get its mean, which
+// decoded the whole image at full size, then several other programs to check the mean.
+
+#include <opencv2/core.hpp>
+#include <opencv2/highgui.hpp>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+#include <string>
+#include <vector>
+
+#include "include/bad_images.h"
+
+// libjpeg calls exit() on errors unless we give it our own error handler.
+// Warnings, like "Premature end of JPEG file", mean the file is corrupt.
+struct jpegErrors {
+	struct jpeg_error_mgr mgr;
+	jmp_buf jumpBuffer;
+	std::string message;				// the first error or warning
+};
+
+static void jpegErrorExit(j_common_ptr cinfo)
+{
+	jpegErrors *err = (jpegErrors *) cinfo->err;
+	if (err->message.empty())
+	{
+		char message[JMSG_LENGTH_MAX];
+		(*cinfo->err->format_message)(cinfo, message);
+		err->message = message;
+	}
+	longjmp(err->jumpBuffer, 1);
+}
+
+static void jpegEmitMessage(j_common_ptr cinfo, int level)
+{
+	jpegErrors *err = (jpegErrors *) cinfo->err;
+	if (level < 0 && err->message.empty())
+	{
+		char message[JMSG_LENGTH_MAX];
+		(*cinfo->err->format_message)(cinfo, message);
+		err->message = message;
+	}
+}
+
+// Decode a JPEG at 1/8 size in grayscale and return its mean (0.0 - 1.0).
+// For color images the grayscale is just the luminance the JPEG already has,
+// so there's no color conversion.
+// Return false and set "message" if the file is corrupt.
+static bool jpegMean(std::string const &file, double *mean, std::string &message)
+{
+	FILE *f = fopen(file.c_str(), "rb");
+	if (f == NULL)
+	{
+		message = strerror(errno);
+		return(false);
+	}
+
+	struct jpeg_decompress_struct cinfo;
+	jpegErrors err;
+	std::vector<unsigned char> row;
+	cinfo.err = jpeg_std_error(&err.mgr);
+	err.mgr.error_exit = jpegErrorExit;
+	err.mgr.emit_message = jpegEmitMessage;
+	if (setjmp(err.jumpBuffer))
+	{
+		jpeg_destroy_decompress(&cinfo);
+		fclose(f);
+		message = err.message;
+		return(false);
+	}
+
+	jpeg_create_decompress(&cinfo);
+	jpeg_stdio_src(&cinfo, f);
+	jpeg_read_header(&cinfo, TRUE);
+	cinfo.scale_num = 1;
+	cinfo.scale_denom = 8;
+	cinfo.out_color_space = JCS_GRAYSCALE;
+	cinfo.dct_method = JDCT_IFAST;
+	jpeg_start_decompress(&cinfo);
+
+	row.resize(cinfo.output_width);
+	unsigned long long sum = 0;
+	while (cinfo.output_scanline < cinfo.output_height)
+	{
+		JSAMPROW r = row.data();
+		jpeg_read_scanlines(&cinfo, &r, 1);
+		for (unsigned char p : row)
+			sum += p;
+	}
+	unsigned long long count = (unsigned long long) cinfo.output_width * cinfo.output_height;
+	jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+	fclose(f);
+
+	if (! err.message.empty())
+	{
+		message = err.message;
+		return(false);
+	}
+	*mean = count == 0 ? 0.0 : (double) sum / count / 255.0;
+	return(true);
+}
+
+// Other formats are decoded in full by OpenCV then reduced.
+static bool otherMean(std::string const &file, double *mean, std::string &message)
+{
+	cv::Mat image;
+	try
+	{
+		image = cv::imread(file, cv::IMREAD_REDUCED_GRAYSCALE_8);
+	}
+	catch (const cv::Exception& ex)
+	{
+		message = ex.what();
+		return(false);
+	}
+	if (! image.data)
+	{
+		message = "unable to read image";
+		return(false);
+	}
+	*mean = cv::mean(image)[0] / 255.0;
+	return(true);
+}
+
+static bool isJpeg(std::string const &file)
+{
+	FILE *f = fopen(file.c_str(), "rb");
+	if (f == NULL)
+		return(false);
+	unsigned char magic[2] = { 0, 0 };
+	bool jpeg = fread(magic, 1, 2, f) == 2 && magic[0] == 0xFF && magic[1] == 0xD8;
+	fclose(f);
+	return(jpeg);
+}
+
+// removeBadImages.sh compared percents with 2 decimal places as integers.
+static long hundredths(double percent)
+{
+	return((long) (percent * 100));
+}
+
+badImageResult checkImage(std::string const &file, badImageThresholds const &thresholds, double knownMean)
+{
+	badImageResult result;
+	char buf[500];
+
+	struct stat s;
+	if (stat(file.c_str(), &s) != 0 || s.st_size == 0)
+	{
+		result.bad = true;
+		result.reason = "'" + file + "' (zero length)";
+		return(result);
+	}
+
+	if (knownMean >= 0.0 && knownMean <= 1.0)
+	{
+		result.mean = knownMean;
+	}
+	else
+	{
+		std::string message;
+		bool ok = isJpeg(file) ? jpegMean(file, &result.mean, message) : otherMean(file, &result.mean, message);
+		if (! ok)
+		{
+			result.bad = true;
+			result.mean = -1;
+			result.reason = "'" + file + "' (corrupt file: " + message + ")";
+			return(result);
+		}
+	}
+
+	snprintf(buf, sizeof(buf), "%0.2f", result.mean * 100);
+	std::string mean = buf;
+	long meanCheck = hundredths(atof(buf));
+
+	double high = atof(thresholds.high.c_str());
+	double low = atof(thresholds.low.c_str());
+	if (high > 0 && high <= 100 && meanCheck > hundredths(high))
+	{
+		result.bad = true;
+		result.reason = "'" + file + "' (above threshold: MEAN=" + mean + ", threshold = " + thresholds.high + ")";
+	}
+	else if (low > 0 && meanCheck < hundredths(low))
+	{
+		result.bad = true;
+		result.reason = "'" + file + "' (below threshold: MEAN=" + mean + ", threshold = " + thresholds.low + ")";
+	}
+
+	return(result);
+}
@@ -0,0 +1,298 @@
+// The "replay" camera returns pictures read from files in a directory, or synthetic
+// pictures, instead of taking them with a real camera.
+// It's used by the capture programs when "-replay directory" or "-replay synthetic"
+// is given so the capture loop can be run and timed without a camera attached.
+//
+// Each picture takes as long as its exposure, and the brightness of synthetic pictures
+// depends on the exposure and gain so the auto-exposure algorithms have something to work with.
+
+#include <opencv2/core.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/highgui.hpp>
+#include <errno.h>
+#include <glob.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include "include/allsky_common.h"
+#include "include/camera.h"
+
+class ReplayCamera : public Camera
+{
+public:
+	ReplayCamera(config *cg);
+	char const *name() { return("Replay"); }
+	int takeImage(config *cg, long exposure_us, double gain, cv::Mat *image);
+	bool startImage(config *cg, long exposure_us, double gain);
+	bool imageStarted() { return(started); }
+	void getLastValues(config *cg);
+
+private:
+	bool synthetic					= false;
+	std::vector<std::string> files;					// files to replay, in order
+	size_t nextFile					= 0;
+	long numImages					= 0;
+	double lastGain					= NOT_SET;
+	cv::Mat sky;										// synthetic sky, 0.0 to 1.0
+	bool started					= false;			// by startImage()
+	long startedExposure_us			= 0;
+	std::chrono::high_resolution_clock::time_point startTime;
+
+	bool readImage(config *cg, cv::Size size, int type, cv::Mat *image);
+	void makeImage(config *cg, long exposure_us, double gain, cv::Size size, int type, cv::Mat *image);
+	void makeSky(cv::Size size);
+};
+
+
+// Return the OpenCV type for the specified image type.
+static int getCvType(long imageType)
+{
+	switch (imageType)
+	{
+		case IMG_RAW16:
+			return(CV_16UC1);
+		case IMG_RAW8:
+		case IMG_Y8:
+			return(CV_8UC1);
+		default:
+			return(CV_8UC3);
+	}
+}
+
+// Convert "src" to the specified size and type and put it in "image".
+// If "image" is already that size and type its memory is reused.
+static void copyToImage(cv::Mat src, cv::Size size, int type, cv::Mat *image)
+{
+	cv::Mat m = src;
+
+	int channels = CV_MAT_CN(type);
+	if (m.channels() != channels)
+	{
+		int code;
+		if (channels == 1)
+			code = m.channels() == 4 ? cv::COLOR_BGRA2GRAY : cv::COLOR_BGR2GRAY;
+		else
+			code = m.channels() == 4 ? cv::COLOR_BGRA2BGR : cv::COLOR_GRAY2BGR;
+		cv::cvtColor(m, m, code);
+	}
+
+	if (m.depth() != CV_MAT_DEPTH(type))
+	{
+		double scale = m.depth() == CV_16U ? (1.0 / 257) : 257.0;
+		m.convertTo(m, type, scale);
+	}
+
+	if (m.size() != size)
+		cv::resize(m, m, size, 0, 0, cv::INTER_AREA);
+
+	m.copyTo(*image);
+}
+
+
+ReplayCamera::ReplayCamera(config *cg)
+{
+	if (strcmp(cg->replay, "synthetic") == 0)
+	{
+		synthetic = true;
+		return;
+	}
+
+	glob_t files_found;
+	std::string pattern = std::string(cg->replay) + "/*";
+	if (glob(pattern.c_str(), 0, NULL, &files_found) == 0)
+	{
+		// glob() sorts the names so the files are replayed in the order they were taken.
+		for (size_t i = 0; i < files_found.gl_pathc; i++)
+		{
+			char const *f = files_found.gl_pathv[i];
+			char const *ext = strrchr(f, '.');
+			if (ext != NULL && (strcasecmp(ext, ".jpg") == 0 || strcasecmp(ext, ".jpeg") == 0 ||
+				strcasecmp(ext, ".png") == 0 || strcasecmp(ext, ".raw") == 0))
+			{
+				files.push_back(f);
+			}
+		}
+	}
+	globfree(&files_found);
+
+	if (files.size() == 0)
+	{
+		Log(0, "*** %s: ERROR: No .jpg, .png, or .raw files to replay in '%s'.\n", cg->ME, cg->replay);
+		closeUp(EXIT_ERROR_STOP);
+	}
+	Log(2, "Replaying %'ld images from '%s'.\n", (long) files.size(), cg->replay);
+}
+
+
+// Read the next file into "image".
+// .raw files contain only the pixels and must be the size and type of the image.
+bool ReplayCamera::readImage(config *cg, cv::Size size, int type, cv::Mat *image)
+{
+	std::string file = files[nextFile];
+	nextFile = (nextFile + 1) % files.size();
+
+	char const *ext = strrchr(file.c_str(), '.');
+	if (strcasecmp(ext, ".raw") == 0)
+	{
+		image->create(size, type);
+		size_t numBytes = image->total() * image->elemSize();
+		FILE *f = fopen(file.c_str(), "r");
+		if (f == NULL)
+		{
+			Log(1, "*** %s: WARNING: Unable to open '%s': %s\n", cg->ME, file.c_str(), strerror(errno));
+			return(false);
+		}
+		size_t numRead = fread(image->data, 1, numBytes, f);
+		fclose(f);
+		if (numRead != numBytes)
+		{
+			Log(1, "*** %s: WARNING: '%s' has %'ld bytes but a %dx%d image needs %'ld.\n",
+				cg->ME, file.c_str(), (long) numRead, size.width, size.height, (long) numBytes);
+			return(false);
+		}
+		return(true);
+	}
+
+	cv::Mat src = cv::imread(file, cv::IMREAD_UNCHANGED);
+	if (! src.data)
+	{
+		Log(1, "*** %s: WARNING: Unable to read '%s'.\n", cg->ME, file.c_str());
+		return(false);
+	}
+	copyToImage(src, size, type, image);
+	return(true);
+}
+
+
+// Make a synthetic sky that's brighter toward the horizon and has some stars.
+void ReplayCamera::makeSky(cv::Size size)
+{
+	sky.create(size, CV_32FC1);
+
+	double centerX = size.width / 2.0;
+	double centerY = size.height / 2.0;
+	double radius2 = (centerX * centerX) + (centerY * centerY);
+	for (int y = 0; y < size.height; y++)
+	{
+		float *p = sky.ptr<float>(y);
+		double dy2 = (y - centerY) * (y - centerY);
+		for (int x = 0; x < size.width; x++)
+		{
+			double r2 = ((x - centerX) * (x - centerX) + dy2) / radius2;
+			p[x] = (float) (0.6 + (0.4 * r2));
+		}
+	}
+
+	// Use the same stars every time.
+	cv::RNG rng(12345);
+	int numStars = (size.width * size.height) / 20000;
+	for (int i = 0; i < numStars; i++)
+	{
+		cv::Point center(rng.uniform(0, size.width), rng.uniform(0, size.height));
+		cv::circle(sky, center, rng.uniform(1, 3), cv::Scalar(rng.uniform(2.0, 20.0)), cv::FILLED);
+	}
+}
+
+// Make a picture whose brightness depends on the exposure, gain, and time of day.
+void ReplayCamera::makeImage(config *cg, long exposure_us, double gain, cv::Size size, int type, cv::Mat *image)
+{
+	if (sky.size() != size)
+		makeSky(size);
+
+	// Fraction of full scale per second of exposure at unity gain.
+	// The daytime sky is roughly 100,000 times brighter than the nighttime sky.
+	double skyBrightness = dayOrNight == "DAY" ? 1500.0 : 0.015;
+
+	// ZWO gain is in 0.1 dB units; RPi gain is a multiplier.
+	double gainFactor = cg->ct == ctZWO ? pow(10.0, gain / 200.0) : gain;
+	double level = skyBrightness * ((double) exposure_us / US_IN_SEC) * gainFactor;
+
+	cv::Mat m = sky * level;
+	cv::Mat noise(size, CV_32FC1);
+	cv::randn(noise, 0.0, 0.01);
+	m += noise;
+
+	double maxValue = CV_MAT_DEPTH(type) == CV_16U ? 65535.0 : 255.0;
+	m.convertTo(m, CV_MAKETYPE(CV_MAT_DEPTH(type), 1), maxValue);
+	copyToImage(m, size, type, image);
+}
+
+
+// Mimic snapshot mode so overlapping exposures with processing can be timed.
+bool ReplayCamera::startImage(config *cg, long exposure_us, double gain)
+{
+	if (! cg->snapshotMode)
+		return(false);
+
+	started = true;
+	startedExposure_us = exposure_us;
+	startTime = std::chrono::high_resolution_clock::now();
+	return(true);
+}
+
+int ReplayCamera::takeImage(config *cg, long exposure_us, double gain, cv::Mat *image)
+{
+	auto tStart = std::chrono::high_resolution_clock::now();
+	if (started && startedExposure_us == exposure_us)
+		tStart = startTime;		// it's been exposing since startImage()
+	started = false;
+
+	cv::Size size;
+	int type;
+	if (image->data)
+	{
+		size = image->size();
+		type = image->type();
+	}
+	else
+	{
+		size = cv::Size(cg->width, cg->height);
+		type = getCvType(cg->imageType);
+	}
+
+	bool ok;
+	if (synthetic)
+	{
+		makeImage(cg, exposure_us, gain, size, type, image);
+		ok = true;
+	}
+	else
+	{
+		ok = readImage(cg, size, type, image);
+	}
+
+	// Make the picture take as long as the exposure, including the time to read or make it.
+	auto tElapsed = std::chrono::high_resolution_clock::now() - tStart;
+	long elapsed_us = std::chrono::duration_cast<std::chrono::microseconds>(tElapsed).count();
+	if (elapsed_us < exposure_us)
+		usleep(exposure_us - elapsed_us);
+
+	if (! ok)
+		return(1);
+
+	numImages++;
+	lastGain = gain;
+	return(0);
+}
+
+void ReplayCamera::getLastValues(config *cg)
+{
+	cg->lastGain = lastGain;
+	cg->lastWBR = cg->currentWBR;
+	cg->lastWBB = cg->currentWBB;
+
+	// The sensor warms up after the camera starts.
+	cg->lastSensorTemp = 15.0 + (20.0 * (1.0 - exp(-numImages / 100.0)));
+}
+
+
+Camera *newReplayCamera(config *cg)
+{
+	return(new ReplayCamera(cg));
+}
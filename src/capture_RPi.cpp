@@ -17,6 +17,8 @@
 #include <sstream>
 
 #include "include/allsky_common.h"
+#include "include/camera.h"
+#include "include/jpeg_parallel.h"
 
 // CG holds all configuration variables.
 // There are only a few cases where it's not passed to a function.
@@ -373,6 +375,32 @@ int RPicapture(config cg, cv::Mat *image)
 }
 
 
+// The real camera, which writes the picture to a file then re-reads it.
+class RPiCamera : public Camera
+{
+public:
+	char const *name() { return("RPi"); }
+
+	// RPicapture() uses myRaspistillSetting for the exposure and gain.
+	int takeImage(config *cg, long exposure_us, double gain, cv::Mat *image)
+	{
+		return(RPicapture(*cg, image));
+	}
+
+	// We currently have no way to get the actual white balance values,
+	// so use what the user requested.
+	void getLastValues(config *cg)
+	{
+		cg->lastWBR = cg->currentWBR;
+		cg->lastWBB = cg->currentWBB;
+	}
+
+	bool savesImageFile() { return(true); }
+};
+
+Camera *camera = NULL;
+
+
 //---------------------------------------------------------------------------------------------
 //---------------------------------------------------------------------------------------------
 
@@ -415,6 +443,7 @@ int main(int argc, char *argv[])
 	setlinebuf(stdout);		// Line buffer output so entries appear in the log immediately.
 
 	CG.ct = ctRPi;
+	CG.replay = getReplayArgument(argc, argv);
 
 	processConnectedCameras();	// exits on error
 
@@ -465,6 +494,22 @@ int main(int argc, char *argv[])
 		closeUp(EXIT_ERROR_STOP);
 	}
 
+	if (CG.benchmarkJpeg != NULL)
+	{
+		benchmarkJpeg(CG, CG.benchmarkJpeg);
+		exit(EXIT_OK);
+	}
+	if (CG.benchmarkStats != NULL)
+	{
+		benchmarkStats(CG, CG.benchmarkStats);
+		exit(EXIT_OK);
+	}
+
+	if (CG.replay != NULL)
+		camera = newReplayCamera(&CG);
+	else
+		camera = new RPiCamera();
+
 
 	int iMaxWidth, iMaxHeight;
 	double pixelSize;
@@ -767,18 +812,31 @@ myModeMeanSetting.modeMean = CG.myModeMeanSetting.modeMean;
 			}
 
 			// Capture and save image
-			retCode = RPicapture(CG, &pRgb);
+			startImageTiming();
+			retCode = camera->takeImage(&CG, myRaspistillSetting.shutter_us, myRaspistillSetting.analoggain, &pRgb);
+			endStageTiming(stExposure);
 			if (retCode == 0)
 			{
 				numExposures++;
 				numErrors = 0;
 
-				// We currently have no way to get the actual white balance values,
-				// so use what the user requested.
-				CG.lastWBR = CG.currentWBR;
-				CG.lastWBB = CG.currentWBB;
+				camera->getLastValues(&CG);
 
-				CG.lastFocusMetric = CG.overlay.showFocus ? (int)round(get_focus_metric(pRgb)) : -1;
+				// Cameras that don't save the image themselves need it written out.
+				bool needToWrite = ! camera->savesImageFile();
+
+				// Get the mean and everything else in one pass over the image.
+				imageStats stats = {};
+				if (! computeImageStats(pRgb, aegGetMeanRegion(pRgb.size()), true, 1, CG.overlay.showFocus, &stats))
+					stats.roiMean = stats.fullMean = -1;
+				CG.lastFocusMetric = CG.overlay.showFocus ? (int)round(stats.focus) : -1;
+				Log(4, "  > Channel means: %.3f %.3f %.3f, saturated: %.2f%%, black: %.2f%%\n",
+					stats.channelMeans[0], stats.channelMeans[1], stats.channelMeans[2],
+					stats.saturatedFraction * 100.0, stats.blackFraction * 100.0);
+
+				// Subtract darks and fix hot pixels before the overlay is added.
+				if (correctImage(pRgb, CG, dayOrNight.c_str()))
+					needToWrite = true;
 
 				// If takeDarkFrames is off, add overlay text to the image
 				if (! CG.takeDarkFrames)
@@ -793,8 +851,10 @@ myModeMeanSetting.modeMean = CG.myModeMeanSetting.modeMean;
 						CG.lastGain = CG.currentGain;	// ZWO gain=0.1 dB , RPi gain=factor
 					}
 
-					CG.lastMean = aegCalcMean(pRgb, true);
-					CG.lastMeanFull = aegCalcMean(pRgb, false);
+					CG.lastMean = stats.roiMean;
+					CG.lastMeanFull = stats.fullMean;
+					CG.lastMedianFull = stats.fullMedian;
+					CG.lastBoxMean = stats.roiMean;
 					if (myModeMeanSetting.meanAuto != MEAN_AUTO_OFF)
 					{
 						// set myRaspistillSetting.shutter_us and myRaspistillSetting.analoggain
@@ -802,7 +862,7 @@ myModeMeanSetting.modeMean = CG.myModeMeanSetting.modeMean;
 
 						if (CG.lastMean == -1)
 						{
-							Log(-1, "*** %s: ERROR: aegCalcMean() returned mean of -1.\n", CG.ME);
+							Log(-1, "*** %s: ERROR: computeImageStats() returned mean of -1.\n", CG.ME);
 							Log(2, "  > Sleeping from failed exposure: %.1f seconds\n", (float)CG.currentDelay_ms / MS_IN_SEC);
 							usleep(CG.currentDelay_ms * US_IN_MS);
 							continue;
@@ -812,17 +872,23 @@ myModeMeanSetting.modeMean = CG.myModeMeanSetting.modeMean;
 						myRaspistillSetting.shutter_us = CG.currentExposure_us;
 						myRaspistillSetting.analoggain = CG.currentGain;
 					}
+					endStageTiming(stHistogram);
 
 					if (CG.currentSkipFrames == 0 &&
 						CG.overlay.overlayMethod == OVERLAY_METHOD_LEGACY &&
 						doOverlay(pRgb, CG, bufTime, 0) > 0)
 					{
 						// if we added anything to overlay, write the file out
-						bool result = cv::imwrite(CG.fullFilename, pRgb, compressionParameters);
-						if (! result) fprintf(stderr, "*** ERROR: Unable to write to '%s'\n", CG.fullFilename);
+						needToWrite = true;
 					}
 				}
 
+				// pRgb is reused for the next capture, so the image is processed in "out";
+				// resizing and cropping put their result in a separate buffer instead of pRgb.
+				cv::Mat out = pRgb;
+				if (processImage(out, CG, dayOrNight.c_str()))
+					needToWrite = true;
+
 				// We skip the initial frames to give auto-exposure time to
 				// lock in on a good exposure.  If it does that quickly, stop skipping images.
 				if (CG.goodLastExposure && CG.currentSkipFrames > 0)
@@ -831,6 +897,23 @@ myModeMeanSetting.modeMean = CG.myModeMeanSetting.modeMean;
 					CG.currentSkipFrames = 0;
 				}
 
+				savedImages saved;
+				if (needToWrite)
+				{
+					bool result;
+					if (CG.currentSkipFrames > 0)
+						result = cv::imwrite(CG.fullFilename, out, compressionParameters);	// removed below
+					else
+						result = writeImage(out, CG, dayOrNight.c_str(), compressionParameters, &saved);
+					if (! result) fprintf(stderr, "*** ERROR: Unable to write to '%s'\n", CG.fullFilename);
+				}
+				else if (stats.fullMean >= 0.0)
+				{
+					// The camera saved this image, which we already have the means of.
+					setSavedImageStats(out, &saved, &stats);
+				}
+				endStageTiming(stOverlay);
+
 				if (CG.currentSkipFrames > 0)
 				{
 					CG.currentSkipFrames--;
@@ -844,14 +927,10 @@ myModeMeanSetting.modeMean = CG.myModeMeanSetting.modeMean;
 				}
 				else
 				{
-					char cmd[1100+strlen(CG.allskyHome)];
 					Log(1, "  > Saving %s image '%s'\n", CG.takeDarkFrames ? "dark" : dayOrNight.c_str(), CG.finalFileName);
-					snprintf(cmd, sizeof(cmd), "%s/scripts/saveImage.sh %s '%s'", CG.allskyHome, dayOrNight.c_str(), CG.fullFilename);
-
-					add_variables_to_command(CG, cmd, exposureStartDateTime);
-					strcat(cmd, " &");
-					// Not too useful to check return code for commands run in the background.
-					system(cmd);
+					postProcessImage(CG, dayOrNight.c_str(), exposureStartDateTime, saved);
+					endStageTiming(stSave);
+					reportImageTiming();
 				}
 
 				std::string s;
@@ -865,7 +944,8 @@ myModeMeanSetting.modeMean = CG.myModeMeanSetting.modeMean;
 			{
 				// Unable to take picture.
 				// If we got a signal a message is output elsewhere.
-				if (! WIFSIGNALED(retCode))
+				// The replay camera's return code isn't from system() so never means a signal.
+				if (CG.replay != NULL || ! WIFSIGNALED(retCode))
 				{
 					numErrors++;
 					if (numErrors >= maxErrors)
@@ -15,6 +15,8 @@
 #include <chrono>
 
 #include "include/allsky_common.h"
+#include "include/camera.h"
+#include "include/jpeg_parallel.h"
 
 // CG holds all configuration variables.
 // There are only a few cases where it's not passed to a function.
@@ -25,8 +27,6 @@ config CG;
 #define IS_ZWO
 #include "ASI_functions.cpp"
 
-bool useSnapshotMode = false;	// XXXXXX use the ZWO snapshot exposure mode or vide mode?
-
 // Forward definitions
 char *getRetCode(ASI_ERROR_CODE);
 void closeUp(int);
@@ -55,6 +55,26 @@ bool bSaveRun					= false;
 bool bSavingImg					= false;
 pthread_mutex_t mtxSaveImg;
 pthread_cond_t condStartSave;
+
+// Images waiting to be saved.
+// Images are always taken into pRgb.  When an image is to be saved, pRgb is swapped with a
+// free buffer in the pool (no copying) and that buffer is queued for SaveImgThd(),
+// along with the settings in effect when the image was taken.
+// If no buffer is free the image is dropped so capture never waits on the disk
+// and never overwrites an image that's being saved.
+struct saveBuffer {
+	cv::Mat image;
+	config cg;									// settings when the image was taken
+	timeval exposureStartDateTime;
+	std::string dayOrNight;
+	bool inUse							= false;	// queued or being saved
+};
+saveBuffer savePool[MAX_SAVE_BUFFERS];
+int saveQueue[MAX_SAVE_BUFFERS];				// indexes into savePool[], oldest first
+int saveQueueHead				= 0;
+int saveQueueDepth				= 0;			// number of images waiting to be saved
+int maxSaveQueueDepth			= 0;			// most images ever waiting at once
+long numImagesDropped			= 0;			// images not saved because no buffer was free
 ASI_CONTROL_CAPS ControlCaps;
 int numErrors					= 0;				// Number of errors in a row.
 int maxErrors					= 5;				// Max number of errors in a row before we exit
@@ -64,6 +84,8 @@ pthread_t threadDisplay			= 0;
 pthread_t hthdSave				= 0;
 int numExposures				= 0;				// how many valid pictures have we taken so far?
 int currentBpp					= NOT_SET;			// bytes per pixel: 8, 16, or 24
+long lastGainSet				= NOT_SET;			// what setControl() last set ASI_GAIN to
+std::chrono::steady_clock::time_point gainChanged;	// and when, so streamed frames with the old gain are skipped
 
 // Make sure we don't try to update a non-updateable control, and check for errors.
 ASI_ERROR_CODE setControl(int camNum, ASI_CONTROL_TYPE control, long value, ASI_BOOL makeAuto)
@@ -76,7 +98,7 @@ ASI_ERROR_CODE setControl(int camNum, ASI_CONTROL_TYPE control, long value, ASI_
 	// ASIGetControlCaps(camNum, 5, &ControlCaps) since there are only 3 elements in the array.
 	for (int i = 0; i < iNumOfCtrl && i <= control; i++)	// controls are sorted 1 to n
 	{
-		ret = ASIGetControlCaps(camNum, i, &ControlCaps);
+		ret = getControlCaps(camNum, i, &ControlCaps);
 		if (ret != ASI_SUCCESS)
 		{
 			Log(-1, "*** %s: WARNING: ASIGetControlCaps() for control %d failed: %s, camNum=%d, iNumOfCtrl=%d, control=%d\n",
@@ -105,13 +127,21 @@ ASI_ERROR_CODE setControl(int camNum, ASI_CONTROL_TYPE control, long value, ASI_
 						CG.ME, ControlCaps.Name, ControlCaps.ControlType);
 					makeAuto = ASI_FALSE;
 				}
-				ret = ASISetControlValue(camNum, control, value, makeAuto);
+				if (CG.replay != NULL)
+					ret = ASI_SUCCESS;
+				else
+					ret = ASISetControlValue(camNum, control, value, makeAuto);
 				if (ret != ASI_SUCCESS)
 				{
 					Log(-1, "*** %s: WARNING: ASISetControlCaps() for control %d, value=%ld failed: %s\n",
 						CG.ME, control, value, getRetCode(ret));
 					return(ret);
 				}
+				if (control == ASI_GAIN && value != lastGainSet)
+				{
+					lastGainSet = value;
+					gainChanged = std::chrono::steady_clock::now();
+				}
 			} else {
 				Log(0, "*** %s: ERROR: ControlCap: '%s' (#%d) not writable; not setting to %ld.\n",
 						CG.ME, ControlCaps.Name, ControlCaps.ControlType, value);
@@ -147,12 +177,72 @@ void *Display(void *params)
 	return (void *)0;
 }
 
+// Make sure all free save buffers are the same size as pRgb so we don't
+// allocate memory while taking pictures.
+// Buffers in use are resized, if needed, when they are next swapped with pRgb.
+void allocateSaveBuffers()
+{
+	pthread_mutex_lock(&mtxSaveImg);
+	for (int b = 0; b < CG.saveBuffers; b++)
+	{
+		if (! savePool[b].inUse)
+			savePool[b].image.create(pRgb.size(), pRgb.type());
+	}
+	pthread_mutex_unlock(&mtxSaveImg);
+}
+
+// Queue the image in pRgb to be saved by SaveImgThd().
+// "imageDayOrNight" is when the image was taken, which can differ from "dayOrNight"
+// once the next image's time has been calculated.
+// Return false if there was no free buffer, in which case the image is dropped.
+bool queueImageToSave(std::string const &imageDayOrNight)
+{
+	pthread_mutex_lock(&mtxSaveImg);
+
+	int b;
+	for (b = 0; b < CG.saveBuffers; b++)
+	{
+		if (! savePool[b].inUse)
+			break;
+	}
+	if (b == CG.saveBuffers)
+	{
+		numImagesDropped++;
+		pthread_mutex_unlock(&mtxSaveImg);
+		return(false);
+	}
+
+	saveBuffer *sb = &savePool[b];
+	sb->inUse = true;
+	cv::swap(pRgb, sb->image);
+	sb->cg = CG;
+	sb->exposureStartDateTime = exposureStartDateTime;
+	sb->dayOrNight = imageDayOrNight;
+
+	saveQueue[(saveQueueHead + saveQueueDepth) % MAX_SAVE_BUFFERS] = b;
+	saveQueueDepth++;
+	if (saveQueueDepth > maxSaveQueueDepth)
+		maxSaveQueueDepth = saveQueueDepth;
+	Log(4, "  > Queued image in save buffer %d (%d waiting, max %d, %ld dropped).\n",
+		b, saveQueueDepth, maxSaveQueueDepth, numImagesDropped);
+
+	pthread_cond_signal(&condStartSave);
+	pthread_mutex_unlock(&mtxSaveImg);
+
+	// pRgb now has what was the free buffer.
+	// It will normally be the correct size already, in which case create() does nothing.
+	pRgb.create(sb->image.size(), sb->image.type());
+
+	return(true);
+}
+
 void *SaveImgThd(void *para)
 {
 	while (bSaveRun)
 	{
 		pthread_mutex_lock(&mtxSaveImg);
-		pthread_cond_wait(&condStartSave, &mtxSaveImg);
+		while (saveQueueDepth == 0 && ! gotSignal)
+			pthread_cond_wait(&condStartSave, &mtxSaveImg);
 
 		if (gotSignal)
 		{
@@ -161,42 +251,54 @@ void *SaveImgThd(void *para)
 			break;
 		}
 
+		int b = saveQueue[saveQueueHead];
+		saveQueueHead = (saveQueueHead + 1) % MAX_SAVE_BUFFERS;
+		saveQueueDepth--;
 		bSavingImg = true;
+		pthread_mutex_unlock(&mtxSaveImg);
+
+		// Only this thread uses the buffer until it's marked as not in use.
+		saveBuffer *sb = &savePool[b];
 
 		// I don't know how to cast "st" to 0, so call now() and ignore it.
 		auto st = std::chrono::high_resolution_clock::now();
 		auto et = st;
 
 		bool result = false;
-		if (pRgb.data)
+		savedImages saved;
+		if (sb->image.data)
 		{
-			char cmd[1100+strlen(CG.allskyHome)];
-			Log(4, "  > Saving %s image '%s'\n", CG.takeDarkFrames ? "dark" : dayOrNight.c_str(), CG.finalFileName);
-			snprintf(cmd, sizeof(cmd), "%s/scripts/saveImage.sh %s '%s'", CG.allskyHome, dayOrNight.c_str(), CG.fullFilename);
-			add_variables_to_command(CG, cmd, exposureStartDateTime);
-			strcat(cmd, " &");
+			Log(4, "  > Saving %s image '%s'\n", sb->cg.takeDarkFrames ? "dark" : sb->dayOrNight.c_str(), sb->cg.finalFileName);
 
 			st = std::chrono::high_resolution_clock::now();
 			try
 			{
-				result = imwrite(CG.fullFilename, pRgb, compressionParameters);
+				// Don't change the pool buffer's size.
+				cv::Mat out = sb->image;
+				processImage(out, sb->cg, sb->dayOrNight.c_str());
+				result = writeImage(out, sb->cg, sb->dayOrNight.c_str(), compressionParameters, &saved);
 			}
 			catch (const cv::Exception& ex)
 			{
-				Log(0, "*** %s: ERROR: Exception saving image: %s\n", CG.ME, ex.what());
+				Log(0, "*** %s: ERROR: Exception saving image: %s\n", sb->cg.ME, ex.what());
 			}
 			et = std::chrono::high_resolution_clock::now();
 
 			if (result)
-				system(cmd);
+				postProcessImage(sb->cg, sb->dayOrNight.c_str(), sb->exposureStartDateTime, saved);
 			else
-				Log(0, "*** %s: ERROR: Unable to save image '%s'.\n", CG.ME, CG.fullFilename);
+				Log(0, "*** %s: ERROR: Unable to save image '%s'.\n", sb->cg.ME, sb->cg.fullFilename);
 
 		} else {
 			// This can happen if the program is closed before the first picture.
-			Log(0, "----- SaveImgThd(): pRgb.data is null\n");
+			Log(0, "----- SaveImgThd(): image data is null\n");
 		}
-		bSavingImg = false;
+
+		pthread_mutex_lock(&mtxSaveImg);
+		sb->inUse = false;
+		bSavingImg = (saveQueueDepth > 0);
+		int waiting = saveQueueDepth;
+		pthread_mutex_unlock(&mtxSaveImg);
 
 		if (result)
 		{
@@ -212,10 +314,8 @@ void *SaveImgThd(void *para)
 				x = "  > *****\n";	// indicate when it takes a REALLY long time to save
 			else
 				x = "";
-			Log(4, "%s  > Image took %'.1f ms to save (average %'.1f ms).\n%s", x, diff_ms, totalTime_ms / totalSaves, x);
+			Log(4, "%s  > Image took %'.1f ms to save (average %'.1f ms, %d waiting).\n%s", x, diff_ms, totalTime_ms / totalSaves, waiting, x);
 		}
-
-		pthread_mutex_unlock(&mtxSaveImg);
 	}
 
 	return (void *)0;
@@ -227,96 +327,13 @@ void *SaveImgThd(void *para)
 // As a workaround, our histogram code replaces ZWO's code auto-exposure mechanism.
 // We look at the mean brightness of an X by X rectangle in image, and adjust exposure based on that.
 
-// FIXME prevent this from misbehaving when unreasonable settings are given,
-// eg. box size 0x0, box size WxW, box crosses image edge, ... basically
-// anything that would read/write out-of-bounds
-
-int computeHistogram(unsigned char *imageBuffer, config cg, bool useHistogramBox)
+// Return the histogram box, in pixels.
+// computeImageStats() ignores any part of it outside the image.
+cv::Rect getHistogramBox(config *cg)
 {
-	unsigned char *buf = imageBuffer;
-	int histogram[256];
-
-	// Clear the histogram array.
-	for (int i = 0; i < 256; i++) {
-		histogram[i] = 0;
-	}
-
-	// Different image types have a different number of bytes per pixel.
-	cg.width *= currentBpp;
-	int roiX1, roiX2, roiY1, roiY2;
-	if (useHistogramBox)
-	{
-		roiX1 = (cg.width * cg.HB.histogramBoxPercentFromLeft) - (cg.HB.currentHistogramBoxSizeX * currentBpp / 2);
-		roiX2 = roiX1 + (currentBpp * cg.HB.currentHistogramBoxSizeX);
-		roiY1 = (cg.height * cg.HB.histogramBoxPercentFromTop) - (cg.HB.currentHistogramBoxSizeY / 2);
-		roiY2 = roiY1 + cg.HB.currentHistogramBoxSizeY;
-
-		// Start off and end on a logical pixel boundries.
-		roiX1 = (roiX1 / currentBpp) * currentBpp;
-		roiX2 = (roiX2 / currentBpp) * currentBpp;
-	} else {
-		roiX1 = 0;
-		roiX2 = cg.width;
-		roiY1 = 0;
-		roiY2 = cg.height;
-	}
-
-	// For RGB24, data for each pixel is stored in 3 consecutive bytes: blue, green, red.
-	// For all image types, each row in the image contains one row of pixels.
-	// currentBpp doesn't apply to rows, just columns.
-	switch (cg.imageType) {
-	case IMG_RGB24:
-	case IMG_RAW8:
-	case IMG_Y8:
-		for (int y = roiY1; y < roiY2; y++) {
-			for (int x = roiX1; x < roiX2; x+=currentBpp) {
-				int i = (cg.width * y) + x;
-				int total = 0;
-				for (int z = 0; z < currentBpp; z++)
-				{
-					// For RGB24 this averages the blue, green, and red pixels.
-					total += buf[i+z];
-				}
-				int avg = total / currentBpp;
-				histogram[avg]++;
-			}
-		}
-		break;
-	case IMG_RAW16:
-		for (int y = roiY1; y < roiY2; y++) {
-			for (int x = roiX1; x < roiX2; x+=currentBpp) {
-				int i = (cg.width * y) + x;
-				int pixelValue;
-				// This assumes the image data is laid out in big endian format.
-				// We are going to grab the most significant byte
-				// and use that for the histogram value ignoring the
-				// least significant byte so we can use the 256 value histogram array.
-				// If it's acutally little endian then add a +1 to the array subscript for buf[i].
-				pixelValue = buf[i];
-				histogram[pixelValue]++;
-			}
-		}
-		break;
-	case ASI_IMG_END:
-		break;
-	}
-
-	// Now calculate the mean.
-	int meanBin = 0;
-	int a = 0, b = 0;
-	for (int i = 0; i < 256; i++) {
-		a += (i+1) * histogram[i];
-		b += histogram[i];
-	}
-
-	if (b == 0)
-	{
-		// This is one heck of a dark picture!
-		return(0);
-	}
-
-	meanBin = a/b - 1;
-	return meanBin;
+	int x = (cg->width * cg->HB.histogramBoxPercentFromLeft) - (cg->HB.currentHistogramBoxSizeX / 2);
+	int y = (cg->height * cg->HB.histogramBoxPercentFromTop) - (cg->HB.currentHistogramBoxSizeY / 2);
+	return(cv::Rect(x, y, cg->HB.currentHistogramBoxSizeX, cg->HB.currentHistogramBoxSizeY));
 }
 
 // This is based on code from PHD2.
@@ -349,24 +366,404 @@ void flushBufferedImages(config *cg, void *buf, size_t size)
 // Next exposure suggested by the camera.
 long suggestedNextExposure_us = 0;
 
+// When the camera returned the last image, for timing the start of the next one in snapshot mode.
+std::chrono::steady_clock::time_point imageArrived;
+
 // "auto" flag returned by ASIGetControlValue(), when we don't care what it is.
 ASI_BOOL bAuto = ASI_FALSE;
 
 ASI_BOOL wasAutoExposure = ASI_FALSE;
 long bufferSize = NOT_SET;
 
-ASI_ERROR_CODE takeOneExposure(config *cg, unsigned char *imageBuffer)
+// The ZWO camera, using ZWO's SDK.
+class ZWOCamera : public Camera
 {
-	if (imageBuffer == NULL) {
-		return (ASI_ERROR_CODE) -1;
+public:
+	char const *name() { return("ZWO"); }
+	int takeImage(config *cg, long exposure_us, double gain, cv::Mat *image);
+	bool startImage(config *cg, long exposure_us, double gain);
+	bool imageStarted() { return(snapshotStarted); }
+	bool getImageStartTime(timeval *startTime);
+	void getLastValues(config *cg);
+
+private:
+	// Snapshot started by startImage().
+	bool snapshotStarted = false;
+	long snapshotExposure_us = 0;
+	std::chrono::steady_clock::time_point snapshotStart;
+
+	// Streaming mode.
+	long streamExposure_us = NOT_SET;		// what the camera is set to
+	bool streamAutoExposure = false;
+	long streamPriorExposure_us = 0;		// what it was set to before that
+	std::chrono::steady_clock::time_point streamChanged;	// when the exposure was changed
+	std::chrono::steady_clock::time_point streamLastFrame;	// when the last frame was returned
+	bool streamHaveFrame = false;			// has a frame been returned?
+	int streamDroppedAtLast = 0;			// ASIGetDroppedFrames() when it was
+	timeval streamFrameStart;				// when the last frame returned started exposing
+	std::chrono::steady_clock::time_point streamReportStart;
+	long streamFrames = 0;					// returned since streamReportStart
+	long streamStaleFrames = 0;				// thrown away since streamReportStart
+	int streamDroppedFrames = 0;			// ASIGetDroppedFrames() at streamReportStart
+
+	ASI_ERROR_CODE waitForSnapshot(config *cg, cv::Mat *image);
+	ASI_ERROR_CODE getStreamingImage(config *cg, long exposure_us, cv::Mat *image);
+	void reportStreaming(config *cg);
+};
+
+// Start a snapshot exposure.  Only done in snapshot mode since video mode can't
+// expose one frame while we're busy with another.
+// The gain was already set so isn't used here.
+bool ZWOCamera::startImage(config *cg, long exposure_us, double gain)
+{
+	if (! cg->snapshotMode)
+		return(false);
+
+	if (cg->currentAutoExposure)
+	{
+		// ZWO auto-exposure only works in video mode.
+		static bool showedMessage = false;
+		if (! showedMessage)
+		{
+			Log(1, "  > %s: WARNING: ZWO auto-exposure isn't available in snapshot mode; using %s exposures.\n",
+				cg->ME, cg->HB.useHistogram ? "Allsky auto" : "manual");
+			showedMessage = true;
+		}
+	}
+	setControl(cg->cameraNumber, ASI_EXPOSURE, exposure_us, ASI_FALSE);
+
+	ASI_ERROR_CODE ret = ASIStartExposure(cg->cameraNumber, ASI_FALSE);
+	if (ret != ASI_SUCCESS)
+	{
+		Log(1, "  > %s: WARNING: ASIStartExposure() failed: %s\n", cg->ME, getRetCode(ret));
+		return(false);
+	}
+
+	snapshotStarted = true;
+	snapshotExposure_us = exposure_us;
+	snapshotStart = std::chrono::steady_clock::now();
+	return(true);
+}
+
+// Wait for the snapshot to finish, then get its data.
+// Sleep through most of the exposure, then poll the camera until it's done or we give up.
+ASI_ERROR_CODE ZWOCamera::waitForSnapshot(config *cg, cv::Mat *image)
+{
+	snapshotStarted = false;
+
+	// Same timeout as video mode.
+	auto deadline = snapshotStart + std::chrono::microseconds((snapshotExposure_us * 2) + (5000 * US_IN_MS));
+	auto wakeup = snapshotStart + std::chrono::microseconds((long) (snapshotExposure_us * 0.95));
+	auto now = std::chrono::steady_clock::now();
+	if (now < wakeup)
+		usleep(std::chrono::duration_cast<std::chrono::microseconds>(wakeup - now).count());
+
+	ASI_EXPOSURE_STATUS expStatus = ASI_EXP_WORKING;
+	ASI_ERROR_CODE ret;
+	while (true)
+	{
+		ret = ASIGetExpStatus(cg->cameraNumber, &expStatus);
+		if (ret != ASI_SUCCESS || expStatus != ASI_EXP_WORKING)
+			break;
+		if (std::chrono::steady_clock::now() > deadline)
+		{
+			(void) ASIStopExposure(cg->cameraNumber);
+			return(ASI_ERROR_TIMEOUT);
+		}
+		usleep(1 * US_IN_MS);
 	}
 
+	if (ret != ASI_SUCCESS)
+		return(ret);
+	if (expStatus != ASI_EXP_SUCCESS)
+	{
+		Log(1, "  > %s: WARNING: snapshot exposure failed (status %d).\n", cg->ME, (int) expStatus);
+		return(ASI_ERROR_GENERAL_ERROR);
+	}
+
+	return(ASIGetDataAfterExp(cg->cameraNumber, image->data, bufferSize));
+}
+
+// How often to report the streaming frame rate.
+#define STREAM_REPORT_SECONDS	60
+
+// Get the next frame from the video stream.
+// Unlike flushBufferedImages() the stream is never interrupted, so the camera runs at its
+// own frame rate and most frames are ready when we ask for them.
+// Frames the camera may have started before an exposure or gain change are thrown away.
+// Those are the one being exposed when the change was made and any buffered ones,
+// which all finish before the old exposure plus the new one have elapsed.
+// Frames the SDK buffered while we were busy are drained and only the newest is used.
+// The camera keeps exposing so the newest one just finished, unless the SDK's buffer filled
+// up and it dropped the newer frames, e.g., during a delay between images.
+// In that case the frames are counted as stale and the next frame is waited for.
+// getImageStartTime() returns when the frame started exposing.
+ASI_ERROR_CODE ZWOCamera::getStreamingImage(config *cg, long exposure_us, cv::Mat *image)
+{
+	auto now = std::chrono::steady_clock::now();
+	if (streamExposure_us == NOT_SET)
+	{
+		streamReportStart = now;
+		(void) ASIGetDroppedFrames(cg->cameraNumber, &streamDroppedFrames);
+	}
+
+	bool autoExposure = cg->currentAutoExposure;
+	if (exposure_us != streamExposure_us || autoExposure != streamAutoExposure)
+	{
+		setControl(cg->cameraNumber, ASI_EXPOSURE, exposure_us, autoExposure ? ASI_TRUE : ASI_FALSE);
+		streamPriorExposure_us = streamExposure_us == NOT_SET ? 0 : streamExposure_us;
+		streamExposure_us = exposure_us;
+		streamAutoExposure = autoExposure;
+		streamChanged = now;
+	}
+
+	// The camera picks the exposure in auto-exposure mode so all frames have the right one.
+	auto freshAfter = streamChanged;
+	if (! autoExposure)
+		freshAfter += std::chrono::microseconds(streamPriorExposure_us + exposure_us);
+	// A gain change is like an exposure change.
+	auto gainFreshAfter = gainChanged + std::chrono::microseconds(std::max(streamPriorExposure_us, exposure_us) + exposure_us);
+	if (gainFreshAfter > freshAfter)
+		freshAfter = gainFreshAfter;
+
+	// Drain the buffered frames without waiting, keeping the newest.
+	int numBuffered = 0;
+	while (ASIGetVideoData(cg->cameraNumber, image->data, bufferSize, 0) == ASI_SUCCESS)
+		numBuffered++;
+	int dropped = streamDroppedAtLast;
+	if (numBuffered > 0)
+		(void) ASIGetDroppedFrames(cg->cameraNumber, &dropped);
+	bool useBuffered = numBuffered > 0 && streamHaveFrame && streamLastFrame >= freshAfter &&
+		dropped == streamDroppedAtLast;
+	if (numBuffered > 0)
+	{
+		int numStale = useBuffered ? numBuffered - 1 : numBuffered;
+		streamStaleFrames += numStale;
+		if (numStale > 0)
+			Log(4, "  > [Skipped %d buffered frame%s]\n", numStale, numStale == 1 ? "" : "s");
+	}
+
+	// ZWO recommends timeout = (exposure*2) + 500 ms; see takeImage().
+	long timeout = ((exposure_us * 2) / US_IN_MS) + 5000;	// timeout is in ms
+	ASI_ERROR_CODE status = ASI_SUCCESS;
+	while (! useBuffered)
+	{
+		status = ASIGetVideoData(cg->cameraNumber, image->data, bufferSize, timeout);
+		if (status != ASI_SUCCESS || std::chrono::steady_clock::now() >= freshAfter)
+			break;
+		streamStaleFrames++;
+		Log(4, "  > [Skipped stale frame]\n");
+	}
+
+	if (status == ASI_SUCCESS)
+	{
+		// A frame ends when it arrives, or for a buffered one, by now.
+		streamLastFrame = std::chrono::steady_clock::now();
+		streamHaveFrame = true;
+		(void) ASIGetDroppedFrames(cg->cameraNumber, &streamDroppedAtLast);
+		timeval tv = getTimeval();
+		long long start_us = ((long long) tv.tv_sec * US_IN_SEC) + tv.tv_usec - exposure_us;
+		streamFrameStart.tv_sec = start_us / US_IN_SEC;
+		streamFrameStart.tv_usec = start_us % US_IN_SEC;
+
+		streamFrames++;
+		reportStreaming(cg);
+	}
+	return(status);
+}
+
+// A streamed frame usually started exposing before takeImage() was called.
+bool ZWOCamera::getImageStartTime(timeval *startTime)
+{
+	if (! CG.streamingMode || ! streamHaveFrame)
+		return(false);
+	*startTime = streamFrameStart;
+	return(true);
+}
+
+// Periodically log how fast frames are arriving, and how many the camera dropped
+// because we didn't read them quickly enough.
+void ZWOCamera::reportStreaming(config *cg)
+{
+	auto now = std::chrono::steady_clock::now();
+	double seconds = std::chrono::duration<double>(now - streamReportStart).count();
+	if (seconds < STREAM_REPORT_SECONDS)
+		return;
+
+	int dropped = streamDroppedFrames;
+	(void) ASIGetDroppedFrames(cg->cameraNumber, &dropped);
+	int newDropped = dropped - streamDroppedFrames;
+
+	// Frames the camera produced = ones we used + ones we threw away + ones it dropped.
+	Log(2, "  > Streaming: %.2f fps used, %.2f fps from camera over %.0f seconds; %d dropped, %ld stale.\n",
+		streamFrames / seconds, (streamFrames + streamStaleFrames + newDropped) / seconds,
+		seconds, newDropped, streamStaleFrames);
+
+	streamReportStart = now;
+	streamFrames = 0;
+	streamStaleFrames = 0;
+	streamDroppedFrames = dropped;
+}
+
+// The gain was already set so isn't used here.
+int ZWOCamera::takeImage(config *cg, long exposure_us, double gain, cv::Mat *image)
+{
 	ASI_ERROR_CODE status, ret;
 
+	if (cg->snapshotMode)
+	{
+		// Restart the snapshot if the exposure changed after it was started.
+		if (snapshotStarted && snapshotExposure_us != exposure_us)
+		{
+			(void) ASIStopExposure(cg->cameraNumber);
+			snapshotStarted = false;
+		}
+		if (! snapshotStarted && ! startImage(cg, exposure_us, gain))
+			return(ASI_ERROR_GENERAL_ERROR);
+
+		status = waitForSnapshot(cg, image);
+		if (status != ASI_SUCCESS)
+			Log(0, "  > %s: ERROR: Failed getting image: %s\n", cg->ME, getRetCode(status));
+		return(status);
+	}
+
+	if (cg->streamingMode)
+	{
+		status = getStreamingImage(cg, exposure_us, image);
+		if (status != ASI_SUCCESS)
+			Log(0, "  > %s: ERROR: Failed getting image: %s\n", cg->ME, getRetCode(status));
+		return(status);
+	}
+
 	// ZWO recommends timeout = (exposure*2) + 500 ms
 	// After some discussion, we're doing +5000ms to account for delays induced by
 	// USB contention, such as that caused by heavy USB disk IO
-	long timeout = ((cg->currentExposure_us * 2) / US_IN_MS) + 5000;	// timeout is in ms
+	long timeout = ((exposure_us * 2) / US_IN_MS) + 5000;	// timeout is in ms
+
+	flushBufferedImages(cg, image->data, bufferSize);
+
+	setControl(cg->cameraNumber, ASI_EXPOSURE, exposure_us, cg->currentAutoExposure ? ASI_TRUE : ASI_FALSE);
+
+	if (cg->videoOffBetweenImages)
+	{
+		status = ASIStartVideoCapture(cg->cameraNumber);
+	} else {
+		status = ASI_SUCCESS;
+	}
+
+	if (status != ASI_SUCCESS) {
+		Log(0, "  > %s: ERROR: Not fetching exposure data because status is %s\n", cg->ME, getRetCode(status));
+		return(status);
+	}
+
+	status = ASIGetVideoData(cg->cameraNumber, image->data, bufferSize, timeout);
+	if (cg->videoOffBetweenImages)
+	{
+		ret = ASIStopVideoCapture(cg->cameraNumber);
+		if (ret != ASI_SUCCESS)
+		{
+			Log(1, "  > %s: WARNING: ASIStopVideoCapture() failed: %s\n", cg->ME, getRetCode(ret));
+		}
+	}
+
+	if (status != ASI_SUCCESS)
+		Log(0, "  > %s: ERROR: Failed getting image: %s\n", cg->ME, getRetCode(status));
+
+	return(status);
+}
+
+void ZWOCamera::getLastValues(config *cg)
+{
+	ASI_ERROR_CODE ret;
+	long l;
+
+	ret = ASIGetControlValue(cg->cameraNumber, ASI_GAIN, &l, &bAuto);
+	if (ret != ASI_SUCCESS)
+	{
+		Log(1, "  > %s: WARNING: ASIGetControlValue(ASI_GAIN) failed: %s\n", cg->ME, getRetCode(ret));
+	}
+	cg->lastGain = (double) l;
+
+	// Per ZWO, when in manual-exposure mode, the returned exposure length should always
+	// be equal to the requested length; in fact, "there's no need to call ASIGetControlValue()".
+	// When in auto-exposure mode, the returned exposure length is what the driver thinks the
+	// next exposure should be, and will eventually converge on the correct exposure.
+	ret = ASIGetControlValue(cg->cameraNumber, ASI_EXPOSURE, &suggestedNextExposure_us, &wasAutoExposure);
+	if (ret != ASI_SUCCESS)
+	{
+		Log(1, "  > %s: WARNING: ASIGetControlValue(ASI_EXPOSURE) failed: %s\n", cg->ME, getRetCode(ret));
+	}
+
+	long temp;
+	ret = ASIGetControlValue(cg->cameraNumber, ASI_TEMPERATURE, &temp, &bAuto);
+	if (ret != ASI_SUCCESS)
+	{
+		Log(1, "  > %s: WARNING: ASIGetControlValue(ASI_TEMPERATURE) failed: %s\n", cg->ME, getRetCode(ret));
+	}
+	cg->lastSensorTemp = (long) ((double)temp / cg->divideTemperatureBy);
+	if (cg->isColorCamera)
+	{
+		ret = ASIGetControlValue(cg->cameraNumber, ASI_WB_R, &l, &bAuto);
+		if (ret != ASI_SUCCESS)
+		{
+			Log(1, "  > %s: WARNING: ASIGetControlValue(ASI_WB_R) failed: %s\n", cg->ME, getRetCode(ret));
+		}
+		cg->lastWBR = (double) l;
+
+		ret = ASIGetControlValue(cg->cameraNumber, ASI_WB_B, &l, &bAuto);
+		if (ret != ASI_SUCCESS)
+		{
+			Log(1, "  > %s: WARNING: ASIGetControlValue(ASI_WB_B) failed: %s\n", cg->ME, getRetCode(ret));
+		}
+		cg->lastWBB = (double) l;
+	}
+
+	if (cg->asiAutoBandwidth)
+	{
+		ret = ASIGetControlValue(cg->cameraNumber, ASI_BANDWIDTHOVERLOAD, &cg->lastAsiBandwidth, &wasAutoExposure);
+		if (ret != ASI_SUCCESS)
+		{
+			Log(1, "  > %s: WARNING: ASIGetControlValue(ASI_BANDWIDTHOVERLOAD) failed: %s\n", cg->ME, getRetCode(ret));
+		}
+	}
+}
+
+Camera *camera = NULL;		// ZWO or replay
+
+// Snapshot mode: the next image, started while this one is processed.
+bool nextImageStarted = false;
+long nextImageExposure_us = 0;
+timeval nextExposureStartDateTime;
+std::string nextDayOrNight;			// when the next image was started, or would have been
+bool startNextImageEarly = false;	// start it as soon as this image arrives
+
+// Start the next image unless it's now a different day/night, since settings change then.
+void startNextImage(config *cg)
+{
+	nextDayOrNight = calculateDayOrNight(cg->latitude, cg->longitude, cg->angle);
+	nextImageStarted = false;
+	if (! bMain || nextDayOrNight != dayOrNight)
+		return;
+
+	nextExposureStartDateTime = getTimeval();
+	nextImageExposure_us = cg->currentExposure_us;
+	nextImageStarted = camera->startImage(cg, cg->currentExposure_us, cg->currentGain);
+	if (nextImageStarted)
+	{
+		long after_us = std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now() - imageArrived).count();
+		Log(4, "  > Started next exposure %s after this image arrived.\n", length_in_units(after_us, true));
+	}
+}
+
+
+ASI_ERROR_CODE takeOneExposure(config *cg, cv::Mat *image)
+{
+	if (image->data == NULL) {
+		return (ASI_ERROR_CODE) -1;
+	}
+
+	ASI_ERROR_CODE status;
 
 	// This debug message isn't typcally needed since we already displayed a message about
 	// starting a new exposure, and below we display the result when the exposure is done.
@@ -375,177 +772,127 @@ ASI_ERROR_CODE takeOneExposure(config *cg, unsigned char *imageBuffer)
 			(wasAutoExposure == ASI_TRUE ? "Camera set auto-exposure" : "Manual exposure set"),
 		length_in_units(cg->currentExposure_us, true));
 
-	if (! useSnapshotMode)
-		flushBufferedImages(cg, imageBuffer, bufferSize);
-
 	// Sanity check.
 	if (cg->HB.useHistogram && cg->currentAutoExposure == ASI_TRUE)
 		Log(0, "*** %s: ERROR: HB.useHistogram AND currentAutoExposure are both set\n", cg->ME);
 
-	setControl(cg->cameraNumber, ASI_EXPOSURE, cg->currentExposure_us, cg->currentAutoExposure ? ASI_TRUE : ASI_FALSE);
+	// Make sure the actual time to take the picture is "close" to the requested time.
+	// Can't tell if the picture was started before we were called,
+	// and streamed frames are usually exposed while the prior one is processed.
+	bool startedEarly = camera->imageStarted() || cg->streamingMode;
+	auto tStart = std::chrono::high_resolution_clock::now();
+
+	status = (ASI_ERROR_CODE) camera->takeImage(cg, cg->currentExposure_us, cg->currentGain, image);
+	imageArrived = std::chrono::steady_clock::now();
+	nextImageStarted = false;		// takeImage() used it
+	endStageTiming(stExposure);
 
-	if (! useSnapshotMode && cg->videoOffBetweenImages)
+	if (status != ASI_SUCCESS)
 	{
-		status = ASIStartVideoCapture(cg->cameraNumber);
-	} else {
-		status = ASI_SUCCESS;
+		int exitCode;
+
+		// Check if we reached the maximum number of consective errors
+		if (! checkMaxErrors(&exitCode, maxErrors))
+		{
+			closeUp(exitCode);
+		}
 	}
+	else
+	{
+		// The timeToTakeImage_us should never be less than what was requested.
+		// and shouldn't be less then the time taked plus overhead of setting up the shot.
 
-	if (status == ASI_SUCCESS) {
-		// Make sure the actual time to take the picture is "close" to the requested time.
-		auto tStart = std::chrono::high_resolution_clock::now();
+		auto tElapsed = std::chrono::high_resolution_clock::now() - tStart;
+		long timeToTakeImage_us = std::chrono::duration_cast<std::chrono::microseconds>(tElapsed).count();
+		long diff_us = timeToTakeImage_us - cg->currentExposure_us;
+		long threshold_us = 0;
 
-		if (useSnapshotMode)
+		bool tooShort = false;
+		if (startedEarly)
 		{
-// xxxxxxxxxxxxxxxxxx start exposure, sleep for 95% of cg->currentExposure_us, then check every 5 us.
-		} else {
-			status = ASIGetVideoData(cg->cameraNumber, imageBuffer, bufferSize, timeout);
-			if (cg->videoOffBetweenImages)
-			{
-				ret = ASIStopVideoCapture(cg->cameraNumber);
-				if (ret != ASI_SUCCESS)
-				{
-					Log(1, "  > %s: WARNING: ASIStopVideoCapture() failed: %s\n", cg->ME, getRetCode(ret));
-				}
-			}
+			;	// Exposure overlapped processing of the prior image.
 		}
-
-		if (status != ASI_SUCCESS)
+		else if (diff_us < 0)
 		{
-			int exitCode;
-			Log(0, "  > %s: ERROR: Failed getting image: %s\n", cg->ME, getRetCode(status));
+			tooShort = true;			// WAY too short
+		}
+		else if (cg->currentExposure_us > (5 * US_IN_SEC))
+		{
+			// There is too much variance in the overhead of taking pictures to
+			// accurately determine the actual time to take an image at short exposures,
+			// so only check for long ones.
+			// Testing shows there's about this much us overhead,
+			// so subtract it to get our best estimate of the "actual" time.
+			const int OVERHEAD_us = (int) (0.34 * US_IN_SEC);
+
+			// Don't subtract if it would have made timeToTakeImage_us negative.
+			if (timeToTakeImage_us > OVERHEAD_us)
+				diff_us -= OVERHEAD_us;
+
+			threshold_us = cg->currentExposure_us * 0.5;	// 50% seems like a good number
+			if (abs(diff_us) > threshold_us)
+				tooShort = true;
+		}
 
-			// Check if we reached the maximum number of consective errors
-			if (! checkMaxErrors(&exitCode, maxErrors))
-			{
-				closeUp(exitCode);
-			}
+		if (tooShort)
+		{
+			Log(1, "   *** WARNING: Time to take exposure (%s) ",
+				length_in_units(timeToTakeImage_us, true));
+			Log(1, "differs from requested exposure time (%s) by %s, threshold=%s\n",
+				length_in_units(cg->currentExposure_us, true),
+				length_in_units(diff_us, true),
+				length_in_units(threshold_us, true));
 		}
 		else
 		{
-			// The timeToTakeImage_us should never be less than what was requested.
-			// and shouldn't be less then the time taked plus overhead of setting up the shot.
-
-			auto tElapsed = std::chrono::high_resolution_clock::now() - tStart;
-			long timeToTakeImage_us = std::chrono::duration_cast<std::chrono::microseconds>(tElapsed).count();
-			long diff_us = timeToTakeImage_us - cg->currentExposure_us;
-			long threshold_us = 0;
+// XXXXXXXXXXXXX set to 4 after testing
+			Log(3, "    > Time to take exposure=%'ld us, diff_us=%'ld", timeToTakeImage_us, diff_us);
+			if (threshold_us > 0)
+				Log(3, ", threshold_us=%'ld", threshold_us);
+			Log(3, "\n");
+		}
 
-			bool tooShort = false;
-			if (diff_us < 0)
-			{
-				tooShort = true;			// WAY too short
-			}
-			else if (cg->currentExposure_us > (5 * US_IN_SEC))
-			{
-				// There is too much variance in the overhead of taking pictures to
-				// accurately determine the actual time to take an image at short exposures,
-				// so only check for long ones.
-				// Testing shows there's about this much us overhead,
-				// so subtract it to get our best estimate of the "actual" time.
-				const int OVERHEAD_us = (int) (0.34 * US_IN_SEC);
-
-				// Don't subtract if it would have made timeToTakeImage_us negative.
-				if (timeToTakeImage_us > OVERHEAD_us)
-					diff_us -= OVERHEAD_us;
-
-				threshold_us = cg->currentExposure_us * 0.5;	// 50% seems like a good number
-				if (abs(diff_us) > threshold_us)
-					tooShort = true;
-			}
+		numErrors = 0;
 
-			if (tooShort)
-			{
-				Log(1, "   *** WARNING: Time to take exposure (%s) ",
-					length_in_units(timeToTakeImage_us, true));
-				Log(1, "differs from requested exposure time (%s) by %s, threshold=%s\n",
-					length_in_units(cg->currentExposure_us, true),
-					length_in_units(diff_us, true),
-					length_in_units(threshold_us, true));
-			}
-			else
-			{
-// XXXXXXXXXXXXX set to 4 after testing
-				Log(3, "    > Time to take exposure=%'ld us, diff_us=%'ld", timeToTakeImage_us, diff_us);
-				if (threshold_us > 0)
-					Log(3, ", threshold_us=%'ld", threshold_us);
-				Log(3, "\n");
-			}
+		// Cameras that don't suggest the next exposure leave it alone.
+		suggestedNextExposure_us = cg->currentExposure_us;
+		camera->getLastValues(cg);
 
-			numErrors = 0;
-			long l;
-			ret = ASIGetControlValue(cg->cameraNumber, ASI_GAIN, &l, &bAuto);
-			if (ret != ASI_SUCCESS)
-			{
-				Log(1, "  > %s: WARNING: ASIGetControlValue(ASI_GAIN) failed: %s\n", cg->ME, getRetCode(ret));
-			}
-			cg->lastGain = (double) l;
+		// With no delay between images the next one starts now, with the same settings, so it's
+		// exposing while this one's statistics are calculated.
+		// takeImage() restarts it if the statistics change the exposure.
+		if (startNextImageEarly)
+			startNextImage(cg);
 
-			char tempBuf[500];
-			tempBuf[0] = '\0';
-			char *tb = tempBuf;
+		char tempBuf[500];
+		tempBuf[0] = '\0';
+		char *tb = tempBuf;
 
-			cg->lastMean = (double)computeHistogram(imageBuffer, *cg, true);
+		// Get the mean of the histogram box and everything else in one pass over the image.
+		imageStats stats;
+		computeImageStats(*image, getHistogramBox(cg), false, cg->HB.sampling, cg->overlay.showFocus, &stats);
+		cg->lastMean = (double) stats.roiMeanBin;
 
 // xxxxxx for testing.  Get the mean of the whole image so we can compare to what removeBadImages.sh calculates.
 //	If it's the same, then the algorithms are the same and removeBadImages.sh can use MEAN.
-cg->lastMeanFull = (double)computeHistogram(imageBuffer, *cg, false);
-
-			sprintf(tb, " @ mean %d, %sgain %ld, fullMean %d",
-				(int) cg->lastMean, cg->currentAutoGain ? "(auto) " : "",
-				(long) cg->lastGain, (int) cg->lastMeanFull);
-			cg->lastExposure_us = cg->currentExposure_us;
-
-			// Per ZWO, when in manual-exposure mode, the returned exposure length should always
-			// be equal to the requested length; in fact, "there's no need to call ASIGetControlValue()".
-			// When in auto-exposure mode, the returned exposure length is what the driver thinks the
-			// next exposure should be, and will eventually converge on the correct exposure.
-			ret = ASIGetControlValue(cg->cameraNumber, ASI_EXPOSURE, &suggestedNextExposure_us, &wasAutoExposure);
-			if (ret != ASI_SUCCESS)
-			{
-				Log(1, "  > WARNING: ASIGetControlValue(ASI_EXPOSURE) failed: %s\n", cg->ME, getRetCode(ret));
-			}
-			Log(2, "  > GOT IMAGE%s.", tb);
-			Log(3, cg->HB.useHistogram ? " Ignoring suggested next exposure of %s." : "  Suggested next exposure: %s.",
-				length_in_units(suggestedNextExposure_us, true));
-			Log(2, "\n");
-
-			long temp;
-			ret = ASIGetControlValue(cg->cameraNumber, ASI_TEMPERATURE, &temp, &bAuto);
-			if (ret != ASI_SUCCESS)
-			{
-				Log(1, "  > %s: WARNING: ASIGetControlValue(ASI_TEMPERATURE) failed: %s\n", cg->ME, getRetCode(ret));
-			}
-			cg->lastSensorTemp = (long) ((double)temp / cg->divideTemperatureBy);
-			if (cg->isColorCamera)
-			{
-				ret = ASIGetControlValue(cg->cameraNumber, ASI_WB_R, &l, &bAuto);
-				if (ret != ASI_SUCCESS)
-				{
-					Log(1, "  > %s: WARNING: ASIGetControlValue(ASI_WB_R) failed: %s\n", cg->ME, getRetCode(ret));
-				}
-				cg->lastWBR = (double) l;
-
-				ret = ASIGetControlValue(cg->cameraNumber, ASI_WB_B, &l, &bAuto);
-				if (ret != ASI_SUCCESS)
-				{
-					Log(1, "  > %s: WARNING: ASIGetControlValue(ASI_WB_B) failed: %s\n", cg->ME, getRetCode(ret));
-				}
-				cg->lastWBB = (double) l;
-			}
-
-			if (cg->asiAutoBandwidth)
-			{
-				ret = ASIGetControlValue(cg->cameraNumber, ASI_BANDWIDTHOVERLOAD, &cg->lastAsiBandwidth, &wasAutoExposure);
-				if (ret != ASI_SUCCESS)
-				{
-					Log(1, "  > %s: WARNING: ASIGetControlValue(ASI_BANDWIDTHOVERLOAD) failed: %s\n", cg->ME, getRetCode(ret));
-				}
-			}
-		}
-	}
-	else {
-		Log(0, "  > %s: ERROR: Not fetching exposure data because status is %s\n", cg->ME, getRetCode(status));
+cg->lastMeanFull = (double) stats.fullMeanBin;
+		cg->lastMedianFull = stats.fullMedian;
+		cg->lastBoxMean = stats.roiMean;
+		cg->lastFocusMetric = cg->overlay.showFocus ? (long) round(stats.focus) : -1;
+		endStageTiming(stHistogram);
+
+		sprintf(tb, " @ mean %d, %sgain %ld, fullMean %d",
+			(int) cg->lastMean, cg->currentAutoGain ? "(auto) " : "",
+			(long) cg->lastGain, (int) cg->lastMeanFull);
+		cg->lastExposure_us = cg->currentExposure_us;
+
+		Log(2, "  > GOT IMAGE%s.", tb);
+		Log(3, cg->HB.useHistogram ? " Ignoring suggested next exposure of %s." : "  Suggested next exposure: %s.",
+			length_in_units(suggestedNextExposure_us, true));
+		Log(2, "\n");
+		Log(4, "  > Channel means: %.3f %.3f %.3f, saturated: %.2f%%, black: %.2f%%\n",
+			stats.channelMeans[0], stats.channelMeans[1], stats.channelMeans[2],
+			stats.saturatedFraction * 100.0, stats.blackFraction * 100.0);
 	}
 
 	return status;
@@ -738,28 +1085,41 @@ int main(int argc, char *argv[])
 
 	CG.ct = ctZWO;
 
-	processConnectedCameras();	// exits on error.  Sets CG.cameraNumber.
-
-	asiRetCode = ASIOpenCamera(CG.cameraNumber);
-	if (asiRetCode != ASI_SUCCESS)
-	{
-		Log(0, "*** %s: ERROR: opening camera, check that you have root permissions! (%s)\n",
-			CG.ME, getRetCode(asiRetCode));
-		closeUp(EXIT_NO_CAMERA);
-	}
+	CG.replay = getReplayArgument(argc, argv);
 
 	ASI_CAMERA_INFO ASICameraInfo;
-	asiRetCode = ASIGetCameraProperty(&ASICameraInfo, CG.cameraNumber);
-	if (asiRetCode != ASI_SUCCESS)
+	if (CG.replay != NULL)
 	{
-		Log(0, "*** %s: ERROR: ASIGetCamerProperty() returned: %s\n", CG.ME, getRetCode(asiRetCode));
-		exit(EXIT_ERROR_STOP);
+		// There's no camera so use the replay camera's information.
+		CG.numCameras = 1;
+		CG.cameraNumber = 0;
+		ASICameraInfo = replayCameraInfo;
+		iNumOfCtrl = replayNumOfControls;
 	}
-	asiRetCode = ASIGetNumOfControls(CG.cameraNumber, &iNumOfCtrl);
-	if (asiRetCode != ASI_SUCCESS)
+	else
 	{
-		Log(0, "*** %s: ERROR: ASIGetNumOfControls() returned: %s\n", CG.ME, getRetCode(asiRetCode));
-		exit(EXIT_ERROR_STOP);
+		processConnectedCameras();	// exits on error.  Sets CG.cameraNumber.
+
+		asiRetCode = ASIOpenCamera(CG.cameraNumber);
+		if (asiRetCode != ASI_SUCCESS)
+		{
+			Log(0, "*** %s: ERROR: opening camera, check that you have root permissions! (%s)\n",
+				CG.ME, getRetCode(asiRetCode));
+			closeUp(EXIT_NO_CAMERA);
+		}
+
+		asiRetCode = ASIGetCameraProperty(&ASICameraInfo, CG.cameraNumber);
+		if (asiRetCode != ASI_SUCCESS)
+		{
+			Log(0, "*** %s: ERROR: ASIGetCamerProperty() returned: %s\n", CG.ME, getRetCode(asiRetCode));
+			exit(EXIT_ERROR_STOP);
+		}
+		asiRetCode = ASIGetNumOfControls(CG.cameraNumber, &iNumOfCtrl);
+		if (asiRetCode != ASI_SUCCESS)
+		{
+			Log(0, "*** %s: ERROR: ASIGetNumOfControls() returned: %s\n", CG.ME, getRetCode(asiRetCode));
+			exit(EXIT_ERROR_STOP);
+		}
 	}
 	CG.ASIversion = ASIGetSDKVersion();
 
@@ -795,6 +1155,17 @@ int main(int argc, char *argv[])
 		closeUp(EXIT_ERROR_STOP);
 	}
 
+	if (CG.benchmarkJpeg != NULL)
+	{
+		benchmarkJpeg(CG, CG.benchmarkJpeg);
+		exit(EXIT_OK);
+	}
+	if (CG.benchmarkStats != NULL)
+	{
+		benchmarkStats(CG, CG.benchmarkStats);
+		exit(EXIT_OK);
+	}
+
 
 	int iMaxWidth, iMaxHeight;
 	double pixelSize;
@@ -886,11 +1257,19 @@ int main(int argc, char *argv[])
 		closeUp(EXIT_ERROR_STOP);	// force the user to fix it
 	}
 
-	asiRetCode = ASIInitCamera(CG.cameraNumber);
-	if (asiRetCode != ASI_SUCCESS)
+	if (CG.replay != NULL)
 	{
-		Log(0, "*** %s: ERROR: Unable to initialise camera: %s\n", CG.ME, getRetCode(asiRetCode));
-		closeUp(EXIT_ERROR_STOP);	// Can't do anything so might as well exit.
+		camera = newReplayCamera(&CG);
+	}
+	else
+	{
+		asiRetCode = ASIInitCamera(CG.cameraNumber);
+		if (asiRetCode != ASI_SUCCESS)
+		{
+			Log(0, "*** %s: ERROR: Unable to initialise camera: %s\n", CG.ME, getRetCode(asiRetCode));
+			closeUp(EXIT_ERROR_STOP);	// Can't do anything so might as well exit.
+		}
+		camera = new ZWOCamera();
 	}
 
 	// Handle "auto" imageType.
@@ -999,7 +1378,7 @@ int main(int argc, char *argv[])
 
 	// Start taking pictures
 
-	if (! CG.videoOffBetweenImages)
+	if (! CG.videoOffBetweenImages && ! CG.snapshotMode && CG.replay == NULL)
 	{
 		asiRetCode = ASIStartVideoCapture(CG.cameraNumber);
 		if (asiRetCode != ASI_SUCCESS)
@@ -1308,11 +1687,15 @@ if (CG.HB.useExperimentalExposure) {
 			{
 				pRgb.create(cv::Size(CG.width, CG.height), CV_8UC1);
 			}
+			allocateSaveBuffers();
 
 // TODO: ASISetStartPos(CG.cameraNumber, from_left_xxx, from_top_xxx);	By default it's at the center.
 // TODO: width % 8 must be 0. height % 2 must be 0.
 // TODO: ASI120's (width*height) % 1024 must be 0
-			asiRetCode = ASISetROIFormat(CG.cameraNumber, CG.width, CG.height, CG.currentBin, (ASI_IMG_TYPE)CG.imageType);
+			if (CG.replay != NULL)
+				asiRetCode = ASI_SUCCESS;
+			else
+				asiRetCode = ASISetROIFormat(CG.cameraNumber, CG.width, CG.height, CG.currentBin, (ASI_IMG_TYPE)CG.imageType);
 			if (asiRetCode != ASI_SUCCESS)
 			{
 				if (asiRetCode == ASI_ERROR_INVALID_SIZE)
@@ -1340,7 +1723,23 @@ if (CG.HB.useExperimentalExposure) {
 		{
 			// date/time is added to many log entries to make it easier to associate them
 			// with an image (which has the date/time in the filename).
-			exposureStartDateTime = getTimeval();
+			if (nextImageStarted && nextImageExposure_us == CG.currentExposure_us)
+			{
+				// It started exposing while the prior image was processed.
+				exposureStartDateTime = nextExposureStartDateTime;
+			}
+			else
+			{
+				// takeImage() restarts an image whose exposure changed.
+				exposureStartDateTime = getTimeval();
+			}
+			std::string imageDayOrNight = dayOrNight;
+			nextDayOrNight.clear();
+			if (CG.snapshotMode)
+			{
+				startNextImageEarly = ! currentAdjustGain &&
+					getDelayBetweenImages_us(CG, CG.currentExposure_us, "", false) == 0;
+			}
 			char exposureStart[128];
 			snprintf(exposureStart, sizeof(exposureStart), "%s", formatTime(exposureStartDateTime, "%F %T"));
 			// Unfortunately our histogram method only does exposure, not gain, so we
@@ -1354,15 +1753,14 @@ if (CG.HB.useExperimentalExposure) {
 				sprintf(bufTime, "%s", formatTime(exposureStartDateTime, CG.timeFormat));
 			}
 
-			asiRetCode = takeOneExposure(&CG, pRgb.data);
+			startImageTiming();
+			asiRetCode = takeOneExposure(&CG, &pRgb);
 			if (asiRetCode == ASI_SUCCESS)
 			{
 				numErrors = 0;
 				numExposures++;
 				bool hitMinOrMax = false;
 
-				CG.lastFocusMetric = CG.overlay.showFocus ? (int)round(get_focus_metric(pRgb)) : -1;
-
 				if (numExposures == 0 && CG.preview)
 				{
 					// Start the preview thread at the last possible moment.
@@ -1569,7 +1967,7 @@ if (saved_newExposure_us != newExposure_us)
 						priorMean = CG.lastMean;
 						priorMeanDiff = lastMeanDiff;
 
-						asiRetCode = takeOneExposure(&CG, pRgb.data);
+						asiRetCode = takeOneExposure(&CG, &pRgb);
 						if (asiRetCode == ASI_SUCCESS)
 						{
 							if (CG.lastMean < minAcceptableMean)
@@ -1728,12 +2126,60 @@ if (saved_newExposure_us != newExposure_us)
 					}
 				}
 
+				std::string s;
+				if (CG.currentAutoExposure)
+				{
+					s = "auto";
+				}
+				else if (CG.HB.useHistogram)
+				{
+					s = "histogram";
+				} else {
+					s = "manual";
+				}
+
+				// A streamed frame started before we asked for it.
+				timeval frameStart;
+				if (camera->getImageStartTime(&frameStart))
+				{
+					exposureStartDateTime = frameStart;
+					snprintf(exposureStart, sizeof(exposureStart), "%s", formatTime(exposureStartDateTime, "%F %T"));
+					if (CG.overlay.showTime)
+						sprintf(bufTime, "%s", formatTime(exposureStartDateTime, CG.timeFormat));
+				}
+
+				// In snapshot mode the gain for the next image is set now so the next
+				// exposure can start as soon as the delay is over, but the overlay shows
+				// this image's gain change.
+				int imageGainChange = gainChange;	// gain change for this image
+				if (CG.snapshotMode && ! CG.takeDarkFrames && currentAdjustGain)
+				{
+					// Determine if we need to change the gain on the next image.
+					gainChange = determineGainChange(CG);
+					setControl(CG.cameraNumber, ASI_GAIN, CG.currentGain + gainChange, CG.currentAutoGain ? ASI_TRUE : ASI_FALSE);
+				}
+
+				// In snapshot mode the next exposure starts the delay after this image arrived,
+				// or now if that's already passed, so it's exposing while this image's overlay
+				// is added and it's queued, and while SaveImgThd() saves it.
+				// With no delay it was started when this image arrived.
+				std::chrono::steady_clock::time_point nextImageStart;
+				if (CG.snapshotMode && nextDayOrNight.empty())
+				{
+					nextImageStart = imageArrived + std::chrono::microseconds(getDelayBetweenImages_us(CG, CG.lastExposure_us, s));
+					if (std::chrono::steady_clock::now() >= nextImageStart)
+						startNextImage(&CG);
+				}
+
+				// Subtract darks and fix hot pixels before the overlay is added.
+				(void) correctImage(pRgb, CG, dayOrNight.c_str());
+
 				// If takeDarkFrames is off, add overlay text to the image
 				if (! CG.takeDarkFrames)
 				{
 					if (CG.overlay.overlayMethod == OVERLAY_METHOD_LEGACY)
 					{
-						(void) doOverlay(pRgb, CG, bufTime, gainChange);
+						(void) doOverlay(pRgb, CG, bufTime, imageGainChange);
 						if (CG.overlay.showHistogramBox)
 						{
 							// Draw a rectangle where the histogram box is.
@@ -1751,7 +2197,7 @@ if (saved_newExposure_us != newExposure_us)
 							cv::rectangle(pRgb, cv::Point(X1+thickness, Y1+thickness), cv::Point(X2-thickness, Y2-thickness), innerLine, thickness, lt, 0);
 						}
 					}
-					if (currentAdjustGain)
+					if (currentAdjustGain && ! CG.snapshotMode)
 					{
 						// Determine if we need to change the gain on the next image.
 						// This must come AFTER the "showGain" above.
@@ -1759,48 +2205,48 @@ if (saved_newExposure_us != newExposure_us)
 						setControl(CG.cameraNumber, ASI_GAIN, CG.currentGain + gainChange, CG.currentAutoGain ? ASI_TRUE : ASI_FALSE);
 					}
 				}
+				endStageTiming(stOverlay);
 
 				// Save the image
-				if (! bSavingImg)
+				// For dark frames we already know the finalFilename.
+				if (! CG.takeDarkFrames)
 				{
-					// For dark frames we already know the finalFilename.
-					if (! CG.takeDarkFrames)
-					{
-						// Create the name of the file that goes in the images/<date> directory.
-						snprintf(CG.finalFileName, sizeof(CG.finalFileName), "%s-%s.%s",
-							CG.fileNameOnly, formatTime(exposureStartDateTime, "%Y%m%d%H%M%S"), CG.imageExt);
-						snprintf(CG.fullFilename, sizeof(CG.fullFilename), "%s/%s", CG.saveDir, CG.finalFileName);
-					}
-
-					pthread_mutex_lock(&mtxSaveImg);
-					pthread_cond_signal(&condStartSave);
-					pthread_mutex_unlock(&mtxSaveImg);
+					// Create the name of the file that goes in the images/<date> directory.
+					snprintf(CG.finalFileName, sizeof(CG.finalFileName), "%s-%s.%s",
+						CG.fileNameOnly, formatTime(exposureStartDateTime, "%Y%m%d%H%M%S"), CG.imageExt);
+					snprintf(CG.fullFilename, sizeof(CG.fullFilename), "%s/%s", CG.saveDir, CG.finalFileName);
 				}
-				else
+
+				if (! queueImageToSave(imageDayOrNight))
 				{
 					// Hopefully the user can use the time it took to save a file to disk
 					// to help determine why they are getting this warning.
 					// Perhaps their disk is very slow or their delay is too short.
-					Log(1, "  > WARNING: currently saving an image; can't save new one at %s.\n", exposureStart);
-
-					// TODO: wait for the prior image to finish saving.
+					Log(1, "  > WARNING: all %ld save buffers are in use; dropping image taken at %s (%ld dropped so far).\n",
+						CG.saveBuffers, exposureStart, numImagesDropped);
 				}
+				// This is only the time to queue the image; SaveImgThd() reports the time to save it.
+				endStageTiming(stSave);
+				reportImageTiming();
 
-				std::string s;
-				if (CG.currentAutoExposure)
+				if (! CG.snapshotMode)
 				{
-					s = "auto";
+					// Delay applied before next exposure
+					delayBetweenImages(CG, CG.lastExposure_us, s);
+					dayOrNight = calculateDayOrNight(CG.latitude, CG.longitude, CG.angle);
 				}
-				else if (CG.HB.useHistogram)
+				else
 				{
-					s = "histogram";
-				} else {
-					s = "manual";
+					if (nextDayOrNight.empty())
+					{
+						// The rest of the delay.
+						auto now = std::chrono::steady_clock::now();
+						if (now < nextImageStart)
+							usleep(std::chrono::duration_cast<std::chrono::microseconds>(nextImageStart - now).count());
+						startNextImage(&CG);
+					}
+					dayOrNight = nextDayOrNight;
 				}
-				// Delay applied before next exposure
-				delayBetweenImages(CG, CG.lastExposure_us, s);
-
-				dayOrNight = calculateDayOrNight(CG.latitude, CG.longitude, CG.angle);
 			}
 		}
 
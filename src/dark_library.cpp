@@ -0,0 +1,266 @@
+// Dark frames kept in memory and subtracted by the capture programs.
+// darkSubtract.sh used to search the darks directory and run "convert" for every
+// nighttime image, which decoded both images and encoded the result again.
+//
+// Only the (at most two) darks being used are kept in memory; the sensor temperature
+// changes slowly so they rarely need to be read again.
+
+#include <opencv2/core.hpp>
+#include <opencv2/highgui.hpp>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <math.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "include/allsky_common.h"
+#include "include/dark_library.h"
+
+struct darkFrame {
+	std::string file;
+	double temperature;
+	long exposure_us;					// NOT_SET if not known
+	time_t modified;					// when "file" was last modified
+	cv::Mat image;						// empty until needed
+};
+
+static std::vector<darkFrame> darks;	// sorted by temperature
+static time_t darksDirModified			= 0;
+static bool showedNoDarks				= false;
+
+
+// Get the temperature and optional exposure from a dark's file name.
+static bool parseDarkName(char const *name, double *temperature, long *exposure_us)
+{
+	char *end;
+	*temperature = strtod(name, &end);
+	if (end == name)
+		return(false);
+
+	*exposure_us = NOT_SET;
+	if (*end == '_')
+	{
+		char *e = end + 1;
+		*exposure_us = strtol(e, &end, 10);
+		if (end == e || strncmp(end, "us", 2) != 0 || *exposure_us <= 0)
+			return(false);
+		end += 2;
+	}
+
+	return(strcasecmp(end, ".jpg") == 0 || strcasecmp(end, ".jpeg") == 0 || strcasecmp(end, ".png") == 0);
+}
+
+// Read the list of darks if the directory changed.
+// Darks that were already read and haven't changed are kept.
+static void scanDarks(config const &cg)
+{
+	struct stat s;
+	if (stat(cg.darksDir, &s) != 0)
+	{
+		if (! darks.empty() || darksDirModified != 0)
+			Log(1, "*** %s: WARNING: Unable to read darks directory '%s': %s\n", cg.ME, cg.darksDir, strerror(errno));
+		darks.clear();
+		darksDirModified = 0;
+		return;
+	}
+	if (s.st_mtime == darksDirModified)
+		return;
+	darksDirModified = s.st_mtime;
+	showedNoDarks = false;
+
+	DIR *dir = opendir(cg.darksDir);
+	if (dir == NULL)
+		return;
+
+	std::vector<darkFrame> found;
+	struct dirent *entry;
+	while ((entry = readdir(dir)) != NULL)
+	{
+		darkFrame d;
+		if (! parseDarkName(entry->d_name, &d.temperature, &d.exposure_us))
+			continue;
+
+		d.file = std::string(cg.darksDir) + "/" + entry->d_name;
+		struct stat f;
+		if (stat(d.file.c_str(), &f) != 0 || f.st_size == 0)
+			continue;
+		d.modified = f.st_mtime;
+
+		for (darkFrame &old : darks)
+		{
+			if (old.file == d.file && old.modified == d.modified)
+			{
+				d.image = old.image;
+				break;
+			}
+		}
+		found.push_back(d);
+	}
+	closedir(dir);
+
+	std::sort(found.begin(), found.end(),
+		[](darkFrame const &a, darkFrame const &b) { return(a.temperature < b.temperature); });
+	darks.swap(found);
+	Log(4, "  > Found %d dark frame(s) in '%s'.\n", (int) darks.size(), cg.darksDir);
+}
+
+// Of the darks at "temperature", return the one whose exposure is closest to "exposure_us".
+static darkFrame *closestExposure(double temperature, long exposure_us)
+{
+	darkFrame *best = NULL;
+	double bestDiff = 0;
+	for (darkFrame &d : darks)
+	{
+		if (d.temperature != temperature)
+			continue;
+		double diff = 0;
+		if (d.exposure_us != NOT_SET && exposure_us > 0)
+			diff = fabs(log((double) exposure_us / d.exposure_us));
+		if (best == NULL || diff < bestDiff)
+		{
+			best = &d;
+			bestDiff = diff;
+		}
+	}
+	return(best);
+}
+
+// Make sure the dark's image is in memory and is usable with "image".
+static bool loadDark(darkFrame *d, cv::Mat const &image, config const &cg)
+{
+	struct stat f;
+	if (stat(d->file.c_str(), &f) == 0 && f.st_mtime != d->modified)
+	{
+		d->modified = f.st_mtime;
+		d->image.release();				// it changed
+	}
+	if (d->image.data)
+		return(d->image.size() == image.size() && d->image.type() == image.type());
+
+	cv::Mat m = cv::imread(d->file, cv::IMREAD_UNCHANGED);
+	if (! m.data)
+	{
+		Log(1, "*** %s: WARNING: Unable to read dark frame '%s'.\n", cg.ME, d->file.c_str());
+		return(false);
+	}
+	if (m.depth() != image.depth())
+	{
+		double scale = m.depth() == CV_16U ? (1.0 / 257) : 257.0;
+		m.convertTo(m, CV_MAKETYPE(image.depth(), m.channels()), scale);
+	}
+	if (m.size() != image.size() || m.channels() != image.channels())
+	{
+		Log(1, "*** %s: WARNING: Dark frame '%s' is %dx%d with %d channel(s) but images are %dx%d with %d; not using it.\n",
+			cg.ME, d->file.c_str(), m.cols, m.rows, m.channels(), image.cols, image.rows, image.channels());
+	}
+	d->image = m;
+	Log(4, "  > Read dark frame '%s'.\n", d->file.c_str());
+	return(d->image.size() == image.size() && d->image.type() == image.type());
+}
+
+bool subtractDark(cv::Mat &image, config const &cg)
+{
+	if (cg.darksDir == NULL)
+		return(false);
+
+	// Some cameras don't have a sensor temperature.
+	if (! cg.supportsTemperature || cg.lastSensorTemp == NOT_SET)
+	{
+		static bool showedMessage = false;
+		if (! showedMessage)
+		{
+			Log(1, "*** %s: WARNING: The sensor temperature isn't known; continuing without dark subtraction.\n", cg.ME);
+			showedMessage = true;
+		}
+		return(false);
+	}
+
+	scanDarks(cg);
+
+	// The closest temperatures at or below and at or above the sensor's.
+	double temperature = cg.lastSensorTemp;
+	darkFrame *below = NULL, *above = NULL;
+	for (darkFrame &d : darks)
+	{
+		if (d.temperature <= temperature)
+			below = &d;
+		else if (above == NULL)
+			above = &d;
+	}
+	if (below != NULL)
+		below = closestExposure(below->temperature, cg.lastExposure_us);
+	if (above != NULL)
+		above = closestExposure(above->temperature, cg.lastExposure_us);
+
+	// Free darks we're not using.
+	for (darkFrame &d : darks)
+	{
+		if (&d != below && &d != above)
+			d.image.release();
+	}
+
+	if (below != NULL && ! loadDark(below, image, cg))
+		below = NULL;
+	if (above != NULL && ! loadDark(above, image, cg))
+		above = NULL;
+	if (below == NULL && above == NULL)
+	{
+		if (! showedNoDarks)
+		{
+			Log(1, "*** %s: WARNING: No usable dark frame in '%s' for temperature %.1f C; continuing without dark subtraction.\n",
+				cg.ME, cg.darksDir, temperature);
+			showedNoDarks = true;
+		}
+		return(false);
+	}
+
+	// How much of each dark to subtract.
+	double weightBelow = 1.0, weightAbove = 1.0;
+	if (below != NULL && above != NULL)
+	{
+		weightAbove = (temperature - below->temperature) / (above->temperature - below->temperature);
+		weightBelow = 1.0 - weightAbove;
+	}
+	auto exposureScale = [&cg](darkFrame const *d)
+	{
+		if (d->exposure_us == NOT_SET || cg.lastExposure_us <= 0)
+			return(1.0);
+		return((double) cg.lastExposure_us / d->exposure_us);
+	};
+	if (below != NULL)
+		weightBelow *= exposureScale(below);
+	if (above != NULL)
+		weightAbove *= exposureScale(above);
+
+	// Reuse the memory from the last image.
+	static cv::Mat dark;
+	if (below != NULL && above != NULL)
+	{
+		cv::addWeighted(below->image, weightBelow, above->image, weightAbove, 0.0, dark, image.depth());
+		cv::subtract(image, dark, image);
+	}
+	else
+	{
+		darkFrame *d = below != NULL ? below : above;
+		double weight = below != NULL ? weightBelow : weightAbove;
+		if (weight == 1.0)
+		{
+			cv::subtract(image, d->image, image);
+		}
+		else
+		{
+			d->image.convertTo(dark, image.type(), weight);
+			cv::subtract(image, dark, image);
+		}
+	}
+
+	Log(4, "  > Subtracted dark frame(s) %s%s%s for temperature %.1f C.\n",
+		below != NULL ? below->file.c_str() : "", below != NULL && above != NULL ? " and " : "",
+		above != NULL ? above->file.c_str() : "", temperature);
+	return(true);
+}
@@ -0,0 +1,796 @@
+// Make a master dark frame from many dark frames taken at the same temperature.
+// SPDX-License-Identifier: MIT
+//
+// Each pixel of the master is the median, or the sigma-clipped mean, of that pixel
+// in all the frames, which removes the noise of any single frame and things like
+// cosmic-ray hits.
+// The frames are read a band of rows at a time so memory use depends on the number
+// of frames and the band size, not the image size; a Pi with 1 GB can stack many
+// full-size frames.
+// JPEG frames are decoded directly with libjpeg a band at a time.  Other frames
+// are decoded once and kept uncompressed in a temporary file next to the master,
+// not in /tmp, which is often a small RAM disk.
+// The master is a 16-bit PNG with the number of frames and temperature in text chunks.
+//
+// Optionally a map of the hot pixels in the master is also saved for the capture
+// programs to fix.  A pixel is hot if it's much brighter than the median of its
+// neighbors of the same color.  This also works on a stack of nighttime images,
+// where the stars move but the hot pixels don't.
+
+using namespace std;
+
+#include <getopt.h>
+#include <glob.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <setjmp.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/statvfs.h>
+#include <jpeglib.h>
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <opencv2/highgui.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/opencv.hpp>
+
+#define KNRM "\x1B[0m"
+#define KRED "\x1B[31m"
+
+#define METHOD_MEDIAN	0
+#define METHOD_SIGMA	1
+
+struct config_t {
+	std::string img_src_dir;
+	std::string img_src_ext;
+	std::string dst_master;
+	std::string temperature;
+	std::string dst_hot_pixels;
+	bool bayer;
+	double hot_sigma;
+	int hot_minimum;
+	int method;
+	double sigma;
+	int max_frames;
+	int memory_mb;
+	int num_threads;
+	int nice_level;
+	int verbose;
+} config;
+
+std::mutex stdio_mutex;
+
+// libjpeg calls exit() on errors unless we give it our own error handler.
+struct jpeg_error_t {
+	struct jpeg_error_mgr mgr;
+	jmp_buf jump_buffer;
+	char message[JMSG_LENGTH_MAX];
+};
+
+static void jpeg_error_exit(j_common_ptr cinfo)
+{
+	jpeg_error_t *err = (jpeg_error_t *) cinfo->err;
+	(*cinfo->err->format_message)(cinfo, err->message);
+	longjmp(err->jump_buffer, 1);
+}
+
+// Keep libjpeg's warnings about corrupt data quiet unless verbose.
+static void jpeg_output_message(j_common_ptr cinfo)
+{
+	if (config.verbose > 1) {
+		char message[JMSG_LENGTH_MAX];
+		(*cinfo->err->format_message)(cinfo, message);
+		stdio_mutex.lock();
+		fprintf(stderr, "%s\n", message);
+		stdio_mutex.unlock();
+	}
+}
+
+// One dark frame being read a band at a time.
+struct frame_t {
+	std::string filename;
+	FILE *fp = NULL;
+	bool is_jpeg = false;
+	bool ok = false;
+	int width = 0, height = 0, channels = 0, depth = CV_8U;
+	struct jpeg_decompress_struct cinfo;
+	jpeg_error_t err;
+	std::vector<unsigned char> band;	// the rows currently being stacked
+};
+
+// Where the uncompressed temporary files go: the master's directory.
+std::string temp_dir;
+
+// Free space to leave in temp_dir for the master and hot pixel map.
+#define TEMP_RESERVE_MB		100
+
+// Return a temporary file in temp_dir for "bytes" bytes of a decoded frame,
+// or NULL if there isn't room for it.  It's deleted when closed.
+FILE *temp_file(std::string const& filename, size_t bytes)
+{
+	struct statvfs vfs;
+	if (statvfs(temp_dir.c_str(), &vfs) == 0) {
+		unsigned long long avail = (unsigned long long) vfs.f_bavail * vfs.f_frsize;
+		unsigned long long needed = bytes + ((unsigned long long) TEMP_RESERVE_MB * 1024 * 1024);
+		if (avail < needed) {
+			fprintf(stderr, "%s: not enough space in '%s' to decode it (%llu MB needed, %llu MB free); ignoring file\n",
+				filename.c_str(), temp_dir.c_str(), needed / (1024 * 1024), avail / (1024 * 1024));
+			return(NULL);
+		}
+	}
+
+	std::string name = temp_dir + "/.darkmaster.XXXXXX";
+	int fd = mkstemp(&name[0]);
+	if (fd == -1) {
+		fprintf(stderr, "Unable to create temporary file in '%s': %s\n", temp_dir.c_str(), strerror(errno));
+		return(NULL);
+	}
+	unlink(name.c_str());
+	FILE *fp = fdopen(fd, "w+b");
+	if (fp == NULL) {
+		fprintf(stderr, "Unable to create temporary file in '%s': %s\n", temp_dir.c_str(), strerror(errno));
+		close(fd);
+	}
+	return(fp);
+}
+
+// Start reading a frame.  JPEG frames are decoded as they are read;
+// anything else is decoded now into an uncompressed temporary file.
+bool open_frame(frame_t *f)
+{
+	f->fp = fopen(f->filename.c_str(), "rb");
+	if (f->fp == NULL) {
+		fprintf(stderr, "%s: %s; ignoring file\n", f->filename.c_str(), strerror(errno));
+		return(false);
+	}
+
+	unsigned char magic[2] = { 0, 0 };
+	f->is_jpeg = fread(magic, 1, 2, f->fp) == 2 && magic[0] == 0xFF && magic[1] == 0xD8;
+	rewind(f->fp);
+
+	if (f->is_jpeg) {
+		f->cinfo.err = jpeg_std_error(&f->err.mgr);
+		f->err.mgr.error_exit = jpeg_error_exit;
+		f->err.mgr.output_message = jpeg_output_message;
+		if (setjmp(f->err.jump_buffer)) {
+			fprintf(stderr, "%s: %s; ignoring file\n", f->filename.c_str(), f->err.message);
+			jpeg_destroy_decompress(&f->cinfo);
+			fclose(f->fp);
+			f->fp = NULL;
+			return(false);
+		}
+		jpeg_create_decompress(&f->cinfo);
+		jpeg_stdio_src(&f->cinfo, f->fp);
+		jpeg_read_header(&f->cinfo, TRUE);
+		if (f->cinfo.num_components == 1) {
+			f->cinfo.out_color_space = JCS_GRAYSCALE;
+		} else {
+#ifdef JCS_EXTENSIONS
+			f->cinfo.out_color_space = JCS_EXT_BGR;
+#else
+			f->cinfo.out_color_space = JCS_RGB;
+#endif
+		}
+		jpeg_start_decompress(&f->cinfo);
+		f->width = f->cinfo.output_width;
+		f->height = f->cinfo.output_height;
+		f->channels = f->cinfo.output_components;
+		f->depth = CV_8U;
+	} else {
+		fclose(f->fp);
+		f->fp = NULL;
+
+		cv::Mat mat = cv::imread(f->filename, cv::IMREAD_UNCHANGED);
+		if (! mat.data || (mat.depth() != CV_8U && mat.depth() != CV_16U) || mat.channels() == 2) {
+			fprintf(stderr, "%s: unable to read 8- or 16-bit image; ignoring file\n", f->filename.c_str());
+			return(false);
+		}
+		if (mat.channels() == 4)
+			cv::cvtColor(mat, mat, cv::COLOR_BGRA2BGR);
+
+		size_t row_bytes = mat.cols * mat.elemSize();
+		f->fp = temp_file(f->filename, row_bytes * mat.rows);
+		if (f->fp == NULL)
+			return(false);
+		for (int y = 0; y < mat.rows; y++) {
+			if (fwrite(mat.ptr(y), 1, row_bytes, f->fp) != row_bytes) {
+				fprintf(stderr, "Unable to write temporary file: %s\n", strerror(errno));
+				fclose(f->fp);
+				f->fp = NULL;
+				return(false);
+			}
+		}
+		rewind(f->fp);
+		f->width = mat.cols;
+		f->height = mat.rows;
+		f->channels = mat.channels();
+		f->depth = mat.depth();
+	}
+
+	f->ok = true;
+	return(true);
+}
+
+void close_frame(frame_t *f)
+{
+	if (f->fp == NULL)
+		return;
+	if (f->is_jpeg)
+		jpeg_destroy_decompress(&f->cinfo);
+	fclose(f->fp);
+	f->fp = NULL;
+}
+
+// Read the next "rows" rows of the frame into its band.
+// On error the frame is no longer used.
+void read_band(frame_t *f, int rows)
+{
+	if (! f->ok)
+		return;
+
+	size_t row_bytes = f->width * f->channels * (f->depth == CV_16U ? 2 : 1);
+	f->band.resize(row_bytes * rows);
+
+	if (! f->is_jpeg) {
+		if (fread(f->band.data(), 1, f->band.size(), f->fp) != f->band.size()) {
+			fprintf(stderr, "%s: unable to read temporary file; ignoring rest of file\n", f->filename.c_str());
+			f->ok = false;
+		}
+		return;
+	}
+
+	if (setjmp(f->err.jump_buffer)) {
+		stdio_mutex.lock();
+		fprintf(stderr, "%s: %s; ignoring rest of file\n", f->filename.c_str(), f->err.message);
+		stdio_mutex.unlock();
+		f->ok = false;
+		return;
+	}
+	for (int y = 0; y < rows; y++) {
+		JSAMPROW row = f->band.data() + (y * row_bytes);
+		jpeg_read_scanlines(&f->cinfo, &row, 1);
+#ifndef JCS_EXTENSIONS
+		if (f->channels == 3) {
+			for (size_t x = 0; x < row_bytes; x += 3)
+				std::swap(row[x], row[x + 2]);
+		}
+#endif
+	}
+}
+
+// Median of the first "n" values; reorders them.
+static double median(float *v, int n)
+{
+	int mid = n / 2;
+	std::nth_element(v, v + mid, v + n);
+	double m = v[mid];
+	if (n % 2 == 0)
+		m = (m + *std::max_element(v, v + mid)) / 2.0;
+	return(m);
+}
+
+// Mean of the values within "sigma" standard deviations of the mean,
+// repeated until no more values are rejected.
+static double sigma_clipped_mean(float *v, int n, double sigma)
+{
+	double mean = 0;
+	for (int pass = 0; pass < 10 && n > 0; pass++) {
+		double sum = 0, sum_sq = 0;
+		for (int i = 0; i < n; i++) {
+			sum += v[i];
+			sum_sq += (double) v[i] * v[i];
+		}
+		mean = sum / n;
+		double sd = sqrt(std::max(0.0, (sum_sq / n) - (mean * mean)));
+		if (sd == 0)
+			break;
+
+		int kept = 0;
+		for (int i = 0; i < n; i++) {
+			if (fabs(v[i] - mean) <= sigma * sd)
+				v[kept++] = v[i];
+		}
+		if (kept == n || kept == 0)
+			break;
+		n = kept;
+	}
+	return(mean);
+}
+
+// Stack values "first" to "last" of the bands into the master's band.
+void stack_worker(struct config_t* cf, std::vector<frame_t*> const* frames,
+				  int depth, size_t first, size_t last, uint16_t* master)
+{
+	std::vector<float> values(frames->size());
+	double scale = depth == CV_16U ? 1.0 : 257.0;	// 8-bit values go to 16 bits
+
+	for (size_t i = first; i < last; i++) {
+		int n = 0;
+		for (frame_t *f : *frames) {
+			if (! f->ok)
+				continue;
+			if (depth == CV_16U)
+				values[n++] = ((uint16_t *) f->band.data())[i];
+			else
+				values[n++] = f->band[i];
+		}
+
+		double v = 0;
+		if (n > 0) {
+			if (cf->method == METHOD_MEDIAN)
+				v = median(values.data(), n);
+			else
+				v = sigma_clipped_mean(values.data(), n, cf->sigma);
+		}
+		master[i] = cv::saturate_cast<uint16_t>(v * scale);
+	}
+}
+
+// Run "work(first, last)" on parts of [0, count) in up to "num_threads" threads.
+template<typename F>
+static void run_threads(int num_threads, size_t count, F work)
+{
+	num_threads = std::max(1, (int) std::min((size_t) num_threads, count));
+	std::vector<std::thread> threadpool;
+	for (int t = 1; t < num_threads; t++)
+		threadpool.push_back(std::thread(work, (count * t) / num_threads, (count * (t+1)) / num_threads));
+	work(0, count / num_threads);
+	for (auto& t : threadpool)
+		t.join();
+}
+
+// Add text chunks to a PNG after its IHDR chunk.
+static uint32_t crc32(unsigned char const *p, size_t n, uint32_t crc = 0)
+{
+	static uint32_t table[256];
+	if (table[1] == 0) {
+		for (uint32_t i = 0; i < 256; i++) {
+			uint32_t c = i;
+			for (int k = 0; k < 8; k++)
+				c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+			table[i] = c;
+		}
+	}
+	crc = ~crc;
+	for (size_t i = 0; i < n; i++)
+		crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+	return(~crc);
+}
+
+static void add_png_text(std::vector<unsigned char>& png, std::vector<std::pair<std::string, std::string>> const& text)
+{
+	auto put32 = [](std::vector<unsigned char>& v, uint32_t x) {
+		v.push_back(x >> 24); v.push_back(x >> 16); v.push_back(x >> 8); v.push_back(x);
+	};
+
+	std::vector<unsigned char> chunks;
+	for (auto const& t : text) {
+		std::vector<unsigned char> data;
+		data.insert(data.end(), {'t', 'E', 'X', 't'});
+		data.insert(data.end(), t.first.begin(), t.first.end());
+		data.push_back(0);
+		data.insert(data.end(), t.second.begin(), t.second.end());
+
+		put32(chunks, data.size() - 4);
+		chunks.insert(chunks.end(), data.begin(), data.end());
+		put32(chunks, crc32(data.data(), data.size()));
+	}
+
+	// 8-byte signature, then IHDR: 4-byte length, 4-byte type, 13 bytes of data, 4-byte CRC.
+	size_t after_ihdr = 8 + 4 + 4 + 13 + 4;
+	png.insert(png.begin() + after_ihdr, chunks.begin(), chunks.end());
+}
+
+// Median of the neighbors of pixel (x, y) in channel "c" that are "step" pixels away.
+static int neighbor_median(cv::Mat const& m, int x, int y, int c, int step)
+{
+	uint16_t values[8];
+	int n = 0;
+	for (int dy = -step; dy <= step; dy += step) {
+		if (y + dy < 0 || y + dy >= m.rows)
+			continue;
+		uint16_t const* row = m.ptr<uint16_t>(y + dy);
+		for (int dx = -step; dx <= step; dx += step) {
+			if ((dx == 0 && dy == 0) || x + dx < 0 || x + dx >= m.cols)
+				continue;
+			values[n++] = row[((x + dx) * m.channels()) + c];
+		}
+	}
+	std::nth_element(values, values + (n / 2), values + n);
+	return(values[n / 2]);
+}
+
+// Save the pixels of "master" that are more than "hot_sigma" standard deviations,
+// and at least "hot_minimum", brighter than their neighbors.
+// The standard deviation is estimated from the median absolute difference so
+// the hot pixels themselves don't affect it.
+bool save_hot_pixels(struct config_t* cf, cv::Mat const& master)
+{
+	int step = cf->bayer ? 2 : 1;
+	int channels = master.channels();
+	size_t pixels = (size_t) master.rows * master.cols;
+
+	// Count how many pixels are each amount brighter than their neighbors,
+	// then find the median of those amounts.
+	std::vector<size_t> histogram(65536, 0);
+	std::mutex histogram_mutex;
+	run_threads(cf->num_threads, master.rows, [&](size_t first, size_t last) {
+		std::vector<size_t> h(65536, 0);
+		for (size_t y = first; y < last; y++) {
+			uint16_t const* row = master.ptr<uint16_t>(y);
+			for (int x = 0; x < master.cols; x++) {
+				for (int c = 0; c < channels; c++) {
+					int d = row[(x * channels) + c] - neighbor_median(master, x, y, c, step);
+					h[abs(d)]++;
+				}
+			}
+		}
+		std::lock_guard<std::mutex> lock(histogram_mutex);
+		for (size_t i = 0; i < h.size(); i++)
+			histogram[i] += h[i];
+	});
+	size_t half = (pixels * channels) / 2, count = 0;
+	int mad = 0;
+	while (mad < 65535 && (count += histogram[mad]) < half)
+		mad++;
+	int threshold = std::max(cf->hot_minimum, (int) ceil(cf->hot_sigma * 1.4826 * mad));
+
+	std::vector<cv::Point> hot;
+	for (int y = 0; y < master.rows; y++) {
+		uint16_t const* row = master.ptr<uint16_t>(y);
+		for (int x = 0; x < master.cols; x++) {
+			for (int c = 0; c < channels; c++) {
+				if (row[(x * channels) + c] - neighbor_median(master, x, y, c, step) > threshold) {
+					hot.push_back(cv::Point(x, y));
+					break;
+				}
+			}
+		}
+	}
+
+	std::string tmp_file = cf->dst_hot_pixels + ".tmp";
+	FILE *fp = fopen(tmp_file.c_str(), "w");
+	if (fp == NULL) {
+		fprintf(stderr, "ERROR: could not save hot pixel map '%s': %s\n", cf->dst_hot_pixels.c_str(), strerror(errno));
+		return(false);
+	}
+	fprintf(fp, "# %d hot pixels in %dx%d %sdark at temperature %s, threshold %d\n",
+		(int) hot.size(), master.cols, master.rows, cf->bayer ? "Bayer " : "", cf->temperature.c_str(), threshold);
+	for (cv::Point const& p : hot)
+		fprintf(fp, "%d %d\n", p.x, p.y);
+	if (fclose(fp) != 0 || rename(tmp_file.c_str(), cf->dst_hot_pixels.c_str()) != 0) {
+		fprintf(stderr, "ERROR: could not save hot pixel map '%s': %s\n", cf->dst_hot_pixels.c_str(), strerror(errno));
+		unlink(tmp_file.c_str());
+		return(false);
+	}
+
+	if (cf->verbose)
+		fprintf(stderr, "Saved %d hot pixels to '%s'\n", (int) hot.size(), cf->dst_hot_pixels.c_str());
+	if (hot.size() > pixels / 100)
+		fprintf(stderr, "WARNING: %d%% of the pixels are hot; is '%s' a dark?\n",
+			(int) ((100 * hot.size()) / pixels), cf->img_src_dir.c_str());
+	return(true);
+}
+
+void parse_args(int, char**, struct config_t*);
+void usage_and_exit(int);
+
+void parse_args(int argc, char** argv, struct config_t* cf) {
+	int c, tmp, ncpu = std::thread::hardware_concurrency();
+
+	cf->verbose = 0;
+	cf->method = METHOD_MEDIAN;
+	cf->sigma = 3.0;
+	cf->max_frames = 100;
+	cf->memory_mb = 128;
+	cf->bayer = false;
+	cf->hot_sigma = 6.0;
+	cf->hot_minimum = 1000;
+	cf->nice_level = 10;
+	cf->num_threads = ncpu;
+
+	while (1) {		// getopt loop
+		int option_index = 0;
+		static struct option long_options[] = {
+			{"directory", required_argument, 0, 'd'},
+			{"extension", required_argument, 0, 'e'},
+			{"output", required_argument, 0, 'o'},
+			{"temperature", required_argument, 0, 't'},
+			{"method", required_argument, 0, 'm'},
+			{"sigma", required_argument, 0, 's'},
+			{"max-frames", required_argument, 0, 'n'},
+			{"memory", required_argument, 0, 'M'},
+			{"hot-pixels", required_argument, 0, 'p'},
+			{"bayer", no_argument, 0, 'b'},
+			{"hot-sigma", required_argument, 0, 'k'},
+			{"hot-minimum", required_argument, 0, 'z'},
+			{"max-threads", required_argument, 0, 'Q'},
+			{"nice-level", required_argument, 0, 'q'},
+			{"verbose", no_argument, 0, 'v'},
+			{"help", no_argument, 0, 'h'},
+			{0, 0, 0, 0}
+		};
+
+		c = getopt_long(argc, argv, "hvbd:e:o:t:m:s:n:M:p:k:z:Q:q:", long_options, &option_index);
+		if (c == -1)
+			break;
+
+		switch (c) {
+			case 'h':
+				usage_and_exit(0);
+				// NOTREACHED
+				break;
+			case 'v':
+				cf->verbose++;
+				break;
+			case 'd':
+				cf->img_src_dir = optarg;
+				break;
+			case 'e':
+				cf->img_src_ext = optarg;
+				break;
+			case 'o':
+				cf->dst_master = optarg;
+				break;
+			case 't':
+				cf->temperature = optarg;
+				break;
+			case 'm':
+				if (strcmp(optarg, "median") == 0)
+					cf->method = METHOD_MEDIAN;
+				else if (strcmp(optarg, "sigma") == 0)
+					cf->method = METHOD_SIGMA;
+				else {
+					fprintf(stderr, "ERROR: Invalid method '%s'. Must be 'median' or 'sigma'; exiting\n", optarg);
+					usage_and_exit(1);
+				}
+				break;
+			case 's':
+				cf->sigma = atof(optarg);
+				if (cf->sigma <= 0) {
+					fprintf(stderr, "ERROR: Invalid sigma %s. Must be greater than 0; exiting\n", optarg);
+					usage_and_exit(1);
+				}
+				break;
+			case 'n':
+				tmp = atoi(optarg);
+				if (tmp >= 1)
+					cf->max_frames = tmp;
+				else
+					fprintf(stderr, "WARNING: Invalid maximum number of frames %d; using %d\n", tmp, cf->max_frames);
+				break;
+			case 'M':
+				tmp = atoi(optarg);
+				if (tmp >= 1)
+					cf->memory_mb = tmp;
+				else
+					fprintf(stderr, "WARNING: Invalid memory size %d; using %d MB\n", tmp, cf->memory_mb);
+				break;
+			case 'p':
+				cf->dst_hot_pixels = optarg;
+				break;
+			case 'b':
+				cf->bayer = true;
+				break;
+			case 'k':
+				cf->hot_sigma = atof(optarg);
+				if (cf->hot_sigma <= 0) {
+					fprintf(stderr, "ERROR: Invalid hot pixel sigma %s. Must be greater than 0; exiting\n", optarg);
+					usage_and_exit(1);
+				}
+				break;
+			case 'z':
+				tmp = atoi(optarg);
+				if (tmp >= 0 && tmp <= 65535)
+					cf->hot_minimum = tmp;
+				else
+					fprintf(stderr, "WARNING: Invalid hot pixel minimum %d; using %d\n", tmp, cf->hot_minimum);
+				break;
+			case 'Q':
+				tmp = atoi(optarg);
+				if ((tmp >= 1) && (tmp <= ncpu))
+					cf->num_threads = tmp;
+				else
+					fprintf(stderr, "WARNING: Invalid number of threads %d; using %d\n", tmp, cf->num_threads);
+				break;
+			case 'q':
+				tmp = atoi(optarg);
+				if (PRIO_MIN > tmp) {
+					tmp = PRIO_MIN;
+					fprintf(stderr, "WARNING: Clamping scheduler priority to PRIO_MIN (%d)\n", PRIO_MIN);
+				} else if (PRIO_MAX < tmp) {
+					fprintf(stderr, "WARNING: Clamping scheduler priority to PRIO_MAX (%d)\n", PRIO_MAX);
+					tmp = PRIO_MAX;
+				}
+				cf->nice_level = tmp;
+				break;
+			default:
+				break;
+		}	// option switch
+	}		// getopt loop
+}
+
+void usage_and_exit(int x) {
+	std::cout << "Usage: darkmaster [-v] -d <dir> -e <ext> -o <output.png> [-t <temperature>]"
+		" [-m median|sigma] [-s <sigma>] [-n <max-frames>] [-M <MB>] [-p <hot-pixels> [-b] [-k <sigma>] [-z <min>]]"
+		" [-Q <max-threads>] [-q <nice>]" << std::endl;
+	if (x) {
+		std::cout << KRED
+			<< "Source directory, file extension, and output file are always required."
+			<< KNRM << std::endl;
+	}
+
+	std::cout << std::endl << "Arguments:" << std::endl;
+	std::cout << "-h | --help : display this help, then exit" << std::endl;
+	std::cout << "-v | --verbose : increase log verbosity" << std::endl;
+	std::cout << "-d | --directory <str> : directory from which to read dark frames" << std::endl;
+	std::cout << "-e | --extension <str> : filter dark frames to just this extension" << std::endl;
+	std::cout << "-o | --output <str> : master dark filename; always a 16-bit PNG" << std::endl;
+	std::cout << "-t | --temperature <str> : temperature saved in the master (name of the directory)" << std::endl;
+	std::cout << "-m | --method <str> : 'median' or 'sigma' for sigma-clipped mean (median)" << std::endl;
+	std::cout << "-s | --sigma <float> : with '-m sigma', ignore values this many standard deviations from the mean (3.0)" << std::endl;
+	std::cout << "-n | --max-frames <int> : use at most this many of the newest frames (100)" << std::endl;
+	std::cout << "-M | --memory <int> : approximate MB of memory for frame data (128)" << std::endl;
+	std::cout << "-p | --hot-pixels <str> : also save the hot pixels in the master to this file" << std::endl;
+	std::cout << "-b | --bayer : the frames are Bayer mosaics so compare pixels to those 2 pixels away" << std::endl;
+	std::cout << "-k | --hot-sigma <float> : hot pixels are this many standard deviations brighter than their neighbors (6.0)" << std::endl;
+	std::cout << "-z | --hot-minimum <int> : hot pixels are at least this much brighter, out of 65535 (1000)" << std::endl;
+	std::cout << "-Q | --max-threads <int> : limit maximum number of processing threads (all cpus)" << std::endl;
+	std::cout << "-q | --nice <int> : nice(2) level of processing threads (10)" << std::endl;
+
+	std::cout << std::endl;
+	std::cout << "ex: darkmaster -d ../darks/frames/25 -e jpg -o ../darks/25.png" << std::endl;
+	exit(x);
+}
+
+int main(int argc, char* argv[]) {
+	struct config_t& cf = config;
+	int r;
+
+	parse_args(argc, argv, &cf);
+
+	if (cf.img_src_dir.empty() || cf.img_src_ext.empty() || cf.dst_master.empty())
+		usage_and_exit(3);
+
+	r = setpriority(PRIO_PROCESS, 0, cf.nice_level);
+	if (r) {
+		cf.nice_level = getpriority(PRIO_PROCESS, 0);
+		fprintf(stderr, "unable to set nice level: %s\n", strerror(errno));
+	}
+
+	if (cf.temperature.empty()) {
+		std::string d = cf.img_src_dir;
+		while (d.size() > 1 && d.back() == '/')
+			d.pop_back();
+		cf.temperature = d.substr(d.find_last_of('/') + 1);
+	}
+
+	size_t slash = cf.dst_master.find_last_of('/');
+	temp_dir = slash == std::string::npos ? "." : slash == 0 ? "/" : cf.dst_master.substr(0, slash);
+
+	// Find files.  Their names are times so the newest are last.
+	glob_t files;
+	std::string wildcard = cf.img_src_dir + "/*." + cf.img_src_ext;
+	glob(wildcard.c_str(), 0, NULL, &files);
+	size_t nfiles = files.gl_pathc;
+	if (nfiles == 0) {
+		globfree(&files);
+		std::cout << "ERROR: No dark frames found, exiting." << std::endl;
+		exit(1);
+	}
+
+	std::vector<frame_t> all_frames(std::min(nfiles, (size_t) cf.max_frames));
+	for (size_t i = 0; i < all_frames.size(); i++)
+		all_frames[i].filename = files.gl_pathv[nfiles - all_frames.size() + i];
+	globfree(&files);
+
+	// Use the frames that are the same as the first one that could be read.
+	std::vector<frame_t*> frames;
+	for (frame_t& f : all_frames) {
+		if (! open_frame(&f))
+			continue;
+		if (! frames.empty()) {
+			frame_t *first = frames[0];
+			if (f.width != first->width || f.height != first->height ||
+				f.channels != first->channels || f.depth != first->depth) {
+				fprintf(stderr, "%s: %dx%d, %d channel(s) does not match %dx%d, %d channel(s); ignoring file\n",
+					f.filename.c_str(), f.width, f.height, f.channels,
+					first->width, first->height, first->channels);
+				close_frame(&f);
+				continue;
+			}
+		}
+		frames.push_back(&f);
+	}
+	if (frames.empty()) {
+		std::cout << "ERROR: No usable dark frames found, exiting." << std::endl;
+		exit(1);
+	}
+
+	int width = frames[0]->width, height = frames[0]->height, channels = frames[0]->channels;
+	int depth = frames[0]->depth;
+	size_t row_values = (size_t) width * channels;
+	size_t row_bytes = row_values * (depth == CV_16U ? 2 : 1);
+
+	// As many rows at a time as fit in the memory given.
+	size_t band_rows = ((size_t) cf.memory_mb * 1024 * 1024) / (row_bytes * frames.size());
+	band_rows = std::max((size_t) 1, std::min(band_rows, (size_t) height));
+	if (cf.verbose) {
+		fprintf(stderr, "Stacking %d dark frame(s) of %dx%d, %d channel(s), %d bits using the %s, %d rows at a time\n",
+			(int) frames.size(), width, height, channels, depth == CV_16U ? 16 : 8,
+			cf.method == METHOD_MEDIAN ? "median" : "sigma-clipped mean", (int) band_rows);
+	}
+
+	cv::Mat master(height, width, CV_16UC(channels));
+	for (int y = 0; y < height; y += band_rows) {
+		int rows = std::min((int) band_rows, height - y);
+
+		// Each thread decodes the next frame not yet done.
+		std::atomic<size_t> next_frame(0);
+		run_threads(cf.num_threads, frames.size(), [&](size_t, size_t) {
+			size_t f;
+			while ((f = next_frame++) < frames.size())
+				read_band(frames[f], rows);
+		});
+
+		uint16_t *out = master.ptr<uint16_t>(y);
+		run_threads(cf.num_threads, rows * row_values, [&](size_t first, size_t last) {
+			stack_worker(&cf, &frames, depth, first, last, out);
+		});
+
+		if (cf.verbose > 1)
+			fprintf(stderr, "\r%d%%", (int) ((100L * (y + rows)) / height));
+	}
+	if (cf.verbose > 1)
+		fprintf(stderr, "\n");
+
+	int used = 0;
+	for (frame_t *f : frames) {
+		if (f->ok)
+			used++;
+		close_frame(f);
+	}
+
+	std::vector<unsigned char> png;
+	std::vector<int> compression_params = { cv::IMWRITE_PNG_COMPRESSION, 3 };
+	if (! cv::imencode(".png", master, png, compression_params)) {
+		fprintf(stderr, "ERROR: could not encode master dark\n");
+		exit(2);
+	}
+	char sigma[50];
+	snprintf(sigma, sizeof(sigma), "sigma-clipped mean, %.1f sigma", cf.sigma);
+	add_png_text(png, {
+		{ "Frames", std::to_string(used) },
+		{ "Temperature", cf.temperature },
+		{ "Method", cf.method == METHOD_MEDIAN ? "median" : sigma },
+		{ "Software", "allsky darkmaster" } });
+
+	// The capture program may be reading the darks directory so never leave a partial file.
+	std::string tmp_file = cf.dst_master + ".tmp";
+	FILE *fp = fopen(tmp_file.c_str(), "wb");
+	bool ok = fp != NULL && fwrite(png.data(), 1, png.size(), fp) == png.size();
+	if (fp != NULL && fclose(fp) != 0)
+		ok = false;
+	if (! ok || rename(tmp_file.c_str(), cf.dst_master.c_str()) != 0) {
+		fprintf(stderr, "ERROR: could not save master dark '%s': %s\n", cf.dst_master.c_str(), strerror(errno));
+		unlink(tmp_file.c_str());
+		exit(2);
+	}
+
+	if (cf.verbose)
+		fprintf(stderr, "Saved master dark '%s' from %d frame(s)\n", cf.dst_master.c_str(), used);
+
+	if (! cf.dst_hot_pixels.empty() && ! save_hot_pixels(&cf, master))
+		exit(2);
+
+	exit(0);
+}
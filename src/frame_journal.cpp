@@ -0,0 +1,179 @@
+// Read and write the journal of frames saved in a <date> directory.
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stddef.h>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "include/frame_journal.h"
+
+#define JOURNAL_MAGIC			"ASFRAMES"
+#define JOURNAL_VERSION			1
+
+struct journalHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t recordSize;
+};
+
+static uint32_t crc32(unsigned char const *p, size_t n)
+{
+	static uint32_t const *table = []()
+	{
+		static uint32_t t[256];
+		for (uint32_t i = 0; i < 256; i++)
+		{
+			uint32_t c = i;
+			for (int k = 0; k < 8; k++)
+				c = (c & 1) ? (0xEDB88320 ^ (c >> 1)) : (c >> 1);
+			t[i] = c;
+		}
+		return(t);
+	}();
+
+	uint32_t crc = 0xFFFFFFFF;
+	for (size_t i = 0; i < n; i++)
+		crc = table[(crc ^ p[i]) & 0xFF] ^ (crc >> 8);
+	return(~crc);
+}
+
+static uint32_t recordCrc(frameRecord const &record)
+{
+	return(crc32((unsigned char const *) &record, offsetof(frameRecord, crc)));
+}
+
+static bool validHeader(journalHeader const &header)
+{
+	return(memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) == 0 &&
+		header.version == JOURNAL_VERSION && header.recordSize == sizeof(frameRecord));
+}
+
+static std::mutex journalMutex;
+static int journalFd					= -1;
+static std::string journalDir;
+
+// Open the journal in "dir", starting a new one if it doesn't exist or isn't usable,
+// and trimming any partial record at the end.
+static bool openJournal(std::string const &dir, std::string &error)
+{
+	std::string file = dir + "/" + FRAME_JOURNAL_NAME;
+	int fd = open(file.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (fd == -1)
+	{
+		error = "Unable to open '" + file + "': " + strerror(errno);
+		return(false);
+	}
+
+	struct stat s;
+	journalHeader header;
+	bool ok = fstat(fd, &s) == 0;
+	if (ok && (s.st_size < (off_t) sizeof(header) ||
+		pread(fd, &header, sizeof(header), 0) != (ssize_t) sizeof(header) || ! validHeader(header)))
+	{
+		memset(&header, 0, sizeof(header));
+		memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+		header.version = JOURNAL_VERSION;
+		header.recordSize = sizeof(frameRecord);
+		ok = ftruncate(fd, 0) == 0 && write(fd, &header, sizeof(header)) == (ssize_t) sizeof(header);
+	}
+	else if (ok)
+	{
+		off_t partial = (s.st_size - sizeof(header)) % sizeof(frameRecord);
+		if (partial != 0)
+			ok = ftruncate(fd, s.st_size - partial) == 0;
+	}
+	if (! ok)
+	{
+		error = "Unable to initialize '" + file + "': " + strerror(errno);
+		close(fd);
+		return(false);
+	}
+
+	journalFd = fd;
+	journalDir = dir;
+	return(true);
+}
+
+bool appendFrameRecord(std::string const &dir, frameRecord &record, std::string &error)
+{
+	std::lock_guard<std::mutex> lock(journalMutex);
+
+	if (journalFd != -1 && dir != journalDir)
+	{
+		close(journalFd);
+		journalFd = -1;
+	}
+	if (journalFd == -1 && ! openJournal(dir, error))
+		return(false);
+
+	record.crc = recordCrc(record);
+	if (write(journalFd, &record, sizeof(record)) != (ssize_t) sizeof(record))
+	{
+		error = std::string("Unable to append to '") + dir + "/" + FRAME_JOURNAL_NAME + "': " + strerror(errno);
+		// Reopening trims what was written.
+		close(journalFd);
+		journalFd = -1;
+		return(false);
+	}
+	return(true);
+}
+
+std::unordered_map<std::string, frameRecord> readFrameJournal(std::string const &dir)
+{
+	std::unordered_map<std::string, frameRecord> records;
+
+	std::string file = dir + "/" + FRAME_JOURNAL_NAME;
+	FILE *f = fopen(file.c_str(), "rb");
+	if (f == NULL)
+		return(records);
+
+	journalHeader header;
+	if (fread(&header, sizeof(header), 1, f) == 1 && validHeader(header))
+	{
+		std::vector<frameRecord> buffer(256);
+		size_t n;
+		while ((n = fread(buffer.data(), sizeof(frameRecord), buffer.size(), f)) > 0)
+		{
+			for (size_t i = 0; i < n; i++)
+			{
+				frameRecord const &r = buffer[i];
+				if (r.crc == recordCrc(r) && memchr(r.name, '\0', sizeof(r.name)) != NULL)
+					records[r.name] = r;
+			}
+		}
+	}
+	fclose(f);
+
+	return(records);
+}
+
+frameRecord const *findFrameRecord(std::unordered_map<std::string, frameRecord> const &journal,
+	char const *filename)
+{
+	char const *name = strrchr(filename, '/');
+	auto r = journal.find(name == NULL ? filename : name + 1);
+	return(r == journal.end() ? NULL : &r->second);
+}
+
+frameRecord const *savedFrameRecord(std::unordered_map<std::string, frameRecord> const &journal,
+	char const *filename, int channels, int width, int height)
+{
+	frameRecord const *record = findFrameRecord(journal, filename);
+	if (record == NULL)
+		return(NULL);
+
+	if (! (record->flags & FRAME_FINAL) || record->mean < 0 || record->width == 0 || record->height == 0)
+		return(NULL);
+	if (channels != 0 && record->channels != channels)
+		return(NULL);
+	if (width != 0 && height != 0 && ((int) record->width != width || (int) record->height != height))
+		return(NULL);
+	return(record);
+}
@@ -0,0 +1,139 @@
+// Fix hot pixels listed in a map.
+// Most of the defects in nighttime images are a few thousand hot pixels, so fixing
+// only them takes a tiny fraction of the time needed to subtract a dark from every pixel,
+// and doesn't need a dark at the sensor's temperature.
+
+#include <opencv2/core.hpp>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+#include <vector>
+
+#include "include/allsky_common.h"
+#include "include/hot_pixels.h"
+
+static std::vector<cv::Point> hotPixels;
+static cv::Size hotPixelsSize;				// size of the images the map is for, if known
+static bool warnedSize					= false;
+static time_t hotPixelsModified			= 0;
+
+// Read the map if it changed.
+static void readHotPixels(config const &cg)
+{
+	struct stat s;
+	if (stat(cg.hotPixelsFile, &s) != 0)
+	{
+		static bool showedMessage = false;
+		if (! showedMessage)
+		{
+			Log(1, "*** %s: WARNING: Unable to read hot pixel map '%s': %s\n", cg.ME, cg.hotPixelsFile, strerror(errno));
+			showedMessage = true;
+		}
+		hotPixels.clear();
+		hotPixelsModified = 0;
+		return;
+	}
+	if (s.st_mtime == hotPixelsModified)
+		return;
+	hotPixelsModified = s.st_mtime;
+
+	FILE *f = fopen(cg.hotPixelsFile, "r");
+	if (f == NULL)
+		return;
+
+	hotPixels.clear();
+	hotPixelsSize = cv::Size();
+	warnedSize = false;
+	char line[100];
+	while (fgets(line, sizeof(line), f) != NULL)
+	{
+		int x, y;
+		char const *in;
+		if (line[0] != '#')
+		{
+			if (sscanf(line, "%d %d", &x, &y) == 2 && x >= 0 && y >= 0)
+				hotPixels.push_back(cv::Point(x, y));
+		}
+		else if (hotPixelsSize.width == 0 && (in = strstr(line, " in ")) != NULL &&
+			sscanf(in, " in %dx%d", &x, &y) == 2)
+		{
+			hotPixelsSize = cv::Size(x, y);
+		}
+	}
+	fclose(f);
+	Log(4, "  > Read %'d hot pixels for %dx%d images from '%s'.\n",
+		(int) hotPixels.size(), hotPixelsSize.width, hotPixelsSize.height, cg.hotPixelsFile);
+}
+
+template<typename T>
+static void fixPixels(cv::Mat &image, int step)
+{
+	int const channels = image.channels();
+	T values[8];
+
+	for (cv::Point const &p : hotPixels)
+	{
+		if (p.x >= image.cols || p.y >= image.rows)
+			continue;
+
+		for (int c = 0; c < channels; c++)
+		{
+			int n = 0;
+			for (int dy = -step; dy <= step; dy += step)
+			{
+				int y = p.y + dy;
+				if (y < 0 || y >= image.rows)
+					continue;
+				T const *row = image.ptr<T>(y);
+				for (int dx = -step; dx <= step; dx += step)
+				{
+					int x = p.x + dx;
+					if ((dx == 0 && dy == 0) || x < 0 || x >= image.cols)
+						continue;
+					values[n++] = row[(x * channels) + c];
+				}
+			}
+			if (n == 0)
+				continue;
+			std::nth_element(values, values + (n / 2), values + n);
+			image.ptr<T>(p.y)[(p.x * channels) + c] = values[n / 2];
+		}
+	}
+}
+
+bool fixHotPixels(cv::Mat &image, config const &cg)
+{
+	if (cg.hotPixelsFile == NULL)
+		return(false);
+
+	readHotPixels(cg);
+	if (hotPixels.empty())
+		return(false);
+
+	// A map made before the binning, resolution, or ROI changed would fix the wrong pixels.
+	if (hotPixelsSize.width != 0 && hotPixelsSize != cv::Size(image.cols, image.rows))
+	{
+		if (! warnedSize)
+		{
+			Log(1, "*** %s: WARNING: Hot pixel map '%s' is for %dx%d images, not %dx%d; not using it.\n",
+				cg.ME, cg.hotPixelsFile, hotPixelsSize.width, hotPixelsSize.height, image.cols, image.rows);
+			warnedSize = true;
+		}
+		return(false);
+	}
+
+	// The neighbors of the same color in a Bayer mosaic are 2 pixels away.
+	// allsky.sh tells darkmaster the darks are Bayer mosaics for the same image types.
+	bool bayer = image.channels() == 1 && cg.isColorCamera &&
+		(cg.imageType == IMG_RAW8 || cg.imageType == IMG_RAW16);
+	int step = bayer ? 2 : 1;
+
+	if (image.depth() == CV_16U)
+		fixPixels<uint16_t>(image, step);
+	else
+		fixPixels<uint8_t>(image, step);
+
+	return(true);
+}
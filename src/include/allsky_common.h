@@ -36,6 +36,9 @@
 // Defaults
 #define NO_MAX_VALUE				9999999		// signifies a number has no maximum value
 #define AUTO_IMAGE_TYPE				99	// must match what's in the camera_settings.json file
+#define MAX_SAVE_BUFFERS			10	// max number of images waiting to be saved, ZWO only
+#define MAX_HISTOGRAM_SAMPLING		16	// max rows/columns to skip when calculating the mean, ZWO only
+#define MAX_STATS_THREADS			4	// max threads computeImageStats() uses
 
 #define DEFAULT_DAYMEAN_RPi				0.5	// target value
 #define DEFAULT_DAYMEAN_THRESHOLD_RPi	0.1	// mean brightness must be within this % to be "ok"
@@ -91,6 +94,15 @@ enum cameraType {
 	ctRPi
 };
 
+// Stages of taking and processing an image, for timing.
+enum imageStage {
+	stExposure,
+	stHistogram,
+	stOverlay,
+	stSave,
+	stNumStages
+};
+
 // Use long instead of int so we can use validateLong() without creating validateInt().
 struct overlay {
 	char const *ImgText					= "";
@@ -140,9 +152,41 @@ struct HB {
 	int topOfBox						= NOT_SET;		// top left pixel (calculated value)
 	int rightOfBox						= NOT_SET;		// bottom right pixel (calculated value)
 	int bottomOfBox						= NOT_SET;		// bottom right pixel (calculated value)
+	long sampling						= 1;			// only use every Nth row and column
 	char const *sArgs					= "500 500 50 50";		// string version of arguments
 };
 
+// Processing done to images before they are saved.
+// These are the IMG_RESIZE, CROP_*, and AUTO_STRETCH* settings in config.sh.
+struct processing {
+	bool resize							= false;
+	long width							= NOT_SET;
+	long height							= NOT_SET;
+	bool crop							= false;
+	long cropWidth						= NOT_SET;
+	long cropHeight						= NOT_SET;
+	long cropOffsetX					= 0;			// from the center
+	long cropOffsetY					= 0;
+	bool stretch						= false;		// nighttime only
+	double stretchAmount				= 10;
+	double stretchMidPoint				= 10;			// percent
+	bool stretchAdaptive				= false;		// mid point from each image's histogram
+};
+
+// Other files written from the image when it's saved, so saveImage.sh doesn't have to make them.
+// These are only written if nothing changes the image after the capture program saves it.
+struct outputs {
+	char const *imagesDir				= NULL;			// the <date> directories are here
+	bool imageIsFinal					= false;		// post-processing doesn't change the image
+	bool thumbnails						= false;		// IMG_CREATE_THUMBNAILS
+	long thumbnailWidth					= 100;
+	long thumbnailHeight				= 75;
+	bool resizeUploads					= false;		// RESIZE_UPLOADS, and images are uploaded
+	long uploadWidth					= NOT_SET;
+	long uploadHeight					= NOT_SET;
+	long liveKeogram					= 0;			// write the night's keogram every this many images
+};
+
 struct myModeMeanSetting {
 	bool modeMean						= false;		// currently using it?
 	double dayMean						= NOT_SET;		// initialized at runtime
@@ -292,15 +336,28 @@ struct config {			// for configuration variables
 	char const *longitude				= NULL;
 	float angle							= -6.0;
 	bool takeDarkFrames					= false;
+	bool useDarkFrames					= false;			// subtract darks from nighttime images
+	char const *darksDir				= NULL;				// where the darks are
+	bool hotPixels						= false;			// fix hot pixels in nighttime images
+	char const *hotPixelsFile			= NULL;				// map of the hot pixels
 	char const *locale					= NULL;
 	long debugLevel						= 1;
 	bool consistentDelays				= true;
 	bool videoOffBetweenImages			= true;
+	bool snapshotMode					= false;			// ZWO only: overlap exposures with processing
+	bool streamingMode					= false;			// ZWO only: leave video running, no flushing
+	long saveBuffers					= 3;				// # of images that can be waiting to be saved
+	bool parallelJpeg					= false;			// encode JPEGs using all CPU cores
+	char const *benchmarkJpeg			= NULL;				// time encoding this file, then exit
+	char const *benchmarkStats			= NULL;				// time computeImageStats() on this file, then exit
+	char const *replay					= NULL;				// Directory of images to use instead of camera
 	char const *ASIversion				= "UNKNOWN";		// calculated value
 
 	struct overlay overlay;
 	struct myModeMeanSetting myModeMeanSetting;
 	struct HB HB;							// Histogram Box, ZWO only
+	struct processing PP;					// Post-processing
+	struct outputs OUT;						// Files written from each image
 
 	// Default values used in multiple places, so get just once.
 	// Only include variables that we pass to the capture routine/program.
@@ -343,9 +400,41 @@ struct config {			// for configuration variables
 	long lastAsiBandwidth				= NOT_SET;
 	double lastMean						= NOT_SET;
 	double lastMeanFull					= NOT_SET;
+	double lastMedianFull				= NOT_SET;		// 0.0 to 1.0
+	double lastBoxMean					= NOT_SET;		// 0.0 to 1.0
 	bool goodLastExposure				= false;		// Was the last image propery exposed?
 };
 
+// Statistics for an image, all calculated in one pass by computeImageStats().
+// Means are 0.0 to 1.0 except the "Bin" ones, which are histogram bins (0 - 255).
+struct imageStats {
+	unsigned int histogram[256];		// of the region of interest, using the average of the channels
+	int roiMeanBin;						// mean bin of the region of interest
+	int fullMeanBin;					// mean bin of the whole image
+	double roiMean;						// region of interest
+	double fullMean;					// whole image
+	double fullMedian;					// whole image, from its histogram
+	double channelMeans[3];				// whole image; blue, green, red for color images
+	double saturatedFraction;			// pixels with any channel at the maximum value
+	double blackFraction;				// pixels with all channels 0
+	double focus;						// variance of the Laplacian, or NOT_SET
+};
+
+// The files writeImage() wrote in addition to the image, or "" if not written.
+struct savedImages {
+	std::string copy;						// in the <date> directory
+	std::string thumbnail;
+	std::string upload;						// resized for uploading
+	// Of the saved image:
+	cv::Mat slit;							// middle column, for the keogram
+	double mean								= NOT_SET;	// 0.0 to 1.0, average of the channels
+	double channelMeans[3]					= { NOT_SET, NOT_SET, NOT_SET };
+	int width								= 0;
+	int height								= 0;
+	int channels							= 0;
+	int bitDepth							= 0;
+};
+
 // Global variables and functions.
 extern char debug_text[];
 extern char allskyHome[];
@@ -363,7 +452,12 @@ timeval getTimeval();
 char *formatTime(timeval, char const *);
 char *getTime(char const *);
 std::string exec(const char *);
-void add_variables_to_command(config, char *, timeval);
+bool willProcessImage(config const &, char const *);
+bool correctImage(cv::Mat &, config const &, char const *);
+bool processImage(cv::Mat &, config const &, char const *);
+bool writeImage(cv::Mat const &, config const &, char const *, std::vector<int> const &, savedImages *);
+void setSavedImageStats(cv::Mat const &, savedImages *, imageStats const * = NULL);
+void postProcessImage(config const &, char const *, timeval, savedImages const &);
 bool checkForValidExtension(config *);
 std::string calculateDayOrNight(const char *, const char *, float);
 int calculateTimeToNightTime(const char *, const char *, float);
@@ -374,7 +468,8 @@ char const *yesNo(bool);
 char *length_in_units(long, bool);
 int doOverlay(cv::Mat, config, char *, int);
 bool getBoolean(const char *);
-double get_focus_metric(cv::Mat);
+bool computeImageStats(cv::Mat const &, cv::Rect, bool, int, bool, imageStats *);
+void benchmarkStats(config const &, char const *);
 char const *getFlip(int);
 void closeUp(int);
 void IntHandle(int);
@@ -386,8 +481,13 @@ void displayHelp(config);
 void displaySettings(config);
 char *LorF(double, char const *, char const *);
 bool daytimeSleep(bool, config);
+long getDelayBetweenImages_us(config const &, long, std::string, bool = true);
 void delayBetweenImages(config, long, std::string);
+void startImageTiming();
+void endStageTiming(imageStage);
+void reportImageTiming();
 bool getCommandLineArguments(config *, int, char *[]);
+char const *getReplayArgument(int, char *[]);
 int displayNotificationImage(char const *);
 bool validateLatitudeLongitude(config *);
 void doLocale(config *);
@@ -0,0 +1,26 @@
+#pragma once
+
+// Check images for corruption and for being too dark or too bright, as removeBadImages.sh did.
+// This doesn't use anything from allsky_common so any program can use it.
+
+#include <string>
+
+struct badImageResult {
+	bool bad				= false;
+	std::string reason;				// why it's bad, in removeBadImages.sh's format
+	double mean				= -1;	// 0.0 to 1.0 if it could be determined
+};
+
+// The thresholds are percents (0 - 100) as strings so the messages show what the user entered.
+// A "low" of 0 and a "high" of 0 or over 100 disable the check.
+struct badImageThresholds {
+	std::string low			= "0";
+	std::string high		= "0";
+};
+
+// Check "file".  If "knownMean" is 0.0 to 1.0 it's the mean the capture program calculated
+// when it wrote the file, so the file isn't read.
+// Otherwise JPEG files are decoded at 1/8 size, which reads all the compressed data so
+// any corruption is found, but does much less work.
+badImageResult checkImage(std::string const &file, badImageThresholds const &thresholds,
+	double knownMean = -1);
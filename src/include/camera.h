@@ -0,0 +1,41 @@
+#pragma once
+
+// Interface to whatever takes the pictures.
+// capture_ZWO and capture_RPi each have a class for their real camera, and both can use
+// the "replay" camera, which returns images read from files (or made up) so the
+// capture loop can be run and timed on any Linux box without a camera attached.
+class Camera
+{
+public:
+	virtual ~Camera() {}
+
+	// Name used in messages.
+	virtual char const *name() = 0;
+
+	// Take one picture with the specified exposure and gain and put it in "image".
+	// If "image" already has data, the picture must be the same size and type since
+	// the caller may have pointers into it.
+	// Return 0 on success.
+	virtual int takeImage(config *cg, long exposure_us, double gain, cv::Mat *image) = 0;
+
+	// Start a picture in the background; takeImage() then waits for it and returns it.
+	// This lets the caller process the prior picture while the next one is exposing.
+	// Return false if the camera can't do that or the picture couldn't be started,
+	// in which case takeImage() takes the picture itself.
+	virtual bool startImage(config *cg, long exposure_us, double gain) { return(false); }
+
+	// Is there a picture from startImage() that takeImage() hasn't returned yet?
+	virtual bool imageStarted() { return(false); }
+
+	// If the picture takeImage() just returned started exposing before takeImage() was called,
+	// e.g., a video frame the camera was already taking, set "startTime" to when and return true.
+	virtual bool getImageStartTime(timeval *startTime) { return(false); }
+
+	// Set the cg->last* values to what the camera used for the picture just taken.
+	virtual void getLastValues(config *cg) = 0;
+
+	// Does takeImage() write the picture to cg->fullFilename?
+	virtual bool savesImageFile() { return(false); }
+};
+
+Camera *newReplayCamera(config *cg);
@@ -0,0 +1,13 @@
+#pragma once
+
+// Dark frames kept in memory and subtracted by the capture programs.
+// Darks are read from cg.darksDir, whose files are named "<temperature>.<ext>"
+// (as saved by darkCapture.sh) or "<temperature>_<exposure_us>us.<ext>".
+// The directory is checked before each image so new or changed darks are used
+// without restarting.
+
+// Subtract from "image" the dark for the sensor temperature and exposure in "cg".
+// The darks at the closest temperatures above and below are interpolated between,
+// and each is scaled by the ratio of the exposures if its exposure is known.
+// Return true if a dark was subtracted.
+bool subtractDark(cv::Mat &image, config const &cg);
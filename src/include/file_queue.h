@@ -0,0 +1,36 @@
+#pragma once
+
+// Hand out the numbers of the files a program processes to its worker threads a few at a time.
+// Files take very different times to process - some are rejected or skipped without being
+// decoded, some are on slow storage - so giving each thread an equal share up front leaves
+// threads idle while others finish.  Instead each thread takes the next few files whenever
+// it's done with its last ones.
+// This doesn't use anything from allsky_common or OpenCV so any program can use it.
+
+#include <atomic>
+#include <algorithm>
+
+struct file_queue {
+	std::atomic<unsigned long> next;
+	unsigned long count;
+	unsigned long chunk;				// files taken at a time
+
+	// Take a few files at a time to keep threads off the counter, but small enough
+	// that the threads all finish at about the same time.
+	file_queue(unsigned long num_files, int num_threads) : next(0), count(num_files)
+	{
+		chunk = std::max(1UL, std::min(8UL, num_files / (16UL * std::max(1, num_threads))));
+	}
+
+	// Set "first" and "last" to the next files to process and return true,
+	// or return false if all the files have been handed out.
+	bool take(unsigned long* first, unsigned long* last)
+	{
+		unsigned long f = next.fetch_add(chunk, std::memory_order_relaxed);
+		if (f >= count)
+			return(false);
+		*first = f;
+		*last = std::min(f + chunk, count) - 1;
+		return(true);
+	}
+};
@@ -0,0 +1,62 @@
+#pragma once
+
+// A journal of the frames saved in a <date> directory, written by the capture programs
+// so keogram, startrails, and other programs don't need to read or stat() every image
+// for what the capture program already knew.
+//
+// The journal is a header followed by fixed-size records, one per saved frame, only ever
+// appended to.  Each record is written with a single write() and has a CRC, so a record
+// cut short or garbled by a crash or power loss is ignored, and the writer trims a partial
+// record before appending after one.
+// The records are in the machine's byte order since they're read on the machine that wrote them.
+// This doesn't use anything from allsky_common or OpenCV so any program can use it.
+
+#include <stdint.h>
+#include <string>
+#include <unordered_map>
+
+#define FRAME_JOURNAL_NAME		"frames.journal"
+
+// frameRecord.flags
+#define FRAME_NIGHT				0x01
+#define FRAME_FINAL				0x02	// nothing changed the image after the capture program saved it,
+										// so the means and size are those of the file
+
+struct frameRecord {
+	int64_t start_us;					// exposure start, microseconds since the epoch
+	int64_t exposure_us;
+	float gain;
+	float sensorTemp;					// Celsius, or NAN if not known
+	float mean;							// whole image, 0.0 to 1.0, average of the channels
+	float boxMean;						// histogram box or region of interest, 0.0 to 1.0
+	float channelMeans[3];				// blue, green, red; all the same for mono images
+	float focus;						// or NAN if not calculated
+	uint32_t width;
+	uint32_t height;
+	uint8_t channels;
+	uint8_t bitDepth;					// 8 or 16
+	uint8_t flags;						// FRAME_*
+	uint8_t reserved;
+	char name[64];						// file name, without the directory
+	uint32_t crc;						// of everything above
+};
+static_assert(sizeof(frameRecord) == 128, "frameRecord must be 128 bytes");
+
+// Append "record" to the journal in "dir", setting its CRC.
+// The journal stays open until a record for a different directory is appended.
+// Return false and set "error" on failure.
+bool appendFrameRecord(std::string const &dir, frameRecord &record, std::string &error);
+
+// Return the valid records in the journal in "dir" by file name.
+// If a name is in the journal more than once the last record is used.
+// There are no records if the journal doesn't exist.
+std::unordered_map<std::string, frameRecord> readFrameJournal(std::string const &dir);
+
+// Return the record in "journal" for "filename", which may include its directory, or NULL.
+frameRecord const *findFrameRecord(std::unordered_map<std::string, frameRecord> const &journal,
+	char const *filename);
+
+// Return the record for "filename" if it describes the file as saved, with "channels"
+// channels (if not 0) and "width" x "height" pixels (if neither is 0); otherwise return NULL.
+frameRecord const *savedFrameRecord(std::unordered_map<std::string, frameRecord> const &journal,
+	char const *filename, int channels, int width, int height);
@@ -0,0 +1,12 @@
+#pragma once
+
+// Fix hot pixels listed in a map instead of subtracting a whole dark frame.
+// The map, cg.hotPixelsFile, has one "x y" pair per line and "#" comment lines;
+// darkmaster makes it from the master darks.
+// A comment with "in WxH" gives the size of the images the map is for; it isn't used for other sizes.
+// The map is read again if it changes.
+
+// Replace each hot pixel in "image" with the median of its neighbors of the same color.
+// Single-channel images from color cameras are Bayer mosaics so the neighbors are 2 pixels away.
+// Return true if any pixels were fixed.
+bool fixHotPixels(cv::Mat &image, config const &cg);
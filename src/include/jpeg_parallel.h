@@ -0,0 +1,17 @@
+#pragma once
+
+// Encode JPEG images using several threads.
+// The image is split into horizontal stripes that are encoded at the same time and then
+// joined into one baseline JPEG, with a restart marker after every row of MCUs so the
+// stripes can be decoded as one image.
+
+// Encode 8-bit, 1- or 3-channel (BGR) "image" with up to "numThreads" threads.
+// The output is the same as a single-threaded encode with a restart marker after every
+// row of MCUs, which is what OpenCV produces other than the restart markers.
+bool encodeParallelJpeg(cv::Mat const &image, int quality, int numThreads, std::vector<unsigned char> &jpeg);
+
+// Same as encodeParallelJpeg() but writes the JPEG to "file".
+bool writeParallelJpeg(char const *file, cv::Mat const &image, int quality, int numThreads);
+
+// Time writing the JPEG "file" with OpenCV and with 1 to numThreads threads.
+void benchmarkJpeg(config const &cg, char const *file);
@@ -0,0 +1,49 @@
+#pragma once
+
+// The keogram "slits" file in a <date> directory: the middle column of each saved image,
+// appended by the capture programs as each image is saved so keogram doesn't have to
+// read every image at the end of the night.
+//
+// The file is a header followed by one entry per image, each a slitInfo then the column's
+// pixels, top to bottom, in OpenCV's layout.  Space for entries is added in blocks so
+// "capacity" can be more than "count"; only the first "count" entries are valid.
+// The capture program updates "count" after writing an entry.
+// This doesn't use anything from allsky_common or OpenCV so any program can use it.
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define KEOGRAM_SLITS_NAME		"keogram.slits"
+#define KEOGRAM_SLITS_MAGIC		"ASSLITS"		// plus the NUL
+#define KEOGRAM_SLITS_VERSION	1
+
+struct slitFileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t width;						// of the images the slits are from
+	uint32_t height;					// of the images, so the length of a slit
+	uint32_t channels;
+	uint32_t bitDepth;					// 8 or 16
+	uint32_t count;						// number of valid entries
+	uint32_t capacity;					// number of entries there's room for
+	uint32_t reserved[7];
+};
+static_assert(sizeof(slitFileHeader) == 64, "slitFileHeader must be 64 bytes");
+
+struct slitInfo {
+	int64_t start_us;					// exposure start, microseconds since the epoch
+	char name[56];						// file name, without the directory
+};
+static_assert(sizeof(slitInfo) == 64, "slitInfo must be 64 bytes");
+
+// Bytes in one entry, rounded up so every slitInfo is aligned.
+inline size_t slitEntrySize(slitFileHeader const &h)
+{
+	size_t pixels = (size_t) h.height * h.channels * (h.bitDepth / 8);
+	return(sizeof(slitInfo) + ((pixels + 7) & ~(size_t) 7));
+}
+
+inline size_t slitEntryOffset(slitFileHeader const &h, size_t entry)
+{
+	return(sizeof(slitFileHeader) + (entry * slitEntrySize(h)));
+}
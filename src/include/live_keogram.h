@@ -0,0 +1,10 @@
+#pragma once
+
+// The keogram for the current night, built as images are saved.
+// The middle column of each saved image is appended to the memory-mapped slits file
+// (see keogram_slits.h) in the image's <date> directory, and the keogram made from
+// them is written every cg.OUT.liveKeogram images.
+// At the end of the night keogram uses the slits instead of reading every image.
+
+// Add the slit in "saved" to the slits file in "dateDir".
+void addToLiveKeogram(std::string const &dateDir, config const &cg, timeval startDateTime, savedImages const &saved);
@@ -57,5 +57,5 @@ struct modeMeanSetting {
 };
 
 bool aegInit(config, raspistillSetting &, modeMeanSetting &);
-float aegCalcMean(cv::Mat, bool);
+cv::Rect aegGetMeanRegion(cv::Size);
 void aegGetNextExposureSettings(config *, raspistillSetting &, modeMeanSetting &);
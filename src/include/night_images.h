@@ -0,0 +1,69 @@
+#pragma once
+
+// Read the images in a <date> directory.
+// Used by keogram, startrails, and nightproducts.
+
+#include <mutex>
+#include <string>
+#include <vector>
+#include <opencv2/core.hpp>
+
+#include "frame_journal.h"
+
+// Read all of "filename" into "buffer", which only grows.
+bool readFileContents(char const *filename, std::vector<unsigned char> *buffer);
+
+// Read "filename" into "image" and return true.
+// Return false if it can't be read, or if "width" and "height" aren't 0 and it's a different size.
+// If "buffer" is given it already holds the file, from readFileContents(), and is decoded
+// into "image"'s memory, which is only reallocated if the image doesn't fit.
+// If "verbose", say why an image can't be used, holding "stdioMutex" while printing.
+bool readNightImage(char const *filename, cv::Mat *image, int width, int height,
+	int verbose, std::mutex &stdioMutex, std::vector<unsigned char> const *buffer = NULL);
+
+// Return "image" with "channels" channels, converting it into "repaired" if it has a different number.
+cv::Mat matchChannels(cv::Mat const &image, int channels, cv::Mat *repaired);
+
+// Return the mean of "image" scaled to 0-1, using the brightest channel of color images.
+double nightImageMean(cv::Mat const &image);
+
+// Return the same mean as nightImageMean() from the capture program's record of an image.
+double nightRecordMean(frameRecord const &record);
+
+// Add "image" to the startrails in "accumulator" if its "mean" is at most "brightnessLimit",
+// and return true if it was added.
+bool addToStartrails(cv::Mat const &image, double mean, double brightnessLimit, cv::Mat *accumulator);
+
+// Add a thread's startrails to the combined one in "accumulator", which "mtx" protects.
+void mergeStartrails(cv::Mat const &threadAccumulator, cv::Mat *accumulator, std::mutex &mtx);
+
+// Descriptive statistics of the image means.
+struct nightStatistics {
+	double min, max, mean, median;
+	int minIndex;				// of the darkest image
+};
+
+// Calculate the statistics of "means", a row of image means with NAN for images
+// that weren't read, and return false if no images were read.
+bool getNightStatistics(cv::Mat const &means, nightStatistics *statistics);
+
+// Return the extension of a startrails file name, "png" or "jpg", or "" if it's neither.
+std::string startrailsExtension(std::string const &filename);
+
+// Save the startrails image and return true, or say why not and return false.
+bool saveStartrails(std::string const &filename, std::string const &extension, cv::Mat const &image);
+
+// Parsers for the command-line arguments the programs have in common.
+// Each one says what's wrong with an invalid argument.
+
+// "WxH"; both are 0 if it's invalid.
+void parseImageSize(char const *arg, int *width, int *height);
+
+// A brightness limit from 0 to 1; return false if it's invalid.
+bool parseBrightnessLimit(char const *arg, double *limit);
+
+// A number of threads up to the number of CPUs; "numThreads" is left alone if it's invalid.
+void parseNumThreads(char const *arg, int *numThreads);
+
+// A nice(2) level, clamped to the valid ones.
+int parseNiceLevel(char const *arg);
@@ -0,0 +1,16 @@
+#pragma once
+
+// Sunrise and sunset times, using the algorithm in sunwait (Paul Schlyter's sunriset.c).
+// This lets the capture programs decide if it's day or night without running sunwait.
+
+// Return values of sunRiseSet().
+#define SUN_RISES_AND_SETS		0
+#define SUN_ALWAYS_ABOVE		1
+#define SUN_ALWAYS_BELOW		-1
+
+// Calculate when the center of the sun crosses "altitude" degrees on the specified date.
+// "longitude" is negative west of Greenwich and "latitude" is negative south of the equator.
+// "rise" and "set" are hours after midnight UTC and may be less than 0 or more than 24.
+// If the sun is always above or below the altitude, both are the time the sun is due south.
+int sunRiseSet(int year, int month, int day, double longitude, double latitude,
+	double altitude, double *rise, double *set);
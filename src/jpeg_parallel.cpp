@@ -0,0 +1,314 @@
+// Encode JPEG images using several threads.
+// cv::imwrite() encodes with one thread, which takes over a second for a 20+ MP image on a Pi 4
+// and limits how short the delay between images can be.
+//
+// The image is split into horizontal stripes that are each a multiple of 8 rows of MCUs
+// (Minimum Coded Units - 16 rows of pixels for color images, 8 for grayscale).
+// Each stripe is encoded as its own JPEG, with the same settings and tables and a
+// restart marker after every row of MCUs.
+// Since the decoder resets at each restart marker, the encoded data of the stripes can be
+// joined, with a restart marker between them, after the header of the first stripe
+// (with the height changed to the whole image's).
+// Restart markers are numbered 0 - 7 so with stripes a multiple of 8 rows of MCUs
+// the markers within each stripe already have the right numbers.
+
+#include <opencv2/core.hpp>
+#include <opencv2/highgui.hpp>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <setjmp.h>
+#include <jpeglib.h>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "include/allsky_common.h"
+#include "include/jpeg_parallel.h"
+
+#define MCU_ROWS_PER_GROUP		8		// restart markers go from 0 to 7 then repeat
+#define MARKER_SOF0				0xC0
+#define MARKER_RST0				0xD0
+#define MARKER_SOI				0xD8
+#define MARKER_EOI				0xD9
+#define MARKER_SOS				0xDA
+
+// libjpeg calls exit() on errors unless we give it our own error handler.
+struct jpegError {
+	struct jpeg_error_mgr mgr;
+	jmp_buf jumpBuffer;
+	char message[JMSG_LENGTH_MAX];
+};
+
+static void jpegErrorExit(j_common_ptr cinfo)
+{
+	jpegError *err = (jpegError *) cinfo->err;
+	(*cinfo->err->format_message)(cinfo, err->message);
+	longjmp(err->jumpBuffer, 1);
+}
+
+// Encode "numRows" rows of "image" starting at "firstRow" as a complete JPEG.
+// If "restarts" is true a restart marker is added after every row of MCUs.
+static bool encodeStripe(cv::Mat const &image, int firstRow, int numRows, int quality,
+	bool restarts, std::vector<unsigned char> &jpeg, std::string &error)
+{
+	struct jpeg_compress_struct cinfo;
+	jpegError err;
+	unsigned char *buffer = NULL;
+	unsigned long size = 0;
+
+	cinfo.err = jpeg_std_error(&err.mgr);
+	err.mgr.error_exit = jpegErrorExit;
+	if (setjmp(err.jumpBuffer))
+	{
+		error = err.message;
+		jpeg_destroy_compress(&cinfo);
+		free(buffer);
+		return(false);
+	}
+
+	jpeg_create_compress(&cinfo);
+	jpeg_mem_dest(&cinfo, &buffer, &size);
+
+	cinfo.image_width = image.cols;
+	cinfo.image_height = numRows;
+	cinfo.input_components = image.channels();
+#ifdef JCS_EXTENSIONS
+	cinfo.in_color_space = image.channels() == 1 ? JCS_GRAYSCALE : JCS_EXT_BGR;
+#else
+	cinfo.in_color_space = image.channels() == 1 ? JCS_GRAYSCALE : JCS_RGB;
+	std::vector<unsigned char> rgb(image.channels() == 1 ? 0 : image.cols * 3);
+#endif
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_quality(&cinfo, quality, TRUE);
+	if (restarts)
+		cinfo.restart_in_rows = 1;
+
+	jpeg_start_compress(&cinfo, TRUE);
+	while (cinfo.next_scanline < cinfo.image_height)
+	{
+		JSAMPROW row = (JSAMPROW) image.ptr(firstRow + cinfo.next_scanline);
+#ifndef JCS_EXTENSIONS
+		if (! rgb.empty())
+		{
+			for (int x = 0; x < image.cols * 3; x += 3)
+			{
+				rgb[x] = row[x + 2];
+				rgb[x + 1] = row[x + 1];
+				rgb[x + 2] = row[x];
+			}
+			row = rgb.data();
+		}
+#endif
+		jpeg_write_scanlines(&cinfo, &row, 1);
+	}
+	jpeg_finish_compress(&cinfo);
+
+	jpeg_destroy_compress(&cinfo);
+	jpeg.assign(buffer, buffer + size);
+	free(buffer);
+	return(true);
+}
+
+// Find where the encoded data starts (after the SOS header) and where the height
+// is in the SOF0 header.
+static bool findScan(std::vector<unsigned char> const &jpeg, size_t *dataStart, size_t *heightOffset)
+{
+	*heightOffset = 0;
+	size_t i = 0;
+	while (i + 4 <= jpeg.size())
+	{
+		if (jpeg[i] != 0xFF)
+			return(false);
+
+		unsigned char marker = jpeg[i+1];
+		if (marker == MARKER_SOI)
+		{
+			i += 2;
+			continue;
+		}
+
+		size_t length = (jpeg[i+2] << 8) | jpeg[i+3];
+		if (marker == MARKER_SOF0)
+			*heightOffset = i + 5;		// after the length and sample precision
+		else if (marker == MARKER_SOS)
+		{
+			*dataStart = i + 2 + length;
+			return(*heightOffset != 0 && *dataStart + 2 <= jpeg.size());
+		}
+		i += 2 + length;
+	}
+	return(false);
+}
+
+bool encodeParallelJpeg(cv::Mat const &image, int quality, int numThreads, std::vector<unsigned char> &jpeg)
+{
+	if (image.depth() != CV_8U || (image.channels() != 1 && image.channels() != 3))
+	{
+		Log(0, "*** %s: ERROR: Only 8-bit, 1- or 3-channel images can be saved as JPEG.\n", CG.ME);
+		return(false);
+	}
+
+	// libjpeg's default for color is 2x2 chroma subsampling, like OpenCV's.
+	int mcuHeight = image.channels() == 1 ? DCTSIZE : 2 * DCTSIZE;
+	int groupHeight = MCU_ROWS_PER_GROUP * mcuHeight;
+	int numGroups = (image.rows + groupHeight - 1) / groupHeight;
+	int numStripes = std::max(1, std::min(numThreads, numGroups));
+
+	std::string error;
+	if (numStripes == 1)
+	{
+		if (encodeStripe(image, 0, image.rows, quality, false, jpeg, error))
+			return(true);
+		Log(0, "*** %s: ERROR: Unable to encode JPEG: %s\n", CG.ME, error.c_str());
+		return(false);
+	}
+
+	// Give each stripe the same number of groups of MCU rows, give or take one.
+	std::vector<int> firstRow(numStripes + 1);
+	for (int s = 0; s <= numStripes; s++)
+		firstRow[s] = std::min(image.rows, ((s * numGroups) / numStripes) * groupHeight);
+
+	std::vector<std::vector<unsigned char>> stripes(numStripes);
+	std::vector<std::string> errors(numStripes);
+	std::vector<char> ok(numStripes, false);
+	auto encode = [&](int s)
+	{
+		ok[s] = encodeStripe(image, firstRow[s], firstRow[s+1] - firstRow[s], quality, true, stripes[s], errors[s]);
+	};
+
+	std::vector<std::thread> threads;
+	for (int s = 1; s < numStripes; s++)
+		threads.emplace_back(encode, s);
+	encode(0);
+	for (std::thread &t : threads)
+		t.join();
+
+	size_t total = 0;
+	std::vector<size_t> dataStart(numStripes);
+	size_t heightOffset = 0;
+	for (int s = 0; s < numStripes; s++)
+	{
+		size_t h;
+		if (! ok[s])
+		{
+			Log(0, "*** %s: ERROR: Unable to encode JPEG: %s\n", CG.ME, errors[s].c_str());
+			return(false);
+		}
+		if (! findScan(stripes[s], &dataStart[s], s == 0 ? &heightOffset : &h))
+		{
+			Log(0, "*** %s: ERROR: Unable to find the image data in encoded JPEG.\n", CG.ME);
+			return(false);
+		}
+		total += stripes[s].size();
+	}
+
+	// The header of the first stripe, the data of each stripe without its EOI marker,
+	// restart markers between the stripes, then an EOI.
+	jpeg.clear();
+	jpeg.reserve(total);
+	jpeg.insert(jpeg.end(), stripes[0].begin(), stripes[0].begin() + dataStart[0]);
+	jpeg[heightOffset] = (image.rows >> 8) & 0xFF;
+	jpeg[heightOffset + 1] = image.rows & 0xFF;
+	for (int s = 0; s < numStripes; s++)
+	{
+		std::vector<unsigned char> const &stripe = stripes[s];
+		jpeg.insert(jpeg.end(), stripe.begin() + dataStart[s], stripe.end() - 2);
+		if (s < numStripes - 1)
+		{
+			int mcuRowsBefore = firstRow[s+1] / mcuHeight;
+			jpeg.push_back(0xFF);
+			jpeg.push_back(MARKER_RST0 + ((mcuRowsBefore - 1) % MCU_ROWS_PER_GROUP));
+		}
+	}
+	jpeg.push_back(0xFF);
+	jpeg.push_back(MARKER_EOI);
+
+	return(true);
+}
+
+bool writeParallelJpeg(char const *file, cv::Mat const &image, int quality, int numThreads)
+{
+	std::vector<unsigned char> jpeg;
+	if (! encodeParallelJpeg(image, quality, numThreads, jpeg))
+		return(false);
+
+	FILE *f = fopen(file, "w");
+	if (f == NULL)
+	{
+		Log(0, "*** %s: ERROR: Unable to open '%s': %s\n", CG.ME, file, strerror(errno));
+		return(false);
+	}
+	bool ok = fwrite(jpeg.data(), 1, jpeg.size(), f) == jpeg.size();
+	if (fclose(f) != 0)
+		ok = false;
+	if (! ok)
+		Log(0, "*** %s: ERROR: Unable to write '%s': %s\n", CG.ME, file, strerror(errno));
+	return(ok);
+}
+
+
+// Return the fastest time in milliseconds to run "encode" several times.
+template<typename F>
+static double timeEncode(F encode, int times)
+{
+	double best_ms = 0;
+	for (int i = 0; i < times; i++)
+	{
+		auto start = std::chrono::high_resolution_clock::now();
+		encode();
+		auto end = std::chrono::high_resolution_clock::now();
+		double ms = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / (double) US_IN_MS;
+		if (i == 0 || ms < best_ms)
+			best_ms = ms;
+	}
+	return(best_ms);
+}
+
+void benchmarkJpeg(config const &cg, char const *file)
+{
+	cv::Mat image = cv::imread(file, cv::IMREAD_UNCHANGED);
+	if (! image.data)
+	{
+		Log(0, "*** %s: ERROR: Unable to read '%s'.\n", cg.ME, file);
+		return;
+	}
+	if (image.depth() != CV_8U)
+	{
+		cv::Mat m;
+		image.convertTo(m, CV_8U, 1.0 / 256);
+		image = m;
+	}
+
+	int const times = 5;
+	int quality = cg.extensionType == isJPG && cg.quality != NOT_SET ? cg.quality : cg.qualityJPG;
+	std::vector<int> parameters = { cv::IMWRITE_JPEG_QUALITY, quality };
+	std::vector<unsigned char> jpeg;
+
+	printf("Encoding %dx%d, %d-channel '%s' at quality %d; best of %d:\n",
+		image.cols, image.rows, image.channels(), file, quality, times);
+
+	double opencv_ms = timeEncode([&]() { cv::imencode(".jpg", image, jpeg, parameters); }, times);
+	printf("  OpenCV:     %'8.1f ms, %'ld bytes\n", opencv_ms, (long) jpeg.size());
+
+	// 1, 2, 4, ... threads, and all of them.
+	int maxThreads = std::max(1, (int) std::thread::hardware_concurrency());
+	std::vector<int> numThreads;
+	for (int n = 1; n < maxThreads; n *= 2)
+		numThreads.push_back(n);
+	numThreads.push_back(maxThreads);
+
+	for (int n : numThreads)
+	{
+		bool ok = true;
+		double ms = timeEncode([&]() { ok = encodeParallelJpeg(image, quality, n, jpeg) && ok; }, times);
+		if (! ok)
+			return;
+		cv::Mat decoded = cv::imdecode(jpeg, cv::IMREAD_UNCHANGED);
+		printf("  %2d thread%s: %'8.1f ms, %'ld bytes, %.1fx OpenCV%s\n",
+			n, n == 1 ? " " : "s", ms, (long) jpeg.size(), opencv_ms / ms,
+			decoded.data ? "" : " - ERROR: unable to decode");
+	}
+}
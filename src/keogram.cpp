@@ -8,21 +8,32 @@ using namespace std;
 
 #include <getopt.h>
 #include <glob.h>
+#include <setjmp.h>
 #include <stdio.h>
+#include <fcntl.h>
+#include <sys/mman.h>
 #include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <unistd.h>
 #include <cstdlib>
 #include <iostream>
 #include <mutex>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
+#include <jpeglib.h>
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgproc.hpp>
 #include <opencv2/opencv.hpp>
 
+#include "include/file_queue.h"
+#include "include/frame_journal.h"
+#include "include/keogram_slits.h"
+#include "include/night_images.h"
+
 #define KNRM "\x1B[0m"
 #define KRED "\x1B[31m"
 #define KGRN "\x1B[32m"
@@ -45,6 +56,7 @@ struct config_t {
 	std::string img_src_dir, img_src_ext, dst_keogram;
 	bool labels_enabled, date_enabled, keogram_enabled;
 	bool parse_filename, junk, img_expand, channel_info;
+	bool slit_decode, benchmark;
 	int img_width;
 	int img_height;
 	int fontFace;
@@ -65,46 +77,143 @@ int nchan = 0;
 unsigned long nfiles = 0;
 int s_len = 0;	// length in characters of nfiles, e.g. if nfiles == "1000", s_len = 4.
 
+// What the capture program recorded about each image, by file name.
+std::unordered_map<std::string, frameRecord> journal;
+
+// Which images are in the keogram, by file number.  Not vector<bool> since threads set them.
+std::vector<char> image_used;
+
 // Read a single file and return true on success and false on error.
 // On success, set "mat".
 bool read_file(struct config_t* cf, char* filename, cv::Mat* mat, int file_num, char *msg, int msg_size)
 {
-	*mat = cv::imread(filename, cv::IMREAD_UNCHANGED);
-	if (! mat->data || mat->empty()) {
-		if (cf->verbose) {
-			stdio_mutex.lock();
-			fprintf(stderr, "Error reading file '%s': no data\n", filename);
-			std::cout << "Error reading file " << filename << ": no data" << std::endl;
-			stdio_mutex.unlock();
-		}
+	if (! readNightImage(filename, mat, cf->img_width, cf->img_height, cf->verbose, stdio_mutex))
 		return(false);
-	}
 
 	if (msg_size > 0 && cf->verbose > 1) {
 		snprintf(msg, msg_size, "[%*d/%lu] %s, channels=%d",
 			s_len, file_num, nfiles, filename, mat->channels());
 	}
+	return(true);
+}
 
-	if (mat->cols == 0 || mat->rows == 0) {
-		if (cf->verbose) {
-			stdio_mutex.lock();
-			fprintf(stderr, "%s invalid image size %dx%d; ignoring file\n", filename, mat->rows, mat->cols);
-			stdio_mutex.unlock();
-		}
+// Reading only the middle column needs libjpeg-turbo's extensions;
+// without them slit_decode is never set.
+#ifdef JCS_EXTENSIONS
+// libjpeg calls exit() on errors unless we give it our own error handler.
+struct jpeg_errors {
+	struct jpeg_error_mgr mgr;
+	jmp_buf jump_buffer;
+};
+
+static void jpeg_error_exit(j_common_ptr cinfo)
+{
+	longjmp(((jpeg_errors*) cinfo->err)->jump_buffer, 1);
+}
+
+static void jpeg_emit_message(j_common_ptr, int)
+{
+	// read_file() reports problems with the file if we can't read it.
+}
+
+// Read only the middle column of a JPEG file and return true on success.
+// On success, set "mat" to the column and "width" to the image's width.
+// libjpeg-turbo still has to decode the whole file's compressed data, but only does the
+// inverse DCT, upsampling, and color conversion for the blocks near the middle column.
+// A few pixels on each side of the column are decoded so its upsampled colors are the
+// same as when the whole image is decoded.
+bool read_slit(struct config_t* cf, char* filename, cv::Mat* mat, int* width)
+{
+	FILE* f = fopen(filename, "rb");
+	if (f == NULL)
+		return(false);
+
+	struct jpeg_decompress_struct cinfo;
+	jpeg_errors err;
+	std::vector<unsigned char> row;
+	cinfo.err = jpeg_std_error(&err.mgr);
+	err.mgr.error_exit = jpeg_error_exit;
+	err.mgr.emit_message = jpeg_emit_message;
+	if (setjmp(err.jump_buffer)) {
+		jpeg_destroy_decompress(&cinfo);
+		fclose(f);
 		return(false);
 	}
-	if (cf->img_height && cf->img_width &&
-		(mat->cols != cf->img_width || mat->rows != cf->img_height)) {
-		if (cf->verbose) {
-			stdio_mutex.lock();
-			fprintf(stderr, "%s: image size %dx%d does not match expected size %dx%d; ignoring\n",
-				filename, mat->cols, mat->rows, cf->img_width, cf->img_height);
-			stdio_mutex.unlock();
+
+	jpeg_create_decompress(&cinfo);
+	jpeg_stdio_src(&cinfo, f);
+	jpeg_read_header(&cinfo, TRUE);
+	bool ok = (cinfo.num_components == 1 || cinfo.num_components == 3) &&
+		cinfo.image_width > 0 && cinfo.image_height > 0 &&
+		! (cf->img_height && cf->img_width &&
+		   ((int) cinfo.image_width != cf->img_width || (int) cinfo.image_height != cf->img_height));
+	if (ok) {
+		// Same channel order as imread().
+		int channels = cinfo.num_components;
+		cinfo.out_color_space = channels == 1 ? JCS_GRAYSCALE : JCS_EXT_BGR;
+		jpeg_start_decompress(&cinfo);
+
+		const int margin = 16;
+		int middle = cinfo.output_width / 2;
+		JDIMENSION x = std::max(0, middle - margin);
+		JDIMENSION w = std::min((int) cinfo.output_width - (int) x, (2 * margin) + 1);
+		jpeg_crop_scanline(&cinfo, &x, &w);
+		int column = (middle - x) * channels;
+
+		mat->create(cinfo.output_height, 1, CV_MAKETYPE(CV_8U, channels));
+		row.resize(cinfo.output_width * channels);
+		while (cinfo.output_scanline < cinfo.output_height) {
+			unsigned char* pixel = mat->ptr(cinfo.output_scanline);
+			JSAMPROW r = row.data();
+			jpeg_read_scanlines(&cinfo, &r, 1);
+			memcpy(pixel, r + column, channels);
 		}
-		return(false);
+		*width = cinfo.image_width;
+		jpeg_finish_decompress(&cinfo);
 	}
+	jpeg_destroy_decompress(&cinfo);
+	fclose(f);
 
-	return(true);
+	return(ok);
+}
+#else
+bool read_slit(struct config_t*, char*, cv::Mat*, int*)
+{
+	return(false);
+}
+#endif
+
+// Where each pixel of the middle column of a rotated image comes from in the unrotated image.
+// Rotating every image just to use one column is slow, so with --rotate only those pixels are sampled.
+struct rotated_line_t {
+	cv::Size size;		// of the unrotated images
+	int width;			// of the rotated images
+	cv::Mat map;		// for remap(): the (x, y) in the unrotated image of each row
+} rotated_line;
+
+// Set "line" for images of size "size" rotated "angle" degrees counterclockwise
+// into their bounding box, the same as warpAffine() would.
+void make_rotated_line(cv::Size size, double angle, rotated_line_t* line)
+{
+	cv::Point2f center((size.width - 1) / 2.0, (size.height - 1) / 2.0);
+	cv::Mat rot = cv::getRotationMatrix2D(center, angle, 1.0);
+	cv::Rect2f bbox = cv::RotatedRect(cv::Point2f(), size, angle).boundingRect2f();
+	rot.at<double>(0, 2) += bbox.width / 2.0 - size.width / 2.0;
+	rot.at<double>(1, 2) += bbox.height / 2.0 - size.height / 2.0;
+	cv::Size rotated = bbox.size();
+
+	// The rotation maps unrotated to rotated, so invert it to find where each pixel came from.
+	cv::Mat inv;
+	cv::invertAffineTransform(rot, inv);
+	double x = rotated.width / 2;
+	line->map.create(rotated.height, 1, CV_32FC2);
+	for (int y = 0; y < rotated.height; y++) {
+		line->map.at<cv::Point2f>(y, 0) = cv::Point2f(
+			inv.at<double>(0, 0) * x + inv.at<double>(0, 1) * y + inv.at<double>(0, 2),
+			inv.at<double>(1, 0) * x + inv.at<double>(1, 1) * y + inv.at<double>(1, 2));
+	}
+	line->size = size;
+	line->width = rotated.width;
 }
 
 void parse_args(int, char**, struct config_t*);
@@ -117,246 +226,442 @@ char s_[10];
 const int num_hours = 24;
 bool hours[num_hours];
 
+// Add an annotation at "destCol" if the hour changed since the previous image.
+// "start_us" is when the image was taken if the capture program recorded it, otherwise -1.
+void label_hour(struct config_t* cf, char* filename, int64_t start_us, int destCol,
+				int* prevHour, std::mutex* mtx, cv::Mat* ann)
+{
+	struct tm ft;	// the time of the file, by any means necessary
+	if (cf->parse_filename) {
+		// engage your safety squints!
+		char* s;
+		// TODO: make sure strrchr() and sscanf work
+		// Example of name:  image-yyyymmddhhmmss.jpg
+		s = strrchr(filename, '-');
+		s++;
+		sscanf(s, "%04d%02d%02d%02d%02d%02d.%*s", &ft.tm_year, &ft.tm_mon,
+			&ft.tm_mday, &ft.tm_hour, &ft.tm_min, &ft.tm_sec);
+	} else if (start_us >= 0) {
+		// the capture program knew when it took the image
+		time_t start = start_us / 1000000;
+		struct tm t;
+		localtime_r(&start, &t);
+		ft.tm_hour = t.tm_hour;
+		ft.tm_mday = t.tm_mday;
+		ft.tm_mon = t.tm_mon +1;
+		ft.tm_year = t.tm_year+1900;
+	} else {
+		// sometimes you can believe the file time on disk
+		struct stat s;
+		if (stat(filename, &s) == 0) {
+			struct tm* t = localtime(&s.st_mtime);
+			ft.tm_hour = t->tm_hour;
+			ft.tm_mday = t->tm_mday;
+			ft.tm_mon = t->tm_mon +1;
+			ft.tm_year = t->tm_year+1900;
+		} else {
+			fprintf(stderr, "WARNING: unable to get time of '%s': %s\n", filename, strerror(errno));
+			ft.tm_hour = -1;
+		}
+	}
+
+	if (ft.tm_hour != *prevHour) {
+		if (*prevHour != -1) {
+			// record the annotation if we haven't already (only for the hour change)
+			if (ft.tm_hour != -1 && ! hours[ft.tm_hour]) {
+				mtx->lock();
+				cv::Mat a = (cv::Mat_<int>(1, 5) << destCol, ft.tm_hour, ft.tm_year, ft.tm_mon, ft.tm_mday);
+				ann->push_back(a);
+				hours[ft.tm_hour] = true;
+				mtx->unlock();
+			}
+		}
+		*prevHour = ft.tm_hour;
+	}
+}
+
 void keogram_worker(int thread_num,			// thread num
 					struct config_t* cf,	// config
 					glob_t* files,			// file list
 					std::mutex* mtx,		// mutex
 					cv::Mat* acc,			// accumulated
-					cv::Mat* ann,			// annotations
-					cv::Mat* mask)			// mask
+					cv::Mat* mask,			// mask
+					file_queue* queue)		// files not yet processed
 {
-	int start_num, end_num, batch_size, prevHour = -1;
 	cv::Mat thread_accumulator;
+	unsigned long first, last, num_processed = 0;
 
-	batch_size = nfiles / cf->num_threads;
-	start_num = thread_num * batch_size;
 	thread_num++;	// so messages start at human-friendly thread 1, not 0.
 
-	// last thread has more work to do if the number of images isn't multiple of
-	// the number of threads
-	if (thread_num == cf->num_threads)
-		end_num = nfiles - 1;
-	else
-		end_num = start_num + batch_size - 1;
-
-	if (cf->verbose > 2 && cf->num_threads > 1) {
-		stdio_mutex.lock();
-		fprintf(stderr, "thread %d/%d processing files %*d-%d (%d/%lu)\n",
-		thread_num, cf->num_threads, s_len, start_num +1, end_num + 1,
-		end_num - start_num + 1, nfiles);
-		stdio_mutex.unlock();
-	}
-
 	const int msg_size = 500;
 	char msg[msg_size];
 
-	for (int f = start_num; f <= end_num; f++) {
-		char* filename = files->gl_pathv[f];
-		cv::Mat imagesrc;
-		msg[0] = '\0';
-		if (! read_file(cf, filename, &imagesrc, f+1, msg, msg_size)) continue;
-		if (cf->verbose > 1) {
-			stdio_mutex.lock();
-			fprintf(stderr, "%s\n", msg);
-			stdio_mutex.unlock();
-		}
-
-		if (imagesrc.channels() != nchan) {
-			if (cf->verbose) {
+	while (queue->take(&first, &last)) {
+		for (int f = first; f <= (int) last; f++) {
+			num_processed++;
+			char* filename = files->gl_pathv[f];
+			cv::Mat imagesrc;	// the whole image, or only its middle column if read_slit() read it
+			int width = 0;
+			msg[0] = '\0';
+			if (cf->slit_decode && read_slit(cf, filename, &imagesrc, &width)) {
+				if (cf->verbose > 1) {
+					snprintf(msg, msg_size, "[%*d/%lu] %s, channels=%d (middle column)",
+						s_len, f+1, nfiles, filename, imagesrc.channels());
+				}
+			} else if (! read_file(cf, filename, &imagesrc, f+1, msg, msg_size)) {
+				continue;
+			}
+			if (cf->verbose > 1) {
 				stdio_mutex.lock();
-				fprintf(stderr, "%s: repairing channel mismatch from %d to %d\n", filename, imagesrc.channels(), nchan);
+				fprintf(stderr, "%s\n", msg);
 				stdio_mutex.unlock();
 			}
-			if (imagesrc.channels() < nchan)
-				cv::cvtColor(imagesrc, imagesrc, cv::COLOR_GRAY2BGR, nchan);
-			else	// imagesrc.channels() > nchan
-				cv::cvtColor(imagesrc, imagesrc, cv::COLOR_BGR2GRAY, nchan);
-		}
-
-		if (cf->rotation_angle) {
-			cv::Point2f center((imagesrc.cols - 1) / 2.0, (imagesrc.rows - 1) / 2.0);
-			cv::Mat rot = cv::getRotationMatrix2D(center, cf->rotation_angle, 1.0);
-			cv::Rect2f bbox = cv::RotatedRect(cv::Point2f(), imagesrc.size(), cf->rotation_angle).boundingRect2f();
-			rot.at<double>(0, 2) += bbox.width / 2.0 - imagesrc.cols / 2.0;
-			rot.at<double>(1, 2) += bbox.height / 2.0 - imagesrc.rows / 2.0;
-			cv::warpAffine(imagesrc, imagesrc, rot, bbox.size());
-		}
-
-		/* This seemingly redundant check saves a bunch of locking and unlocking
-		 later. Maybe all the threads will see the accumlator as empty, so they will
-		 all try grab the lock...
 
-		 The winner of that race initializes the accumulator with its image, and
-		 releases the lock. The rest of the threads will - in turn - get the lock,
-		 and on checking the accumulator again, find it no longer in need of
-		 initialization, so they skip the .create().
-
-		 Future iterations will all see that the accumulator is non-empty.
-		*/
-		if (acc->empty()) {
-			mtx->lock();
-			if (acc->empty()) {
-				// expand ?
-				if (cf->img_expand) {
-					cf->num_img_expand = std::max(1, (int) (imagesrc.cols / (float) nfiles));
-					if (((float)(cf->num_img_expand * nfiles) / imagesrc.cols) < 0.8) // minimal size 0.8 * imagesrc.cols 
-						cf->num_img_expand++;
-				}
-				// channel_info ?
-				if (cf->channel_info) {
-					// create mask
-					*mask = cv::Mat::zeros(imagesrc.size(), CV_8U);
-					cv::circle(*mask, cv::Point(mask->cols/2, mask->rows/2), mask->rows/3, cv::Scalar(255, 255, 255), -1, 8, 0);
-				}
-				acc->create(imagesrc.rows, nfiles * cf->num_img_expand , imagesrc.type());
-				if (cf->verbose > 3) {
+			if (imagesrc.channels() != nchan) {
+				if (cf->verbose) {
 					stdio_mutex.lock();
-					fprintf(stderr, "thread %d initialized accumulator\n", thread_num);
+					fprintf(stderr, "%s: repairing channel mismatch from %d to %d\n", filename, imagesrc.channels(), nchan);
 					stdio_mutex.unlock();
 				}
+				if (imagesrc.channels() < nchan)
+					cv::cvtColor(imagesrc, imagesrc, cv::COLOR_GRAY2BGR, nchan);
+				else	// imagesrc.channels() > nchan
+					cv::cvtColor(imagesrc, imagesrc, cv::COLOR_BGR2GRAY, nchan);
 			}
-			mtx->unlock();
-		}
-
-		// Copy middle column to destination
-		// locking not required - we have absolute index into the accumulator
-		int destCol = f * cf->num_img_expand;
-		for (int i=0; i < cf->num_img_expand; i++) {
-			try {
-				imagesrc.col(imagesrc.cols / 2).copyTo(acc->col(destCol+i));	 //copy
-			} catch (cv::Exception& ex) {
-				fprintf(stderr, "WARNING: internal copy of '%s' failed; ignoring\n", filename);
-				continue;
-			}
-		}
 
-		if (cf->labels_enabled) {
-			struct tm ft;	// the time of the file, by any means necessary
-			if (cf->parse_filename) {
-				// engage your safety squints!
-				char* s;
-				// TODO: make sure strrchr() and sscanf work
-				// Example of name:  image-yyyymmddhhmmss.jpg
-				s = strrchr(filename, '-');
-				s++;
-				sscanf(s, "%04d%02d%02d%02d%02d%02d.%*s", &ft.tm_year, &ft.tm_mon,
-					&ft.tm_mday, &ft.tm_hour, &ft.tm_min, &ft.tm_sec);
-			} else {
-				// sometimes you can believe the file time on disk
-				struct stat s;
-				if (stat(filename, &s) == 0) {
-					struct tm* t = localtime(&s.st_mtime);
-					ft.tm_hour = t->tm_hour;
-					ft.tm_mday = t->tm_mday;
-					ft.tm_mon = t->tm_mon +1;
-					ft.tm_year = t->tm_year+1900;
-				} else {
-					fprintf(stderr, "WARNING: unable to get time of '%s': %s\n", filename, strerror(errno));
-					ft.tm_hour = -1;
+			if (cf->rotation_angle && ! cf->channel_info) {
+				// Only the middle column of the rotated image is used, so only sample it.
+				if (rotated_line.size != imagesrc.size()) {
+					if (cf->verbose) {
+						stdio_mutex.lock();
+						fprintf(stderr, "%s: image size %dx%d does not match expected size %dx%d; ignoring\n",
+							filename, imagesrc.cols, imagesrc.rows, rotated_line.size.width, rotated_line.size.height);
+						stdio_mutex.unlock();
+					}
+					continue;
 				}
+				cv::Mat column;
+				cv::remap(imagesrc, column, rotated_line.map, cv::noArray(), cv::INTER_LINEAR, cv::BORDER_CONSTANT);
+				imagesrc = column;
+				width = rotated_line.width;
+			} else if (cf->rotation_angle) {
+				// channel_info needs the whole rotated image.
+				cv::Point2f center((imagesrc.cols - 1) / 2.0, (imagesrc.rows - 1) / 2.0);
+				cv::Mat rot = cv::getRotationMatrix2D(center, cf->rotation_angle, 1.0);
+				cv::Rect2f bbox = cv::RotatedRect(cv::Point2f(), imagesrc.size(), cf->rotation_angle).boundingRect2f();
+				rot.at<double>(0, 2) += bbox.width / 2.0 - imagesrc.cols / 2.0;
+				rot.at<double>(1, 2) += bbox.height / 2.0 - imagesrc.rows / 2.0;
+				cv::warpAffine(imagesrc, imagesrc, rot, bbox.size());
 			}
+			if (width == 0)
+				width = imagesrc.cols;
+
+			/* This seemingly redundant check saves a bunch of locking and unlocking
+			 later. Maybe all the threads will see the accumlator as empty, so they will
+			 all try grab the lock...
+
+			 The winner of that race initializes the accumulator with its image, and
+			 releases the lock. The rest of the threads will - in turn - get the lock,
+			 and on checking the accumulator again, find it no longer in need of
+			 initialization, so they skip the .create().
 
-			if (ft.tm_hour != prevHour) {
-				if (prevHour != -1) {
-					// record the annotation if we haven't already (only for the hour change)
-					if (ft.tm_hour != -1 && ! hours[ft.tm_hour]) {
-						mtx->lock();
-						cv::Mat a = (cv::Mat_<int>(1, 5) << destCol, ft.tm_hour, ft.tm_year, ft.tm_mon, ft.tm_mday);
-						ann->push_back(a);
-						hours[ft.tm_hour] = true;
-						mtx->unlock();
+			 Future iterations will all see that the accumulator is non-empty.
+			*/
+			if (acc->empty()) {
+				mtx->lock();
+				if (acc->empty()) {
+					// expand ?
+					if (cf->img_expand) {
+						cf->num_img_expand = std::max(1, (int) (width / (float) nfiles));
+						if (((float)(cf->num_img_expand * nfiles) / width) < 0.8) // minimal size 0.8 * width
+							cf->num_img_expand++;
+					}
+					// channel_info ?
+					if (cf->channel_info) {
+						// create mask
+						*mask = cv::Mat::zeros(imagesrc.size(), CV_8U);
+						cv::circle(*mask, cv::Point(mask->cols/2, mask->rows/2), mask->rows/3, cv::Scalar(255, 255, 255), -1, 8, 0);
+					}
+					acc->create(imagesrc.rows, nfiles * cf->num_img_expand , imagesrc.type());
+					if (cf->verbose > 3) {
+						stdio_mutex.lock();
+						fprintf(stderr, "thread %d initialized accumulator\n", thread_num);
+						stdio_mutex.unlock();
 					}
 				}
-				prevHour = ft.tm_hour;
+				mtx->unlock();
 			}
-		}
 
-		if (cf->channel_info)
-		{
-			Scalar mean_scalar = cv::mean(imagesrc, *mask);
-			Vec3b color;
-			uchar color_mono;
-			double mean;
-			double mean_Sum;
-			double mean_maxValue = 255.0/100.0;
-
-			// Scale to 0-1 range
-			switch (imagesrc.depth())
-			{
-				case CV_8U:
-					mean_maxValue = 255.0/100.0;
-					break;
-				case CV_16U:
-					mean_maxValue = 65535.0/100.0;
-					break;
+			// Copy middle column to destination
+			// locking not required - we have absolute index into the accumulator
+			int destCol = f * cf->num_img_expand;
+			for (int i=0; i < cf->num_img_expand; i++) {
+				try {
+					imagesrc.col(imagesrc.cols / 2).copyTo(acc->col(destCol+i));	 //copy
+				} catch (cv::Exception& ex) {
+					fprintf(stderr, "WARNING: internal copy of '%s' failed; ignoring\n", filename);
+					continue;
+				}
 			}
 
-			// background
-			for (int i=0; i < cf->num_img_expand; i++) {
-				switch (nchan)
+			image_used[f] = true;
+
+			if (cf->channel_info)
+			{
+				Scalar mean_scalar = cv::mean(imagesrc, *mask);
+				Vec3b color;
+				uchar color_mono;
+				double mean;
+				double mean_Sum;
+				double mean_maxValue = 255.0/100.0;
+
+				// Scale to 0-1 range
+				switch (imagesrc.depth())
 				{
-				case 1:
-					line( *acc, Point(destCol+i,0), Point(destCol+i,100), Scalar( 255 ), 1, LINE_8 );
-					break;
+					case CV_8U:
+						mean_maxValue = 255.0/100.0;
+						break;
+					case CV_16U:
+						mean_maxValue = 65535.0/100.0;
+						break;
+				}
+
+				// background
+				for (int i=0; i < cf->num_img_expand; i++) {
+					switch (nchan)
+					{
+					case 1:
+						line( *acc, Point(destCol+i,0), Point(destCol+i,100), Scalar( 255 ), 1, LINE_8 );
+						break;
 				
-				default:
-					line( *acc, Point(destCol+i,0), Point(destCol+i,100), Scalar( 255, 255, 255 ), 1, LINE_8 );
-					break;
+					default:
+						line( *acc, Point(destCol+i,0), Point(destCol+i,100), Scalar( 255, 255, 255 ), 1, LINE_8 );
+						break;
+					}
 				}
-			}
-			// grid
-			color.val[0] = color.val[1] = color.val[2] = 127;
-			color_mono = 127;
-			for (int j=0; j <= 10; j++) {
-				switch (nchan)
-				{
-				case 1:
-					acc->at<uchar>(Point(destCol,100-10*j)) = color_mono;
-					break;
+				// grid
+				color.val[0] = color.val[1] = color.val[2] = 127;
+				color_mono = 127;
+				for (int j=0; j <= 10; j++) {
+					switch (nchan)
+					{
+					case 1:
+						acc->at<uchar>(Point(destCol,100-10*j)) = color_mono;
+						break;
 				
-				default:
-					acc->at<cv::Vec3b>(Point(destCol,100-10*j)) = color;
-					break;
+					default:
+						acc->at<cv::Vec3b>(Point(destCol,100-10*j)) = color;
+						break;
+					}
+				} 
+				// values
+				mean_Sum = 0;
+				for (int channel=0; channel < imagesrc.channels(); channel++) {
+					mean = mean_scalar[channel] / mean_maxValue;
+					mean_Sum += mean;
+					color.val[0] = color.val[1] = color.val[2] = 0;
+					color.val[channel] = 255;
+					color_mono = 255;
+					for (int i=0; i < cf->num_img_expand; i++) {
+						switch (nchan)
+						{
+						case 1:
+							acc->at<uchar>(Point(destCol+i,100-mean)) = color_mono;
+							break;
+				
+						default:
+							acc->at<cv::Vec3b>(Point(destCol+i,100-mean)) = color;
+							break;
+						}
+					}
 				}
-			} 
-			// values
-			mean_Sum = 0;
-			for (int channel=0; channel < imagesrc.channels(); channel++) {
-				mean = mean_scalar[channel] / mean_maxValue;
-				mean_Sum += mean;
+				mean_Sum = mean_Sum / std::min(3,imagesrc.channels());
 				color.val[0] = color.val[1] = color.val[2] = 0;
-				color.val[channel] = 255;
-				color_mono = 255;
+				color_mono = 0;
 				for (int i=0; i < cf->num_img_expand; i++) {
 					switch (nchan)
 					{
 					case 1:
-						acc->at<uchar>(Point(destCol+i,100-mean)) = color_mono;
+						acc->at<uchar>(Point(destCol+i,100-mean_Sum)) = color_mono;
 						break;
-				
+			
 					default:
-						acc->at<cv::Vec3b>(Point(destCol+i,100-mean)) = color;
+						acc->at<cv::Vec3b>(Point(destCol+i,100-mean_Sum)) = color;
 						break;
 					}
 				}
 			}
-			mean_Sum = mean_Sum / std::min(3,imagesrc.channels());
-			color.val[0] = color.val[1] = color.val[2] = 0;
-			color_mono = 0;
-			for (int i=0; i < cf->num_img_expand; i++) {
-				switch (nchan)
-				{
-				case 1:
-					acc->at<uchar>(Point(destCol+i,100-mean_Sum)) = color_mono;
-					break;
-			
-				default:
-					acc->at<cv::Vec3b>(Point(destCol+i,100-mean_Sum)) = color;
-					break;
-				}
+		}
+	}
+
+	if (cf->verbose > 2 && cf->num_threads > 1) {
+		stdio_mutex.lock();
+		fprintf(stderr, "thread %d/%d processed %lu files\n", thread_num, cf->num_threads, num_processed);
+		stdio_mutex.unlock();
+	}
+}
+
+// Make the keogram from the slits the capture program saved instead of reading every image.
+// Return false if they can't be used with the options or don't include every image.
+bool keogram_from_slits(struct config_t* cf, glob_t* files, cv::Mat* acc, cv::Mat* ann)
+{
+	if (cf->rotation_angle || cf->channel_info)
+		return(false);
+
+	std::string file = cf->img_src_dir + "/" + KEOGRAM_SLITS_NAME;
+	int fd = open(file.c_str(), O_RDONLY);
+	if (fd == -1)
+		return(false);
+	struct stat s;
+	void* m = MAP_FAILED;
+	if (fstat(fd, &s) == 0 && s.st_size >= (off_t) sizeof(slitFileHeader))
+		m = mmap(NULL, s.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED)
+		return(false);
+	unsigned char const* slits = (unsigned char const*) m;
+
+	slitFileHeader h = *(slitFileHeader const*) slits;
+	h.count = __atomic_load_n(&((slitFileHeader const*) slits)->count, __ATOMIC_ACQUIRE);
+	bool ok = memcmp(h.magic, KEOGRAM_SLITS_MAGIC, sizeof(h.magic)) == 0 && h.version == KEOGRAM_SLITS_VERSION &&
+		(h.bitDepth == 8 || h.bitDepth == 16) && h.channels >= 1 && h.channels <= 4 &&
+		slitEntryOffset(h, h.count) <= (size_t) s.st_size &&
+		(nchan == 0 || nchan == (int) h.channels) &&
+		((cf->img_width == 0 && cf->img_height == 0) ||
+		 (cf->img_width == (int) h.width && cf->img_height == (int) h.height));
+
+	// Every image needs a slit.  Images removed after their slit was saved are skipped.
+	std::vector<slitInfo const*> info(nfiles, NULL);
+	if (ok) {
+		std::unordered_map<std::string, slitInfo const*> by_name;
+		for (uint32_t i = 0; i < h.count; i++) {
+			slitInfo const* si = (slitInfo const*) (slits + slitEntryOffset(h, i));
+			if (memchr(si->name, '\0', sizeof(si->name)) != NULL)
+				by_name[si->name] = si;
+		}
+		for (unsigned long f = 0; ok && f < nfiles; f++) {
+			char const* name = strrchr(files->gl_pathv[f], '/');
+			auto si = by_name.find(name == NULL ? files->gl_pathv[f] : name + 1);
+			if (si == by_name.end()) {
+				if (cf->verbose > 1)
+					fprintf(stderr, "No slit for '%s'; reading all the images\n", files->gl_pathv[f]);
+				ok = false;
+			} else {
+				info[f] = si->second;
 			}
 		}
 	}
+
+	if (ok) {
+		if (cf->verbose)
+			fprintf(stderr, "Using %lu slits from '%s'\n", nfiles, file.c_str());
+		if (cf->img_expand) {
+			cf->num_img_expand = std::max(1, (int) (h.width / (float) nfiles));
+			if (((float)(cf->num_img_expand * nfiles) / h.width) < 0.8) // minimal size 0.8 * width
+				cf->num_img_expand++;
+		}
+
+		// Each slit becomes a row, then the whole thing is turned on its side.
+		cv::Mat rows(nfiles * cf->num_img_expand, h.height,
+			CV_MAKETYPE(h.bitDepth == 16 ? CV_16U : CV_8U, h.channels));
+		size_t bytes = rows.cols * rows.elemSize();
+		std::mutex mtx;
+		int prevHour = -1;
+		for (unsigned long f = 0; f < nfiles; f++) {
+			int destCol = f * cf->num_img_expand;
+			for (int i = 0; i < cf->num_img_expand; i++)
+				memcpy(rows.ptr(destCol + i), (unsigned char const*) info[f] + sizeof(slitInfo), bytes);
+			if (cf->labels_enabled)
+				label_hour(cf, files->gl_pathv[f], info[f]->start_us, destCol, &prevHour, &mtx, ann);
+		}
+		cv::transpose(rows, *acc);
+	}
+
+	munmap(m, s.st_size);
+	return(ok);
+}
+
+// Read every image into "acc" using "num_threads" threads.
+void run_workers(struct config_t* cf, glob_t* files, std::mutex* mtx, cv::Mat* acc, cv::Mat* mask, int num_threads)
+{
+	image_used.assign(nfiles, false);
+	file_queue queue(nfiles, num_threads);
+
+	std::vector<std::thread> threadpool;
+	for (int tid = 0; tid < num_threads; tid++)
+		threadpool.push_back(std::thread(keogram_worker, tid, cf, files,
+										 mtx, acc, mask, &queue));
+
+	for (auto& t : threadpool)
+		t.join();
+}
+
+// Get what's needed to read the images: the journal, the number of channels and size of
+// the images, and where the middle column is if they're rotated.
+void prepare_keogram(struct config_t* cf, glob_t* files)
+{
+	if (cf->labels_enabled && ! cf->parse_filename) {
+		journal = readFrameJournal(cf->img_src_dir);
+		if (cf->verbose > 1)
+			fprintf(stderr, "%lu images in the journal\n", (unsigned long) journal.size());
+	}
+
+	// Set the global "nchan" variable to be the number of channels in one of the images.
+	// Any subsequent file with a different number of channels will be converted to
+	// the sample file's number.
+	// Ditto for the width and height.
+	// In both cases only set the variables if not specified on the command line.
+	cv::Mat temp;
+	const int sample_file_num = 0;	// 1st file
+	char *sample_file = files->gl_pathv[sample_file_num];
+	if (nchan == 0 || (cf->img_width == 0 && cf->img_height == 0)) {
+		char not_used[1];
+		if (! read_file(cf, sample_file, &temp, sample_file_num+1, not_used, 0)) {
+			fprintf(stderr, "ERROR: Unable to read sample file '%s'; quitting\n", sample_file);
+			exit(1);
+		}
+		if (cf->verbose > 1) {
+			fprintf(stderr, "Getting nchan and/or size from: '%s'\n", sample_file);
+		}
+	}
+	if (nchan == 0)
+	{
+		nchan = temp.channels();
+		if (cf->verbose > 1) {
+			fprintf(stderr, "\tnchan = %d\n", nchan);
+		}
+	}
+	// Set the width and height based on the same file if not specified on the command line.
+	if (cf->img_width == 0 && cf->img_height == 0) {
+		cf->img_width = temp.cols;
+		cf->img_height = temp.rows;
+		if (cf->verbose > 1) {
+			fprintf(stderr, "\tsize = %d x %d\n", cf->img_width, cf->img_height);
+		}
+	}
+
+	// All the images are the same size so the rotated middle column is in the same place in each.
+	if (cf->rotation_angle)
+		make_rotated_line(cv::Size(cf->img_width, cf->img_height), cf->rotation_angle, &rotated_line);
+}
+
+// Make the keogram by reading every image.
+void make_keogram(struct config_t* cf, glob_t* files, std::mutex* mtx, cv::Mat* acc, cv::Mat* ann, cv::Mat* mask)
+{
+	prepare_keogram(cf, files);
+	run_workers(cf, files, mtx, acc, mask, cf->num_threads);
+
+	// Threads take files in no particular order, so find where the hours change afterwards.
+	if (cf->labels_enabled) {
+		int prevHour = -1;
+		for (unsigned long f = 0; f < nfiles; f++) {
+			if (! image_used[f])
+				continue;
+			frameRecord const* record = findFrameRecord(journal, files->gl_pathv[f]);
+			label_hour(cf, files->gl_pathv[f], record == NULL ? -1 : record->start_us,
+				f * cf->num_img_expand, &prevHour, mtx, ann);
+		}
+	}
 }
 
 void annotate_image(cv::Mat* ann, cv::Mat* acc, struct config_t* cf) {
@@ -480,6 +785,7 @@ void parse_args(int argc, char** argv, struct config_t* cf) {
 	cf->img_expand = false;
 	cf->num_img_expand = 1;
 	cf->channel_info = false;
+	cf->benchmark = false;
 
 	while (1) {		// getopt loop
 	int option_index = 0;
@@ -504,9 +810,10 @@ void parse_args(int argc, char** argv, struct config_t* cf) {
 		{"image-expand", no_argument, 0, 'x'},
 		{"channel-info", no_argument, 0, 'c'},
 		{"fixed-channel-number", required_argument, 0, 'f'},
+		{"benchmark", no_argument, 0, 'B'},
 		{0, 0, 0, 0}};
 
-		c = getopt_long(argc, argv, "d:e:o:r:s:L:C:N:S:T:Q:q:f:nDpvhxc", long_options, &option_index);
+		c = getopt_long(argc, argv, "d:e:o:r:s:L:C:N:S:T:Q:q:f:nDpvhxcB", long_options, &option_index);
 		if (c == -1)
 			break;
 
@@ -532,6 +839,9 @@ void parse_args(int argc, char** argv, struct config_t* cf) {
 			case 'c':
 				cf->channel_info = true;
 				break;
+			case 'B':
+				cf->benchmark = true;
+				break;
 			case 'f':
 				nchan = atoi(optarg);
 				break;
@@ -653,6 +963,7 @@ void usage_and_exit(int x) {
 	std::cout << "-c | --channel-info : show channel infos - mean value of R/G/B" << std::endl;
 	std::cout << "-f | --fixed-channel-number <int> : define number of channels 0=auto, 1=mono, 3=rgb (0=auto)" << std::endl;
 	std::cout << "-p | --parse-filename : parse time using filename instead of stat(filename)" << std::endl;
+	std::cout << "-B | --benchmark : time reading the images in full and reading only their middle column, and making the keogram with 1 to max-threads threads, then exit" << std::endl;
 
 	std::cout << KNRM << std::endl;
 	std::cout << "Font name is one of these OpenCV font names:\n\tSimplex, Plain, "
@@ -689,13 +1000,84 @@ int get_font_by_name(char* s) {
 	return cv::FONT_HERSHEY_SIMPLEX;
 }
 
+// Time reading the middle column of every image by decoding all of each image and by
+// decoding only around the column, and check both ways get the same pixels.
+void benchmark_reads(struct config_t* cf, glob_t* files)
+{
+	if (! cf->slit_decode) {
+		fprintf(stderr, "Only the middle column of JPEG images can be read, only with libjpeg-turbo, and only without --rotate or --channel-info.\n");
+		return;
+	}
+
+	std::vector<cv::Mat> columns(nfiles);
+	unsigned long num_full = 0, num_slit = 0, num_differ = 0;
+	struct timeval start, full_done, slit_done;
+	char not_used[1];
+
+	gettimeofday(&start, NULL);
+	for (unsigned long f = 0; f < nfiles; f++) {
+		cv::Mat image;
+		if (read_file(cf, files->gl_pathv[f], &image, f+1, not_used, 0)) {
+			columns[f] = image.col(image.cols / 2).clone();
+			num_full++;
+		}
+	}
+	gettimeofday(&full_done, NULL);
+	for (unsigned long f = 0; f < nfiles; f++) {
+		cv::Mat column;
+		int width;
+		if (read_slit(cf, files->gl_pathv[f], &column, &width)) {
+			num_slit++;
+			if (columns[f].empty() || column.type() != columns[f].type() || column.rows != columns[f].rows ||
+				memcmp(column.data, columns[f].data, column.total() * column.elemSize()) != 0)
+				num_differ++;
+		}
+	}
+	gettimeofday(&slit_done, NULL);
+
+	double full_secs = (full_done.tv_sec - start.tv_sec) + (full_done.tv_usec - start.tv_usec) / 1000000.0;
+	double slit_secs = (slit_done.tv_sec - full_done.tv_sec) + (slit_done.tv_usec - full_done.tv_usec) / 1000000.0;
+	printf("Whole image:   %lu images in %.2f seconds, %.1f images/second\n",
+		num_full, full_secs, num_full / full_secs);
+	printf("Middle column: %lu images in %.2f seconds, %.1f images/second, %.1fx faster\n",
+		num_slit, slit_secs, num_slit / slit_secs, full_secs / slit_secs);
+	printf("%lu columns were different\n", num_differ);
+}
+
+// Time making the keogram with 1 to cf->num_threads threads.
+void benchmark_threads(struct config_t* cf, glob_t* files)
+{
+	std::mutex mtx;
+	cv::Mat acc, mask;
+	struct timeval start, done;
+	double one_thread_secs = 0;
+
+	prepare_keogram(cf, files);
+
+	// Once first so every run finds the images in the page cache.
+	run_workers(cf, files, &mtx, &acc, &mask, cf->num_threads);
+
+	printf("Threads  Seconds  Images/second  Speedup\n");
+	for (int n = 1; n <= cf->num_threads; n++) {
+		acc.release();
+		gettimeofday(&start, NULL);
+		run_workers(cf, files, &mtx, &acc, &mask, n);
+		gettimeofday(&done, NULL);
+
+		double secs = (done.tv_sec - start.tv_sec) + (done.tv_usec - start.tv_usec) / 1000000.0;
+		if (n == 1)
+			one_thread_secs = secs;
+		printf("%7d  %7.2f  %13.1f  %6.2fx\n", n, secs, nfiles / secs, one_thread_secs / secs);
+	}
+}
+
 int main(int argc, char* argv[]) {
 	struct config_t config;
 	int r;
 
 	parse_args(argc, argv, &config);
 
-	if (config.img_src_dir.empty() || config.img_src_ext.empty() || config.dst_keogram.empty())
+	if (config.img_src_dir.empty() || config.img_src_ext.empty() || (config.dst_keogram.empty() && ! config.benchmark))
 		usage_and_exit(3);
 
 	r = setpriority(PRIO_PROCESS, 0, config.nice_level);
@@ -718,6 +1100,23 @@ int main(int argc, char* argv[]) {
 	sprintf(s_, "%d", (int)nfiles);
 	s_len = strlen(s_);
 
+	// Only JPEGs can be partly decoded, and only by libjpeg-turbo,
+	// and rotating and channel info need the whole image.
+#ifdef JCS_EXTENSIONS
+	config.slit_decode = (strcasecmp(config.img_src_ext.c_str(), "jpg") == 0 ||
+						  strcasecmp(config.img_src_ext.c_str(), "jpeg") == 0) &&
+						 ! config.rotation_angle && ! config.channel_info;
+#else
+	config.slit_decode = false;
+#endif
+
+	if (config.benchmark) {
+		benchmark_reads(&config, &files);
+		benchmark_threads(&config, &files);
+		globfree(&files);
+		exit(0);
+	}
+
 	std::mutex accumulated_mutex;
 	cv::Mat accumulated;
 	cv::Mat annotations;
@@ -725,50 +1124,11 @@ int main(int argc, char* argv[]) {
 	annotations.create(0, 2, CV_32S);
 	annotations = -1;
 
-	// Set the global "nchan" variable to be the number of channels in one of the images.
-	// Any subsequent file with a different number of channels will be converted to
-	// the sample file's number.
-	// Ditto for the width and height.
-	// In both cases only set the variables if not specified on the command line.
-	cv::Mat temp;
-	const int sample_file_num = 0;	// 1st file
-	char *sample_file = files.gl_pathv[sample_file_num];
-	if (nchan == 0 || (config.img_width == 0 && config.img_height == 0)) {
-		char not_used[1];
-		if (! read_file(&config, sample_file, &temp, sample_file_num+1, not_used, 0)) {
-			fprintf(stderr, "ERROR: Unable to read sample file '%s'; quitting\n", sample_file);
-			exit(1);
-		}
-		if (config.verbose > 1) {
-			fprintf(stderr, "Getting nchan and/or size from: '%s'\n", sample_file);
-		}
-	}
-	if (nchan == 0)
-	{
-		nchan = temp.channels();
-		if (config.verbose > 1) {
-			fprintf(stderr, "\tnchan = %d\n", nchan);
-		}
-	}
-	// Set the width and height based on the same file if not specified on the command line.
-	if (config.img_width == 0 && config.img_height == 0) {
-		config.img_width = temp.cols;
-		config.img_height = temp.rows;
-		if (config.verbose > 1) {
-			fprintf(stderr, "\tsize = %d x %d\n", config.img_width, config.img_height);
-		}
-	}
-
 	for (int i = 0; i < num_hours; i++) hours[i] = false;	// initialize them
 
-	std::vector<std::thread> threadpool;
-	for (int tid = 0; tid < config.num_threads; tid++)
-		threadpool.push_back(std::thread(keogram_worker, tid, &config, &files,
-										 &accumulated_mutex, &accumulated,
-										 &annotations, &mask));
-
-	for (auto& t : threadpool)
-		t.join();
+	if (! keogram_from_slits(&config, &files, &accumulated, &annotations)) {
+		make_keogram(&config, &files, &accumulated_mutex, &accumulated, &annotations, &mask);
+	}
 
 	if (config.labels_enabled)
 		annotate_image(&annotations, &accumulated, &config);
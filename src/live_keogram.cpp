@@ -0,0 +1,210 @@
+// Build the keogram for the current night as images are saved.
+
+#include <opencv2/core.hpp>
+#include <opencv2/highgui.hpp>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <string>
+#include <vector>
+
+#include "include/allsky_common.h"
+#include "include/keogram_slits.h"
+#include "include/live_keogram.h"
+
+// Entries are added this many at a time so the file is rarely resized and remapped.
+#define SLITS_BLOCK				256
+
+static int slitsFd						= -1;
+static std::string slitsDir;
+static unsigned char *slitsMap			= NULL;
+static size_t slitsMapSize				= 0;
+
+static slitFileHeader *header()
+{
+	return((slitFileHeader *) slitsMap);
+}
+
+static void closeSlits()
+{
+	if (slitsMap != NULL)
+		munmap(slitsMap, slitsMapSize);
+	if (slitsFd != -1)
+		close(slitsFd);
+	slitsMap = NULL;
+	slitsMapSize = 0;
+	slitsFd = -1;
+	slitsDir.clear();
+}
+
+// Make the file at least "size" bytes and map all of it.
+static bool mapSlits(size_t size, config const &cg)
+{
+	if (slitsMap != NULL)
+	{
+		munmap(slitsMap, slitsMapSize);
+		slitsMap = NULL;
+	}
+
+	struct stat s;
+	if (fstat(slitsFd, &s) != 0 || ((size_t) s.st_size < size && ftruncate(slitsFd, size) != 0))
+	{
+		Log(1, "*** %s: WARNING: Unable to resize keogram slits in '%s': %s\n", cg.ME, slitsDir.c_str(), strerror(errno));
+		return(false);
+	}
+
+	void *m = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, slitsFd, 0);
+	if (m == MAP_FAILED)
+	{
+		Log(1, "*** %s: WARNING: Unable to map keogram slits in '%s': %s\n", cg.ME, slitsDir.c_str(), strerror(errno));
+		return(false);
+	}
+	slitsMap = (unsigned char *) m;
+	slitsMapSize = size;
+	return(true);
+}
+
+// Open the slits file in "dir", starting a new one if needed.
+// Return false if it can't be used for slits like "slit".
+static bool openSlits(std::string const &dir, cv::Mat const &slit, int width, config const &cg)
+{
+	closeSlits();
+
+	std::string file = dir + "/" + KEOGRAM_SLITS_NAME;
+	slitsFd = open(file.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (slitsFd == -1)
+	{
+		Log(1, "*** %s: WARNING: Unable to open '%s': %s\n", cg.ME, file.c_str(), strerror(errno));
+		return(false);
+	}
+	slitsDir = dir;
+
+	slitFileHeader h;
+	struct stat s;
+	bool existing = fstat(slitsFd, &s) == 0 && s.st_size >= (off_t) sizeof(h) &&
+		pread(slitsFd, &h, sizeof(h), 0) == (ssize_t) sizeof(h) &&
+		memcmp(h.magic, KEOGRAM_SLITS_MAGIC, sizeof(h.magic)) == 0 && h.version == KEOGRAM_SLITS_VERSION;
+	if (! existing)
+	{
+		memset(&h, 0, sizeof(h));
+		memcpy(h.magic, KEOGRAM_SLITS_MAGIC, sizeof(h.magic));
+		h.version = KEOGRAM_SLITS_VERSION;
+		h.width = width;
+		h.height = slit.rows;
+		h.channels = slit.channels();
+		h.bitDepth = slit.depth() == CV_16U ? 16 : 8;
+		if (ftruncate(slitsFd, 0) != 0 || pwrite(slitsFd, &h, sizeof(h), 0) != (ssize_t) sizeof(h))
+		{
+			Log(1, "*** %s: WARNING: Unable to initialize '%s': %s\n", cg.ME, file.c_str(), strerror(errno));
+			closeSlits();
+			return(false);
+		}
+	}
+	else if (h.count > h.capacity)
+	{
+		h.count = h.capacity;
+	}
+
+	if (! mapSlits(slitEntryOffset(h, h.capacity), cg))
+	{
+		closeSlits();
+		return(false);
+	}
+	*header() = h;
+	return(true);
+}
+
+// Return true if "slit" is from an image like the others in the slits file.
+static bool sameGeometry(slitFileHeader const &h, cv::Mat const &slit, int width)
+{
+	return((int) h.width == width && (int) h.height == slit.rows && (int) h.channels == slit.channels() &&
+		(int) h.bitDepth == (slit.depth() == CV_16U ? 16 : 8));
+}
+
+// Write the keogram made from all the slits so far.
+static void writeLiveKeogram(std::string const &dateDir, config const &cg)
+{
+	slitFileHeader const &h = *header();
+	int type = CV_MAKETYPE(h.bitDepth == 16 ? CV_16U : CV_8U, h.channels);
+
+	// Each slit becomes a row, then the whole thing is turned on its side.
+	cv::Mat rows(h.count, h.height, type);
+	size_t bytes = rows.cols * rows.elemSize();
+	for (uint32_t i = 0; i < h.count; i++)
+		memcpy(rows.ptr(i), slitsMap + slitEntryOffset(h, i) + sizeof(slitInfo), bytes);
+	cv::Mat keogram;
+	cv::transpose(rows, keogram);
+
+	char const *ext = strrchr(cg.finalFileName, '.');
+	std::string date = dateDir.substr(dateDir.rfind('/') + 1);
+	std::string dir = dateDir + "/keogram";
+	if (mkdir(dir.c_str(), 0777) != 0 && errno != EEXIST)
+	{
+		Log(1, "*** %s: WARNING: Unable to create '%s': %s\n", cg.ME, dir.c_str(), strerror(errno));
+		return;
+	}
+
+	// Write to a temporary name then rename so the WebUI never sees a partial file.
+	std::string file = dir + "/keogram-" + date + (ext == NULL ? ".jpg" : ext);
+	std::string temp = dir + "/.keogram-" + date + (ext == NULL ? ".jpg" : ext);
+	bool ok = false;
+	try
+	{
+		ok = cv::imwrite(temp, keogram);
+	}
+	catch (const cv::Exception& ex)
+	{
+		Log(1, "*** %s: WARNING: Exception saving '%s': %s\n", cg.ME, temp.c_str(), ex.what());
+	}
+	if (ok && rename(temp.c_str(), file.c_str()) == 0)
+		Log(4, "  > Wrote live keogram '%s' from %'u images.\n", file.c_str(), h.count);
+	else
+		(void) remove(temp.c_str());
+}
+
+void addToLiveKeogram(std::string const &dateDir, config const &cg, timeval startDateTime, savedImages const &saved)
+{
+	if (saved.slit.empty() || strlen(cg.finalFileName) >= sizeof(slitInfo::name))
+		return;
+
+	if (dateDir != slitsDir && ! openSlits(dateDir, saved.slit, saved.width, cg))
+		return;
+
+	slitFileHeader *h = header();
+	if (! sameGeometry(*h, saved.slit, saved.width))
+	{
+		// keogram reads the images for this night instead.
+		Log(4, "  > Not adding to keogram slits; image size or type changed.\n");
+		return;
+	}
+
+	if (h->count == h->capacity)
+	{
+		uint32_t capacity = h->capacity + SLITS_BLOCK;
+		if (! mapSlits(slitEntryOffset(*h, capacity), cg))
+		{
+			closeSlits();
+			return;
+		}
+		h = header();
+		h->capacity = capacity;
+	}
+
+	unsigned char *entry = slitsMap + slitEntryOffset(*h, h->count);
+	slitInfo *info = (slitInfo *) entry;
+	memset(info, 0, sizeof(*info));
+	info->start_us = ((int64_t) startDateTime.tv_sec * US_IN_SEC) + startDateTime.tv_usec;
+	strcpy(info->name, cg.finalFileName);
+	cv::Mat slit = saved.slit.isContinuous() ? saved.slit : saved.slit.clone();
+	memcpy(entry + sizeof(slitInfo), slit.data, slit.total() * slit.elemSize());
+
+	// Only count the entry once it's all there.
+	__atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELEASE);
+
+	if (cg.OUT.liveKeogram > 0 && h->count % cg.OUT.liveKeogram == 0)
+		writeLiveKeogram(dateDir, cg);
+}
@@ -114,84 +114,14 @@ bool aegInit(config cg,
 }
 
 
-// Calculate mean of current image.
-float aegCalcMean(cv::Mat image, bool useMask)
-{
-	float mean;
-
-	// Only create the destination image and mask the first time we're called.
-	static cv::Mat mask;
-	static bool maskCreated = false;
-	if (! maskCreated)
-	{
-		maskCreated = true;
-
+// Return the part of the image whose mean is used for auto-exposure:
+// a circle at the center of the image with a radius of 1/3 the height of the image
+// (diameter == 2/3 height), given as the square it fits in.
 // TODO: Allow user to specify a mask file
-
-		// Create a circular mask at the center of the image with
-		// a radius of 1/3 the height of the image (diameter == 2/3 height).
-
-		const cv::Scalar white = cv::Scalar(255, 255, 255);
-
-		// mask needs to be mono or else it give a cv::exception
-		mask = cv::Mat::zeros(image.size(), CV_8U);
-		cv::Point center = cv::Point(mask.cols/2, mask.rows/2);
-		int radius = mask.rows / 3;
-		cv::circle(mask, center, radius, white, cv::FILLED, cv::LINE_AA, 0);
-
-//x #define xxxxxxxx_for_testing
-#ifdef xxxxxxxx_for_testing		// save masks
-		std::vector<int> compressionParameters;
-		compressionParameters.push_back(cv::IMWRITE_JPEG_QUALITY);
-		compressionParameters.push_back(95);
-		compressionParameters.push_back(cv::IMWRITE_PNG_COMPRESSION);
-		compressionParameters.push_back(9);
-
-		char const *maskName = "tmp/mask.png";
-		if (! cv::imwrite(maskName, mask, compressionParameters))
-			Log(1, "*** ERROR: Unable to write to '%s'\n", maskName);
-
-		if (0) {		// Not sure what good this image does.
-			// Copy the source image to destination image with masking.
-			cv::Mat dstImage = cv::Mat::zeros(image.size(), CV_8U);
-			image.copyTo(dstImage, mask);
-
-			char const *dstImageName = "tmp/dstImage.jpg";
-			if (! cv::imwrite(dstImageName, dstImage, compressionParameters))
-				Log(1, "*** ERROR: Unable to write to '%s'\n", dstImageName);
-		}
-#endif
-	}
-
-	cv::Scalar mean_scalar;
-	if (useMask) {
-		mean_scalar = cv::mean(image, mask);
-	} else {
-		mean_scalar = cv::mean(image, cv::noArray());
-	}
-
-	switch (image.channels())
-	{
-		default: // mono case
-			mean = mean_scalar.val[0];
-			break;
-		case 3: // for color use average of the channels
-		case 4:
-			mean = (mean_scalar[0] + mean_scalar[1] + mean_scalar[2]) / 3.0;
-			break;
-	}
-	// Scale to 0-1 range
-	switch (image.depth())
-	{
-		case CV_8U:
-			mean /= 255.0;
-			break;
-		case CV_16U:
-			mean /= 65535.0;
-			break;
-	}
-
-	return(mean);	// return this image's mean
+cv::Rect aegGetMeanRegion(cv::Size size)
+{
+	int radius = size.height / 3;
+	return(cv::Rect((size.width / 2) - radius, (size.height / 2) - radius, 2 * radius, 2 * radius));
 }
 
 
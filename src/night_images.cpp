@@ -0,0 +1,268 @@
+// Read the images in a <date> directory.
+
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <thread>
+#include <opencv2/imgcodecs.hpp>
+#include <opencv2/imgproc.hpp>
+
+#include "include/night_images.h"
+
+bool readFileContents(char const *filename, std::vector<unsigned char> *buffer)
+{
+	FILE *f = fopen(filename, "rb");
+	if (f == NULL)
+		return(false);
+
+	struct stat s;
+	bool ok = fstat(fileno(f), &s) == 0 && s.st_size > 0;
+	if (ok)
+	{
+		// Leave room for bigger files so the buffer rarely grows.
+		if (buffer->capacity() < (size_t) s.st_size)
+			buffer->reserve(s.st_size + (s.st_size / 4));
+		buffer->resize(s.st_size);
+		ok = fread(buffer->data(), 1, s.st_size, f) == (size_t) s.st_size;
+	}
+	fclose(f);
+	return(ok);
+}
+
+bool readNightImage(char const *filename, cv::Mat *image, int width, int height,
+	int verbose, std::mutex &stdioMutex, std::vector<unsigned char> const *buffer)
+{
+	bool ok;
+	if (buffer == NULL)
+	{
+		*image = cv::imread(filename, cv::IMREAD_UNCHANGED);
+		ok = image->data && ! image->empty();
+	}
+	else
+	{
+		ok = ! cv::imdecode(*buffer, cv::IMREAD_UNCHANGED, image).empty();
+	}
+	if (! ok)
+	{
+		if (verbose)
+		{
+			std::lock_guard<std::mutex> lock(stdioMutex);
+			fprintf(stderr, "Error reading file '%s': no data\n", filename);
+		}
+		return(false);
+	}
+
+	if (image->cols == 0 || image->rows == 0)
+	{
+		if (verbose)
+		{
+			std::lock_guard<std::mutex> lock(stdioMutex);
+			fprintf(stderr, "%s: invalid image size %dx%d; ignoring file\n", filename, image->cols, image->rows);
+		}
+		return(false);
+	}
+	if (height && width && (image->cols != width || image->rows != height))
+	{
+		if (verbose)
+		{
+			std::lock_guard<std::mutex> lock(stdioMutex);
+			fprintf(stderr, "%s: image size %dx%d does not match expected size %dx%d; ignoring\n",
+				filename, image->cols, image->rows, width, height);
+		}
+		return(false);
+	}
+
+	return(true);
+}
+
+cv::Mat matchChannels(cv::Mat const &image, int channels, cv::Mat *repaired)
+{
+	if (image.channels() == channels)
+		return(image);
+
+	if (image.channels() < channels)
+		cv::cvtColor(image, *repaired, cv::COLOR_GRAY2BGR, channels);
+	else	// image.channels() > channels
+		cv::cvtColor(image, *repaired, cv::COLOR_BGR2GRAY, channels);
+	return(*repaired);
+}
+
+double nightImageMean(cv::Mat const &image)
+{
+	cv::Scalar meanScalar = cv::mean(image);
+	double mean;
+	switch (image.channels())
+	{
+		default:	// mono case
+			mean = meanScalar[0];
+			break;
+		case 3:		// for color choose maximum channel
+		case 4:
+			mean = std::max(meanScalar[0], std::max(meanScalar[1], meanScalar[2]));
+			break;
+	}
+	// Scale to 0-1 range
+	switch (image.depth())
+	{
+		case CV_8U:
+			mean /= 255.0;
+			break;
+		case CV_16U:
+			mean /= 65535.0;
+			break;
+	}
+	return(mean);
+}
+
+double nightRecordMean(frameRecord const &record)
+{
+	if (record.channels >= 3)
+		return(std::max(record.channelMeans[0], std::max(record.channelMeans[1], record.channelMeans[2])));
+	return(record.channelMeans[0]);
+}
+
+bool addToStartrails(cv::Mat const &image, double mean, double brightnessLimit, cv::Mat *accumulator)
+{
+	if (mean > brightnessLimit)
+		return(false);
+
+	if (accumulator->empty())
+		image.copyTo(*accumulator);
+	else
+		cv::max(*accumulator, image, *accumulator);		// in place; OpenCV uses SIMD instructions for this
+	return(true);
+}
+
+void mergeStartrails(cv::Mat const &threadAccumulator, cv::Mat *accumulator, std::mutex &mtx)
+{
+	// Skip unlucky threads that might have got only bad images.
+	if (threadAccumulator.empty())
+		return;
+
+	std::lock_guard<std::mutex> lock(mtx);
+	if (accumulator->empty())
+		threadAccumulator.copyTo(*accumulator);
+	else
+		cv::max(threadAccumulator, *accumulator, *accumulator);
+}
+
+bool getNightStatistics(cv::Mat const &means, nightStatistics *statistics)
+{
+	// In OpenCV, NAN is unequal to everything including NAN which means we can
+	// filter out the images that weren't read by checking for element-wise equality
+	// with itself.
+	cv::Mat nanMask = cv::Mat(means == means);
+	cv::Mat filtered;
+	means.copyTo(filtered, nanMask);
+	std::vector<double> vec;
+	filtered.copyTo(vec);
+	if (vec.empty())
+		return(false);
+
+	cv::Point minLoc;
+	cv::minMaxLoc(means, &statistics->min, &statistics->max, &minLoc);
+	statistics->minIndex = minLoc.x;
+	statistics->mean = cv::mean(filtered)[0];
+
+	// For median, do partial sort and take middle value
+	std::nth_element(vec.begin(), vec.begin() + (vec.size() / 2), vec.end());
+	statistics->median = vec[vec.size() / 2];
+	return(true);
+}
+
+std::string startrailsExtension(std::string const &filename)
+{
+	char const *dot = strrchr(filename.c_str(), '.');
+	if (dot == NULL)
+		return("");
+
+	std::string extension = dot + 1;
+	std::transform(extension.begin(), extension.end(), extension.begin(),
+		[](unsigned char c) { return std::tolower(c); });
+	if (extension != "png" && extension != "jpg")
+		return("");
+	return(extension);
+}
+
+bool saveStartrails(std::string const &filename, std::string const &extension, cv::Mat const &image)
+{
+	std::vector<int> compressionParams;
+	if (extension == "png")
+	{
+		compressionParams.push_back(cv::IMWRITE_PNG_COMPRESSION);
+		compressionParams.push_back(9);
+	}
+	else if (extension == "jpg")
+	{
+		compressionParams.push_back(cv::IMWRITE_JPEG_QUALITY);
+		compressionParams.push_back(95);
+	}
+
+	bool result = false;
+	try
+	{
+		result = ! image.empty() && cv::imwrite(filename, image, compressionParams);
+	}
+	catch (cv::Exception &ex)
+	{
+		fprintf(stderr, "ERROR: could not save startrails file: %s\n", ex.what());
+		return(false);
+	}
+	if (! result)
+	{
+		fprintf(stderr, "ERROR: could not save startrails file '%s'\n", filename.c_str());
+		return(false);
+	}
+	return(true);
+}
+
+void parseImageSize(char const *arg, int *width, int *height)
+{
+	*width = *height = 0;
+	sscanf(arg, "%dx%d", width, height);
+	// 122.8Mpx should be enough for anybody.
+	if (*height < 0 || *height > 9600 || *width < 0 || *width > 12800)
+		*height = *width = 0;
+}
+
+bool parseBrightnessLimit(char const *arg, double *limit)
+{
+	double b = atof(arg);
+	if (b < 0 || b > 1.0)
+	{
+		fprintf(stderr, "ERROR: Invalid brightness level %f. Must be from 0 to 1.0; exiting\n", b);
+		return(false);
+	}
+	*limit = b;
+	return(true);
+}
+
+void parseNumThreads(char const *arg, int *numThreads)
+{
+	int ncpu = std::thread::hardware_concurrency();
+	int n = atoi(arg);
+	if (n >= 1 && n <= ncpu)
+		*numThreads = n;
+	else
+		fprintf(stderr, "WARNING: Invalid number of threads %d; using %d\n", n, *numThreads);
+}
+
+int parseNiceLevel(char const *arg)
+{
+	int level = atoi(arg);
+	if (PRIO_MIN > level)
+	{
+		level = PRIO_MIN;
+		fprintf(stderr, "WARNING: Clamping scheduler priority to PRIO_MIN (%d)\n", PRIO_MIN);
+	}
+	else if (PRIO_MAX < level)
+	{
+		fprintf(stderr, "WARNING: Clamping scheduler priority to PRIO_MAX (%d)\n", PRIO_MAX);
+		level = PRIO_MAX;
+	}
+	return(level);
+}
@@ -0,0 +1,745 @@
+// Make what's needed for a night's keogram, startrails, and timelapse video in one pass,
+// reading each image once instead of once for each.
+// SPDX-License-Identifier: MIT
+
+using namespace std;
+
+#include <getopt.h>
+#include <glob.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <opencv2/highgui.hpp>
+#include <opencv2/imgproc.hpp>
+#include <opencv2/opencv.hpp>
+
+#include "include/file_queue.h"
+#include "include/frame_journal.h"
+#include "include/keogram_slits.h"
+#include "include/night_images.h"
+
+#define KNRM "\x1B[0m"
+#define KRED "\x1B[31m"
+#define KGRN "\x1B[32m"
+#define KYEL "\x1B[33m"
+#define KBLU "\x1B[34m"
+#define KMAG "\x1B[35m"
+#define KCYN "\x1B[36m"
+#define KWHT "\x1B[37m"
+
+struct config_t {
+	std::string img_src_dir;
+	std::string img_src_ext;
+	std::string dst_startrails;
+	std::string dst_frames;			// "-" for stdout
+	bool keogram_enabled;
+	bool startrails_enabled;
+	bool frames_enabled;
+	int num_threads;
+	int nice_level;
+	int img_width;
+	int img_height;
+	int video_width;
+	int video_height;
+	int fps;
+	int verbose;
+	double brightness_limit;
+} config;
+
+std::mutex stdio_mutex;
+int nchan = 0;
+int depth = CV_8U;
+unsigned long nfiles = 0;
+int s_len = 0;	// length in characters of nfiles, e.g. if nfiles == "1000", s_len = 4.
+
+// What the capture program recorded about each image, by file name.
+std::unordered_map<std::string, frameRecord> journal;
+
+char const* base_name(char const* filename)
+{
+	char const* name = strrchr(filename, '/');
+	return(name == NULL ? filename : name + 1);
+}
+
+// Read a single file and return true on success and false on error.
+// On success, set "mat".
+// Images of a different size than "-s" only fail if "check_size".
+// If "buffer" is given it already holds the file, from readFileContents(), and is decoded
+// into "mat"'s memory, which is only reallocated if the image doesn't fit.
+bool read_file(struct config_t* cf, char* filename, cv::Mat* mat, int file_num, char *msg, int msg_size,
+			   bool check_size = true, std::vector<uchar>* buffer = NULL)
+{
+	int width = check_size ? cf->img_width : 0;
+	int height = check_size ? cf->img_height : 0;
+	if (! readNightImage(filename, mat, width, height, cf->verbose, stdio_mutex, buffer))
+		return(false);
+
+	if (msg_size > 0 && cf->verbose > 1) {
+		snprintf(msg, msg_size, "[%*d/%lu] %s, channels=%d",
+			s_len, file_num, nfiles, filename, mat->channels());
+	}
+	return(true);
+}
+
+// Put the files in the order timelapse.sh gives them to ffmpeg, "ls -rt":
+// oldest first, and files with the same time in reverse name order.
+void sort_by_time(glob_t* files)
+{
+	std::vector<std::pair<int64_t, char*>> times;
+	for (size_t i = 0; i < files->gl_pathc; i++) {
+		struct stat s;
+		int64_t t = 0;
+		if (stat(files->gl_pathv[i], &s) == 0)
+			t = (int64_t) s.st_mtim.tv_sec * 1000000000 + s.st_mtim.tv_nsec;
+		times.push_back(std::make_pair(t, files->gl_pathv[i]));
+	}
+	std::sort(times.begin(), times.end(),
+		[](std::pair<int64_t, char*> const& a, std::pair<int64_t, char*> const& b) {
+			return(a.first != b.first ? a.first < b.first : strcoll(a.second, b.second) > 0);
+		});
+	for (size_t i = 0; i < files->gl_pathc; i++)
+		files->gl_pathv[i] = times[i].second;
+}
+
+void parse_args(int, char**, struct config_t*);
+void usage_and_exit(int);
+
+// Keep track of number of digits in nfiles so file numbers will be consistent width.
+char s_[10];
+
+// ---------- keogram
+
+// The middle column of each image goes in the keogram slits file (see keogram_slits.h),
+// which keogram then uses instead of reading the images.
+// It's written to a temporary file that replaces the existing one when it's done.
+int slits_fd = -1;
+slitFileHeader slits_header;
+std::atomic<uint32_t> slits_count(0);
+std::atomic<bool> slits_failed(false);
+std::string slits_temp;
+
+// Return true if the slits file already has a slit like ours for every image,
+// which it does when the capture program saved them all.
+bool have_all_slits(struct config_t* cf, glob_t* files)
+{
+	std::string file = cf->img_src_dir + "/" + KEOGRAM_SLITS_NAME;
+	FILE* f = fopen(file.c_str(), "rb");
+	if (f == NULL)
+		return(false);
+
+	slitFileHeader h;
+	std::unordered_set<std::string> names;
+	if (fread(&h, sizeof(h), 1, f) == 1 &&
+		memcmp(h.magic, KEOGRAM_SLITS_MAGIC, sizeof(h.magic)) == 0 && h.version == KEOGRAM_SLITS_VERSION &&
+		(int) h.width == cf->img_width && (int) h.height == cf->img_height && (int) h.channels == nchan &&
+		(int) h.bitDepth == (depth == CV_16U ? 16 : 8)) {
+		std::vector<unsigned char> entry(slitEntrySize(h));
+		for (uint32_t i = 0; i < h.count && fread(entry.data(), entry.size(), 1, f) == 1; i++) {
+			slitInfo const* si = (slitInfo const*) entry.data();
+			if (memchr(si->name, '\0', sizeof(si->name)) != NULL)
+				names.insert(si->name);
+		}
+	}
+	fclose(f);
+
+	for (unsigned long i = 0; i < nfiles; i++) {
+		if (names.count(base_name(files->gl_pathv[i])) == 0)
+			return(false);
+	}
+	return(true);
+}
+
+bool open_slits(struct config_t* cf)
+{
+	slits_temp = cf->img_src_dir + "/." + KEOGRAM_SLITS_NAME;
+	slits_fd = open(slits_temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (slits_fd == -1) {
+		fprintf(stderr, "ERROR: unable to create '%s': %s\n", slits_temp.c_str(), strerror(errno));
+		return(false);
+	}
+
+	memset(&slits_header, 0, sizeof(slits_header));
+	memcpy(slits_header.magic, KEOGRAM_SLITS_MAGIC, sizeof(slits_header.magic));
+	slits_header.version = KEOGRAM_SLITS_VERSION;
+	slits_header.width = cf->img_width;
+	slits_header.height = cf->img_height;
+	slits_header.channels = nchan;
+	slits_header.bitDepth = depth == CV_16U ? 16 : 8;
+	return(true);
+}
+
+// Add the middle column of "image".
+// The entries are in the order the threads get to them; keogram finds them by name.
+void add_slit(char const* filename, cv::Mat const& image)
+{
+	char const* name = base_name(filename);
+	if (strlen(name) >= sizeof(slitInfo::name) || image.rows != (int) slits_header.height ||
+		image.channels() != (int) slits_header.channels || image.depth() != depth) {
+		// keogram reads all the images when one is missing.
+		stdio_mutex.lock();
+		fprintf(stderr, "WARNING: %s: can't save its slit\n", filename);
+		stdio_mutex.unlock();
+		return;
+	}
+
+	std::vector<unsigned char> entry(slitEntrySize(slits_header), 0);
+	slitInfo* info = (slitInfo*) entry.data();
+	frameRecord const* record = findFrameRecord(journal, filename);
+	info->start_us = record == NULL ? -1 : record->start_us;
+	strcpy(info->name, name);
+	cv::Mat column = image.col(image.cols / 2).clone();
+	memcpy(entry.data() + sizeof(slitInfo), column.data, column.total() * column.elemSize());
+
+	uint32_t i = slits_count++;
+	if (pwrite(slits_fd, entry.data(), entry.size(), slitEntryOffset(slits_header, i)) != (ssize_t) entry.size())
+		slits_failed = true;
+}
+
+// Write the header and put the slits file in place.
+bool close_slits(struct config_t* cf)
+{
+	slits_header.count = slits_header.capacity = slits_count;
+	bool ok = ! slits_failed &&
+		pwrite(slits_fd, &slits_header, sizeof(slits_header), 0) == (ssize_t) sizeof(slits_header);
+	ok = close(slits_fd) == 0 && ok;
+	std::string file = cf->img_src_dir + "/" + KEOGRAM_SLITS_NAME;
+	if (ok && rename(slits_temp.c_str(), file.c_str()) == 0) {
+		if (cf->verbose)
+			fprintf(stderr, "Saved %u keogram slits in '%s'\n", slits_header.count, file.c_str());
+		return(true);
+	}
+	fprintf(stderr, "ERROR: unable to save keogram slits in '%s': %s\n", file.c_str(), strerror(errno));
+	unlink(slits_temp.c_str());
+	return(false);
+}
+
+// ---------- timelapse
+
+// The frames are written as a YUV4MPEG2 stream, which ffmpeg reads with "-f yuv4mpegpipe".
+// They have to be written in order but the threads finish images in any order, so a thread
+// doesn't start an image more than "frames_window" after the next one to write.
+// That limits how many frames are held at once.
+FILE* frames_file = NULL;
+cv::Size frame_size;
+std::mutex frames_mutex;
+std::condition_variable frames_cv;
+std::vector<cv::Mat> frames;			// by file number; empty if the image wasn't used
+std::vector<char> frame_done;			// by file number
+unsigned long next_frame = 0;			// the next frame to write
+unsigned long frames_window = 0;
+bool frames_failed = false;
+
+bool open_frames(struct config_t* cf)
+{
+	if (cf->dst_frames == "-") {
+		frames_file = stdout;
+	} else {
+		frames_file = fopen(cf->dst_frames.c_str(), "wb");
+		if (frames_file == NULL) {
+			fprintf(stderr, "ERROR: unable to create '%s': %s\n", cf->dst_frames.c_str(), strerror(errno));
+			return(false);
+		}
+	}
+
+	// As with ffmpeg's scale filter, a missing width or height is the images'.
+	// 4:2:0 needs an even width and height.
+	int width = cf->video_width ? cf->video_width : cf->img_width;
+	int height = cf->video_height ? cf->video_height : cf->img_height;
+	frame_size = cv::Size(width & ~1, height & ~1);
+
+	// OpenCV's YUV is BT.601 with Y from 16 to 235.
+	fprintf(frames_file, "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C420jpeg XCOLORRANGE=LIMITED\n",
+		frame_size.width, frame_size.height, cf->fps);
+
+	frames.resize(nfiles);
+	frame_done.assign(nfiles, false);
+	frames_window = 2 * cf->num_threads;
+	return(true);
+}
+
+// Turn "image" into a frame for the video.
+void make_frame(cv::Mat const& image, cv::Mat* frame)
+{
+	cv::Mat bgr = image;
+	if (bgr.depth() == CV_16U)
+		bgr.convertTo(bgr, CV_8U, 1.0 / 256);
+	if (bgr.channels() == 1)
+		cv::cvtColor(bgr, bgr, cv::COLOR_GRAY2BGR);
+	else if (bgr.channels() == 4)
+		cv::cvtColor(bgr, bgr, cv::COLOR_BGRA2BGR);
+	if (bgr.cols != frame_size.width || bgr.rows != frame_size.height)
+		cv::resize(bgr, bgr, frame_size, 0, 0, cv::INTER_AREA);
+	cv::cvtColor(bgr, *frame, cv::COLOR_BGR2YUV_I420);
+}
+
+// Wait until file "f" is close enough to the next frame to write.
+void wait_for_frame_room(unsigned long f)
+{
+	std::unique_lock<std::mutex> lock(frames_mutex);
+	frames_cv.wait(lock, [f]() { return(f < next_frame + frames_window); });
+}
+
+// File "f" is done; "frame" is empty if it wasn't used.
+void frame_ready(unsigned long f, cv::Mat const& frame)
+{
+	std::lock_guard<std::mutex> lock(frames_mutex);
+	frames[f] = frame;
+	frame_done[f] = true;
+	frames_cv.notify_all();
+}
+
+// Write the frames in order as they're ready, until all have been written.
+void write_frames(struct config_t* cf)
+{
+	std::unique_lock<std::mutex> lock(frames_mutex);
+	while (next_frame < nfiles) {
+		frames_cv.wait(lock, []() { return(frame_done[next_frame]); });
+		cv::Mat frame = frames[next_frame];
+		frames[next_frame].release();
+		lock.unlock();
+
+		if (! frame.empty() && ! frames_failed) {
+			size_t bytes = frame.total() * frame.elemSize();
+			if (fputs("FRAME\n", frames_file) == EOF || fwrite(frame.data, 1, bytes, frames_file) != bytes) {
+				// Probably ffmpeg quit.  Keep going for the keogram and startrails.
+				fprintf(stderr, "ERROR: unable to write timelapse frames: %s\n", strerror(errno));
+				frames_failed = true;
+			}
+		}
+
+		lock.lock();
+		next_frame++;
+		frames_cv.notify_all();
+	}
+}
+
+bool close_frames(struct config_t* cf)
+{
+	if (frames_file == stdout)
+		return(fflush(stdout) == 0 && ! frames_failed);
+	return(fclose(frames_file) == 0 && ! frames_failed);
+}
+
+// ---------- all together
+
+// Each thread's buffers, reused for every image so once they're big enough,
+// reading images doesn't allocate memory.
+struct thread_buffers {
+	std::vector<uchar> file;
+	cv::Mat decoded;
+	cv::Mat repaired;
+};
+
+// Use image "f" for everything it's needed for.
+// Set "frame" to its video frame if it's in the video.
+void process_file(struct config_t* cf, glob_t* files, int f, cv::Mat* stats, cv::Mat* thread_accumulator, cv::Mat* frame,
+				  thread_buffers* buffers)
+{
+	const int msg_size = 500;
+	char msg[msg_size];
+	char* filename = files->gl_pathv[f];
+
+	// The journal has the mean the startrails and statistics need, so images too bright
+	// for the startrails only need to be read for the keogram and video.
+	double image_mean = -1;
+	frameRecord const* record = savedFrameRecord(journal, filename, nchan, cf->img_width, cf->img_height);
+	if (record != NULL) {
+		image_mean = nightRecordMean(*record);
+		if (cf->verbose > 1) {
+			stdio_mutex.lock();
+			fprintf(stderr, "[%*d/%lu] %s, channels=%d (journal), mean=%.3f\n",
+				s_len, f+1, nfiles, filename, record->channels, image_mean);
+			stdio_mutex.unlock();
+		}
+		stats->col(f) = image_mean;
+	}
+	bool for_startrails = cf->startrails_enabled && (image_mean < 0 || image_mean <= cf->brightness_limit);
+	if (record != NULL && ! for_startrails && ! cf->keogram_enabled && ! cf->frames_enabled)
+		return;
+
+	// timelapse.sh puts every image in the video, whatever its size, so only the
+	// keogram, startrails, and statistics skip images that aren't the "-s" size.
+	if (! readFileContents(filename, &buffers->file)) {
+		if (cf->verbose) {
+			stdio_mutex.lock();
+			fprintf(stderr, "Error reading file '%s': no data\n", filename);
+			stdio_mutex.unlock();
+		}
+		return;
+	}
+	msg[0] = '\0';
+	if (! read_file(cf, filename, &buffers->decoded, f+1, msg, msg_size, ! cf->frames_enabled, &buffers->file))
+		return;
+	cv::Mat imagesrc = buffers->decoded;
+
+	if (cf->frames_enabled) {
+		make_frame(imagesrc, frame);
+		if (imagesrc.cols != cf->img_width || imagesrc.rows != cf->img_height) {
+			if (cf->verbose) {
+				stdio_mutex.lock();
+				fprintf(stderr, "%s: image size %dx%d does not match expected size %dx%d; only in the video\n",
+					filename, imagesrc.cols, imagesrc.rows, cf->img_width, cf->img_height);
+				stdio_mutex.unlock();
+			}
+			return;
+		}
+		if (record != NULL && ! for_startrails && ! cf->keogram_enabled)
+			return;
+	}
+
+	if (imagesrc.channels() != nchan && cf->verbose) {
+		stdio_mutex.lock();
+		fprintf(stderr, "%s: repairing channel mismatch from %d to %d\n", filename, imagesrc.channels(), nchan);
+		stdio_mutex.unlock();
+	}
+	imagesrc = matchChannels(imagesrc, nchan, &buffers->repaired);
+
+	if (record == NULL) {
+		image_mean = nightImageMean(imagesrc);
+		if (cf->verbose > 1) {
+			stdio_mutex.lock();
+			fprintf(stderr, "%s, mean=%.3f\n", msg, image_mean);
+			stdio_mutex.unlock();
+		}
+		stats->col(f) = image_mean;
+	}
+
+	if (cf->startrails_enabled)
+		addToStartrails(imagesrc, image_mean, cf->brightness_limit, thread_accumulator);
+
+	if (cf->keogram_enabled)
+		add_slit(filename, imagesrc);
+}
+
+void worker(int thread_num,						// thread num
+			struct config_t* cf,				// config
+			glob_t* files,						// file list
+			std::mutex* mtx,					// mutex
+			cv::Mat* stats,						// statistics
+			cv::Mat* main_accumulator,			// accumulated startrails
+			file_queue* queue)					// files not yet processed
+{
+	cv::Mat thread_accumulator;
+	thread_buffers buffers;
+	unsigned long first, last;
+
+	while (queue->take(&first, &last)) {
+		for (unsigned long f = first; f <= last; f++) {
+			cv::Mat frame;
+			if (cf->frames_enabled)
+				wait_for_frame_room(f);
+			process_file(cf, files, f, stats, &thread_accumulator, &frame, &buffers);
+			if (cf->frames_enabled)
+				frame_ready(f, frame);
+		}
+	}
+
+	if (cf->startrails_enabled)
+		mergeStartrails(thread_accumulator, main_accumulator, *mtx);
+}
+
+void parse_args(int argc, char** argv, struct config_t* cf) {
+	int c, tmp;
+
+	cf->verbose = 0;
+	cf->keogram_enabled = false;
+	cf->startrails_enabled = false;
+	cf->frames_enabled = false;
+	cf->img_height = cf->img_width = 0;
+	cf->video_height = cf->video_width = 0;
+	cf->fps = 25;
+	cf->brightness_limit = 0.35;	// not terrible in the city
+	cf->nice_level = 10;
+	cf->num_threads = std::thread::hardware_concurrency();
+
+	while (1) {		// getopt loop
+		int option_index = 0;
+		static struct option long_options[] = {
+			{"brightness", required_argument, 0, 'b'},
+			{"directory", required_argument, 0, 'd'},
+			{"extension", required_argument, 0, 'e'},
+			{"fps", required_argument, 0, 'F'},
+			{"keogram", no_argument, 0, 'k'},
+			{"max-threads", required_argument, 0, 'Q'},
+			{"nice-level", required_argument, 0, 'q'},
+			{"output", required_argument, 0, 'o'},
+			{"image-size", required_argument, 0, 's'},
+			{"timelapse", required_argument, 0, 't'},
+			{"video-size", required_argument, 0, 'V'},
+			{"verbose", no_argument, 0, 'v'},
+			{"help", no_argument, 0, 'h'},
+			{0, 0, 0, 0}
+		};
+
+		c = getopt_long(argc, argv, "hvkb:d:e:F:Q:q:o:s:t:V:", long_options, &option_index);
+		if (c == -1)
+			break;
+
+		switch (c) {
+			case 'h':
+				usage_and_exit(0);
+				// NOTREACHED
+				break;
+			case 'v':
+				cf->verbose++;
+				break;
+			case 'k':
+				cf->keogram_enabled = true;
+				break;
+			case 's':
+			case 'V':
+				int height, width;
+				parseImageSize(optarg, &width, &height);
+				if (c == 'V' && (width == 0) != (height == 0)) {
+					fprintf(stderr, "WARNING: Video size '%s' is missing the %s; using the images'\n",
+						optarg, width == 0 ? "width" : "height");
+				}
+				if (c == 's') {
+					cf->img_height = height;
+					cf->img_width = width;
+				} else {
+					cf->video_height = height;
+					cf->video_width = width;
+				}
+				break;
+			case 'b':
+				if (! parseBrightnessLimit(optarg, &cf->brightness_limit))
+					usage_and_exit(1);
+				break;
+			case 'd':
+				cf->img_src_dir = optarg;
+				break;
+			case 'e':
+				cf->img_src_ext = optarg;
+				break;
+			case 'F':
+				tmp = atoi(optarg);
+				if (tmp >= 1)
+					cf->fps = tmp;
+				else
+					fprintf(stderr, "WARNING: Invalid frames per second %d; using %d\n", tmp, cf->fps);
+				break;
+			case 'Q':
+				parseNumThreads(optarg, &cf->num_threads);
+				break;
+			case 'q':
+				cf->nice_level = parseNiceLevel(optarg);
+				break;
+			case 'o':
+				cf->dst_startrails = optarg;
+				cf->startrails_enabled = true;
+				break;
+			case 't':
+				cf->dst_frames = optarg;
+				cf->frames_enabled = true;
+				break;
+			default:
+				break;
+		}	// option switch
+	}		// getopt loop
+}
+
+void usage_and_exit(int x) {
+	std::cout << "Usage: nightproducts [-v] -d <dir> -e <ext> [-k] [-b <brightness> -o <output>]"
+		" [-t <frames> [-V <WxH>] [-F <fps>]] [-s <WxH>] [-Q <max-threads>] [-q <nice>]" << std::endl;
+	if (x) {
+		std::cout << KRED
+			<< "Source directory and file extension are always required," << std::endl
+			<< "as is at least one of -k, -o, and -t."
+			<< KNRM << std::endl;
+	}
+
+	std::cout << std::endl << "Reads each image once for all of:" << std::endl;
+	std::cout << "  the keogram slits file, so keogram doesn't need to read the images," << std::endl;
+	std::cout << "  the startrails image and the images' brightness statistics," << std::endl;
+	std::cout << "  the frames for the timelapse video." << std::endl;
+
+	std::cout << std::endl << "Arguments:" << std::endl;
+	std::cout << "-h | --help : display this help, then exit" << std::endl;
+	std::cout << "-v | --verbose : increase log verbosity" << std::endl;
+	std::cout << "-d | --directory <str> : directory from which to read images" << std::endl;
+	std::cout << "-e | --extension <str> : filter images to just this extension" << std::endl;
+	std::cout << "-Q | --max-threads <int> : limit maximum number of processing threads (all cpus)" << std::endl;
+	std::cout << "-q | --nice-level <int> : nice(2) level of processing threads (10)" << std::endl;
+	std::cout << "-s | --image-size <int>x<int> : restrict processed images to this size" << std::endl;
+	std::cout << "-k | --keogram : save the middle column of each image in the directory's keogram slits file" << std::endl;
+	std::cout << "-o | --output <str> : startrails image filename" << std::endl;
+	std::cout << "-b | --brightness <float> : startrails brightness limit, from 0 (black) to 1 (white). (0.35)" << std::endl;
+	std::cout << "-t | --timelapse <str> : file to write the video frames to as YUV4MPEG2, or - for stdout" << std::endl;
+	std::cout << "-V | --video-size <int>x<int> : size of the video frames (size of the images)" << std::endl;
+	std::cout << "-F | --fps <int> : frames per second of the video (25)" << std::endl;
+
+	std::cout << std::endl;
+	std::cout << "ex: nightproducts -d ../images/20220710/ -e jpg -k -b 0.1 -o startrails.jpg -t - | \\" << std::endl;
+	std::cout << "      ffmpeg -f yuv4mpegpipe -i - allsky.mp4" << std::endl;
+	exit(x);
+}
+
+int main(int argc, char* argv[]) {
+	struct config_t config;
+	int r, exit_code = 0;
+
+	parse_args(argc, argv, &config);
+
+	if (config.img_src_dir.empty() || config.img_src_ext.empty() ||
+		! (config.keogram_enabled || config.startrails_enabled || config.frames_enabled))
+		usage_and_exit(3);
+
+	r = setpriority(PRIO_PROCESS, 0, config.nice_level);
+	if (r) {
+		config.nice_level = getpriority(PRIO_PROCESS, 0);
+		fprintf(stderr, "unable to set nice level: %s\n", strerror(errno));
+	}
+
+	std::string ext = "";
+	if (config.startrails_enabled) {
+		ext = startrailsExtension(config.dst_startrails);
+		if (ext.empty()) {
+			fprintf(stderr, KRED "Output file '%s' is missing extension (.jpg or .png)\n\n",
+					config.dst_startrails.c_str());
+			usage_and_exit(3);
+		}
+	}
+
+	// Find files
+	glob_t files;
+	std::string wildcard = config.img_src_dir + "/*." + config.img_src_ext;
+	glob(wildcard.c_str(), 0, NULL, &files);
+	nfiles = files.gl_pathc;
+	if (config.frames_enabled)
+		sort_by_time(&files);
+	if (nfiles == 0) {
+		globfree(&files);
+		fprintf(stderr, "ERROR: No images found, exiting.\n");
+		exit(1);
+	}
+	// Determine width of the number of files, e.g., "1234" is 4 characters wide.
+	sprintf(s_, "%d", (int)nfiles);
+	s_len = strlen(s_);
+
+	journal = readFrameJournal(config.img_src_dir);
+	if (config.verbose > 1)
+		fprintf(stderr, "%lu images in the journal\n", (unsigned long) journal.size());
+
+	// Set the global "nchan" and "depth" variables from one of the images.
+	// Any subsequent file with a different number of channels will be converted to
+	// the sample file's number.
+	// Ditto for the width and height if not specified on the command line.
+	const int sample_file_num = 0;	// 1st file
+	char *sample_file = files.gl_pathv[sample_file_num];
+	frameRecord const* sample_record = savedFrameRecord(journal, sample_file, nchan, config.img_width, config.img_height);
+	if (sample_record != NULL) {
+		nchan = sample_record->channels;
+		depth = sample_record->bitDepth == 16 ? CV_16U : CV_8U;
+		if (config.img_width == 0 && config.img_height == 0) {
+			config.img_width = sample_record->width;
+			config.img_height = sample_record->height;
+		}
+		if (config.verbose > 1) {
+			fprintf(stderr, "Getting nchan and size from the journal for: '%s'\n", sample_file);
+		}
+	} else {
+		cv::Mat temp;
+		char not_used[1];
+		if (! read_file(&config, sample_file, &temp, sample_file_num+1, not_used, 0)) {
+			fprintf(stderr, "ERROR: Unable to read sample file '%s'; quitting\n", sample_file);
+			exit(1);
+		}
+		if (config.verbose > 1) {
+			fprintf(stderr, "Getting nchan and size from: '%s'\n", sample_file);
+		}
+		nchan = temp.channels();
+		depth = temp.depth();
+		if (config.img_width == 0 && config.img_height == 0) {
+			config.img_width = temp.cols;
+			config.img_height = temp.rows;
+		}
+	}
+	if (config.verbose > 1) {
+		fprintf(stderr, "\tnchan = %d\n", nchan);
+		fprintf(stderr, "\tsize = %d x %d\n", config.img_width, config.img_height);
+	}
+
+	if (config.keogram_enabled && have_all_slits(&config, &files)) {
+		if (config.verbose)
+			fprintf(stderr, "The keogram slits file already has every image\n");
+		config.keogram_enabled = false;
+	}
+	if (config.keogram_enabled && ! open_slits(&config)) {
+		config.keogram_enabled = false;
+		exit_code = 2;
+	}
+
+	if (config.frames_enabled) {
+		// Let write() report a reader that went away instead of being killed.
+		signal(SIGPIPE, SIG_IGN);
+		if (! open_frames(&config)) {
+			config.frames_enabled = false;
+			exit_code = 2;
+		}
+	}
+
+	std::mutex accumulated_mutex;
+	cv::Mat accumulated;
+	cv::Mat stats;
+	stats.create(1, nfiles, CV_64F);
+	// initialize stats to NAN so images that weren't read aren't counted.
+	stats = NAN;
+
+	// The video frames are written as they're ready, in order, so memory use doesn't grow with the night.
+	file_queue queue(nfiles, config.num_threads);
+	if (config.frames_enabled)
+		queue.chunk = 1;
+	std::vector<std::thread> threadpool;
+	for (int tid = 0; tid < config.num_threads; tid++)
+		threadpool.push_back(std::thread(worker, tid, &config, &files,
+										 &accumulated_mutex, &stats, &accumulated, &queue));
+	if (config.frames_enabled)
+		write_frames(&config);
+	for (auto& t : threadpool)
+		t.join();
+
+	if (config.keogram_enabled && ! close_slits(&config))
+		exit_code = 2;
+	if (config.frames_enabled && ! close_frames(&config))
+		exit_code = 2;
+
+	// Calculate some descriptive statistics, as startrails does.
+	nightStatistics ds;
+	bool have_stats = getNightStatistics(stats, &ds);
+	if (have_stats) {
+		// Not in the middle of the video frames.
+		FILE* out = frames_file == stdout ? stderr : stdout;
+		fprintf(out, "Minimum: %g maximum: %g mean: %g median: %g\n", ds.min, ds.max, ds.mean, ds.median);
+	}
+
+	// If we still don't have an image (no images below threshold), copy the
+	// minimum mean image so we see why
+	if (config.startrails_enabled) {
+		if (accumulated.empty() && have_stats) {
+			fprintf(stderr, "No images below threshold %.3f, writing the minimum mean image only.\n",
+					config.brightness_limit);
+			accumulated = cv::imread(files.gl_pathv[ds.minIndex], cv::IMREAD_UNCHANGED);
+		}
+		if (! saveStartrails(config.dst_startrails, ext, accumulated))
+			exit_code = 2;
+	}
+	globfree(&files);
+
+	exit(exit_code);
+}
@@ -0,0 +1,234 @@
+// Remove "bad" images: empty files, corrupt files, and ones too dark or too bright.
+// SPDX-License-Identifier: MIT
+//
+// This does what removeBadImages.sh did with ImageMagick, but checks all the images in
+// a directory at once using all the CPUs, and decodes JPEGs at 1/8 size.
+// removeBadImages.sh runs this if it exists, and uses its output the same way.
+
+using namespace std;
+
+#include <getopt.h>
+#include <glob.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "include/bad_images.h"
+#include "include/frame_journal.h"
+
+#define KNRM "\x1B[0m"
+#define KRED "\x1B[31m"
+
+struct config_t {
+	std::string directory;
+	std::string file;
+	std::string pattern;
+	std::string log;
+	badImageThresholds thresholds;
+	double mean;
+	bool debug;
+	int num_threads;
+	int verbose;
+} config;
+
+void parse_args(int, char**, struct config_t*);
+void usage_and_exit(int);
+
+void parse_args(int argc, char** argv, struct config_t* cf) {
+	int c, tmp, ncpu = std::thread::hardware_concurrency();
+
+	cf->pattern = "image-*.jpg";
+	cf->mean = -1;
+	cf->debug = false;
+	cf->verbose = 0;
+	cf->num_threads = ncpu;
+
+	while (1) {		// getopt loop
+		int option_index = 0;
+		static struct option long_options[] = {
+			{"low", required_argument, 0, 'l'},
+			{"high", required_argument, 0, 'H'},
+			{"mean", required_argument, 0, 'm'},
+			{"pattern", required_argument, 0, 'p'},
+			{"log", required_argument, 0, 'o'},
+			{"max-threads", required_argument, 0, 'Q'},
+			{"debug", no_argument, 0, 'd'},
+			{"verbose", no_argument, 0, 'v'},
+			{"help", no_argument, 0, 'h'},
+			{0, 0, 0, 0}
+		};
+
+		c = getopt_long(argc, argv, "hvdl:H:m:p:o:Q:", long_options, &option_index);
+		if (c == -1)
+			break;
+
+		switch (c) {
+			case 'h':
+				usage_and_exit(0);
+				// NOTREACHED
+				break;
+			case 'v':
+				cf->verbose++;
+				break;
+			case 'd':
+				cf->debug = true;
+				break;
+			case 'l':
+				cf->thresholds.low = optarg;
+				break;
+			case 'H':
+				cf->thresholds.high = optarg;
+				break;
+			case 'm':
+				cf->mean = atof(optarg);
+				break;
+			case 'p':
+				cf->pattern = optarg;
+				break;
+			case 'o':
+				cf->log = optarg;
+				break;
+			case 'Q':
+				tmp = atoi(optarg);
+				if ((tmp >= 1) && (tmp <= ncpu))
+					cf->num_threads = tmp;
+				else
+					fprintf(stderr, "WARNING: Invalid number of threads %d; using %d\n", tmp, cf->num_threads);
+				break;
+			default:
+				break;
+		}	// option switch
+	}		// getopt loop
+
+	if (optind < argc)
+		cf->directory = argv[optind++];
+	if (optind < argc)
+		cf->file = argv[optind++];
+}
+
+void usage_and_exit(int x) {
+	std::cout << "Usage: removebadimages [-v] [-d] [-l <low>] [-H <high>] [-p <pattern>] [-o <log>]"
+		" [-Q <max-threads>] directory [file [-m <mean>]]" << std::endl;
+	if (x) {
+		std::cout << KRED << "A directory is required." << KNRM << std::endl;
+	}
+
+	std::cout << std::endl << "Arguments:" << std::endl;
+	std::cout << "-h | --help : display this help, then exit" << std::endl;
+	std::cout << "-v | --verbose : increase log verbosity" << std::endl;
+	std::cout << "-d | --debug : show which images are bad but don't remove them" << std::endl;
+	std::cout << "-l | --low <float> : images with a mean percent below this are bad; 0 disables (0)" << std::endl;
+	std::cout << "-H | --high <float> : images with a mean percent above this are bad; 0 disables (0)" << std::endl;
+	std::cout << "-m | --mean <float> : mean (0.0 - 1.0) of 'file' when it was saved, so it isn't read" << std::endl;
+	std::cout << "-p | --pattern <str> : images in the directory to check (image-*.jpg)" << std::endl;
+	std::cout << "-o | --log <str> : file to list the bad images in" << std::endl;
+	std::cout << "-Q | --max-threads <int> : limit maximum number of processing threads (all cpus)" << std::endl;
+	std::cout << std::endl;
+	std::cout << "With a 'file', its mean is output if it's good, or the reason it's bad." << std::endl;
+	std::cout << "Otherwise the number of bad images is output." << std::endl;
+	std::cout << "The exit code is 99 if any images are bad." << std::endl;
+	std::cout << std::endl;
+	std::cout << "ex: removebadimages --low 0.5 --high 90 ../images/20230710" << std::endl;
+	exit(x);
+}
+
+// Remove a bad image and its thumbnail.
+static void remove_image(std::string const& name)
+{
+	unlink(name.c_str());
+	std::string thumbnail = "thumbnails/" + name.substr(name.find_last_of('/') + 1);
+	unlink(thumbnail.c_str());
+}
+
+int main(int argc, char* argv[]) {
+	struct config_t& cf = config;
+	parse_args(argc, argv, &cf);
+
+	if (cf.directory.empty())
+		usage_and_exit(3);
+
+	// File names are relative to the directory, like removeBadImages.sh's.
+	if (chdir(cf.directory.c_str()) != 0) {
+		fprintf(stderr, "ERROR: '%s' is not a directory\n", cf.directory.c_str());
+		exit(2);
+	}
+	char const* r = cf.debug ? "would be removed" : "removed";
+
+	if (! cf.file.empty()) {
+		badImageResult result = checkImage(cf.file, cf.thresholds, cf.mean);
+		if (result.bad) {
+			printf("%s\n", result.reason.c_str());
+			if (! cf.debug)
+				remove_image(cf.file);
+			exit(99);
+		}
+		if (cf.debug)
+			fprintf(stderr, "===== OK: %s, MEAN=%0.2f, HIGH=%s, LOW=%s\n", cf.file.c_str(),
+				result.mean * 100, cf.thresholds.high.c_str(), cf.thresholds.low.c_str());
+		printf("%f\n", result.mean);
+		exit(0);
+	}
+
+	glob_t files;
+	std::string wildcard = "./" + cf.pattern;
+	glob(wildcard.c_str(), 0, NULL, &files);
+	size_t nfiles = files.gl_pathc;
+
+	// Images the capture program saved have their mean in the journal, so only the
+	// others need to be read.
+	std::unordered_map<std::string, frameRecord> journal = readFrameJournal(".");
+	if (cf.verbose > 1)
+		fprintf(stderr, "%lu images in the journal\n", (unsigned long) journal.size());
+
+	// Each thread checks the next file not yet done.
+	std::vector<badImageResult> results(nfiles);
+	std::atomic<size_t> next_file(0);
+	auto worker = [&]() {
+		size_t f;
+		while ((f = next_file++) < nfiles) {
+			frameRecord const* record = savedFrameRecord(journal, files.gl_pathv[f], 0, 0, 0);
+			results[f] = checkImage(files.gl_pathv[f], cf.thresholds, record == NULL ? -1 : record->mean);
+		}
+	};
+	std::vector<std::thread> threadpool;
+	for (int t = 1; t < std::min(cf.num_threads, (int) nfiles); t++)
+		threadpool.push_back(std::thread(worker));
+	worker();
+	for (auto& t : threadpool)
+		t.join();
+
+	FILE* log = NULL;
+	if (! cf.log.empty() && (log = fopen(cf.log.c_str(), "w")) == NULL)
+		fprintf(stderr, "WARNING: Unable to write to '%s': %s\n", cf.log.c_str(), strerror(errno));
+
+	int num_bad = 0;
+	for (size_t f = 0; f < nfiles; f++) {
+		badImageResult const& result = results[f];
+		if (result.bad) {
+			num_bad++;
+			if (log != NULL)
+				fprintf(log, "%s %s\n", r, result.reason.c_str());
+			if (cf.verbose)
+				fprintf(stderr, "%s %s\n", r, result.reason.c_str());
+			if (! cf.debug)
+				remove_image(files.gl_pathv[f]);
+		} else if (cf.debug) {
+			fprintf(stderr, "===== OK: %s, MEAN=%0.2f, HIGH=%s, LOW=%s\n", files.gl_pathv[f],
+				result.mean * 100, cf.thresholds.high.c_str(), cf.thresholds.low.c_str());
+		}
+	}
+	if (log != NULL)
+		fclose(log);
+	globfree(&files);
+
+	printf("%d\n", num_bad);
+	exit(num_bad == 0 ? 0 : 99);
+}
@@ -11,17 +11,23 @@ using namespace std;
 #include <sys/time.h>
 #include <unistd.h>
 #include <algorithm>
+#include <atomic>
 #include <cstdlib>
 #include <iostream>
 #include <mutex>
 #include <string>
 #include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgproc.hpp>
 #include <opencv2/opencv.hpp>
 
+#include "include/file_queue.h"
+#include "include/frame_journal.h"
+#include "include/night_images.h"
+
 #define KNRM "\x1B[0m"
 #define KRED "\x1B[31m"
 #define KGRN "\x1B[32m"
@@ -36,6 +42,7 @@ struct config_t {
 	std::string img_src_ext;
 	std::string dst_startrails;
 	bool startrails_enabled;
+	bool benchmark;
 	int num_threads;
 	int nice_level;
 	int img_width;
@@ -49,44 +56,53 @@ int nchan = 0;
 unsigned long nfiles = 0;
 int s_len = 0;	// length in characters of nfiles, e.g. if nfiles == "1000", s_len = 4.
 
+// What the capture program recorded about each image, by file name.
+std::unordered_map<std::string, frameRecord> journal;
+
+// How many times a reused buffer had to grow (be given a new block of memory) while reading
+// images, and the number of images read, to show the buffers are reused.
+// This doesn't count memory OpenCV and libjpeg allocate and free while decoding.
+std::atomic<unsigned long> buffer_regrowths(0);
+std::atomic<unsigned long> images_read(0);
+// Images whose mean came from a 1/8 size preview, so weren't fully decoded.
+std::atomic<unsigned long> images_previewed(0);
+
+// A preview's mean can differ slightly from the full image's, so only previews clearly
+// over the brightness limit are rejected without a full decode.
+#define PREVIEW_MARGIN	0.02
+
+// Return the mean of a JPEG file in "buffer", scaled to 0-1, from a 1/8 size decode.
+// libjpeg makes that from the DCT coefficients without doing most of the work of a full decode.
+// Return -1 if the file isn't a JPEG (other formats decode the whole image anyway) or can't be decoded.
+double preview_mean(std::vector<uchar> const& buffer, cv::Mat* preview)
+{
+	if (buffer.size() < 2 || buffer[0] != 0xFF || buffer[1] != 0xD8)
+		return(-1);
+
+	int flags = nchan == 1 ? cv::IMREAD_REDUCED_GRAYSCALE_8 : cv::IMREAD_REDUCED_COLOR_8;
+	if (cv::imdecode(buffer, flags, preview).empty())
+		return(-1);
+
+	cv::Scalar mean_scalar = cv::mean(*preview);
+	double image_mean = preview->channels() >= 3 ?
+		std::max(mean_scalar[0], std::max(mean_scalar[1], mean_scalar[2])) : mean_scalar[0];
+	return(image_mean / 255.0);		// JPEGs are always 8 bits
+}
+
 // Read a single file and return true on success and false on error.
 // On success, set "mat".
-bool read_file(struct config_t* cf, char* filename, cv::Mat* mat, int file_num, char *msg, int msg_size)
+// If "buffer" is given it already holds the file, from readFileContents(), and is decoded
+// into "mat"'s memory, which is only reallocated if the image doesn't fit.
+bool read_file(struct config_t* cf, char* filename, cv::Mat* mat, int file_num, char *msg, int msg_size,
+			   std::vector<uchar>* buffer = NULL)
 {
-	*mat = cv::imread(filename, cv::IMREAD_UNCHANGED);
-	if (! mat->data || mat->empty()) {
-		if (cf->verbose) {
-			stdio_mutex.lock();
-			fprintf(stderr, "Error reading file '%s': no data\n", filename);
-			stdio_mutex.unlock();
-		}
+	if (! readNightImage(filename, mat, cf->img_width, cf->img_height, cf->verbose, stdio_mutex, buffer))
 		return(false);
-	}
 
 	if (msg_size > 0 && cf->verbose > 1) {
 		snprintf(msg, msg_size, "[%*d/%lu] %s, channels=%d",
 			s_len, file_num, nfiles, filename, mat->channels());
 	}
-
-	if (mat->cols == 0 || mat->rows == 0) {
-		if (cf->verbose) {
-			stdio_mutex.lock();
-			fprintf(stderr, "%s: invalid image size %dx%d; ignoring file\n", filename, mat->cols, mat->rows);
-			stdio_mutex.unlock();
-		}
-		return(false);
-	}
-	if (cf->img_height && cf->img_width &&
-		(mat->cols != cf->img_width || mat->rows != cf->img_height)) {
-		if (cf->verbose) {
-			stdio_mutex.lock();
-			fprintf(stderr, "%s: image size %dx%d does not match expected size %dx%d; ignoring\n",
-				filename, mat->cols, mat->rows, cf->img_width, cf->img_height);
-			stdio_mutex.unlock();
-		}
-		return(false);
-	}
-
 	return(true);
 }
 
@@ -101,121 +117,185 @@ void startrail_worker(int thread_num,				// thread num
 					  glob_t* files,				// file list
 					  std::mutex* mtx,				// mutex
 					  cv::Mat* stats_ptr,			// statistics
-					  cv::Mat* main_accumulator)	// accumulated
+					  cv::Mat* main_accumulator,	// accumulated
+					  file_queue* queue)			// files not yet processed
 {
-	int start_num, end_num, batch_size;
 	cv::Mat thread_accumulator;
+	unsigned long first, last, num_processed = 0;
 
-	batch_size = nfiles / cf->num_threads;
-	start_num = thread_num * batch_size;
-	thread_num++;	// so messages start at human-friendly thread 1, not 0.
-
-	// last thread has more work to do if the number of images isn't multiple of
-	// the number of threads
-	if (thread_num == cf->num_threads)
-		end_num = nfiles - 1;
-	else
-		end_num = start_num + batch_size - 1;
+	// Reused for every image so once they're big enough, reading and accumulating don't allocate memory.
+	std::vector<uchar> file_buffer;
+	cv::Mat decoded, repaired, preview;
+	unsigned long regrowths = 0, num_read = 0, num_previewed = 0;
 
-	if (cf->verbose > 2 && cf->num_threads > 1) {
-		stdio_mutex.lock();
-		fprintf(stderr, "thread %d/%d processing files %*d-%d (%d/%lu)\n",
-			thread_num, cf->num_threads, s_len, start_num +1, end_num + 1,
-			end_num - start_num + 1, nfiles);
-		stdio_mutex.unlock();
-	}
+	thread_num++;	// so messages start at human-friendly thread 1, not 0.
 
 	const int msg_size = 500;
 	char msg[msg_size];
 	const int repair_msg_size = 500;
 	char repair_msg[repair_msg_size];
 
-	for (int f = start_num; f <= end_num; f++) {
-		char* filename = files->gl_pathv[f];
-		cv::Mat imagesrc;
-		msg[0] = '\0';
-		if (! read_file(cf, filename, &imagesrc, f+1, msg, msg_size)) continue;
+	while (queue->take(&first, &last)) {
+		for (int f = first; f <= (int) last; f++) {
+			num_processed++;
+			char* filename = files->gl_pathv[f];
+
+			// Images too bright to use don't need to be read if the journal has their mean.
+			frameRecord const* record = savedFrameRecord(journal, filename, nchan, cf->img_width, cf->img_height);
+			if (record != NULL) {
+				double image_mean = nightRecordMean(*record);
+				if (! cf->startrails_enabled || image_mean > cf->brightness_limit) {
+					if (cf->verbose > 1) {
+						stdio_mutex.lock();
+						fprintf(stderr, "[%*d/%lu] %s, channels=%d (journal), mean=%.3f\n",
+							s_len, f+1, nfiles, filename, record->channels, image_mean);
+						stdio_mutex.unlock();
+					}
+					stats_ptr->col(f) = image_mean;
+					continue;
+				}
+			}
 
-		repair_msg[0] = '\0';
-		if (imagesrc.channels() != nchan) {
-			if (cf->verbose) {
-				snprintf(repair_msg, repair_msg_size, "%s: repairing channel mismatch from %d to %d\n", filename, imagesrc.channels(), nchan);
+			size_t old_capacity = file_buffer.capacity();
+			bool ok = readFileContents(filename, &file_buffer);
+			regrowths += file_buffer.capacity() != old_capacity;
+			if (! ok) {
+				if (cf->verbose) {
+					stdio_mutex.lock();
+					fprintf(stderr, "Error reading file '%s': no data\n", filename);
+					stdio_mutex.unlock();
+				}
+				continue;
 			}
-			if (imagesrc.channels() < nchan)
-				cv::cvtColor(imagesrc, imagesrc, cv::COLOR_GRAY2BGR, nchan);
-			else	// imagesrc.channels() > nchan
-				cv::cvtColor(imagesrc, imagesrc, cv::COLOR_BGR2GRAY, nchan);
-		}
 
-		cv::Scalar mean_scalar = cv::mean(imagesrc);
-		double image_mean;
-		switch (imagesrc.channels()) {
-			default:	// mono case
-				image_mean = mean_scalar.val[0];
-				break;
-			case 3:		// for color choose maximum channel
-			case 4:
-				image_mean = cv::max(mean_scalar[0], cv::max(mean_scalar[1], mean_scalar[2]));
-			break;
-		}
-		// Scale to 0-1 range
-		switch (imagesrc.depth()) {
-			case CV_8U:
-				image_mean /= 255.0;
-				break;
-			case CV_16U:
-				image_mean /= 65535.0;
-				break;
-		}
-		if (cf->verbose > 1) {
-			stdio_mutex.lock();
-			fprintf(stderr, "%s, mean=%.3f\n", msg, image_mean);
-			stdio_mutex.unlock();
-		}
+			// Without the journal, a small preview is enough to reject images that are
+			// too bright, or to get the mean when only statistics are wanted.
+			if (record == NULL) {
+				uchar const* old_data = preview.data;
+				double image_mean = preview_mean(file_buffer, &preview);
+				regrowths += preview.data != old_data && preview.data != NULL;
+				if (image_mean >= 0 &&
+					(! cf->startrails_enabled || image_mean > cf->brightness_limit + PREVIEW_MARGIN)) {
+					if (cf->verbose > 1) {
+						stdio_mutex.lock();
+						fprintf(stderr, "[%*d/%lu] %s, channels=%d (preview), mean=%.3f\n",
+							s_len, f+1, nfiles, filename, preview.channels(), image_mean);
+						stdio_mutex.unlock();
+					}
+					num_previewed++;
+					stats_ptr->col(f) = image_mean;
+					continue;
+				}
+			}
 
-		// Want to print the message above before this one.
-		if (repair_msg[0] != '\0' && cf->verbose) {
-			stdio_mutex.lock();
-			fprintf(stderr, "%s", repair_msg);
-			stdio_mutex.unlock();
-		}
+			uchar const* old_data = decoded.data;
+			msg[0] = '\0';
+			ok = read_file(cf, filename, &decoded, f+1, msg, msg_size, &file_buffer);
+			regrowths += decoded.data != old_data && decoded.data != NULL;
+			if (! ok) continue;
+			num_read++;
 
-		// the matrix pointed to by stats_ptr has already been initialized to NAN
-		// so we just update the entry once the image is successfully loaded
-		stats_ptr->col(f) = image_mean;
+			repair_msg[0] = '\0';
+			if (decoded.channels() != nchan && cf->verbose) {
+				snprintf(repair_msg, repair_msg_size, "%s: repairing channel mismatch from %d to %d\n", filename, decoded.channels(), nchan);
+			}
+			old_data = repaired.data;
+			cv::Mat imagesrc = matchChannels(decoded, nchan, &repaired);
+			regrowths += repaired.data != old_data;
+
+			double image_mean = nightImageMean(imagesrc);
+			if (cf->verbose > 1) {
+				stdio_mutex.lock();
+				fprintf(stderr, "%s, mean=%.3f\n", msg, image_mean);
+				stdio_mutex.unlock();
+			}
 
-		if (cf->startrails_enabled && image_mean <= cf->brightness_limit) {
-			if (thread_accumulator.empty()) {
-				imagesrc.copyTo(thread_accumulator);
-			} else {
-				thread_accumulator = cv::max(thread_accumulator, imagesrc);
+			// Want to print the message above before this one.
+			if (repair_msg[0] != '\0' && cf->verbose) {
+				stdio_mutex.lock();
+				fprintf(stderr, "%s", repair_msg);
+				stdio_mutex.unlock();
 			}
-		}
-	}
 
-	if (cf->startrails_enabled) {
-		// skip unlucky threads that might have got only bad images
-		if (!thread_accumulator.empty()) {
-			mtx->lock();
-			if (main_accumulator->empty()) {
-				thread_accumulator.copyTo(*main_accumulator);
-			} else {
-				*main_accumulator = cv::max(thread_accumulator, *main_accumulator);
+			// the matrix pointed to by stats_ptr has already been initialized to NAN
+			// so we just update the entry once the image is successfully loaded
+			stats_ptr->col(f) = image_mean;
+
+			if (cf->startrails_enabled) {
+				bool first_image = thread_accumulator.empty();
+				if (addToStartrails(imagesrc, image_mean, cf->brightness_limit, &thread_accumulator))
+					regrowths += first_image;
 			}
-			mtx->unlock();
 		}
 	}
+
+	if (cf->verbose > 2 && cf->num_threads > 1) {
+		stdio_mutex.lock();
+		fprintf(stderr, "thread %d/%d processed %lu files, %lu buffer regrowths\n",
+			thread_num, cf->num_threads, num_processed, regrowths);
+		stdio_mutex.unlock();
+	}
+	buffer_regrowths += regrowths;
+	images_read += num_read;
+	images_previewed += num_previewed;
+
+	if (cf->startrails_enabled)
+		mergeStartrails(thread_accumulator, main_accumulator, *mtx);
+}
+
+// Read every image using "num_threads" threads.
+void run_workers(struct config_t* cf, glob_t* files, std::mutex* mtx, cv::Mat* stats, cv::Mat* accumulated, int num_threads)
+{
+	file_queue queue(nfiles, num_threads);
+	buffer_regrowths = 0;
+	images_read = 0;
+	images_previewed = 0;
+
+	std::vector<std::thread> threadpool;
+	for (int tid = 0; tid < num_threads; tid++)
+		threadpool.push_back(std::thread(startrail_worker, tid, cf, files,
+							 			 mtx, stats, accumulated, &queue));
+
+	for (auto& t : threadpool)
+		t.join();
+}
+
+// Time reading the images with 1 to cf->num_threads threads.
+void benchmark_threads(struct config_t* cf, glob_t* files)
+{
+	std::mutex mtx;
+	cv::Mat stats(1, nfiles, CV_64F), accumulated;
+	struct timeval start, done;
+	double one_thread_secs = 0;
+
+	// Once first so every run finds the images in the page cache.
+	run_workers(cf, files, &mtx, &stats, &accumulated, cf->num_threads);
+
+	printf("Threads  Seconds  Images/second  Speedup  Buffer regrowths/image\n");
+	for (int n = 1; n <= cf->num_threads; n++) {
+		accumulated.release();
+		gettimeofday(&start, NULL);
+		run_workers(cf, files, &mtx, &stats, &accumulated, n);
+		gettimeofday(&done, NULL);
+
+		double secs = (done.tv_sec - start.tv_sec) + (done.tv_usec - start.tv_usec) / 1000000.0;
+		if (n == 1)
+			one_thread_secs = secs;
+		printf("%7d  %7.2f  %13.1f  %6.2fx  %22.3f\n", n, secs, nfiles / secs, one_thread_secs / secs,
+			images_read == 0 ? 0.0 : (double) buffer_regrowths / images_read);
+	}
 }
 
 void parse_args(int argc, char** argv, struct config_t* cf) {
-	int c, tmp, ncpu = std::thread::hardware_concurrency();
+	int c;
 
 	cf->verbose = 0;
 	cf->startrails_enabled = true;
 	cf->img_height = cf->img_width = 0;
 	cf->brightness_limit = 0.35;	// not terrible in the city
 	cf->nice_level = 10;
-	cf->num_threads = ncpu;
+	cf->num_threads = std::thread::hardware_concurrency();
+	cf->benchmark = false;
 
 	while (1) {		// getopt loop
 		int option_index = 0;
@@ -228,12 +308,13 @@ void parse_args(int argc, char** argv, struct config_t* cf) {
 			{"output", required_argument, 0, 'o'},
 			{"image-size", required_argument, 0, 's'},
 			{"statistics", no_argument, 0, 'S'},
+			{"benchmark", no_argument, 0, 'B'},
 			{"verbose", no_argument, 0, 'v'},
 			{"help", no_argument, 0, 'h'},
 			{0, 0, 0, 0}
 		};
 
-		c = getopt_long(argc, argv, "hvSb:d:e:Q:q:o:s:", long_options, &option_index);
+		c = getopt_long(argc, argv, "hvSBb:d:e:Q:q:o:s:", long_options, &option_index);
 		if (c == -1)
 			break;
 
@@ -248,24 +329,15 @@ void parse_args(int argc, char** argv, struct config_t* cf) {
 			case 'S':
 				cf->startrails_enabled = false;
 				break;
+			case 'B':
+				cf->benchmark = true;
+				break;
 			case 's':
-				int height, width;
-				sscanf(optarg, "%dx%d", &width, &height);
-				// 122.8Mpx should be enough for anybody.
-				if (height < 0 || height > 9600 || width < 0 || width > 12800)
-					height = width = 0;
-				cf->img_height = height;
-				cf->img_width = width;
+				parseImageSize(optarg, &cf->img_width, &cf->img_height);
 				break;
 			case 'b':
-				double b;
-				b = atof(optarg);
-				if (b >= 0 && b <= 1.0)
-					cf->brightness_limit = b;
-				else {
-					fprintf(stderr, "ERROR: Invalid brightness level %f. Must be from 0 to 1.0; exiting\n", b);
+				if (! parseBrightnessLimit(optarg, &cf->brightness_limit))
 					usage_and_exit(1);
-				}
 				break;
 			case 'd':
 				cf->img_src_dir = optarg;
@@ -274,22 +346,10 @@ void parse_args(int argc, char** argv, struct config_t* cf) {
 				cf->img_src_ext = optarg;
 				break;
 			case 'Q':
-				tmp = atoi(optarg);
-				if ((tmp >= 1) && (tmp <= ncpu))
-					cf->num_threads = tmp;
-				else
-					fprintf(stderr, "WARNING: Invalid number of threads %d; using %d\n", tmp, cf->num_threads);
+				parseNumThreads(optarg, &cf->num_threads);
 				break;
 			case 'q':
-				tmp = atoi(optarg);
-				if (PRIO_MIN > tmp) {
-					tmp = PRIO_MIN;
-					fprintf(stderr, "WARNING: Clamping scheduler priority to PRIO_MIN (%d)\n", PRIO_MIN);
-				} else if (PRIO_MAX < tmp) {
-					fprintf(stderr, "WARNING: Clamping scheduler priority to PRIO_MAX (%d)\n", PRIO_MAX);
-					tmp = PRIO_MAX;
-				}
-				cf->nice_level = atoi(optarg);
+				cf->nice_level = parseNiceLevel(optarg);
 				break;
 			case 'o':
 				cf->dst_startrails = optarg;
@@ -301,7 +361,7 @@ void parse_args(int argc, char** argv, struct config_t* cf) {
 }
 
 void usage_and_exit(int x) {
-	std::cout << "Usage: startrails [-v] -d <dir> -e <ext> [-b <brightness> -o <output> | -S] "
+	std::cout << "Usage: startrails [-v] -d <dir> -e <ext> [-b <brightness> -o <output> | -S | -B] "
 		" [-s <WxH>] [-Q <max-threads>] [-q <nice>]" << std::endl;
 	if (x) {
 		std::cout << KRED
@@ -314,6 +374,7 @@ void usage_and_exit(int x) {
 	std::cout << "-h | --help : display this help, then exit" << std::endl;
 	std::cout << "-v | --verbose : increase log verbosity" << std::endl;
 	std::cout << "-S | --statistics : print image directory statistics without producing image" << std::endl;
+	std::cout << "-B | --benchmark : time reading the images with 1 to max-threads threads, then exit" << std::endl;
 	std::cout << "-d | --directory <str> : directory from which to read images" << std::endl;
 	std::cout << "-e | --extension <str> : filter images to just this extension" << std::endl;
 	std::cout << "-Q | --max-threads <int> : limit maximum number of processing threads (all cpus)" << std::endl;
@@ -344,17 +405,15 @@ int main(int argc, char* argv[]) {
 	}
 
 	std::string ext = "";
-	if (config.startrails_enabled) {
-		std::string extcheck = config.dst_startrails;
-		std::transform(extcheck.begin(), extcheck.end(), extcheck.begin(),
-						 [](unsigned char c) { return std::tolower(c); });
-
-		if (extcheck.rfind(".png") == string::npos && extcheck.rfind(".jpg") == string::npos) {
+	if (config.benchmark) {
+		// Nothing is written.
+	} else if (config.startrails_enabled) {
+		ext = startrailsExtension(config.dst_startrails);
+		if (ext.empty()) {
 			fprintf(stderr, KRED "Output file '%s' is missing extension (.jpg or .png)\n\n",
 					config.dst_startrails.c_str());
 			usage_and_exit(3);
 		}
-		ext = strrchr(config.dst_startrails.c_str(), '.') + 1;
 	} else {
 		config.brightness_limit = 0;
 		config.dst_startrails = "/dev/null";
@@ -384,15 +443,28 @@ int main(int argc, char* argv[]) {
 	// images with 1.0 brightness since no image data was read.
 	stats = NAN;
 
+	journal = readFrameJournal(config.img_src_dir);
+	if (config.verbose > 1)
+		fprintf(stderr, "%lu images in the journal\n", (unsigned long) journal.size());
+
 	// Set the global "nchan" variable to be the number of channels in one of the images.
 	// Any subsequent file with a different number of channels will be converted to
 	// the sample file's number.
 	// Ditto for the width and height.
 	// In both cases only set the variables if not specified on the command line.
-	cv::Mat temp;
 	const int sample_file_num = 0;	// 1st file
 	char *sample_file = files.gl_pathv[sample_file_num];
-	if (nchan == 0 || (config.img_width == 0 && config.img_height == 0)) {
+	int sample_channels = 0, sample_width = 0, sample_height = 0;
+	frameRecord const* sample_record = savedFrameRecord(journal, sample_file, nchan, config.img_width, config.img_height);
+	if (sample_record != NULL) {
+		sample_channels = sample_record->channels;
+		sample_width = sample_record->width;
+		sample_height = sample_record->height;
+		if (config.verbose > 1) {
+			fprintf(stderr, "Getting nchan and/or size from the journal for: '%s'\n", sample_file);
+		}
+	} else if (nchan == 0 || (config.img_width == 0 && config.img_height == 0)) {
+		cv::Mat temp;
 		char not_used[1];
 		if (! read_file(&config, sample_file, &temp, sample_file_num+1, not_used, 0)) {
 			fprintf(stderr, "ERROR: Unable to read sample file '%s'; quitting\n", sample_file);
@@ -401,54 +473,51 @@ int main(int argc, char* argv[]) {
 		if (config.verbose > 1) {
 			fprintf(stderr, "Getting nchan and/or size from: '%s'\n", sample_file);
 		}
+		sample_channels = temp.channels();
+		sample_width = temp.cols;
+		sample_height = temp.rows;
 	}
 	if (nchan == 0)
 	{
-		nchan = temp.channels();
+		nchan = sample_channels;
 		if (config.verbose > 1) {
 			fprintf(stderr, "\tnchan = %d\n", nchan);
 		}
 	}
 	// Set the width and height based on the same file if not specified on the command line.
 	if (config.img_width == 0 && config.img_height == 0) {
-		config.img_width = temp.cols;
-		config.img_height = temp.rows;
+		config.img_width = sample_width;
+		config.img_height = sample_height;
 		if (config.verbose > 1) {
 			fprintf(stderr, "\tsize = %d x %d\n", config.img_width, config.img_height);
 		}
 	}
 
-	std::vector<std::thread> threadpool;
-	for (int tid = 0; tid < config.num_threads; tid++)
-		threadpool.push_back(std::thread(startrail_worker, tid, &config, &files,
-							 			 &accumulated_mutex, &stats, &accumulated));
-
-	for (auto& t : threadpool)
-		t.join();
+	if (config.benchmark) {
+		benchmark_threads(&config, &files);
+		globfree(&files);
+		exit(0);
+	}
 
-	// Calculate some descriptive statistics
-	double ds_min, ds_max, ds_mean, ds_median;
-	cv::Point min_loc;
+	run_workers(&config, &files, &accumulated_mutex, &stats, &accumulated, config.num_threads);
+	if (config.verbose) {
+		fprintf(stderr, "Read %lu images with %lu buffer regrowths (%.3f per image)\n",
+			(unsigned long) images_read, (unsigned long) buffer_regrowths,
+			images_read == 0 ? 0.0 : (double) buffer_regrowths / images_read);
+		fprintf(stderr, "%lu images only needed a 1/8 size preview\n", (unsigned long) images_previewed);
+	}
 
+	// Calculate some descriptive statistics.
 	// Each thread will have updated stats with the brightness of the images
-	// that were successfully processed. Invalid images will be left as NAN.
-	// In OpenCV, NAN is unequal to everything including NAN which means we can
-	// filter out bogus entries by checking stats for element-wise equality
-	// with itself.
-	cv::Mat nan_mask = cv::Mat(stats == stats);
-	cv::Mat filtered_stats;
-	stats.copyTo(filtered_stats, nan_mask);
-	cv::minMaxLoc(stats, &ds_min, &ds_max, &min_loc);
-	ds_mean = cv::mean(filtered_stats)[0];
-
-	// For median, do partial sort and take middle value
-	std::vector<double> vec;
-	filtered_stats.copyTo(vec);
-	std::nth_element(vec.begin(), vec.begin() + (vec.size() / 2), vec.end());
-	ds_median = vec[vec.size() / 2];
-
-	std::cout << "Minimum: " << ds_min << " maximum: " << ds_max
-			<< " mean: " << ds_mean << " median: " << ds_median << std::endl;
+	// that were successfully processed. Invalid images are left as NAN.
+	nightStatistics ds;
+	if (! getNightStatistics(stats, &ds)) {
+		globfree(&files);
+		std::cout << "ERROR: No images could be read, exiting." << std::endl;
+		exit(1);
+	}
+	std::cout << "Minimum: " << ds.min << " maximum: " << ds.max
+			<< " mean: " << ds.mean << " median: " << ds.median << std::endl;
 
 	// If we still don't have an image (no images below threshold), copy the
 	// minimum mean image so we see why
@@ -456,29 +525,10 @@ int main(int argc, char* argv[]) {
 		if (accumulated.empty()) {
 			fprintf(stderr, "No images below threshold %.3f, writing the minimum mean image only.\n",
 					config.brightness_limit);
-			accumulated = cv::imread(files.gl_pathv[min_loc.x], cv::IMREAD_UNCHANGED);
-		}
-
-		std::vector<int> compression_params;
-		if (ext == "png") {
-			compression_params.push_back(cv::IMWRITE_PNG_COMPRESSION);
-			compression_params.push_back(9);
-		} else if (ext == "jpg") {
-			compression_params.push_back(cv::IMWRITE_JPEG_QUALITY);
-			compression_params.push_back(95);
+			accumulated = cv::imread(files.gl_pathv[ds.minIndex], cv::IMREAD_UNCHANGED);
 		}
-
-		bool result = false;
-		try {
-			result = cv::imwrite(config.dst_startrails, accumulated, compression_params);
-		} catch (cv::Exception& ex) {
-			fprintf(stderr, "ERROR: could not save startrails file: %s\n", ex.what());
+		if (! saveStartrails(config.dst_startrails, ext, accumulated))
 			exit(2);
-		}
-		if (! result) {
-			fprintf(stderr, "ERROR: could not save Startrails file: %s\n", strerror(errno));
-			exit(2);
-		}
 	}
 	globfree(&files);
 
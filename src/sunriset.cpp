@@ -0,0 +1,107 @@
+// Sunrise and sunset times.
+// This is based on Paul Schlyter's public domain sunriset.c, which sunwait also uses,
+// so the capture programs switch between day and night at the same times sunwait did.
+
+#include <math.h>
+
+#include "include/sunriset.h"
+
+#define RADEG		(180.0 / M_PI)
+#define DEGRAD		(M_PI / 180.0)
+#define INV360		(1.0 / 360.0)
+
+static double sind(double x)	{ return(sin(x * DEGRAD)); }
+static double cosd(double x)	{ return(cos(x * DEGRAD)); }
+static double acosd(double x)	{ return(RADEG * acos(x)); }
+static double atan2d(double y, double x) { return(RADEG * atan2(y, x)); }
+
+// Days since 2000 Jan 0.0 (UTC).
+static long daysSince2000Jan0(int y, int m, int d)
+{
+	return((367L * y) - ((7 * (y + ((m + 9) / 12))) / 4) + ((275 * m) / 9) + d - 730530L);
+}
+
+// Reduce an angle to 0 - 360 degrees.
+static double revolution(double x)
+{
+	return(x - (360.0 * floor(x * INV360)));
+}
+
+// Reduce an angle to -180 - +180 degrees.
+static double rev180(double x)
+{
+	return(x - (360.0 * floor((x * INV360) + 0.5)));
+}
+
+// Greenwich Mean Sidereal Time at 0h UT, in degrees.
+static double GMST0(double d)
+{
+	return(revolution((180.0 + 356.0470 + 282.9404) + ((0.9856002585 + 4.70935E-5) * d)));
+}
+
+// The sun's ecliptic longitude and distance in AU on day "d".
+static void sunPosition(double d, double *lon, double *r)
+{
+	double M = revolution(356.0470 + (0.9856002585 * d));	// mean anomaly
+	double w = 282.9404 + (4.70935E-5 * d);					// longitude of perihelion
+	double e = 0.016709 - (1.151E-9 * d);					// eccentricity
+
+	double E = M + (e * RADEG * sind(M) * (1.0 + (e * cosd(M))));	// eccentric anomaly
+	double x = cosd(E) - e;
+	double y = sqrt(1.0 - (e * e)) * sind(E);
+	*r = sqrt((x * x) + (y * y));
+	*lon = atan2d(y, x) + w;
+	if (*lon >= 360.0)
+		*lon -= 360.0;
+}
+
+// The sun's right ascension and declination in degrees and distance in AU on day "d".
+static void sunRADec(double d, double *RA, double *dec, double *r)
+{
+	double lon;
+	sunPosition(d, &lon, r);
+
+	double x = *r * cosd(lon);
+	double y = *r * sind(lon);
+	double oblEcl = 23.4393 - (3.563E-7 * d);		// obliquity of the ecliptic
+	double z = y * sind(oblEcl);
+	y = y * cosd(oblEcl);
+
+	*RA = atan2d(y, x);
+	*dec = atan2d(z, sqrt((x * x) + (y * y)));
+}
+
+int sunRiseSet(int year, int month, int day, double longitude, double latitude,
+	double altitude, double *rise, double *set)
+{
+	// Compute for local noon so the times are for the right day.
+	double d = daysSince2000Jan0(year, month, day) + 0.5 - (longitude / 360.0);
+
+	double sidTime = revolution(GMST0(d) + 180.0 + longitude);
+	double sRA, sDec, sr;
+	sunRADec(d, &sRA, &sDec, &sr);
+	double tSouth = 12.0 - (rev180(sidTime - sRA) / 15.0);	// when the sun is due south
+
+	// Hours the sun is above the altitude.
+	int ret = SUN_RISES_AND_SETS;
+	double t;
+	double cost = (sind(altitude) - (sind(latitude) * sind(sDec))) / (cosd(latitude) * cosd(sDec));
+	if (cost >= 1.0)
+	{
+		ret = SUN_ALWAYS_BELOW;
+		t = 0.0;
+	}
+	else if (cost <= -1.0)
+	{
+		ret = SUN_ALWAYS_ABOVE;
+		t = 0.0;
+	}
+	else
+	{
+		t = acosd(cost) / 15.0;
+	}
+
+	*rise = tSouth - t;
+	*set = tSouth + t;
+	return(ret);
+}
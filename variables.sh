@@ -90,6 +90,8 @@ if [[ -z "${ALLSKY_VARIABLE_SET}" ]]; then
 
 	# Holds all the dark frames.
 	ALLSKY_DARKS="${ALLSKY_HOME}/darks"
+	# How many of the newest dark frames at each temperature are kept and stacked into a master.
+	ALLSKY_DARK_FRAMES_TO_STACK=100
 
 	# Location of WebUI.
 	ALLSKY_WEBUI="${ALLSKY_HOME}/html"